@@ -1,128 +1,454 @@
+/*
+ * Load generator for hlld. Each connection runs in its own
+ * thread and keeps up to a pipeline depth of requests in flight.
+ * Requests either add keys to a random set, using set or bulk
+ * commands, or read the size of a random set.
+ *
+ * By default every connection sends as fast as the server
+ * replies (closed loop). Giving a rate instead sends requests on
+ * a fixed schedule (open loop), and latency is measured from when
+ * each request was due, so a slow server is not hidden by the
+ * generator falling behind.
+ */
 #include <arpa/inet.h>
-#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
-static int NUM_THREADS = 1;
-static int NUM_KEYS = 1000000;
 static char* HOST = "127.0.0.1";
 static int PORT = 4553;
-static char *SET_NAME = "foobar%d";
+static int NUM_CONNS = 1;           // Connections, one thread each
+static int DEPTH = 1;               // Requests in flight per connection
+static int BATCH = 1;               // Keys per write, bulk is used above 1
+static uint64_t NUM_KEYS = 1000000; // Size of the key space
+static double ZIPF = 0;             // Zipf exponent, or 0 for uniform keys
+static int NUM_SETS = 1;
+static char *SET_PREFIX = "bench";
+static double READ_RATIO = 0;       // Fraction of requests that are reads
+static double RATE = 0;             // Total requests per second, or 0 for closed loop
+static uint64_t NUM_REQUESTS = 100000;  // Per connection, or 0 for no limit
+static double DURATION = 0;         // Seconds, or 0 for no limit
+static int KEEP_SETS = 0;
+static uint64_t SEED = 1;
+
+// Cumulative distribution of the keys, for zipf
+static double *ZIPF_CDF;
+
+/*
+ * Latencies are kept in nanoseconds in a log-linear histogram.
+ * Each power of two is split into 32 buckets, so a bucket is
+ * within about 3% of the values in it.
+ */
+#define SUB_BITS 5
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_LATENCY_BITS 44
+#define NUM_BUCKETS ((MAX_LATENCY_BITS - SUB_BITS + 1) * SUB_BUCKETS)
+
+#define READ_BUF_SIZE 65536
 
 typedef struct {
+    int id;
     int conn_fd;
-    char set_name[32];
-    char cmd_buf[128];
+    uint64_t rng;
+
+    // Send times of the requests in flight, oldest first
+    uint64_t *in_flight;
+    int head;
+    int count;
+
+    // Buffered responses
+    char read_buf[READ_BUF_SIZE];
+    int read_start;
+    int read_end;
+
+    char *cmd_buf;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t keys;
+    uint64_t errors;
+    uint64_t max_latency;
+    uint64_t latencies[NUM_BUCKETS];
 } conn_info;
 
-int connect_fd(conn_info *info) {
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int latency_bucket(uint64_t ns) {
+    if (ns < SUB_BUCKETS) return ns;
+    if (ns >> MAX_LATENCY_BITS) ns = (1ULL << MAX_LATENCY_BITS) - 1;
+    int bits = 63 - __builtin_clzll(ns);
+    return (bits - SUB_BITS + 1) * SUB_BUCKETS + (ns >> (bits - SUB_BITS)) - SUB_BUCKETS;
+}
+
+static uint64_t bucket_latency(int bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    int bits = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = bucket % SUB_BUCKETS + SUB_BUCKETS;
+    return sub << (bits - SUB_BITS);
+}
+
+/**
+ * Per thread pseudo random numbers (xorshift64*)
+ */
+static uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_uniform(uint64_t *state) {
+    return (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t next_key(conn_info *info) {
+    if (!ZIPF_CDF) return next_rand(&info->rng) % NUM_KEYS;
+
+    // Binary search for the first key covering the sample
+    double u = next_uniform(&info->rng);
+    uint64_t low = 0, high = NUM_KEYS - 1;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (ZIPF_CDF[mid] < u) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+static int setup_zipf(void) {
+    ZIPF_CDF = malloc(NUM_KEYS * sizeof(double));
+    if (!ZIPF_CDF) return -1;
+    double total = 0;
+    for (uint64_t i=0; i < NUM_KEYS; i++) {
+        total += 1.0 / pow(i + 1, ZIPF);
+        ZIPF_CDF[i] = total;
+    }
+    for (uint64_t i=0; i < NUM_KEYS; i++) ZIPF_CDF[i] /= total;
+    return 0;
+}
+
+static int connect_fd(void) {
     struct sockaddr_in addr;
     bzero(&addr, sizeof(addr));
     addr.sin_family = PF_INET;
     addr.sin_port = htons(PORT);
-    inet_pton(PF_INET, HOST, &addr.sin_addr);
-
-    info->conn_fd = socket(PF_INET, SOCK_STREAM, 0);
-    return connect(info->conn_fd, (struct sockaddr*)&addr, sizeof(addr));
-}
-
-int timediff(struct timeval *t1, struct timeval *t2) {
-    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
-    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
-    return (micro2-micro1) / 1000;
-}
-
-void *thread_main(void *in) {
-    printf("Thread started.");
-    conn_info info;
-    int sets = 0;
-
-    // Generate a set name
-    char *buf = (char*)&info.set_name;
-    sprintf(buf, SET_NAME, rand());
-    printf("Using set: %s\n", buf);
-
-    struct timeval start_connect, start_create, start_set, start_check, end;
-    char out_buf[16];
-    int num, sent, len;
-
-    // Connect
-    gettimeofday(&start_connect, NULL);
-    int res = connect_fd(&info);
-    if (res) {
-        printf("Failed to connect!");
-        return NULL;
-    }
-    gettimeofday(&end, NULL);
-    printf("Connect: %d msec\n", timediff(&start_connect, &end));
-
-    // Make set
-    gettimeofday(&start_create, NULL);
-
-    len = sprintf((char*)&info.cmd_buf, "create %s\n", buf);
-    send(info.conn_fd, info.cmd_buf, len, 0);
-    num = recv(info.conn_fd, (char*)&out_buf, 5, 0);
-    if (strcmp(out_buf, "Done\n") != 0) {
-        printf("Failed to create set!");
-        return NULL;
-   }
-
-    gettimeofday(&end, NULL);
-    printf("Create: %d msec\n", timediff(&start_create, &end));
-
-    // Set
-    gettimeofday(&start_set, NULL);
-    for (int i=0; i< NUM_KEYS; i++) {
-        sprintf((char*)&info.cmd_buf, "set %s test%d\n", buf, i);
-        sent = send(info.conn_fd, (char*)&info.cmd_buf, strlen(info.cmd_buf), 0);
-        if (sent == -1) {
-            printf("Failed to send!");
-            return NULL;
+    if (inet_pton(PF_INET, HOST, &addr.sin_addr) != 1) return -1;
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return fd;
+}
+
+static int send_all(int fd, char *buf, int len) {
+    while (len) {
+        ssize_t sent = send(fd, buf, len, 0);
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Returns the length of the next buffered response,
+ * including the newline, or 0 if there is none.
+ */
+static int buffered_line(conn_info *info) {
+    char *start = info->read_buf + info->read_start;
+    char *nl = memchr(start, '\n', info->read_end - info->read_start);
+    return nl ? nl - start + 1 : 0;
+}
+
+/**
+ * Reads more responses into the buffer
+ * @return 0 on success, -1 if the connection failed
+ */
+static int fill_buf(conn_info *info) {
+    // Move any partial response to the front
+    if (info->read_start) {
+        memmove(info->read_buf, info->read_buf + info->read_start,
+                info->read_end - info->read_start);
+        info->read_end -= info->read_start;
+        info->read_start = 0;
+    }
+    ssize_t num = recv(info->conn_fd, info->read_buf + info->read_end,
+                       READ_BUF_SIZE - info->read_end, 0);
+    if (num == -1 && errno == EINTR) return 0;
+    if (num <= 0) return -1;
+    info->read_end += num;
+    return 0;
+}
+
+/**
+ * Sends a single command and waits for the response
+ * @return 0 on success, -1 on failure
+ */
+static int command(conn_info *info, char *cmd, char *expect, char *alt) {
+    if (send_all(info->conn_fd, cmd, strlen(cmd))) return -1;
+    int len;
+    while (!(len = buffered_line(info))) {
+        if (fill_buf(info)) return -1;
+    }
+    char *line = info->read_buf + info->read_start;
+    info->read_start += len;
+    if (!strncmp(line, expect, len)) return 0;
+    if (alt && !strncmp(line, alt, len)) return 0;
+    return -1;
+}
+
+/**
+ * Sends the next request, with the time it is recorded as sent
+ */
+static int send_request(conn_info *info, uint64_t sent_at) {
+    int len;
+    int set = next_rand(&info->rng) % NUM_SETS;
+    if (READ_RATIO && next_uniform(&info->rng) < READ_RATIO) {
+        len = sprintf(info->cmd_buf, "size %s%d\n", SET_PREFIX, set);
+        info->reads++;
+    } else {
+        len = sprintf(info->cmd_buf, "%s %s%d", (BATCH > 1) ? "b" : "s", SET_PREFIX, set);
+        for (int i=0; i < BATCH; i++) {
+            len += sprintf(info->cmd_buf + len, " key%llu", (unsigned long long)next_key(info));
         }
+        info->cmd_buf[len++] = '\n';
+        info->writes++;
+        info->keys += BATCH;
     }
+    if (send_all(info->conn_fd, info->cmd_buf, len)) return -1;
 
-    for (int i=0; i< NUM_KEYS; i++) {
-        int remain = 5;
-        while (remain) {
-            num = recv(info.conn_fd, (char*)out_buf, remain, 0);
-            if (num == -1) {
-                printf("Failed to read! Iter: %d. Res: %d\n", i, num);
+    info->in_flight[(info->head + info->count) % DEPTH] = sent_at;
+    info->count++;
+    return 0;
+}
+
+/**
+ * Consumes the buffered responses, recording their latency
+ */
+static void read_responses(conn_info *info) {
+    int len;
+    uint64_t now = now_ns();
+    while (info->count && (len = buffered_line(info))) {
+        char *line = info->read_buf + info->read_start;
+        info->read_start += len;
+
+        // Writes return Done and reads return the size
+        if (strncmp(line, "Done\n", len) && (line[0] < '0' || line[0] > '9'))
+            info->errors++;
+
+        uint64_t latency = now - info->in_flight[info->head];
+        if (latency > info->max_latency) info->max_latency = latency;
+        info->latencies[latency_bucket(latency)]++;
+        info->head = (info->head + 1) % DEPTH;
+        info->count--;
+    }
+}
+
+static void *thread_main(void *in) {
+    conn_info *info = in;
+    uint64_t sent = 0;
+    uint64_t start = now_ns();
+    uint64_t deadline = DURATION ? start + DURATION * 1e9 : 0;
+
+    // Open loop connections each send an equal share of the rate
+    uint64_t interval = RATE ? 1e9 * NUM_CONNS / RATE : 0;
+    uint64_t next_send = start;
+
+    for (;;) {
+        uint64_t now = now_ns();
+        int more = (!NUM_REQUESTS || sent < NUM_REQUESTS) && (!deadline || now < deadline);
+        if (!more && !info->count) break;
+
+        // Send while there is room in the pipeline, and the schedule allows
+        while (more && info->count < DEPTH && (!interval || next_send <= now)) {
+            if (send_request(info, interval ? next_send : now)) {
+                fprintf(stderr, "Connection %d failed to send!\n", info->id);
                 return NULL;
             }
-            remain -= num;
+            next_send += interval;
+            sent++;
+            now = now_ns();
+            more = (!NUM_REQUESTS || sent < NUM_REQUESTS) && (!deadline || now < deadline);
         }
-        sets++;
-    }
-    gettimeofday(&end, NULL);
-    printf("Set: %d msec. Num: %d\n", timediff(&start_set, &end), sets);
-
-    sprintf((char*)&info.cmd_buf, "drop %s\n", buf);
-    sent = send(info.conn_fd, (char*)&info.cmd_buf, strlen(info.cmd_buf), 0);
 
+        // Wait for a response, or until the next request is due
+        if (!buffered_line(info)) {
+            struct pollfd pfd = {info->conn_fd, POLLIN, 0};
+            struct timespec wait, *timeout = NULL;
+            if (interval && more && info->count < DEPTH) {
+                uint64_t delay = (next_send > now) ? next_send - now : 0;
+                wait.tv_sec = delay / 1000000000ULL;
+                wait.tv_nsec = delay % 1000000000ULL;
+                timeout = &wait;
+            }
+            if (!info->count) {
+                if (timeout) nanosleep(timeout, NULL);
+                continue;
+            }
+            int res = ppoll(&pfd, 1, timeout, NULL);
+            if (res == -1 && errno != EINTR) break;
+            if (res <= 0) continue;
+            if (fill_buf(info)) {
+                fprintf(stderr, "Connection %d failed to read!\n", info->id);
+                return NULL;
+            }
+        }
+        read_responses(info);
+    }
     return NULL;
 }
 
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s [options]\n\
+    -H host      Server address (default 127.0.0.1)\n\
+    -p port      Server port (default 4553)\n\
+    -c conns     Number of connections (default 1)\n\
+    -d depth     Requests in flight per connection (default 1)\n\
+    -b batch     Keys per write, bulk is used above 1 (default 1)\n\
+    -k keys      Number of distinct keys (default 1000000)\n\
+    -z exponent  Pick keys with a zipf distribution (default uniform)\n\
+    -S sets      Number of sets (default 1)\n\
+    -P prefix    Prefix of the set names (default bench)\n\
+    -r ratio     Fraction of requests that read a size (default 0)\n\
+    -R rate      Total requests per second, open loop (default closed loop)\n\
+    -n requests  Requests per connection, 0 for no limit (default 100000)\n\
+    -t seconds   Stop after a duration (default no limit)\n\
+    -K           Keep the sets instead of dropping them\n\
+    -s seed      Random seed (default 1)\n", name);
+}
+
 int main(int argc, char **argv) {
-    // Read random seed
-    int randfh = open("/dev/random", O_RDONLY);
-    unsigned seed = 0;
-    read(randfh, &seed, sizeof(seed));
-    close(randfh);
-
-    srand(seed);
-    pthread_t t[NUM_THREADS];
-    for (int i=0; i< NUM_THREADS; i++) {
-        pthread_create(&t[i], NULL, thread_main, NULL);
-    }
-    for (int i=0; i< NUM_THREADS; i++) {
+    int c;
+    while ((c = getopt(argc, argv, "H:p:c:d:b:k:z:S:P:r:R:n:t:Ks:h")) != -1) {
+        switch (c) {
+            case 'H': HOST = optarg; break;
+            case 'p': PORT = atoi(optarg); break;
+            case 'c': NUM_CONNS = atoi(optarg); break;
+            case 'd': DEPTH = atoi(optarg); break;
+            case 'b': BATCH = atoi(optarg); break;
+            case 'k': NUM_KEYS = strtoull(optarg, NULL, 10); break;
+            case 'z': ZIPF = atof(optarg); break;
+            case 'S': NUM_SETS = atoi(optarg); break;
+            case 'P': SET_PREFIX = optarg; break;
+            case 'r': READ_RATIO = atof(optarg); break;
+            case 'R': RATE = atof(optarg); break;
+            case 'n': NUM_REQUESTS = strtoull(optarg, NULL, 10); break;
+            case 't': DURATION = atof(optarg); break;
+            case 'K': KEEP_SETS = 1; break;
+            case 's': SEED = strtoull(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (NUM_CONNS < 1 || DEPTH < 1 || BATCH < 1 || NUM_KEYS < 1 || NUM_SETS < 1 ||
+        ZIPF < 0 || READ_RATIO < 0 || READ_RATIO > 1 || RATE < 0 || DURATION < 0 ||
+        (!NUM_REQUESTS && !DURATION)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (ZIPF && setup_zipf()) {
+        fprintf(stderr, "Failed to allocate the key distribution!\n");
+        return 1;
+    }
+
+    // Connect everything up front
+    conn_info *conns = calloc(NUM_CONNS, sizeof(conn_info));
+    for (int i=0; i < NUM_CONNS; i++) {
+        conn_info *info = conns + i;
+        info->id = i;
+        info->rng = (SEED + 1) * 0x9E3779B97F4A7C15ULL + i;
+        info->in_flight = calloc(DEPTH, sizeof(uint64_t));
+        info->cmd_buf = malloc(strlen(SET_PREFIX) + 32 + BATCH * 24);
+        if ((info->conn_fd = connect_fd()) == -1) {
+            fprintf(stderr, "Failed to connect to %s:%d!\n", HOST, PORT);
+            return 1;
+        }
+    }
+
+    // Make the sets
+    char cmd[256];
+    for (int i=0; i < NUM_SETS; i++) {
+        snprintf(cmd, sizeof(cmd), "create %s%d\n", SET_PREFIX, i);
+        if (command(conns, cmd, "Done\n", "Exists\n")) {
+            fprintf(stderr, "Failed to create set %s%d!\n", SET_PREFIX, i);
+            return 1;
+        }
+    }
+
+    uint64_t start = now_ns();
+    pthread_t *t = calloc(NUM_CONNS, sizeof(pthread_t));
+    for (int i=0; i < NUM_CONNS; i++) {
+        pthread_create(&t[i], NULL, thread_main, conns + i);
+    }
+    for (int i=0; i < NUM_CONNS; i++) {
         pthread_join(t[i], NULL);
     }
-    return 0;
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // Combine the results of every connection
+    uint64_t reads = 0, writes = 0, keys = 0, errors = 0, max = 0, total = 0;
+    uint64_t latencies[NUM_BUCKETS] = {0};
+    for (int i=0; i < NUM_CONNS; i++) {
+        conn_info *info = conns + i;
+        reads += info->reads;
+        writes += info->writes;
+        keys += info->keys;
+        errors += info->errors;
+        if (info->max_latency > max) max = info->max_latency;
+        for (int b=0; b < NUM_BUCKETS; b++) {
+            latencies[b] += info->latencies[b];
+            total += info->latencies[b];
+        }
+    }
+
+    printf("Requests: %llu (%llu writes, %llu reads, %llu errors) in %.2f sec\n",
+            (unsigned long long)(reads + writes), (unsigned long long)writes,
+            (unsigned long long)reads, (unsigned long long)errors, elapsed);
+    printf("Throughput: %.0f req/sec, %.0f keys/sec\n",
+            (reads + writes) / elapsed, keys / elapsed);
+
+    double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+    char *names[] = {"p50", "p90", "p99", "p999"};
+    printf("Latency (usec):");
+    for (int p=0, b=0; p < 4; p++) {
+        uint64_t target = ceil(percentiles[p] * total), seen = 0;
+        for (b=0; b < NUM_BUCKETS; b++) {
+            seen += latencies[b];
+            if (seen >= target) break;
+        }
+        printf(" %s %.1f", names[p], total ? bucket_latency(b) / 1e3 : 0);
+    }
+    printf(" max %.1f\n", max / 1e3);
+
+    // Clean up the sets
+    if (!KEEP_SETS) {
+        for (int i=0; i < NUM_SETS; i++) {
+            snprintf(cmd, sizeof(cmd), "drop %s%d\n", SET_PREFIX, i);
+            command(conns, cmd, "Done\n", NULL);
+        }
+    }
+    return errors ? 1 : 0;
 }
@@ -0,0 +1,338 @@
+/*
+ * Micro-benchmarks for the internals of hlld. Each benchmark
+ * does a fixed amount of work with fixed inputs, and is run
+ * several times keeping the fastest run. The results are
+ * printed one benchmark per line, separated by tabs:
+ *
+ *   name ops ns_per_op ops_per_sec
+ *
+ * Usage: bench_internal [-r runs] [prefix]
+ *
+ * Only benchmarks whose name starts with the prefix are run.
+ * Run from the root of the repo so tests/words.txt is found.
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "art.h"
+#include "bitmap.h"
+#include "hll.h"
+#include "networking.h"
+
+// Link the external murmur hash in
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+#define WORDS_FILE "tests/words.txt"
+#define NUM_HASHES (1 << 20)
+#define NUM_COMMANDS 100000
+
+/**
+ * A benchmark runs ops operations, and returns
+ * the nanoseconds taken by the timed portion.
+ */
+typedef uint64_t (*bench_fn)(void *arg, uint64_t ops);
+
+static int RUNS = 5;
+static char *PREFIX = "";
+
+// Results are summed in here, so the work is not optimized out
+static volatile uint64_t SINK;
+
+// Shared inputs
+static uint64_t *HASHES;
+static char **WORDS;
+static int *WORD_LENS;
+static uint64_t NUM_WORDS;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Fixed sequence of pseudo random hashes (splitmix64)
+ */
+static uint64_t next_hash(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Runs a benchmark if it matches the prefix,
+ * and prints the fastest run.
+ */
+static void run(char *name, bench_fn fn, void *arg, uint64_t ops) {
+    if (strncmp(name, PREFIX, strlen(PREFIX))) return;
+
+    uint64_t best = UINT64_MAX;
+    for (int i=0; i < RUNS; i++) {
+        uint64_t ns = fn(arg, ops);
+        if (ns < best) best = ns;
+    }
+    if (!best) best = 1;
+    printf("%s\t%llu\t%.2f\t%.0f\n", name, (unsigned long long)ops,
+            (double)best / ops, ops * 1e9 / best);
+    fflush(stdout);
+}
+
+/**
+ * An HLL with a given precision and layout
+ */
+typedef struct {
+    int precision;
+    hll_layout layout;
+} hll_arg;
+
+static uint64_t bench_hll_add_hash(void *in, uint64_t ops) {
+    hll_arg *arg = in;
+    hll_t h;
+    hll_init_layout(arg->precision, arg->layout, &h);
+
+    uint64_t start = now_ns();
+    for (uint64_t i=0; i < ops; i++) {
+        hll_add_hash(&h, HASHES[i & (NUM_HASHES - 1)]);
+    }
+    uint64_t end = now_ns();
+
+    hll_destroy(&h);
+    return end - start;
+}
+
+static uint64_t bench_hll_size(void *in, uint64_t ops) {
+    hll_arg *arg = in;
+    hll_t h;
+    hll_init_layout(arg->precision, arg->layout, &h);
+
+    // Fill about half the registers
+    for (uint64_t i=0; i < (1ULL << arg->precision) / 2; i++) {
+        hll_add_hash(&h, HASHES[i & (NUM_HASHES - 1)]);
+    }
+
+    uint64_t start = now_ns();
+    double total = 0;
+    for (uint64_t i=0; i < ops; i++) {
+        total += hll_size(&h);
+    }
+    uint64_t end = now_ns();
+    SINK += total;
+
+    hll_destroy(&h);
+    return end - start;
+}
+
+static uint64_t bench_murmur(void *in, uint64_t ops) {
+    int len = *(int*)in;
+    char *key = malloc(len);
+    for (int i=0; i < len; i++) key[i] = 'a' + (i % 26);
+
+    uint64_t out[2], total = 0;
+    uint64_t start = now_ns();
+    for (uint64_t i=0; i < ops; i++) {
+        key[0] = i;
+        MurmurHash3_x64_128(key, len, 0, &out);
+        total += out[1];
+    }
+    uint64_t end = now_ns();
+    SINK += total;
+
+    free(key);
+    return end - start;
+}
+
+static uint64_t bench_art_insert(void *in, uint64_t ops) {
+    (void)in;
+    art_tree t;
+    init_art_tree(&t);
+
+    uint64_t start = now_ns();
+    for (uint64_t i=0; i < ops; i++) {
+        art_insert(&t, (unsigned char*)WORDS[i], WORD_LENS[i], WORDS[i]);
+    }
+    uint64_t end = now_ns();
+
+    destroy_art_tree(&t);
+    return end - start;
+}
+
+static uint64_t bench_art_search(void *in, uint64_t ops) {
+    art_tree *t = in;
+    uint64_t found = 0;
+
+    uint64_t start = now_ns();
+    for (uint64_t i=0; i < ops; i++) {
+        uint64_t w = i % NUM_WORDS;
+        found += (art_search(t, (unsigned char*)WORDS[w], WORD_LENS[w]) != NULL);
+    }
+    uint64_t end = now_ns();
+    SINK += found;
+    return end - start;
+}
+
+/**
+ * A bitmap to flush, with the mode to use
+ */
+typedef struct {
+    char *path;
+    bitmap_mode mode;
+} bitmap_arg;
+
+static uint64_t bench_bitmap_flush(void *in, uint64_t ops) {
+    bitmap_arg *arg = in;
+    hlld_bitmap bm;
+    uint64_t size = hll_bytes_for_precision(14);
+    if (bitmap_from_filename(arg->path, size, 1, arg->mode, &bm)) {
+        fprintf(stderr, "Failed to open bitmap %s\n", arg->path);
+        exit(1);
+    }
+
+    uint64_t elapsed = 0;
+    for (uint64_t i=0; i < ops; i++) {
+        // Dirty every page
+        for (uint64_t off=0; off < size; off += 4096) bm.mmap[off] = i;
+
+        uint64_t start = now_ns();
+        bitmap_flush(&bm);
+        elapsed += now_ns() - start;
+    }
+
+    bitmap_close(&bm);
+    unlink(arg->path);
+    return elapsed;
+}
+
+static uint64_t bench_extract_to_terminator(void *in, uint64_t ops) {
+    (void)in;
+
+    // Buffer all the commands up front, as if read at once
+    char *cmds = malloc(ops * 64);
+    uint64_t cmds_len = 0;
+    for (uint64_t i=0; i < ops; i++) {
+        cmds_len += sprintf(cmds + cmds_len, "set foobar test%llu\n", (unsigned long long)i);
+    }
+    hlld_conn_info *conn = init_buffered_conn(cmds, cmds_len);
+    free(cmds);
+
+    char *buf;
+    int buf_len, should_free;
+    uint64_t total = 0;
+    uint64_t start = now_ns();
+    while (!extract_to_terminator(conn, '\n', &buf, &buf_len, &should_free)) {
+        total += buf_len;
+        if (should_free) free(buf);
+    }
+    uint64_t end = now_ns();
+    SINK += total;
+
+    destroy_buffered_conn(conn);
+    return end - start;
+}
+
+/**
+ * Reads the words used as set names
+ */
+static int load_words(void) {
+    FILE *f = fopen(WORDS_FILE, "r");
+    if (!f) return -1;
+
+    uint64_t cap = 1024;
+    WORDS = malloc(cap * sizeof(char*));
+    WORD_LENS = malloc(cap * sizeof(int));
+    char buf[512];
+    while (fgets(buf, sizeof(buf), f)) {
+        int len = strlen(buf);
+        if (len && buf[len-1] == '\n') buf[--len] = '\0';
+        if (NUM_WORDS == cap) {
+            cap *= 2;
+            WORDS = realloc(WORDS, cap * sizeof(char*));
+            WORD_LENS = realloc(WORD_LENS, cap * sizeof(int));
+        }
+        WORDS[NUM_WORDS] = strdup(buf);
+        WORD_LENS[NUM_WORDS++] = len + 1;
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "r:")) != -1) {
+        switch (c) {
+            case 'r':
+                RUNS = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-r runs] [prefix]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (RUNS < 1) RUNS = 1;
+    if (optind < argc) PREFIX = argv[optind];
+
+    if (load_words()) {
+        fprintf(stderr, "Failed to read %s\n", WORDS_FILE);
+        return 1;
+    }
+    uint64_t state = 0;
+    HASHES = malloc(NUM_HASHES * sizeof(uint64_t));
+    for (int i=0; i < NUM_HASHES; i++) HASHES[i] = next_hash(&state);
+
+    printf("name\tops\tns_per_op\tops_per_sec\n");
+    char name[64];
+
+    // HLL adds and estimates at each precision, in both layouts
+    const char *layouts[] = {"packed", "bytes"};
+    for (int l=HLL_LAYOUT_PACKED; l <= HLL_LAYOUT_BYTES; l++) {
+        for (int p=HLL_MIN_PRECISION; p <= HLL_MAX_PRECISION; p++) {
+            hll_arg arg = {p, l};
+            snprintf(name, sizeof(name), "hll_add_hash/%s/p%d", layouts[l], p);
+            run(name, bench_hll_add_hash, &arg, 1 << 22);
+        }
+        for (int p=HLL_MIN_PRECISION; p <= HLL_MAX_PRECISION; p++) {
+            hll_arg arg = {p, l};
+            snprintf(name, sizeof(name), "hll_size/%s/p%d", layouts[l], p);
+            run(name, bench_hll_size, &arg, (1 << 26) >> p);
+        }
+    }
+
+    // Hashing by key length
+    int key_lens[] = {8, 16, 32, 64, 128, 256, 1024};
+    for (unsigned i=0; i < sizeof(key_lens) / sizeof(int); i++) {
+        snprintf(name, sizeof(name), "murmur3/len%d", key_lens[i]);
+        run(name, bench_murmur, &key_lens[i], (1 << 24) / key_lens[i]);
+    }
+
+    // Set name lookups
+    run("art_insert/words", bench_art_insert, NULL, NUM_WORDS);
+    art_tree t;
+    init_art_tree(&t);
+    for (uint64_t i=0; i < NUM_WORDS; i++) {
+        art_insert(&t, (unsigned char*)WORDS[i], WORD_LENS[i], WORDS[i]);
+    }
+    run("art_search/words", bench_art_search, &t, NUM_WORDS);
+    destroy_art_tree(&t);
+
+    // Flushing the registers of a precision 14 set
+    char path[] = "/tmp/hlld_bench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+    bitmap_arg shared = {path, SHARED};
+    bitmap_arg persistent = {path, PERSISTENT};
+    run("bitmap_flush/shared/p14", bench_bitmap_flush, &shared, 100);
+    run("bitmap_flush/persistent/p14", bench_bitmap_flush, &persistent, 100);
+    unlink(path);
+
+    // Splitting buffered commands
+    run("extract_to_terminator", bench_extract_to_terminator, NULL, NUM_COMMANDS);
+    return 0;
+}
@@ -394,6 +394,162 @@ class TestInteg(object):
         assert "filter:test:very:long:sub:prefix:1" in fh.readline()
         assert fh.readline() == "END\n"
 
+    def test_list_paged(self, servers):
+        "Tests listing sets in pages"
+        server, _ = servers
+        fh = server.makefile()
+        for x in xrange(5):
+            server.sendall("create page%d\n" % x)
+            assert fh.readline() == "Done\n"
+        server.sendall("list page limit=2 after=page1\n")
+        assert fh.readline() == "START\n"
+        assert "page2" in fh.readline()
+        assert "page3" in fh.readline()
+        assert fh.readline() == "END\n"
+
+    def test_stats(self, servers):
+        "Tests the set cache stats"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("set foobar test\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("set foobar test\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("stats\n")
+        assert fh.readline() == "START\n"
+        assert "set_cache_hits" in fh.readline()
+        assert "set_cache_misses" in fh.readline()
+        assert "set_cache_hit_rate" in fh.readline()
+        assert "resident_bytes" in fh.readline()
+        assert "pinned_bytes" in fh.readline()
+        assert fh.readline() == "END\n"
+    def test_sizes(self, servers):
+        "Tests getting the size of many sets"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foo1\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("create foo2\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("b foo1 a b c\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("sizes foo1 missing foo2\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline() == "foo1 3\n"
+        assert fh.readline() == "foo2 0\n"
+        assert fh.readline() == "END\n"
+        server.sendall("sizes_prefix foo\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline() == "foo1 3\n"
+        assert fh.readline() == "foo2 0\n"
+        assert fh.readline() == "END\n"
+    def test_fault_pipelined(self, servers):
+        "Tests pipelined sets against a closed set"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("close foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("set foobar a\nbulk foobar b c\nsizes foobar\n")
+        assert fh.readline() == "Done\n"
+        assert fh.readline() == "Done\n"
+        assert fh.readline() == "START\n"
+        assert fh.readline() == "foobar 3\n"
+        assert fh.readline() == "END\n"
+
+    def test_windowed(self, servers):
+        "Tests creating and estimating a windowed set"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar window=1h\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+        server.sendall("create foobar window=1h retain=24\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("b foobar a b c\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("size foobar\n")
+        assert fh.readline() == "3\n"
+        server.sendall("close foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("size foobar last=2h\n")
+        assert fh.readline() == "3\n"
+        server.sendall("size foobar last=bad\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+
+    def test_sliding(self, servers):
+        "Tests counting a sliding set over a period"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar sliding=1h\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("set foobar a\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("set foobar b time=%d\n" % (time.time() - 600))
+        assert fh.readline() == "Done\n"
+        server.sendall("size foobar last=5m\n")
+        assert fh.readline() == "1\n"
+        server.sendall("size foobar\n")
+        assert fh.readline() == "2\n"
+
+    def test_intersect_size(self, servers):
+        "Tests estimating the intersection of sets"
+        server, _ = servers
+        fh = server.makefile()
+        for name in ("foo", "bar"):
+            server.sendall("create %s\n" % name)
+            assert fh.readline() == "Done\n"
+        server.sendall("bulk foo a b c d\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bulk bar c d e\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("intersect_size foo bar\n")
+        assert fh.readline() == "2\n"
+        server.sendall("intersect_size foo missing\n")
+        assert fh.readline() == "Set does not exist\n"
+        server.sendall("intersect_size foo\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+
+    def test_layout(self, servers):
+        "Tests the byte register layout and converting sets"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create foobar layout=bytes precision=12\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("bulk foobar a b c\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("convert foobar layout=packed\n")
+        assert fh.readline() == "Set is not proxied. Close it first.\n"
+        server.sendall("close foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("convert foobar layout=packed\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("size foobar\n")
+        assert fh.readline() == "3\n"
+        server.sendall("convert foobar layout=wide\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+
+    def test_warm(self, servers):
+        "Tests warming closed sets"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("warm foobar\n")
+        assert fh.readline() == "Set does not exist\n"
+        server.sendall("create foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("close foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("warm foobar\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("warm_prefix foo\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("sizes foobar\n")
+        assert fh.readline() == "START\n"
+        assert fh.readline() == "foobar 0\n"
+        assert fh.readline() == "END\n"
+
 if __name__ == "__main__":
     sys.exit(pytest.main(args="-k TestInteg."))
 
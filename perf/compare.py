@@ -0,0 +1,247 @@
+#!/usr/bin/env python
+"""
+Compares the performance of two builds of hlld on the same machine.
+
+Each build is a directory holding the hlld, bench and bench_internal
+binaries, such as a checkout after running scons. The micro-benchmarks
+and the load generator are run against both builds, alternating between
+them each iteration so that drift in the machine affects both equally.
+The first iterations are a warmup and are discarded.
+
+For every metric the medians are compared, and a permutation test gives
+the chance that a difference that large is noise. A metric that is worse
+by more than the threshold, with a p-value under alpha, is flagged as a
+regression and the script exits with a non-zero status.
+
+Usage: compare.py [options] base_dir new_dir
+"""
+from __future__ import print_function
+
+import itertools
+import optparse
+import os
+import random
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+# Metrics of the load generator, and whether higher is better
+LOAD_METRICS = [
+    ("load/throughput_req_sec", True),
+    ("load/p50_usec", False),
+    ("load/p99_usec", False),
+    ("load/p999_usec", False),
+]
+
+# Most splits a permutation test enumerates before sampling instead
+MAX_EXACT_SPLITS = 20000
+SAMPLED_SPLITS = 20000
+
+
+def run(cmd, cwd):
+    "Runs a command, returning its output"
+    out = subprocess.check_output(cmd, cwd=cwd)
+    return out.decode("utf-8")
+
+
+def run_micro(build, prefix):
+    "Runs the micro-benchmarks once, returning the ns/op by name"
+    cmd = [os.path.join(build, "bench_internal"), "-r", "1"]
+    if prefix:
+        cmd.append(prefix)
+    results = {}
+    for line in run(cmd, build).splitlines()[1:]:
+        name, _, ns_per_op, _ = line.split("\t")
+        results["micro/" + name] = float(ns_per_op)
+    return results
+
+
+def free_port():
+    "Returns a port that is not in use"
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.bind(("127.0.0.1", 0))
+    port = sock.getsockname()[1]
+    sock.close()
+    return port
+
+
+def start_server(build):
+    "Starts hlld with an empty data dir, returning the process, dir and port"
+    tmpdir = tempfile.mkdtemp()
+    port = free_port()
+    config_path = os.path.join(tmpdir, "config.cfg")
+    with open(config_path, "w") as f:
+        f.write("[hlld]\ndata_dir = %s\nport = %d\nudp_port = %d\n" %
+                (tmpdir, port, free_port()))
+    proc = subprocess.Popen([os.path.join(build, "hlld"), "-f", config_path],
+                            stdout=open(os.devnull, "w"), stderr=subprocess.STDOUT)
+
+    # Wait until it accepts connections
+    for _ in range(100):
+        try:
+            socket.create_connection(("127.0.0.1", port), 1).close()
+            return proc, tmpdir, port
+        except socket.error:
+            if proc.poll() is not None:
+                break
+            time.sleep(0.1)
+    stop_server(proc, tmpdir)
+    raise RuntimeError("hlld in %s failed to start" % build)
+
+
+def stop_server(proc, tmpdir):
+    if proc.poll() is None:
+        proc.kill()
+        proc.wait()
+    shutil.rmtree(tmpdir, ignore_errors=True)
+
+
+def parse_load(out):
+    "Parses the report of the load generator"
+    results = {}
+    for line in out.splitlines():
+        fields = line.split()
+        if line.startswith("Throughput:"):
+            results["load/throughput_req_sec"] = float(fields[1])
+        elif line.startswith("Latency"):
+            values = dict(zip(fields[2::2], fields[3::2]))
+            for name in ("p50", "p99", "p999"):
+                results["load/%s_usec" % name] = float(values[name])
+    return results
+
+
+def run_load(build, bench_args):
+    "Runs the load generator against a fresh server once"
+    proc, tmpdir, port = start_server(build)
+    try:
+        cmd = [os.path.join(build, "bench"), "-p", str(port)] + bench_args
+        return parse_load(run(cmd, build))
+    finally:
+        stop_server(proc, tmpdir)
+
+
+def median(values):
+    values = sorted(values)
+    mid = len(values) // 2
+    if len(values) % 2:
+        return values[mid]
+    return (values[mid - 1] + values[mid]) / 2.0
+
+
+def permutation_p(base, new):
+    """
+    Two sided permutation test on the difference of the medians.
+    Every split of the samples is tried when there are few enough,
+    otherwise a fixed random sample of splits is used.
+    """
+    observed = abs(median(new) - median(base))
+    pooled = base + new
+    n = len(base)
+
+    def splits():
+        total = 1
+        for i in range(n):
+            total = total * (len(pooled) - i) // (i + 1)
+        if total <= MAX_EXACT_SPLITS:
+            for idx in itertools.combinations(range(len(pooled)), n):
+                yield idx
+        else:
+            rng = random.Random(0)
+            for _ in range(SAMPLED_SPLITS):
+                yield rng.sample(range(len(pooled)), n)
+
+    count = extreme = 0
+    for idx in splits():
+        chosen = set(idx)
+        a = [pooled[i] for i in chosen]
+        b = [pooled[i] for i in range(len(pooled)) if i not in chosen]
+        if abs(median(b) - median(a)) >= observed - 1e-12:
+            extreme += 1
+        count += 1
+    return float(extreme) / count
+
+
+def compare(name, base, new, higher_better, threshold, alpha):
+    "Compares the samples of one metric, returning a report row"
+    base_med, new_med = median(base), median(new)
+    change = (new_med - base_med) / base_med * 100 if base_med else 0.0
+    p = permutation_p(base, new)
+    worse = -change if higher_better else change
+    if p < alpha and worse > threshold:
+        verdict = "REGRESSION"
+    elif p < alpha and -worse > threshold:
+        verdict = "improved"
+    else:
+        verdict = "~"
+    return (name, base_med, new_med, change, p, verdict)
+
+
+def main():
+    parser = optparse.OptionParser(usage="%prog [options] base_dir new_dir")
+    parser.add_option("-i", "--iterations", type="int", default=7,
+                      help="Measured iterations per build [default: %default]")
+    parser.add_option("-w", "--warmup", type="int", default=1,
+                      help="Discarded iterations per build [default: %default]")
+    parser.add_option("-t", "--threshold", type="float", default=5.0,
+                      help="Percent change that is flagged [default: %default]")
+    parser.add_option("-a", "--alpha", type="float", default=0.05,
+                      help="Largest p-value that is flagged [default: %default]")
+    parser.add_option("--micro-filter", default="",
+                      help="Only run micro-benchmarks with this prefix")
+    parser.add_option("--bench-args", default="-c 4 -d 16 -b 10 -S 16 -n 50000",
+                      help="Arguments to the load generator [default: %default]")
+    parser.add_option("--no-micro", action="store_true", help="Skip the micro-benchmarks")
+    parser.add_option("--no-load", action="store_true", help="Skip the load generator")
+    parser.add_option("-o", "--output", help="Also write the report to a file")
+    opts, args = parser.parse_args()
+    if len(args) != 2 or opts.iterations < 2 or opts.warmup < 0:
+        parser.error("Expected a base and a new build, and at least 2 iterations")
+    builds = [os.path.abspath(a) for a in args]
+
+    # Alternate between the builds every iteration
+    samples = [{}, {}]
+    for it in range(opts.warmup + opts.iterations):
+        for b, build in enumerate(builds):
+            results = {}
+            if not opts.no_micro:
+                results.update(run_micro(build, opts.micro_filter))
+            if not opts.no_load:
+                results.update(run_load(build, opts.bench_args.split()))
+            if it < opts.warmup:
+                continue
+            for name, value in results.items():
+                samples[b].setdefault(name, []).append(value)
+        print("Finished iteration %d of %d" % (it + 1, opts.warmup + opts.iterations),
+              file=sys.stderr)
+
+    higher_better = dict(LOAD_METRICS)
+    rows = []
+    for name in sorted(set(samples[0]) & set(samples[1])):
+        rows.append(compare(name, samples[0][name], samples[1][name],
+                            higher_better.get(name, False), opts.threshold, opts.alpha))
+
+    lines = ["Base: %s" % builds[0], "New:  %s" % builds[1],
+             "Iterations: %d (after %d warmup), threshold %.1f%%, alpha %.3f" %
+             (opts.iterations, opts.warmup, opts.threshold, opts.alpha), "",
+             "%-40s %14s %14s %9s %7s  %s" % ("metric", "base", "new", "change", "p", "verdict")]
+    for name, base_med, new_med, change, p, verdict in rows:
+        lines.append("%-40s %14.2f %14.2f %+8.1f%% %7.3f  %s" %
+                     (name, base_med, new_med, change, p, verdict))
+    regressions = [r for r in rows if r[5] == "REGRESSION"]
+    lines.append("")
+    lines.append("%d regressions, %d improvements, %d metrics" %
+                 (len(regressions), len([r for r in rows if r[5] == "improved"]), len(rows)))
+
+    report = "\n".join(lines)
+    print(report)
+    if opts.output:
+        with open(opts.output, "w") as f:
+            f.write(report + "\n")
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
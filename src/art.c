@@ -14,31 +14,66 @@
 #define LEAF_RAW(x) ((void*)((uintptr_t)x & ~1))
 
 /**
- * Allocates a node of the given type,
- * initializes to zero and sets the type.
+ * Target size of each slab of nodes in bytes
  */
-static art_node* alloc_node(uint8_t type) {
-    art_node* n;
-    switch (type) {
-        case NODE4:
-            n = calloc(1, sizeof(art_node4));
-            break;
-        case NODE16:
-            n = calloc(1, sizeof(art_node16));
-            break;
-        case NODE48:
-            n = calloc(1, sizeof(art_node48));
-            break;
-        case NODE256:
-            n = calloc(1, sizeof(art_node256));
-            break;
-        default:
-            abort();
+#define SLAB_SIZE 16384
+
+/**
+ * Size of each node type, indexed by type
+ */
+static const size_t NODE_SIZES[] = {
+    0,
+    sizeof(art_node4),
+    sizeof(art_node16),
+    sizeof(art_node48),
+    sizeof(art_node256)
+};
+
+/**
+ * Allocates a node of the given type from the
+ * tree's arena, initializes to zero and sets the type.
+ */
+static art_node* alloc_node(art_tree *t, uint8_t type) {
+    if (type < NODE4 || type > NODE256) abort();
+    art_arena *a = &t->arena;
+    size_t size = NODE_SIZES[type];
+    art_node *n;
+
+    // Re-use a released node if possible
+    if (a->free_list[type]) {
+        n = a->free_list[type];
+        a->free_list[type] = *(void**)n;
+
+    // Carve from the current slab, or allocate a new one
+    } else {
+        if (!a->next[type] || a->next[type] + size > a->end[type]) {
+            size_t num = (SLAB_SIZE / size) ? SLAB_SIZE / size : 1;
+            art_slab *slab = malloc(sizeof(art_slab) + num * size);
+            if (!slab) abort();
+            slab->next = a->slabs;
+            a->slabs = slab;
+            a->next[type] = (char*)(slab+1);
+            a->end[type] = a->next[type] + num * size;
+        }
+        n = (art_node*)a->next[type];
+        a->next[type] += size;
     }
+
+    memset(n, 0, size);
     n->type = type;
     return n;
 }
 
+/**
+ * Returns a node to the free list of the tree's arena.
+ */
+static void free_node(art_tree *t, art_node *n) {
+    art_arena *a = &t->arena;
+    uint8_t type = n->type;
+    *(void**)n = a->free_list[type];
+    a->free_list[type] = n;
+}
+
 /**
  * Initializes an ART tree
  * @return 0 on success.
@@ -46,11 +81,16 @@ static art_node* alloc_node(uint8_t type) {
 int init_art_tree(art_tree *t) {
     t->root = NULL;
     t->size = 0;
+    memset(&t->arena, 0, sizeof(art_arena));
+    t->garbage = NULL;
+    t->num_garbage = 0;
+    t->max_garbage = 0;
     return 0;
 }
 
-// Recursively destroys the tree
-static void destroy_node(art_node *n) {
+// Recursively releases the leaves of the tree.
+// The nodes are released with the arena.
+static void destroy_node(art_tree *t, art_node *n) {
     // Break if null
     if (!n) return;
 
@@ -76,21 +116,21 @@ static void destroy_node(art_node *n) {
         case NODE4:
             p.p1 = (art_node4*)n;
             for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p1->children[i]);
+                destroy_node(t, p.p1->children[i]);
             }
             break;
 
         case NODE16:
             p.p2 = (art_node16*)n;
             for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p2->children[i]);
+                destroy_node(t, p.p2->children[i]);
             }
             break;
 
         case NODE48:
             p.p3 = (art_node48*)n;
             for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p3->children[i]);
+                destroy_node(t, p.p3->children[i]);
             }
             break;
 
@@ -98,16 +138,13 @@ static void destroy_node(art_node *n) {
             p.p4 = (art_node256*)n;
             for (i=0;i<256;i++) {
                 if (p.p4->children[i])
-                    destroy_node(p.p4->children[i]);
+                    destroy_node(t, p.p4->children[i]);
             }
             break;
 
         default:
             abort();
     }
-
-    // Free ourself on the way up
-    free(n);
 }
 
 /**
@@ -115,7 +152,18 @@ static void destroy_node(art_node *n) {
  * @return 0 on success.
  */
 int destroy_art_tree(art_tree *t) {
-    destroy_node(t->root);
+    destroy_node(t, t->root);
+    art_release_garbage(t);
+    free(t->garbage);
+
+    // Release all the slabs in bulk
+    art_slab *next, *slab = t->arena.slabs;
+    while (slab) {
+        next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    init_art_tree(t);
     return 0;
 }
 
@@ -216,24 +264,20 @@ static int leaf_matches(art_leaf *n, unsigned char *key, int key_len, int depth)
 }
 
 /**
- * Searches for a value in the ART tree
- * @arg t The tree
- * @arg key The key
- * @arg key_len The length of the key
- * @return NULL if the item was not found, otherwise
- * the value pointer is returned.
+ * Searches for the leaf of a key
+ * @return The leaf or NULL if not found
  */
-void* art_search(art_tree *t, unsigned char *key, int key_len) {
+static art_leaf* search_leaf(art_tree *t, unsigned char *key, int key_len) {
     art_node **child;
-    art_node *n = t->root;
+    art_node *n = __atomic_load_n(&t->root, __ATOMIC_ACQUIRE);
     int prefix_len, depth = 0;
     while (n) {
         // Might be a leaf
         if (IS_LEAF(n)) {
-            n = LEAF_RAW(n);
+            art_leaf *l = LEAF_RAW(n);
             // Check if the expanded path matches
-            if (!leaf_matches((art_leaf*)n, key, key_len, depth)) {
-                return ((art_leaf*)n)->value;
+            if (!leaf_matches(l, key, key_len, depth)) {
+                return l;
             }
             return NULL;
         }
@@ -254,6 +298,19 @@ void* art_search(art_tree *t, unsigned char *key, int key_len) {
     return NULL;
 }
 
+/**
+ * Searches for a value in the ART tree
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_search(art_tree *t, unsigned char *key, int key_len) {
+    art_leaf *l = search_leaf(t, key, key_len);
+    return (l) ? l->value : NULL;
+}
+
 // Find the minimum leaf under a node
 static art_leaf* minimum(art_node *n) {
     // Handle base cases
@@ -310,14 +367,14 @@ static art_leaf* maximum(art_node *n) {
  * Returns the minimum valued leaf
  */
 art_leaf* art_minimum(art_tree *t) {
-    return minimum((art_node*)t->root);
+    return minimum(__atomic_load_n(&t->root, __ATOMIC_ACQUIRE));
 }
 
 /**
  * Returns the maximum valued leaf
  */
 art_leaf* art_maximum(art_tree *t) {
-    return maximum((art_node*)t->root);
+    return maximum(__atomic_load_n(&t->root, __ATOMIC_ACQUIRE));
 }
 
 static art_leaf* make_leaf(unsigned char *key, int key_len, void *value) {
@@ -345,13 +402,14 @@ static void copy_header(art_node *dest, art_node *src) {
     memcpy(dest->partial, src->partial, min(MAX_PREFIX_LEN, src->partial_len));
 }
 
-static void add_child256(art_node256 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child256(art_tree *t, art_node256 *n, art_node **ref, unsigned char c, void *child) {
+    (void)t;
     (void)ref;
     n->n.num_children++;
     n->children[c] = child;
 }
 
-static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child48(art_tree *t, art_node48 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 48) {
         int pos = 0;
         while (n->children[pos]) pos++;
@@ -359,7 +417,7 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
         n->keys[c] = pos + 1;
         n->n.num_children++;
     } else {
-        art_node256 *new = (art_node256*)alloc_node(NODE256);
+        art_node256 *new = (art_node256*)alloc_node(t, NODE256);
         for (int i=0;i<256;i++) {
             if (n->keys[i]) {
                 new->children[i] = n->children[n->keys[i] - 1];
@@ -367,12 +425,12 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
         }
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child256(new, ref, c, child);
+        free_node(t, (art_node*)n);
+        add_child256(t, new, ref, c, child);
     }
 }
 
-static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child16(art_tree *t, art_node16 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 16) {
         __m128i cmp;
 
@@ -400,7 +458,7 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         n->n.num_children++;
 
     } else {
-        art_node48 *new = (art_node48*)alloc_node(NODE48);
+        art_node48 *new = (art_node48*)alloc_node(t, NODE48);
 
         // Copy the child pointers and populate the key map
         memcpy(new->children, n->children,
@@ -410,12 +468,12 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         }
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child48(new, ref, c, child);
+        free_node(t, (art_node*)n);
+        add_child48(t, new, ref, c, child);
     }
 }
 
-static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child4(art_tree *t, art_node4 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 4) {
         int idx;
         for (idx=0; idx < n->n.num_children; idx++) {
@@ -433,7 +491,7 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
         n->n.num_children++;
 
     } else {
-        art_node16 *new = (art_node16*)alloc_node(NODE16);
+        art_node16 *new = (art_node16*)alloc_node(t, NODE16);
 
         // Copy the child pointers and the key map
         memcpy(new->children, n->children,
@@ -442,21 +500,21 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
                 sizeof(unsigned char)*n->n.num_children);
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child16(new, ref, c, child);
+        free_node(t, (art_node*)n);
+        add_child16(t, new, ref, c, child);
     }
 }
 
-static void add_child(art_node *n, art_node **ref, unsigned char c, void *child) {
+static void add_child(art_tree *t, art_node *n, art_node **ref, unsigned char c, void *child) {
     switch (n->type) {
         case NODE4:
-            return add_child4((art_node4*)n, ref, c, child);
+            return add_child4(t, (art_node4*)n, ref, c, child);
         case NODE16:
-            return add_child16((art_node16*)n, ref, c, child);
+            return add_child16(t, (art_node16*)n, ref, c, child);
         case NODE48:
-            return add_child48((art_node48*)n, ref, c, child);
+            return add_child48(t, (art_node48*)n, ref, c, child);
         case NODE256:
-            return add_child256((art_node256*)n, ref, c, child);
+            return add_child256(t, (art_node256*)n, ref, c, child);
         default:
             abort();
     }
@@ -486,7 +544,7 @@ static int prefix_mismatch(art_node *n, unsigned char *key, int key_len, int dep
     return idx;
 }
 
-static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, int key_len, void *value, int depth, int *old) {
+static void* recursive_insert(art_tree *t, art_node *n, art_node **ref, unsigned char *key, int key_len, void *value, int depth, int *old) {
     // If we are at a NULL node, inject a leaf
     if (!n) {
         *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
@@ -506,7 +564,7 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         }
 
         // New value, we must split the leaf into a node4
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
 
         // Create a new leaf
         art_leaf *l2 = make_leaf(key, key_len, value);
@@ -517,8 +575,8 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         memcpy(new->n.partial, key+depth, min(MAX_PREFIX_LEN, longest_prefix));
         // Add the leafs to the new node4
         *ref = (art_node*)new;
-        add_child4(new, ref, l->key[depth+longest_prefix], SET_LEAF(l));
-        add_child4(new, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
+        add_child4(t, new, ref, l->key[depth+longest_prefix], SET_LEAF(l));
+        add_child4(t, new, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
         return NULL;
     }
 
@@ -532,28 +590,28 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         }
 
         // Create a new node
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
         *ref = (art_node*)new;
         new->n.partial_len = prefix_diff;
         memcpy(new->n.partial, n->partial, min(MAX_PREFIX_LEN, prefix_diff));
 
         // Adjust the prefix of the old node
         if (n->partial_len <= MAX_PREFIX_LEN) {
-            add_child4(new, ref, n->partial[prefix_diff], n);
+            add_child4(t, new, ref, n->partial[prefix_diff], n);
             n->partial_len -= (prefix_diff+1);
             memmove(n->partial, n->partial+prefix_diff+1,
                     min(MAX_PREFIX_LEN, n->partial_len));
         } else {
             n->partial_len -= (prefix_diff+1);
             art_leaf *l = minimum(n);
-            add_child4(new, ref, l->key[depth+prefix_diff], n);
+            add_child4(t, new, ref, l->key[depth+prefix_diff], n);
             memcpy(n->partial, l->key+depth+prefix_diff+1,
                     min(MAX_PREFIX_LEN, n->partial_len));
         }
 
         // Insert the new leaf
         art_leaf *l = make_leaf(key, key_len, value);
-        add_child4(new, ref, key[depth+prefix_diff], SET_LEAF(l));
+        add_child4(t, new, ref, key[depth+prefix_diff], SET_LEAF(l));
         return NULL;
     }
 
@@ -562,12 +620,12 @@ RECURSE_SEARCH:;
     // Find a child to recurse to
     art_node **child = find_child(n, key[depth]);
     if (child) {
-        return recursive_insert(*child, child, key, key_len, value, depth+1, old);
+        return recursive_insert(t, *child, child, key, key_len, value, depth+1, old);
     }
 
     // No child, node goes within us
     art_leaf *l = make_leaf(key, key_len, value);
-    add_child(n, ref, key[depth], SET_LEAF(l));
+    add_child(t, n, ref, key[depth], SET_LEAF(l));
     return NULL;
 }
 
@@ -582,19 +640,19 @@ RECURSE_SEARCH:;
  */
 void* art_insert(art_tree *t, unsigned char *key, int key_len, void *value) {
     int old_val = 0;
-    void *old = recursive_insert(t->root, &t->root, key, key_len, value, 0, &old_val);
+    void *old = recursive_insert(t, t->root, &t->root, key, key_len, value, 0, &old_val);
     if (!old_val) t->size++;
     return old;
 }
 
-static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
+static void remove_child256(art_tree *t, art_node256 *n, art_node **ref, unsigned char c) {
     n->children[c] = NULL;
     n->n.num_children--;
 
     // Resize to a node48 on underflow, not immediately to prevent
     // trashing if we sit on the 48/49 boundary
     if (n->n.num_children == 37) {
-        art_node48 *new = (art_node48*)alloc_node(NODE48);
+        art_node48 *new = (art_node48*)alloc_node(t, NODE48);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
 
@@ -606,18 +664,18 @@ static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
                 pos++;
             }
         }
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
+static void remove_child48(art_tree *t, art_node48 *n, art_node **ref, unsigned char c) {
     int pos = n->keys[c];
     n->keys[c] = 0;
     n->children[pos-1] = NULL;
     n->n.num_children--;
 
     if (n->n.num_children == 12) {
-        art_node16 *new = (art_node16*)alloc_node(NODE16);
+        art_node16 *new = (art_node16*)alloc_node(t, NODE16);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
 
@@ -630,27 +688,27 @@ static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
                 child++;
             }
         }
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child16(art_node16 *n, art_node **ref, art_node **l) {
+static void remove_child16(art_tree *t, art_node16 *n, art_node **ref, art_node **l) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
     memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
     n->n.num_children--;
 
     if (n->n.num_children == 3) {
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
         memcpy(new->keys, n->keys, 4);
         memcpy(new->children, n->children, 4*sizeof(void*));
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
+static void remove_child4(art_tree *t, art_node4 *n, art_node **ref, art_node **l) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
     memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
@@ -677,26 +735,26 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
             child->partial_len += n->n.partial_len + 1;
         }
         *ref = child;
-        free(n);
+        free_node(t, (art_node*)n);
     }
 }
 
-static void remove_child(art_node *n, art_node **ref, unsigned char c, art_node **l) {
+static void remove_child(art_tree *t, art_node *n, art_node **ref, unsigned char c, art_node **l) {
     switch (n->type) {
         case NODE4:
-            return remove_child4((art_node4*)n, ref, l);
+            return remove_child4(t, (art_node4*)n, ref, l);
         case NODE16:
-            return remove_child16((art_node16*)n, ref, l);
+            return remove_child16(t, (art_node16*)n, ref, l);
         case NODE48:
-            return remove_child48((art_node48*)n, ref, c);
+            return remove_child48(t, (art_node48*)n, ref, c);
         case NODE256:
-            return remove_child256((art_node256*)n, ref, c);
+            return remove_child256(t, (art_node256*)n, ref, c);
         default:
             abort();
     }
 }
 
-static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *key, int key_len, int depth) {
+static art_leaf* recursive_delete(art_tree *t, art_node *n, art_node **ref, unsigned char *key, int key_len, int depth) {
     // Search terminated
     if (!n) return NULL;
 
@@ -727,14 +785,14 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
     if (IS_LEAF(*child)) {
         art_leaf *l = LEAF_RAW(*child);
         if (!leaf_matches(l, key, key_len, depth)) {
-            remove_child(n, ref, key[depth], child);
+            remove_child(t, n, ref, key[depth], child);
             return l;
         }
         return NULL;
 
     // Recurse
     } else {
-        return recursive_delete(*child, child, key, key_len, depth+1);
+        return recursive_delete(t, *child, child, key, key_len, depth+1);
     }
 }
 
@@ -747,7 +805,7 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
  * the value pointer is returned.
  */
 void* art_delete(art_tree *t, unsigned char *key, int key_len) {
-    art_leaf *l = recursive_delete(t->root, &t->root, key, key_len, 0);
+    art_leaf *l = recursive_delete(t, t->root, &t->root, key, key_len, 0);
     if (l) {
         t->size--;
         void *old = l->value;
@@ -762,6 +820,241 @@ void* art_delete(art_tree *t, unsigned char *key, int key_len) {
     return NULL;
 }
 
+/**
+ * Copies a node, the copy is not yet reachable
+ */
+static art_node* clone_node(art_tree *t, art_node *n) {
+    art_node *c = alloc_node(t, n->type);
+    memcpy(c, n, NODE_SIZES[n->type]);
+    return c;
+}
+
+/**
+ * Adds a node or a tagged leaf to the garbage of the tree.
+ * It may still be used by readers of an older root.
+ */
+static void retire(art_tree *t, void *n) {
+    if (t->num_garbage == t->max_garbage) {
+        t->max_garbage = (t->max_garbage) ? t->max_garbage * 2 : 64;
+        t->garbage = realloc(t->garbage, t->max_garbage * sizeof(void*));
+        if (!t->garbage) abort();
+    }
+    t->garbage[t->num_garbage++] = n;
+}
+
+/**
+ * Inserts by copying the path from the root. The nodes
+ * of the old path are retired, and never modified.
+ */
+static void* cow_insert(art_tree *t, art_node *n, art_node **ref, unsigned char *key, int key_len, void *value, int depth, int *old) {
+    // If we are at a NULL node, inject a leaf
+    if (!n) {
+        *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
+        return NULL;
+    }
+
+    // If we are at a leaf, we need to replace it
+    if (IS_LEAF(n)) {
+        art_leaf *l = LEAF_RAW(n);
+
+        // Check if we are updating an existing value
+        if (!leaf_matches(l, key, key_len, depth)) {
+            *old = 1;
+            *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
+            retire(t, n);
+            return l->value;
+        }
+
+        // New value, we must split the leaf into a node4
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
+        art_leaf *l2 = make_leaf(key, key_len, value);
+        int longest_prefix = longest_common_prefix(l, l2, depth);
+        new->n.partial_len = longest_prefix;
+        memcpy(new->n.partial, key+depth, min(MAX_PREFIX_LEN, longest_prefix));
+        *ref = (art_node*)new;
+        add_child4(t, new, ref, l->key[depth+longest_prefix], SET_LEAF(l));
+        add_child4(t, new, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
+        return NULL;
+    }
+
+    // Check if given node has a prefix
+    if (n->partial_len) {
+        // Determine if the prefixes differ, since we need to split
+        int prefix_diff = prefix_mismatch(n, key, key_len, depth);
+        if ((uint32_t)prefix_diff >= n->partial_len) {
+            depth += n->partial_len;
+            goto RECURSE_SEARCH;
+        }
+
+        // Create a new node
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
+        *ref = (art_node*)new;
+        new->n.partial_len = prefix_diff;
+        memcpy(new->n.partial, n->partial, min(MAX_PREFIX_LEN, prefix_diff));
+
+        // Adjust the prefix of a copy of the old node
+        art_node *c = clone_node(t, n);
+        retire(t, n);
+        if (c->partial_len <= MAX_PREFIX_LEN) {
+            add_child4(t, new, ref, c->partial[prefix_diff], c);
+            c->partial_len -= (prefix_diff+1);
+            memmove(c->partial, c->partial+prefix_diff+1,
+                    min(MAX_PREFIX_LEN, c->partial_len));
+        } else {
+            c->partial_len -= (prefix_diff+1);
+            art_leaf *l = minimum(c);
+            add_child4(t, new, ref, l->key[depth+prefix_diff], c);
+            memcpy(c->partial, l->key+depth+prefix_diff+1,
+                    min(MAX_PREFIX_LEN, c->partial_len));
+        }
+
+        // Insert the new leaf
+        art_leaf *l = make_leaf(key, key_len, value);
+        add_child4(t, new, ref, key[depth+prefix_diff], SET_LEAF(l));
+        return NULL;
+    }
+
+RECURSE_SEARCH:;
+
+    // Copy ourself, the child is replaced in the copy
+    art_node *c = clone_node(t, n);
+    retire(t, n);
+    *ref = c;
+
+    // Find a child to recurse to
+    art_node **child = find_child(c, key[depth]);
+    if (child) {
+        return cow_insert(t, *child, child, key, key_len, value, depth+1, old);
+    }
+
+    // No child, node goes within the copy
+    art_leaf *l = make_leaf(key, key_len, value);
+    add_child(t, c, ref, key[depth], SET_LEAF(l));
+    return NULL;
+}
+
+/**
+ * Deletes by copying the path from the root. The key
+ * must exist under the node. The nodes of the old path
+ * are retired, and never modified.
+ */
+static art_leaf* cow_delete(art_tree *t, art_node *n, art_node **ref, unsigned char *key, int key_len, int depth) {
+    // Only the root can be a leaf
+    if (IS_LEAF(n)) {
+        *ref = NULL;
+        return LEAF_RAW(n);
+    }
+    depth += n->partial_len;
+
+    // Copy ourself, the child is replaced in the copy
+    art_node *c = clone_node(t, n);
+    retire(t, n);
+    *ref = c;
+
+    // Recurse unless the child is the leaf
+    art_node **child = find_child(c, key[depth]);
+    if (!IS_LEAF(*child)) {
+        return cow_delete(t, *child, child, key, key_len, depth+1);
+    }
+
+    // Removing from a node4 with 2 children merges our prefix
+    // into the remaining child, so it must be copied as well
+    if (c->type == NODE4 && c->num_children == 2) {
+        art_node4 *c4 = (art_node4*)c;
+        int other = (child == c4->children) ? 1 : 0;
+        if (!IS_LEAF(c4->children[other])) {
+            art_node *o = c4->children[other];
+            c4->children[other] = clone_node(t, o);
+            retire(t, o);
+        }
+    }
+
+    art_leaf *l = LEAF_RAW(*child);
+    remove_child(t, c, ref, key[depth], child);
+    return l;
+}
+
+/**
+ * Inserts a new value into the ART tree, without
+ * modifying any node reachable from the current root.
+ * The new root is published atomically, so readers may
+ * search the tree concurrently. Replaced nodes are kept
+ * until art_release_garbage() is called.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @return NULL if the item was newly inserted, otherwise
+ * the old value pointer is returned.
+ */
+void* art_insert_cow(art_tree *t, unsigned char *key, int key_len, void *value) {
+    int old_val = 0;
+    art_node *root = t->root;
+    void *old = cow_insert(t, root, &root, key, key_len, value, 0, &old_val);
+    __atomic_store_n(&t->root, root, __ATOMIC_RELEASE);
+    if (!old_val) t->size++;
+    return old;
+}
+
+/**
+ * Deletes a value from the ART tree, without
+ * modifying any node reachable from the current root.
+ * The new root is published atomically, so readers may
+ * search the tree concurrently. Replaced nodes are kept
+ * until art_release_garbage() is called.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_delete_cow(art_tree *t, unsigned char *key, int key_len) {
+    // Avoid copying a path if the key does not exist
+    if (!search_leaf(t, key, key_len)) return NULL;
+
+    art_node *root = t->root;
+    art_leaf *l = cow_delete(t, root, &root, key, key_len, 0);
+    __atomic_store_n(&t->root, root, __ATOMIC_RELEASE);
+    t->size--;
+    retire(t, SET_LEAF(l));
+    return l->value;
+}
+
+/**
+ * Releases the nodes and leaves replaced by the copy on
+ * write operations. Must only be called once no reader
+ * can be using an older root.
+ * @arg t The tree
+ */
+void art_release_garbage(art_tree *t) {
+    art_release_garbage_upto(t, t->num_garbage);
+}
+
+/**
+ * Releases the oldest nodes and leaves replaced by the
+ * copy on write operations, keeping any replaced since.
+ * Must only be called once no reader can be using a
+ * root from before the nodes were replaced.
+ * @arg t The tree
+ * @arg num The number of replaced nodes to release, as
+ * given by num_garbage when they were replaced.
+ */
+void art_release_garbage_upto(art_tree *t, uint32_t num) {
+    if (num > t->num_garbage) num = t->num_garbage;
+    if (!num) return;
+    for (uint32_t i=0; i < num; i++) {
+        art_node *n = t->garbage[i];
+        if (IS_LEAF(n)) {
+            art_leaf *l = LEAF_RAW(n);
+            if (!__sync_sub_and_fetch(&l->ref_count, 1))
+                free(l);
+        } else
+            free_node(t, n);
+    }
+    t->num_garbage -= num;
+    memmove(t->garbage, t->garbage + num, t->num_garbage * sizeof(void*));
+}
+
 // Recursively iterates over the tree
 static int recursive_iter(art_node *n, art_callback cb, void *data) {
     // Handle base cases
@@ -811,6 +1104,87 @@ static int recursive_iter(art_node *n, art_callback cb, void *data) {
     return 0;
 }
 
+// Iterates over the leaves of a node that are greater than a key
+static int recursive_iter_after(art_node *n, unsigned char *key, int key_len, int depth, art_callback cb, void *data);
+
+// Iterates over a child, given its key byte at the depth
+static int iter_child_after(art_node *child, unsigned char c, unsigned char *key, int key_len, int depth, art_callback cb, void *data) {
+    if (c < key[depth]) return 0;
+    if (c == key[depth])
+        return recursive_iter_after(child, key, key_len, depth+1, cb, data);
+    return recursive_iter(child, cb, data);
+}
+
+static int recursive_iter_after(art_node *n, unsigned char *key, int key_len, int depth, art_callback cb, void *data) {
+    // Handle base cases
+    if (!n) return 0;
+    if (IS_LEAF(n)) {
+        art_leaf *l = LEAF_RAW(n);
+        int cmp = memcmp(l->key, key, min(l->key_len, key_len));
+        if (cmp > 0 || (cmp == 0 && l->key_len > (uint32_t)key_len))
+            return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+        return 0;
+    }
+
+    // Compare the prefix to the key. The stored prefix
+    // may be truncated, so we use the minimum leaf.
+    if (n->partial_len) {
+        art_leaf *l = minimum(n);
+        for (uint32_t i=0; i < n->partial_len; i++) {
+            if (depth + (int)i >= key_len || l->key[depth+i] > key[depth+i])
+                return recursive_iter(n, cb, data);
+            if (l->key[depth+i] < key[depth+i])
+                return 0;
+        }
+        depth = depth + n->partial_len;
+    }
+
+    // All the keys below us extend the key
+    if (depth >= key_len) return recursive_iter(n, cb, data);
+
+    int idx, res;
+    switch (n->type) {
+        case NODE4:
+            for (int i=0; i < n->num_children; i++) {
+                res = iter_child_after(((art_node4*)n)->children[i],
+                        ((art_node4*)n)->keys[i], key, key_len, depth, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE16:
+            for (int i=0; i < n->num_children; i++) {
+                res = iter_child_after(((art_node16*)n)->children[i],
+                        ((art_node16*)n)->keys[i], key, key_len, depth, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE48:
+            for (int i=key[depth]; i < 256; i++) {
+                idx = ((art_node48*)n)->keys[i];
+                if (!idx) continue;
+                res = iter_child_after(((art_node48*)n)->children[idx-1],
+                        i, key, key_len, depth, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        case NODE256:
+            for (int i=key[depth]; i < 256; i++) {
+                if (!((art_node256*)n)->children[i]) continue;
+                res = iter_child_after(((art_node256*)n)->children[i],
+                        i, key, key_len, depth, cb, data);
+                if (res) return res;
+            }
+            break;
+
+        default:
+            abort();
+    }
+    return 0;
+}
+
 /**
  * Iterates through the entries pairs in the map,
  * invoking a callback for each. The call back gets a
@@ -822,7 +1196,7 @@ static int recursive_iter(art_node *n, art_callback cb, void *data) {
  * @return 0 on success, or the return of the callback.
  */
 int art_iter(art_tree *t, art_callback cb, void *data) {
-    return recursive_iter(t->root, cb, data);
+    return recursive_iter(__atomic_load_n(&t->root, __ATOMIC_ACQUIRE), cb, data);
 }
 
 /**
@@ -851,7 +1225,7 @@ static int leaf_prefix_matches(art_leaf *n, unsigned char *prefix, int prefix_le
  */
 int art_iter_prefix(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data) {
     art_node **child;
-    art_node *n = t->root;
+    art_node *n = __atomic_load_n(&t->root, __ATOMIC_ACQUIRE);
     int prefix_len, depth = 0;
     while (n) {
         // Might be a leaf
@@ -898,8 +1272,25 @@ int art_iter_prefix(art_tree *t, unsigned char *key, int key_len, art_callback c
     return 0;
 }
 
+/**
+ * Iterates in order through the entries in the map with keys
+ * strictly greater than a given key, invoking a callback for each.
+ * Subtrees that only hold smaller keys are skipped.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg key The key to start after
+ * @arg key_len The length of the key
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_after(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data) {
+    art_node *root = __atomic_load_n(&t->root, __ATOMIC_ACQUIRE);
+    return recursive_iter_after(root, key, key_len, 0, cb, data);
+}
+
 // Recursively copies a tree
-static art_node* recursive_copy(art_node *n) {
+static art_node* recursive_copy(art_tree *t, art_node *n) {
     // Handle the NULL nodes
     if (!n) return NULL;
 
@@ -919,37 +1310,37 @@ static art_node* recursive_copy(art_node *n) {
     } p;
     switch (n->type) {
         case NODE4:
-            p.p1 = (art_node4*)alloc_node(NODE4);
+            p.p1 = (art_node4*)alloc_node(t, NODE4);
             copy_header((art_node*)p.p1, n);
             memcpy(p.p1->keys, ((art_node4*)n)->keys, 4);
             for (int i=0; i < n->num_children; i++) {
-                p.p1->children[i] = recursive_copy(((art_node4*)n)->children[i]);
+                p.p1->children[i] = recursive_copy(t, ((art_node4*)n)->children[i]);
             }
             return (art_node*)p.p1;
 
         case NODE16:
-            p.p2 = (art_node16*)alloc_node(NODE16);
+            p.p2 = (art_node16*)alloc_node(t, NODE16);
             copy_header((art_node*)p.p2, n);
             memcpy(p.p1->keys, ((art_node16*)n)->keys, 16);
             for (int i=0; i < n->num_children; i++) {
-                p.p2->children[i] = recursive_copy(((art_node16*)n)->children[i]);
+                p.p2->children[i] = recursive_copy(t, ((art_node16*)n)->children[i]);
             }
             return (art_node*)p.p2;
 
         case NODE48:
-            p.p3 = (art_node48*)alloc_node(NODE48);
+            p.p3 = (art_node48*)alloc_node(t, NODE48);
             copy_header((art_node*)p.p3, n);
             memcpy(p.p3->keys, ((art_node48*)n)->keys, 256);
             for (int i=0; i < n->num_children; i++) {
-                p.p3->children[i] = recursive_copy(((art_node48*)n)->children[i]);
+                p.p3->children[i] = recursive_copy(t, ((art_node48*)n)->children[i]);
             }
             return (art_node*)p.p3;
 
         case NODE256:
-            p.p4 = (art_node256*)alloc_node(NODE256);
+            p.p4 = (art_node256*)alloc_node(t, NODE256);
             copy_header((art_node*)p.p4, n);
             for (int i=0; i < 256; i++) {
-                p.p4->children[i] = recursive_copy(((art_node256*)n)->children[i]);
+                p.p4->children[i] = recursive_copy(t, ((art_node256*)n)->children[i]);
             }
             return (art_node*)p.p4;
 
@@ -970,8 +1361,9 @@ static art_node* recursive_copy(art_node *n) {
  * @return 0 on success.
  */
 int art_copy(art_tree *dst, art_tree *src) {
+    init_art_tree(dst);
     dst->size = src->size;
-    dst->root = recursive_copy(src->root);
+    dst->root = recursive_copy(dst, src->root);
     return 0;
 }
 
@@ -69,12 +69,39 @@ typedef struct {
     unsigned char key[];
 } art_leaf;
 
+/**
+ * Header of a slab of nodes. Slabs are
+ * only released when the tree is destroyed.
+ */
+typedef struct art_slab {
+    struct art_slab *next;
+    uint64_t pad;           // Keeps the nodes 16 byte aligned
+} art_slab;
+
+/**
+ * Arena that the nodes of a tree are allocated from.
+ * Nodes of each type are carved out of shared slabs, and
+ * released nodes are kept on a free list per type.
+ * Leaves are shared between copies of a tree, so they
+ * are allocated individually.
+ */
+typedef struct {
+    art_slab *slabs;
+    char *next[NODE256+1];      // Next unused node in the current slab
+    char *end[NODE256+1];       // End of the current slab
+    void *free_list[NODE256+1]; // Released nodes
+} art_arena;
+
 /**
  * Main struct, points to root.
  */
 typedef struct {
     art_node *root;
     uint64_t size;
+    art_arena arena;
+    void **garbage;         // Nodes replaced by copy on write
+    uint32_t num_garbage;
+    uint32_t max_garbage;
 } art_tree;
 
 /**
@@ -84,7 +111,7 @@ typedef struct {
 int init_art_tree(art_tree *t);
 
 /**
- * Destroys an ART tree
+ * Destroys an ART tree, releasing all of its nodes
  * @return 0 on success.
  */
 int destroy_art_tree(art_tree *t);
@@ -117,6 +144,54 @@ void* art_insert(art_tree *t, unsigned char *key, int key_len, void *value);
  */
 void* art_delete(art_tree *t, unsigned char *key, int key_len);
 
+/**
+ * Inserts a new value into the ART tree, without
+ * modifying any node reachable from the current root.
+ * The new root is published atomically, so readers may
+ * search the tree concurrently. Replaced nodes are kept
+ * until art_release_garbage() is called.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @return NULL if the item was newly inserted, otherwise
+ * the old value pointer is returned.
+ */
+void* art_insert_cow(art_tree *t, unsigned char *key, int key_len, void *value);
+
+/**
+ * Deletes a value from the ART tree, without
+ * modifying any node reachable from the current root.
+ * The new root is published atomically, so readers may
+ * search the tree concurrently. Replaced nodes are kept
+ * until art_release_garbage() is called.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_delete_cow(art_tree *t, unsigned char *key, int key_len);
+
+/**
+ * Releases the nodes and leaves replaced by the copy on
+ * write operations. Must only be called once no reader
+ * can be using an older root.
+ * @arg t The tree
+ */
+void art_release_garbage(art_tree *t);
+
+/**
+ * Releases the oldest nodes and leaves replaced by the
+ * copy on write operations, keeping any replaced since.
+ * Must only be called once no reader can be using a
+ * root from before the nodes were replaced.
+ * @arg t The tree
+ * @arg num The number of replaced nodes to release, as
+ * given by num_garbage when they were replaced.
+ */
+void art_release_garbage_upto(art_tree *t, uint32_t num);
+
 /**
  * Searches for a value in the ART tree
  * @arg t The tree
@@ -165,6 +240,20 @@ int art_iter(art_tree *t, art_callback cb, void *data);
  */
 int art_iter_prefix(art_tree *t, unsigned char *prefix, int prefix_len, art_callback cb, void *data);
 
+/**
+ * Iterates in order through the entries in the map with keys
+ * strictly greater than a given key, invoking a callback for each.
+ * Subtrees that only hold smaller keys are skipped.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg key The key to start after
+ * @arg key_len The length of the key
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_after(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data);
+
 /**
  * Creates a copy of an ART tree. The two trees will
  * share the internal leaves, but will NOT share internal nodes.
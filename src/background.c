@@ -22,6 +22,19 @@
  */
 #define PERIODIC_CHECKPOINT 64
 
+/**
+ * When over the memory budget, sets are unmapped
+ * until this percentage of the budget is in use. This
+ * leaves some headroom so we do not evict on every tick.
+ */
+#define EVICT_TARGET_PCT 90
+
+/**
+ * When an eviction frees nothing, the next attempt
+ * waits twice as many ticks as the last, up to this.
+ */
+#define MAX_EVICT_BACKOFF_TICKS 64
+
 static int timediff_msec(struct timeval *t1, struct timeval *t2);
 static void* flush_thread_main(void *in);
 static void* unmap_thread_main(void *in);
@@ -74,7 +87,9 @@ int start_flush_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, p
 
 /**
  * Starts a cold unmap thread which on every
- * cold interval unamps cold sets.
+ * cold interval unamps cold sets. If there is
+ * a memory budget, the thread also unmaps the
+ * coldest sets as soon as the budget is exceeded.
  * @arg config The configuration
  * @arg mgr The manager to use
  * @arg should_run Pointer to an integer that is set to 0 to
@@ -84,7 +99,7 @@ int start_flush_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, p
  */
 int start_cold_unmap_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, pthread_t *t) {
     // Return if we are not scheduled
-    if(config->cold_interval <= 0) {
+    if(config->cold_interval <= 0 && !config->max_memory) {
         return 0;
     }
 
@@ -134,6 +149,9 @@ static void* flush_thread_main(void *in) {
                 node = node->next;
             }
 
+            // Update the catalog of sets
+            setmgr_write_catalog(mgr);
+
             // Compute the elapsed time
             gettimeofday(&end, NULL);
             syslog(LOG_INFO, "Flushed %d sets in %d msecs", head->size, timediff_msec(&start, &end));
@@ -154,12 +172,35 @@ static void* unmap_thread_main(void *in) {
     // Perform the initial checkpoint with the manager
     setmgr_client_checkpoint(mgr);
 
-    syslog(LOG_INFO, "Cold unmap thread started. Interval: %d seconds.", config->cold_interval);
+    syslog(LOG_INFO, "Cold unmap thread started. Interval: %d seconds. Memory budget: %llu bytes.",
+            config->cold_interval, (unsigned long long)config->max_memory);
     unsigned int ticks = 0;
+    unsigned int evict_backoff = 0, evict_wait = 0;
     while (*should_run) {
         usleep(PERIODIC_TIME_USEC);
         setmgr_client_checkpoint(mgr);
-        if ((++ticks % SEC_TO_TICKS(config->cold_interval)) == 0 && *should_run) {
+
+        // Enforce the memory budget on every tick, backing
+        // off while there is nothing that can be unmapped
+        if (evict_wait) {
+            evict_wait--;
+        } else if (config->max_memory && setmgr_resident_bytes(mgr) > config->max_memory) {
+            struct timeval start, end;
+            gettimeofday(&start, NULL);
+            int num = setmgr_evict(mgr, config->max_memory / 100 * EVICT_TARGET_PCT);
+            gettimeofday(&end, NULL);
+            if (num > 0) {
+                syslog(LOG_INFO, "Unmapped %d sets over the memory budget in %d msecs",
+                        num, timediff_msec(&start, &end));
+                evict_backoff = 0;
+            } else if (evict_backoff < MAX_EVICT_BACKOFF_TICKS) {
+                evict_backoff = (evict_backoff) ? evict_backoff * 2 : 1;
+            }
+            evict_wait = evict_backoff;
+        }
+
+        if (config->cold_interval > 0 &&
+                (++ticks % SEC_TO_TICKS(config->cold_interval)) == 0 && *should_run) {
             // Time how long this takes
             struct timeval start, end;
             gettimeofday(&start, NULL);
@@ -184,7 +225,9 @@ static void* unmap_thread_main(void *in) {
 
             // Compute the elapsed time
             gettimeofday(&end, NULL);
-            syslog(LOG_INFO, "Unmapped %d sets in %d msecs", head->size, timediff_msec(&start, &end));
+            if (head->size > 0) {
+                syslog(LOG_INFO, "Unmapped %d sets in %d msecs", head->size, timediff_msec(&start, &end));
+            }
 
             // Cleanup
             setmgr_cleanup_list(head);
@@ -18,7 +18,9 @@ int start_flush_thread(hlld_config *config, hlld_setmgr *mgr, int *should_run, p
 
 /**
  * Starts a cold unmap thread which on every
- * cold interval unamps cold sets.
+ * cold interval unamps cold sets. If there is
+ * a memory budget, the thread also unmaps the
+ * coldest sets as soon as the budget is exceeded.
  * @arg config The configuration
  * @arg mgr The manager to use
  * @arg should_run Pointer to an integer that is set to 0 to
@@ -4,17 +4,19 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
 #include <syslog.h>
 #include "bitmap.h"
+#include "crc32c.h"
 
 /* Static declarations */
 static int fill_buffer(int fileno, unsigned char* buf, uint64_t len);
 static int flush_all_pages(hlld_bitmap *map);
-static int flush_page(hlld_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page);
+static int flush_page(hlld_bitmap *map, unsigned char *page_buf, uint64_t page, uint64_t size, uint64_t max_page);
 extern inline int bitmap_getbit(hlld_bitmap *map, uint64_t idx);
 extern inline void bitmap_setbit(hlld_bitmap *map, uint64_t idx);
 
@@ -86,14 +88,22 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, hlld_bitmap *ma
 
     // For the PERSISTENT case, we manually track
     // dirty pages, and need a bit field for this
+    uint32_t checksum = 0;
     if (mode == PERSISTENT) {
         // For existing bitmaps we need to read in the data
-        // since we cannot use the kernel to fault it in
+        // since we cannot use the kernel to fault it in.
+        // Ask for the whole file to be read ahead first.
+        if (!new_bitmap) {
+            posix_fadvise(newfileno, 0, len, POSIX_FADV_WILLNEED);
+        }
         if (!new_bitmap && (res = fill_buffer(newfileno, addr, len))) {
             munmap(addr, len);
             if (newfileno >= 0) close(newfileno);
             return res;
         }
+
+        // Checksum what we read, so torn writes can be detected
+        checksum = crc32c(0, addr, len);
     }
 
     // Allocate space for the map
@@ -101,6 +111,7 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, hlld_bitmap *ma
     map->fileno = newfileno;
     map->size = len;
     map->mmap = addr;
+    map->checksum = checksum;
     return 0;
 }
 
@@ -197,6 +208,22 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
 }
 
 
+/**
+ * Touches every page of the bitmap, so that
+ * a SHARED bitmap is read in from disk now instead
+ * of on the first access. A no-op for other modes.
+ * @arg map The bitmap
+ */
+void bitmap_prefault(hlld_bitmap *map) {
+    if (map->mode != SHARED || !map->mmap) return;
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile unsigned char sum = 0;
+    for (uint64_t off=0; off < map->size; off += page_size) {
+        sum += map->mmap[off];
+    }
+    (void)sum;
+}
+
 /**
  * Flushes the bitmap back to disk. This is
  * a syncronous operation. It is a no-op for
@@ -231,22 +258,63 @@ int bitmap_flush(hlld_bitmap *map) {
 
 
 /**
- * Flushes all the pages of the bitmap.
+ * Writes a copy of a PERSISTENT bitmap back to disk.
+ * This is a syncronous operation. It is used when the
+ * checksum must be known before the write starts, since
+ * the map may be updated while it is being written.
+ * @arg map The bitmap
+ * @arg copy A copy of the map, of the same size
+ * @arg checksum The checksum of the copy
+ * @returns 0 on success, negative failure.
+ */
+int bitmap_flush_copy(hlld_bitmap *map, unsigned char *copy, uint32_t checksum) {
+    if (map == NULL || map->mode != PERSISTENT) return -EINVAL;
+
+    uint64_t total = 0;
+    ssize_t res;
+    while (total < map->size) {
+        res = pwrite(map->fileno, copy + total, map->size - total, total);
+        if (res == -1 && errno != EINTR)
+            return -errno;
+        else if (res > 0)
+            total += res;
+    }
+
+    if (fsync(map->fileno) == -1) return -errno;
+    map->checksum = checksum;
+    return 0;
+}
+
+
+/**
+ * Flushes all the pages of the bitmap, and
+ * computes the checksum of the written data.
  */
 static int flush_all_pages(hlld_bitmap *map) {
     uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    unsigned char page_buf[4096];
+    uint32_t checksum = 0;
     int res = 0;
     for (uint64_t i=0; i < pages; i++) {
-        res = flush_page(map, i, map->size, pages - 1);
+        res = flush_page(map, page_buf, i, map->size, pages - 1);
+        if (res) return res;
+
+        // Checksum the copy, since the map may be updated concurrently
+        uint64_t offset = i * 4096;
+        uint64_t len = (map->size - offset < 4096) ? map->size - offset : 4096;
+        checksum = crc32c(checksum, page_buf, len);
     }
+    map->checksum = checksum;
     return res;
 }
 
 
 /**
- * Flushes out a single page that is dirty
+ * Flushes out a single page that is dirty.
+ * The page is copied into page_buf first, so that
+ * the caller knows exactly what was written.
  */
-static int flush_page(hlld_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page) {
+static int flush_page(hlld_bitmap *map, unsigned char *page_buf, uint64_t page, uint64_t size, uint64_t max_page) {
     int res, total = 0;
     uint64_t offset = page * 4096;
 
@@ -256,8 +324,9 @@ static int flush_page(hlld_bitmap *map, uint64_t page, uint64_t size, uint64_t m
         should_write = size % 4096;
     }
 
+    memcpy(page_buf, map->mmap + offset, should_write);
     while (total < should_write) {
-        res = pwrite(map->fileno, map->mmap + offset + total,
+        res = pwrite(map->fileno, page_buf + total,
                 should_write - total, offset + total);
         if (res == -1 && errno != EINTR)
             return -errno;
@@ -16,6 +16,7 @@ typedef struct {
     int fileno;          // Underlying fileno
     uint64_t size;       // Size of bitmap in bytes
     unsigned char* mmap; // Starting address of the bitmap region
+    uint32_t checksum;   // CRC32C of the file as last read or flushed. PERSISTENT only.
 } hlld_bitmap;
 
 /**
@@ -46,12 +47,33 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
 /**
  * Flushes the bitmap back to disk. This is
  * a syncronous operation. It is a no-op for
- * ANONYMOUS bitmaps.
+ * ANONYMOUS bitmaps. In PERSISTENT mode, the
+ * checksum is updated to match the written data.
  * @arg map The bitmap
  * @returns 0 on success, negative failure.
  */
 int bitmap_flush(hlld_bitmap *map);
 
+/**
+ * Writes a copy of a PERSISTENT bitmap back to disk.
+ * This is a syncronous operation. It is used when the
+ * checksum must be known before the write starts, since
+ * the map may be updated while it is being written.
+ * @arg map The bitmap
+ * @arg copy A copy of the map, of the same size
+ * @arg checksum The checksum of the copy
+ * @returns 0 on success, negative failure.
+ */
+int bitmap_flush_copy(hlld_bitmap *map, unsigned char *copy, uint32_t checksum);
+
+/**
+ * Touches every page of the bitmap, so that
+ * a SHARED bitmap is read in from disk now instead
+ * of on the first access. A no-op for other modes.
+ * @arg map The bitmap
+ */
+void bitmap_prefault(hlld_bitmap *map);
+
 /**
  * * Closes and flushes the bitmap. This is
  * a syncronous operation. It is a no-op for
@@ -0,0 +1,240 @@
+/*
+ * The catalog is stored as a small binary file. It starts
+ * with a fixed header, followed by one record per set:
+ *
+ *   header: magic[8] version:u32 num_entries:u32
+ *           mtime_sec:i64 mtime_nsec:i64
+ *   record: name_len:u16 name[name_len] precision:u8
+ *           in_memory:u8 eps:f64 size:u64
+ *           window:u64 retain:u32 sliding:u64 layout:u8
+ *
+ * All values are in host byte order, since the catalog
+ * is never shared between machines.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "catalog.h"
+
+/**
+ * Magic header and format version. The version
+ * must be bumped whenever the record layout changes.
+ */
+static const char CATALOG_MAGIC[8] = {'H','L','L','D','C','A','T','\0'};
+#define CATALOG_VERSION 4
+
+/**
+ * Size of the fixed header and the fixed portion of a record
+ */
+#define HEADER_SIZE (sizeof(CATALOG_MAGIC) + 2*sizeof(uint32_t) + 2*sizeof(int64_t))
+#define RECORD_SIZE (sizeof(uint16_t) + 3*sizeof(uint8_t) + sizeof(double) + 3*sizeof(uint64_t) + sizeof(uint32_t))
+
+/**
+ * Appends a value to a buffer, advancing the offset
+ */
+#define PUT(buf, off, val) { memcpy((buf)+(off), &(val), sizeof(val)); (off) += sizeof(val); }
+
+/**
+ * Reads a value from a buffer, advancing the offset
+ */
+#define GET(buf, off, val) { memcpy(&(val), (buf)+(off), sizeof(val)); (off) += sizeof(val); }
+
+/**
+ * Writes out the catalog to a file atomically.
+ * The catalog is written to a temporary file first,
+ * synced and then renamed over the existing file.
+ * @arg filename The name of the file to write
+ * @arg catalog The catalog to write out
+ * @return 0 on success, negative on error.
+ */
+int catalog_write(char *filename, hlld_catalog *catalog) {
+    // Determine the size of the catalog
+    uint64_t len = HEADER_SIZE;
+    for (uint32_t i=0; i < catalog->num_entries; i++) {
+        len += RECORD_SIZE + strlen(catalog->entries[i].set_name);
+    }
+
+    // Serialize into a single buffer
+    char *buf = malloc(len);
+    if (!buf) return -ENOMEM;
+
+    uint64_t off = 0;
+    uint32_t version = CATALOG_VERSION;
+    memcpy(buf, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+    off += sizeof(CATALOG_MAGIC);
+    PUT(buf, off, version);
+    PUT(buf, off, catalog->num_entries);
+    PUT(buf, off, catalog->mtime_sec);
+    PUT(buf, off, catalog->mtime_nsec);
+
+    for (uint32_t i=0; i < catalog->num_entries; i++) {
+        hlld_catalog_entry *e = catalog->entries+i;
+        uint16_t name_len = strlen(e->set_name);
+        uint8_t precision = e->config.default_precision;
+        uint8_t in_memory = e->config.in_memory;
+        uint32_t retain = e->config.retain;
+        uint8_t layout = e->config.layout;
+        PUT(buf, off, name_len);
+        memcpy(buf+off, e->set_name, name_len);
+        off += name_len;
+        PUT(buf, off, precision);
+        PUT(buf, off, in_memory);
+        PUT(buf, off, e->config.default_eps);
+        PUT(buf, off, e->config.size);
+        PUT(buf, off, e->config.window);
+        PUT(buf, off, retain);
+        PUT(buf, off, e->config.sliding);
+        PUT(buf, off, layout);
+    }
+
+    // Write to a temporary file
+    char *tmp_name;
+    if (asprintf(&tmp_name, "%s.tmp", filename) == -1) {
+        free(buf);
+        return -ENOMEM;
+    }
+    int res = 0;
+    int fh = open(tmp_name, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if (fh == -1) {
+        res = -errno;
+        syslog(LOG_ERR, "Failed to open catalog '%s'. %s", tmp_name, strerror(errno));
+        goto LEAVE;
+    }
+
+    uint64_t written = 0;
+    ssize_t more;
+    while (written < len) {
+        more = write(fh, buf+written, len-written);
+        if (more == -1 && errno == EINTR) continue;
+        if (more == -1) {
+            res = -errno;
+            syslog(LOG_ERR, "Failed to write catalog '%s'. %s", tmp_name, strerror(errno));
+            close(fh);
+            unlink(tmp_name);
+            goto LEAVE;
+        }
+        written += more;
+    }
+
+    // Sync before the rename so we never expose a partial catalog
+    if (fsync(fh) == -1) res = -errno;
+    close(fh);
+    if (!res && rename(tmp_name, filename) == -1) {
+        res = -errno;
+        syslog(LOG_ERR, "Failed to rename catalog '%s'. %s", tmp_name, strerror(errno));
+    }
+    if (res) unlink(tmp_name);
+
+LEAVE:
+    free(tmp_name);
+    free(buf);
+    return res;
+}
+
+/**
+ * Reads a catalog from a file with a single read.
+ * @arg filename The name of the file to read
+ * @arg catalog Output. The catalog to initialize.
+ * @return 0 on success, -ENOENT if there is no catalog,
+ * -EINVAL if the catalog is corrupt or of another version.
+ */
+int catalog_read(char *filename, hlld_catalog *catalog) {
+    memset(catalog, 0, sizeof(hlld_catalog));
+
+    // Open the catalog and get the size
+    int fh = open(filename, O_RDONLY);
+    if (fh == -1) return -errno;
+
+    struct stat st;
+    if (fstat(fh, &st) == -1) {
+        close(fh);
+        return -errno;
+    }
+    uint64_t len = st.st_size;
+    if (len < HEADER_SIZE) {
+        close(fh);
+        return -EINVAL;
+    }
+
+    // Read the whole catalog in
+    char *buf = malloc(len);
+    uint64_t total = 0;
+    ssize_t more;
+    while (total < len) {
+        more = read(fh, buf+total, len-total);
+        if (more == -1 && errno == EINTR) continue;
+        if (more <= 0) break;
+        total += more;
+    }
+    close(fh);
+    if (total != len) {
+        free(buf);
+        return -EINVAL;
+    }
+
+    // Verify the header
+    uint64_t off = sizeof(CATALOG_MAGIC);
+    uint32_t version;
+    if (memcmp(buf, CATALOG_MAGIC, sizeof(CATALOG_MAGIC))) goto CORRUPT;
+    GET(buf, off, version);
+    if (version != CATALOG_VERSION) goto CORRUPT;
+    GET(buf, off, catalog->num_entries);
+    GET(buf, off, catalog->mtime_sec);
+    GET(buf, off, catalog->mtime_nsec);
+    if ((uint64_t)catalog->num_entries * RECORD_SIZE > len - off) goto CORRUPT;
+
+    // Parse all the records
+    catalog->entries = calloc(catalog->num_entries, sizeof(hlld_catalog_entry));
+    for (uint32_t i=0; i < catalog->num_entries; i++) {
+        hlld_catalog_entry *e = catalog->entries+i;
+        uint16_t name_len;
+        uint8_t precision, in_memory, layout;
+        uint32_t retain;
+        if (off + RECORD_SIZE > len) goto CORRUPT;
+        GET(buf, off, name_len);
+        if (off + name_len + RECORD_SIZE - sizeof(uint16_t) > len) goto CORRUPT;
+        e->set_name = strndup(buf+off, name_len);
+        off += name_len;
+        GET(buf, off, precision);
+        GET(buf, off, in_memory);
+        GET(buf, off, e->config.default_eps);
+        GET(buf, off, e->config.size);
+        GET(buf, off, e->config.window);
+        GET(buf, off, retain);
+        GET(buf, off, e->config.sliding);
+        GET(buf, off, layout);
+        e->config.default_precision = precision;
+        e->config.in_memory = in_memory;
+        e->config.retain = retain;
+        e->config.layout = layout;
+    }
+    if (off != len) goto CORRUPT;
+
+    free(buf);
+    return 0;
+
+CORRUPT:
+    free(buf);
+    catalog_free(catalog);
+    return -EINVAL;
+}
+
+/**
+ * Frees the entries of a catalog returned by catalog_read.
+ * @arg catalog The catalog to cleanup
+ */
+void catalog_free(hlld_catalog *catalog) {
+    if (catalog->entries) {
+        for (uint32_t i=0; i < catalog->num_entries; i++) {
+            if (catalog->entries[i].set_name) free(catalog->entries[i].set_name);
+        }
+        free(catalog->entries);
+    }
+    catalog->entries = NULL;
+    catalog->num_entries = 0;
+}
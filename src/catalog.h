@@ -0,0 +1,51 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+#include <stdint.h>
+#include "config.h"
+
+/**
+ * A single set in the catalog
+ */
+typedef struct {
+    char *set_name;             // The name of the set
+    hlld_set_config config;     // Set-specific config
+} hlld_catalog_entry;
+
+/**
+ * The catalog is a compact snapshot of all the sets
+ * in the data directory. It allows the set manager to
+ * start without scanning every set folder.
+ */
+typedef struct {
+    int64_t mtime_sec;          // Data directory mtime when cataloged
+    int64_t mtime_nsec;
+    uint32_t num_entries;       // Number of entries
+    hlld_catalog_entry *entries;
+} hlld_catalog;
+
+/**
+ * Writes out the catalog to a file atomically.
+ * The catalog is written to a temporary file first,
+ * synced and then renamed over the existing file.
+ * @arg filename The name of the file to write
+ * @arg catalog The catalog to write out
+ * @return 0 on success, negative on error.
+ */
+int catalog_write(char *filename, hlld_catalog *catalog);
+
+/**
+ * Reads a catalog from a file with a single read.
+ * @arg filename The name of the file to read
+ * @arg catalog Output. The catalog to initialize.
+ * @return 0 on success, -ENOENT if there is no catalog,
+ * -EINVAL if the catalog is corrupt or of another version.
+ */
+int catalog_read(char *filename, hlld_catalog *catalog);
+
+/**
+ * Frees the entries of a catalog returned by catalog_read.
+ * @arg catalog The catalog to cleanup
+ */
+void catalog_free(hlld_catalog *catalog);
+
+#endif
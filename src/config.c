@@ -29,7 +29,19 @@ static const hlld_config DEFAULT_CONFIG = {
     3600,               // Cold after an hour
     0,                  // Persist to disk by default
     1,                  // Only a single worker thread by default
-    0                   // Do NOT use mmap by default
+    0,                  // Do NOT use mmap by default
+    "repair",           // Repair corrupt register files
+    CORRUPT_REPAIR,
+    0,                  // No hash log by default
+    0,                  // Leave syncing the hash log to the OS
+    0,                  // Do not compress cold sets by default
+    0,                  // No memory budget by default
+    0,                  // Sets are not windowed by default
+    0,
+    0,                  // Sets are not sliding by default
+    0,                  // Packed registers by default
+    "bias",             // Bias corrected estimates by default
+    ESTIMATE_BIAS
 };
 
 /**
@@ -64,6 +76,67 @@ static int value_to_int64(const char *val, uint64_t *result) {
     return 1;
 }
 
+/**
+ * Attempts to convert a string to a number of bytes,
+ * with an optional K, M or G suffix (e.g. 8GB).
+ * @arg val The string value
+ * @arg result The destination for the result
+ * @return 1 on success, 0 on error.
+ */
+static int value_to_bytes(const char *val, uint64_t *result) {
+    char *end;
+    errno = 0;
+    unsigned long long res = strtoull(val, &end, 10);
+    if (end == val || errno) {
+        return 0;
+    }
+    switch (*end) {
+        case 'k': case 'K':
+            res <<= 10; end++; break;
+        case 'm': case 'M':
+            res <<= 20; end++; break;
+        case 'g': case 'G':
+            res <<= 30; end++; break;
+    }
+    if (*end == 'b' || *end == 'B') end++;
+    if (*end) {
+        return 0;
+    }
+    *result = res;
+    return 1;
+}
+
+/**
+ * Attempts to convert a string to a number of seconds,
+ * with an optional s, m, h or d suffix (e.g. 24h).
+ * @arg val The string value
+ * @arg result The destination for the result
+ * @return 1 on success, 0 on error.
+ */
+int value_to_seconds(const char *val, uint64_t *result) {
+    char *end;
+    errno = 0;
+    unsigned long long res = strtoull(val, &end, 10);
+    if (end == val || errno) {
+        return 0;
+    }
+    switch (*end) {
+        case 's': case 'S':
+            end++; break;
+        case 'm': case 'M':
+            res *= 60; end++; break;
+        case 'h': case 'H':
+            res *= 3600; end++; break;
+        case 'd': case 'D':
+            res *= 86400; end++; break;
+    }
+    if (*end) {
+        return 0;
+    }
+    *result = res;
+    return 1;
+}
+
 /**
  * Attempts to convert a string to a double,
  * and write the value out.
@@ -115,6 +188,14 @@ static int config_callback(void* user, const char* section, const char* name, co
         return value_to_int(value, &config->in_memory);
     } else if (NAME_MATCH("use_mmap")) {
         return value_to_int(value, &config->use_mmap);
+    } else if (NAME_MATCH("use_wal")) {
+        return value_to_int(value, &config->use_wal);
+    } else if (NAME_MATCH("wal_sync")) {
+        return value_to_int(value, &config->wal_sync);
+    } else if (NAME_MATCH("compress_cold")) {
+        return value_to_int(value, &config->compress_cold);
+    } else if (NAME_MATCH("max_memory")) {
+        return value_to_bytes(value, &config->max_memory);
     } else if (NAME_MATCH("workers")) {
         return value_to_int(value, &config->worker_threads);
     } else if (NAME_MATCH("default_precision")) {
@@ -142,6 +223,10 @@ static int config_callback(void* user, const char* section, const char* name, co
         config->log_level = strdup(value);
     } else if (NAME_MATCH("bind_address")) {
         config->bind_address = strdup(value);
+    } else if (NAME_MATCH("corrupt_action")) {
+        config->corrupt_action = strdup(value);
+    } else if (NAME_MATCH("estimator")) {
+        config->estimator = strdup(value);
 
         // Unknown parameter?
     } else {
@@ -349,6 +434,64 @@ int sane_use_mmap(int use_mmap) {
     return 0;
 }
 
+int sane_use_wal(int use_wal) {
+    if (use_wal != 0 && use_wal != 1) {
+        syslog(LOG_ERR,
+                "Illegal value for use_wal. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_wal_sync(int wal_sync) {
+    if (wal_sync != 0 && wal_sync != 1) {
+        syslog(LOG_ERR,
+                "Illegal value for wal_sync. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_compress_cold(int compress_cold) {
+    if (compress_cold != 0 && compress_cold != 1) {
+        syslog(LOG_ERR,
+                "Illegal value for compress_cold. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_max_memory(uint64_t max_memory) {
+    if (max_memory && max_memory < (1 << 20)) {
+        syslog(LOG_WARNING,
+                "Memory budget is very low, sets may be unmapped constantly.");
+    }
+    return 0;
+}
+
+int sane_window(uint64_t window, int retain) {
+    if (!window) return 0;
+    if (retain < 1 || retain > MAX_RETAIN) {
+        syslog(LOG_ERR,
+                "Windowed sets must retain between 1 and %d windows.", MAX_RETAIN);
+        return 1;
+    }
+    return 0;
+}
+
+int sane_sliding(uint64_t sliding, uint64_t window) {
+    if (!sliding) return 0;
+    if (window) {
+        syslog(LOG_ERR, "A set cannot be both windowed and sliding.");
+        return 1;
+    }
+    if (sliding > UINT32_MAX) {
+        syslog(LOG_ERR, "The window of a sliding set is too long.");
+        return 1;
+    }
+    return 0;
+}
+
 int sane_worker_threads(int threads) {
     if (threads <= 0) {
         syslog(LOG_ERR,
@@ -358,6 +501,34 @@ int sane_worker_threads(int threads) {
     return 0;
 }
 
+int sane_corrupt_action(char *action, corrupt_action_t *mode) {
+    if (strcasecmp(action, "repair") == 0) {
+        *mode = CORRUPT_REPAIR;
+    } else if (strcasecmp(action, "quarantine") == 0) {
+        *mode = CORRUPT_QUARANTINE;
+    } else if (strcasecmp(action, "fail") == 0) {
+        *mode = CORRUPT_FAIL;
+    } else {
+        syslog(LOG_ERR,
+                "Unknown corrupt action! Must be repair, quarantine or fail.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_estimator(char *estimator, estimator_t *mode) {
+    if (strcasecmp(estimator, "bias") == 0) {
+        *mode = ESTIMATE_BIAS;
+    } else if (strcasecmp(estimator, "ertl") == 0) {
+        *mode = ESTIMATE_ERTL;
+    } else {
+        syslog(LOG_ERR,
+                "Unknown estimator! Must be bias or ertl.");
+        return 1;
+    }
+    return 0;
+}
+
 
 /**
  * Validates the configuration
@@ -375,7 +546,13 @@ int validate_config(hlld_config *config) {
     res |= sane_cold_interval(config->cold_interval);
     res |= sane_in_memory(config->in_memory);
     res |= sane_use_mmap(config->use_mmap);
+    res |= sane_use_wal(config->use_wal);
+    res |= sane_wal_sync(config->wal_sync);
+    res |= sane_compress_cold(config->compress_cold);
+    res |= sane_max_memory(config->max_memory);
     res |= sane_worker_threads(config->worker_threads);
+    res |= sane_corrupt_action(config->corrupt_action, &config->corrupt_mode);
+    res |= sane_estimator(config->estimator, &config->estimator_mode);
 
     return res;
 }
@@ -409,6 +586,26 @@ static int set_config_callback(void* user, const char* section, const char* name
         // Handle big int
     } else if (NAME_MATCH("size")) {
         return value_to_int64(value, &config->size);
+    } else if (NAME_MATCH("window")) {
+        return value_to_int64(value, &config->window);
+    } else if (NAME_MATCH("retain")) {
+        return value_to_int(value, &config->retain);
+    } else if (NAME_MATCH("sliding")) {
+        return value_to_int64(value, &config->sliding);
+    } else if (NAME_MATCH("layout")) {
+        return value_to_int(value, &config->layout);
+    } else if (NAME_MATCH("checksum")) {
+        uint64_t checksum;
+        if (!value_to_int64(value, &checksum)) return 0;
+        config->checksum = checksum;
+        config->has_checksum = 1;
+        return 1;
+    } else if (NAME_MATCH("pending_checksum")) {
+        uint64_t checksum;
+        if (!value_to_int64(value, &checksum)) return 0;
+        config->pending_checksum = checksum;
+        config->has_pending = 1;
+        return 1;
 
         // Handle the double cases
     } else if (NAME_MATCH("default_eps")) {
@@ -447,15 +644,25 @@ int set_config_from_filename(char *filename, hlld_set_config *config) {
 
 /**
  * Writes the configuration to a filename.
- * Writes the file as an INI configuration
+ * Writes the file as an INI configuration. The file is
+ * written to a temporary file that is synced and then
+ * renamed over, so a crash leaves either the old or the
+ * new config. The caller must sync the folder for the
+ * rename to be durable.
  * @arg filename The name of the file to write.
  * @arg config The config object to write out.
  * @return 0 on success, negative on error.
  */
 int update_filename_from_set_config(char *filename, hlld_set_config *config) {
     // Try to open the file
-    FILE* f = fopen(filename, "w+");
-    if (!f) return -errno;
+    char *tmp_name;
+    if (asprintf(&tmp_name, "%s.tmp", filename) == -1) return -ENOMEM;
+    FILE* f = fopen(tmp_name, "w");
+    if (!f) {
+        int res = -errno;
+        free(tmp_name);
+        return res;
+    }
 
     // Write out
     fprintf(f, "[hlld]\n\
@@ -467,9 +674,30 @@ in_memory = %d\n", (unsigned long long)config->size,
             config->default_precision,
             config->in_memory
            );
+    if (config->has_checksum) {
+        fprintf(f, "checksum = %u\n", config->checksum);
+    }
+    if (config->has_pending) {
+        fprintf(f, "pending_checksum = %u\n", config->pending_checksum);
+    }
+    if (config->window) {
+        fprintf(f, "window = %llu\nretain = %d\n",
+                (unsigned long long)config->window, config->retain);
+    }
+    if (config->sliding) {
+        fprintf(f, "sliding = %llu\n", (unsigned long long)config->sliding);
+    }
+    if (config->layout) {
+        fprintf(f, "layout = %d\n", config->layout);
+    }
 
-    // Close
-    fclose(f);
-    return 0;
+    // Sync before the rename so we never expose a partial config
+    int res = 0;
+    if (fflush(f) || fsync(fileno(f)) == -1) res = -errno;
+    if (fclose(f) && !res) res = -errno;
+    if (!res && rename(tmp_name, filename) == -1) res = -errno;
+    if (res) unlink(tmp_name);
+    free(tmp_name);
+    return res;
 }
 
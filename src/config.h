@@ -3,6 +3,24 @@
 #include <stdint.h>
 #include <syslog.h>
 
+/**
+ * Actions that can be taken when a register
+ * file fails checksum verification.
+ */
+typedef enum {
+    CORRUPT_REPAIR = 0,     // Merge with the last good backup
+    CORRUPT_QUARANTINE,     // Move the file aside and start empty
+    CORRUPT_FAIL            // Refuse to load the set
+} corrupt_action_t;
+
+/**
+ * Estimators that can be used for the size of a set
+ */
+typedef enum {
+    ESTIMATE_BIAS = 0,      // Raw estimate with empirical bias correction
+    ESTIMATE_ERTL           // Ertl's improved raw estimator
+} estimator_t;
+
 /**
  * Stores our configuration
  */
@@ -20,8 +38,25 @@ typedef struct {
     int in_memory;
     int worker_threads;
     int use_mmap;
+    char *corrupt_action;
+    corrupt_action_t corrupt_mode;
+    int use_wal;
+    int wal_sync;           // Sync the hash log before acknowledging adds
+    int compress_cold;
+    uint64_t max_memory;    // Budget for resident registers, 0 for none
+    uint64_t window;        // Seconds per window of new sets, 0 for none. Only set by create.
+    int retain;             // Windows kept by new windowed sets. Only set by create.
+    uint64_t sliding;       // Longest window of new sliding sets, 0 for none. Only set by create.
+    int layout;             // The hll_layout of new sets. Only set by create.
+    char *estimator;
+    estimator_t estimator_mode;
 } hlld_config;
 
+/**
+ * Upper bound on the windows kept by a windowed set
+ */
+#define MAX_RETAIN 1024
+
 /**
  * This structure is used to persist
  * set specific settings to an INI file.
@@ -31,6 +66,14 @@ typedef struct {
     int default_precision;
     int in_memory;
     uint64_t size;
+    int has_checksum;   // Set if the checksum is known
+    uint32_t checksum;  // CRC32C of the registers as last flushed
+    int has_pending;    // Set if a flush was started after the checksum
+    uint32_t pending_checksum;  // CRC32C of the registers being flushed
+    uint64_t window;    // Seconds per window, 0 if the set is not windowed
+    int retain;         // Number of windows kept
+    uint64_t sliding;   // Longest window of a sliding set in seconds, 0 if not sliding
+    int layout;         // The hll_layout of the registers
 } hlld_set_config;
 
 
@@ -55,7 +98,11 @@ int set_config_from_filename(char *filename, hlld_set_config *config);
 
 /**
  * Writes the configuration to a filename.
- * Writes the file as an INI configuration
+ * Writes the file as an INI configuration. The file is
+ * written to a temporary file that is synced and then
+ * renamed over, so a crash leaves either the old or the
+ * new config. The caller must sync the folder for the
+ * rename to be durable.
  * @arg filename The name of the file to write.
  * @arg config The config object to write out.
  * @return 0 on success, negative on error.
@@ -79,6 +126,23 @@ int sane_cold_interval(int intv);
 int sane_in_memory(int in_mem);
 int sane_use_mmap(int use_mmap);
 int sane_worker_threads(int threads);
+int sane_corrupt_action(char *action, corrupt_action_t *mode);
+int sane_estimator(char *estimator, estimator_t *mode);
+int sane_use_wal(int use_wal);
+int sane_wal_sync(int wal_sync);
+int sane_compress_cold(int compress_cold);
+int sane_max_memory(uint64_t max_memory);
+int sane_window(uint64_t window, int retain);
+int sane_sliding(uint64_t sliding, uint64_t window);
+
+/**
+ * Attempts to convert a string to a number of seconds,
+ * with an optional s, m, h or d suffix (e.g. 24h).
+ * @arg val The string value
+ * @arg result The destination for the result
+ * @return 1 on success, 0 on error.
+ */
+int value_to_seconds(const char *val, uint64_t *result);
 
 /**
  * Joins two strings as part of a path,
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <regex.h>
+#include <errno.h>
 #include <assert.h>
 #include "hll.h"
 #include "conn_handler.h"
@@ -16,6 +17,12 @@
  */
 #define MULTI_OP_SIZE 32
 
+/**
+ * The longest valid set name, as allowed
+ * by VALID_SET_NAMES_PATTERN.
+ */
+#define MAX_SET_NAME_LEN 200
+
 /**
  * Invoked in any context with a hlld_conn_handler
  * to send out an INTERNAL_ERROR message to the client.
@@ -32,6 +39,14 @@ static void handle_clear_cmd(hlld_conn_handler *handle, char *args, int args_len
 static void handle_list_cmd(hlld_conn_handler *handle, char *args, int args_len);
 static void handle_info_cmd(hlld_conn_handler *handle, char *args, int args_len);
 static void handle_flush_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_stats_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_size_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_sizes_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_sizes_prefix_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_warm_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_warm_prefix_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_intersect_size_cmd(hlld_conn_handler *handle, char *args, int args_len);
+static void handle_convert_cmd(hlld_conn_handler *handle, char *args, int args_len);
 
 
 static inline void handle_set_cmd_resp(hlld_conn_handler *handle, int res);
@@ -39,6 +54,8 @@ static inline void handle_client_resp(hlld_conn_info *conn, char* resp_mesg, int
 static void handle_client_err(hlld_conn_info *conn, char* err_msg, int msg_len);
 
 static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char **arg_buf, int *arg_len);
+static int park_for_fault(hlld_conn_handler *handle, char *buf, int buf_len);
+static int parse_layout(char *param, int *layout);
 
 static int buffer_after_terminator(char *buf, int buf_len, char terminator, char **after_term, int *after_len);
 
@@ -71,9 +88,24 @@ int handle_client_connect(hlld_conn_handler *handle) {
     char *buf, *arg_buf;
     int buf_len, arg_buf_len, should_free;
     int status;
+
+    // A resumed connection runs the parked command first. It is
+    // not parked again, even if the set was unmapped in the meantime.
+    int resumed = take_parked_command(handle->conn, &buf, &buf_len);
     while (1) {
-        status = extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free);
-        if (status == -1) break; // Return if no command is available
+        if (resumed) {
+            should_free = 1;
+            resumed = 0;
+        } else {
+            status = extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free);
+            if (status == -1) break; // Return if no command is available
+
+            // Wait for any set we need to be faulted in
+            if (park_for_fault(handle, buf, buf_len)) {
+                if (should_free) free(buf);
+                break;
+            }
+        }
 
         // Determine the command type
         conn_cmd_type type = determine_client_command(buf, buf_len, &arg_buf, &arg_buf_len);
@@ -107,6 +139,30 @@ int handle_client_connect(hlld_conn_handler *handle) {
             case FLUSH:
                 handle_flush_cmd(handle, arg_buf, arg_buf_len);
                 break;
+            case STATS:
+                handle_stats_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SIZE:
+                handle_size_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SIZES:
+                handle_sizes_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SIZES_PREFIX:
+                handle_sizes_prefix_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case WARM:
+                handle_warm_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case WARM_PREFIX:
+                handle_warm_prefix_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case INTERSECT_SIZE:
+                handle_intersect_size_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case CONVERT:
+                handle_convert_cmd(handle, arg_buf, arg_buf_len);
+                break;
             default:
                 handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
                 break;
@@ -147,13 +203,31 @@ static void handle_set_cmd(hlld_conn_handler *handle, char *args, int args_len)
     int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
     if (err || key_len <= 1) CHECK_ARG_ERR();
 
+    // Check for a trailing time the key was seen at
+    uint64_t at = 0;
+    char *at_param = strrchr(key, ' ');
+    if (at_param && !strncmp(at_param, " time=", 6)) {
+        char *end;
+        errno = 0;
+        at = strtoull(at_param+6, &end, 10);
+        if (errno || end == at_param+6 || *end || !at || at > UINT32_MAX) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+        *at_param = '\0';
+    }
+
     // Setup the buffers
     char *key_buf[] = {key};
 
     // Call into the set manager
-    int res = setmgr_set_keys(handle->mgr, args, (char**)&key_buf, 1);
+    int res = setmgr_set_keys_at(handle->mgr, args, (char**)&key_buf, 1, at);
 
     // Generate the response
+    if (res == -3) {
+        handle_client_err(handle->conn, (char*)&NOT_SLIDING, NOT_SLIDING_LEN);
+        return;
+    }
     handle_set_cmd_resp(handle, res);
 }
 
@@ -270,6 +344,14 @@ static void handle_create_cmd(hlld_conn_handler *handle, char *args, int args_le
                 match = 1;
             }
             match |= sscanf(param, "in_memory=%d", &config->in_memory);
+            if (!strncmp(param, "window=", 7)) {
+                match = value_to_seconds(param+7, &config->window);
+            }
+            if (!strncmp(param, "sliding=", 8)) {
+                match = value_to_seconds(param+8, &config->sliding);
+            }
+            match |= sscanf(param, "retain=%d", &config->retain);
+            match |= parse_layout(param, &config->layout);
 
             // Check if there was no match
             if (!match) {
@@ -287,6 +369,8 @@ static void handle_create_cmd(hlld_conn_handler *handle, char *args, int args_le
         invalid_config |= sane_default_precision(config->default_precision);
         invalid_config |= sane_default_eps(config->default_eps);
         invalid_config |= sane_in_memory(config->in_memory);
+        invalid_config |= sane_window(config->window, config->retain);
+        invalid_config |= sane_sliding(config->sliding, config->window);
 
         // Barf if the configs are bad
         if (invalid_config) {
@@ -367,68 +451,111 @@ static void handle_clear_cmd(hlld_conn_handler *handle, char *args, int args_len
 // can use to get some info about it
 static void list_set_cb(void *data, char *set_name, hlld_set *set) {
     set_cb_data *cb_data = data;
+    hlld_set_config *set_config = hset_config(set);
     int res;
 
-    // Use the last flush size, attempt to get the latest size.
-    // We do this in-case a list is at the same time as a unmap/delete.
-    uint64_t estimate = set->set_config.size;
-    setmgr_set_size(cb_data->mgr, set_name, &estimate);
+    // Use the last known size, so listing never computes
+    // an estimate or faults in the windows of a set
+    uint64_t estimate = hset_cached_size(set);
 
     res = asprintf(cb_data->output, "%s %f %u %llu %llu\n",
             set_name,
-            set->set_config.default_eps,
-            set->set_config.default_precision,
+            set_config->default_eps,
+            set_config->default_precision,
             (long long unsigned)hset_byte_size(set),
             (long long unsigned)estimate);
     assert(res != -1);
 }
 
-static void handle_list_cmd(hlld_conn_handler *handle, char *args, int args_len) {
-    (void)args_len;
+/**
+ * Number of sets that are listed at a time. We send
+ * each chunk before listing the next, so the whole
+ * listing is never materialized.
+ */
+#define LIST_CHUNK_SIZE 128
 
-    // List all the sets
-    hlld_set_list_head *head;
-    int res = setmgr_list_sets(handle->mgr, args, &head);
-    if (res != 0) {
-        INTERNAL_ERROR();
-        return;
-    }
+// Holds the output lines for a chunk of the list command
+typedef struct {
+    hlld_setmgr *mgr;
+    int num;
+    char *lines[LIST_CHUNK_SIZE];
+    int lens[LIST_CHUNK_SIZE];
+    char *last;     // Name of the last set listed
+} list_chunk;
+
+// Callback invoked by list command for each set in a chunk
+static void list_chunk_cb(void *data, char *set_name, hlld_set *set) {
+    list_chunk *chunk = data;
+    char *line;
+    set_cb_data cb_data = {chunk->mgr, &line};
+    list_set_cb(&cb_data, set_name, set);
+    chunk->lines[chunk->num] = line;
+    chunk->lens[chunk->num] = strlen(line);
+    chunk->num++;
+
+    if (chunk->last) free(chunk->last);
+    chunk->last = strdup(set_name);
+}
 
-    // Allocate buffers for the responses
-    int num_out = (head->size+2);
-    char** output_bufs = malloc(num_out * sizeof(char*));
-    int* output_bufs_len = malloc(num_out * sizeof(int));
+static void handle_list_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // Parse the prefix and the paging options
+    char *prefix = NULL, *after = NULL;
+    int limit = 0;
+    char *param = args;
+    while (param) {
+        // Adds a zero terminator to the current param, scans forward
+        buffer_after_terminator(args, args_len, ' ', &args, &args_len);
+
+        if (!strncmp(param, "limit=", 6)) {
+            char *end;
+            limit = strtol(param+6, &end, 10);
+            if (*end || limit < 0) {
+                handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+                return;
+            }
+        } else if (!strncmp(param, "after=", 6)) {
+            after = param+6;
+        } else if (!prefix) {
+            prefix = param;
+        } else {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+        param = args;
+    }
 
-    // Setup the START/END lines
-    output_bufs[0] = (char*)&START_RESP;
-    output_bufs_len[0] = START_RESP_LEN;
-    output_bufs[head->size+1] = (char*)&END_RESP;
-    output_bufs_len[head->size+1] = END_RESP_LEN;
+    // Send the start, and then stream each chunk
+    char *start = (char*)&START_RESP;
+    int start_len = START_RESP_LEN;
+    send_client_response(handle->conn, &start, &start_len, 1);
 
-    // Generate the responses
-    char *resp;
-    hlld_set_list *node = head->head;
-    set_cb_data cb_data = {handle->mgr, &resp};
-    for (int i=0; i < head->size; i++) {
-        res = setmgr_set_cb(handle->mgr, node->set_name, list_set_cb, &cb_data);
-        if (res == 0) {
-            output_bufs[i+1] = resp;
-            output_bufs_len[i+1] = strlen(resp);
-        } else { // Skip this output
-            output_bufs[i+1] = NULL;
-            output_bufs_len[i+1] = 0;
+    list_chunk chunk;
+    chunk.mgr = handle->mgr;
+    char *last = NULL;
+    int remain = limit;
+    while (1) {
+        int size = (limit && remain < LIST_CHUNK_SIZE) ? remain : LIST_CHUNK_SIZE;
+        chunk.num = 0;
+        chunk.last = NULL;
+        setmgr_list_page(handle->mgr, prefix, after, size, list_chunk_cb, &chunk);
+
+        // Write the chunk
+        if (chunk.num) {
+            send_client_response(handle->conn, chunk.lines, chunk.lens, chunk.num);
         }
-        node = node->next;
-    }
+        for (int i=0; i < chunk.num; i++) free(chunk.lines[i]);
 
-    // Write the response
-    send_client_response(handle->conn, output_bufs, output_bufs_len, num_out);
+        // Continue after the last set
+        if (last) free(last);
+        last = after = chunk.last;
+        remain -= chunk.num;
+        if (chunk.num < size || (limit && !remain)) break;
+    }
+    if (last) free(last);
 
-    // Cleanup
-    for (int i=1; i <= head->size; i++) if(output_bufs[i]) free(output_bufs[i]);
-    free(output_bufs);
-    free(output_bufs_len);
-    setmgr_cleanup_list(head);
+    char *end = (char*)&END_RESP;
+    int end_len = END_RESP_LEN;
+    send_client_response(handle->conn, &end, &end_len, 1);
 }
 
 
@@ -438,16 +565,20 @@ static void handle_list_cmd(hlld_conn_handler *handle, char *args, int args_len)
 static void info_set_cb(void *data, char *set_name, hlld_set *set) {
     (void)set_name;
     set_cb_data *cb_data = data;
+    hlld_set_config *set_config = hset_config(set);
 
     // Use the last flush size, attempt to get the latest size.
     // We do this in-case a list is at the same time as a unmap/delete.
-    uint64_t size = set->set_config.size;
+    uint64_t size = set_config->size;
     setmgr_set_size(cb_data->mgr, set_name, &size);
 
     // Get some metrics
     set_counters *counters = hset_counters(set);
     uint64_t storage = hset_byte_size(set);
-    uint64_t sets = counters->sets;
+    uint64_t sets = __atomic_load_n(&counters->sets, __ATOMIC_RELAXED);
+    uint64_t updates = __atomic_load_n(&counters->updates, __ATOMIC_RELAXED);
+    double set_rate, update_rate;
+    hset_rates(set, &set_rate, &update_rate);
 
     // Generate a formatted string output
     int res;
@@ -458,14 +589,25 @@ epsilon %f\n\
 precision %u\n\
 sets %llu\n\
 size %llu\n\
-storage %llu\n",
+storage %llu\n\
+updates %llu\n\
+set_rate %.2f\n\
+update_rate %.2f\n\
+last_access %llu\n\
+last_flush %llu\n\
+flush_usec %llu\n",
     ((hset_is_proxied(set)) ? 0 : 1),
     (unsigned long long)counters->page_ins, (unsigned long long)counters->page_outs,
-    set->set_config.default_eps,
-    set->set_config.default_precision,
+    set_config->default_eps,
+    set_config->default_precision,
     (unsigned long long)sets,
     (unsigned long long)size,
-    (unsigned long long)storage);
+    (unsigned long long)storage,
+    (unsigned long long)updates,
+    set_rate, update_rate,
+    (unsigned long long)__atomic_load_n(&counters->last_access, __ATOMIC_RELAXED),
+    (unsigned long long)__atomic_load_n(&counters->last_flush, __ATOMIC_RELAXED),
+    (unsigned long long)__atomic_load_n(&counters->flush_usec, __ATOMIC_RELAXED));
     assert(res != -1);
 }
 
@@ -546,6 +688,285 @@ static void handle_flush_cmd(hlld_conn_handler *handle, char *args, int args_len
 }
 
 
+static void handle_stats_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // Get the set cache counters
+    uint64_t hits, misses;
+    setmgr_cache_stats(handle->mgr, &hits, &misses);
+    double hit_rate = (hits + misses) ? (double)hits / (hits + misses) : 0;
+    uint64_t resident = setmgr_resident_bytes(handle->mgr);
+    uint64_t pinned = setmgr_pinned_bytes(handle->mgr);
+
+    // Generate a formatted string output
+    char *output[] = {(char*)&START_RESP, NULL, (char*)&END_RESP};
+    int lens[] = {START_RESP_LEN, 0, END_RESP_LEN};
+    int res = asprintf(&output[1], "set_cache_hits %llu\n\
+set_cache_misses %llu\n\
+set_cache_hit_rate %f\n\
+resident_bytes %llu\n\
+pinned_bytes %llu\n",
+    (unsigned long long)hits, (unsigned long long)misses, hit_rate,
+    (unsigned long long)resident, (unsigned long long)pinned);
+    assert(res != -1);
+    lens[1] = strlen(output[1]);
+
+    // Write out the bufs
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+    free(output[1]);
+}
+
+
+static void handle_size_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    // Check for a period after the set name
+    char *param;
+    int param_len;
+    uint64_t last = 0;
+    int res = buffer_after_terminator(args, args_len, ' ', &param, &param_len);
+    if (res == 0) {
+        char *extra = NULL;
+        int extra_len;
+        buffer_after_terminator(param, param_len, ' ', &extra, &extra_len);
+        if (extra || strncmp(param, "last=", 5) ||
+                !value_to_seconds(param+5, &last) || !last) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+    }
+
+    // Call into the set manager
+    uint64_t est;
+    if (last)
+        res = setmgr_set_size_last(handle->mgr, args, last, &est);
+    else
+        res = setmgr_set_size(handle->mgr, args, &est);
+    if (res) {
+        handle_client_resp(handle->conn, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
+        return;
+    }
+
+    char *output;
+    int output_len = asprintf(&output, "%llu\n", (unsigned long long)est);
+    assert(output_len != -1);
+    handle_client_resp(handle->conn, output, output_len);
+    free(output);
+}
+
+
+/**
+ * Estimates a chunk of sets with a single call into the
+ * set manager, and sends a line for each set that exists.
+ */
+static void send_sizes_chunk(hlld_conn_handler *handle, char **names, int num) {
+    uint64_t ests[LIST_CHUNK_SIZE];
+    char found[LIST_CHUNK_SIZE];
+    char *lines[LIST_CHUNK_SIZE];
+    int lens[LIST_CHUNK_SIZE];
+    setmgr_set_sizes(handle->mgr, names, num, ests, found);
+
+    int num_lines = 0;
+    for (int i=0; i < num; i++) {
+        if (!found[i]) continue;
+        int res = asprintf(&lines[num_lines], "%s %llu\n", names[i],
+                (unsigned long long)ests[i]);
+        assert(res != -1);
+        lens[num_lines++] = res;
+    }
+    if (num_lines) {
+        send_client_response(handle->conn, lines, lens, num_lines);
+    }
+    for (int i=0; i < num_lines; i++) free(lines[i]);
+}
+
+static void handle_sizes_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    char *start = (char*)&START_RESP;
+    int start_len = START_RESP_LEN;
+    send_client_response(handle->conn, &start, &start_len, 1);
+
+    // Estimate the sets a chunk at a time
+    char *names[LIST_CHUNK_SIZE];
+    int num = 0;
+    char *name = args;
+    while (name) {
+        // Adds a zero terminator to the current name, scans forward
+        buffer_after_terminator(args, args_len, ' ', &args, &args_len);
+        if (*name) names[num++] = name;
+        if (num == LIST_CHUNK_SIZE) {
+            send_sizes_chunk(handle, names, num);
+            num = 0;
+        }
+        name = args;
+    }
+    if (num) send_sizes_chunk(handle, names, num);
+
+    char *end = (char*)&END_RESP;
+    int end_len = END_RESP_LEN;
+    send_client_response(handle->conn, &end, &end_len, 1);
+}
+
+// Holds the names for a chunk of the sizes_prefix command
+typedef struct {
+    int num;
+    char *names[LIST_CHUNK_SIZE];
+} name_chunk;
+
+// Callback invoked by sizes_prefix for each set in a chunk
+static void name_chunk_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set;
+    name_chunk *chunk = data;
+    chunk->names[chunk->num++] = strdup(set_name);
+}
+
+static void handle_sizes_prefix_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // Check for any extra arguments after the prefix
+    char *extra = NULL;
+    int extra_len;
+    if (args) buffer_after_terminator(args, args_len, ' ', &extra, &extra_len);
+    if (extra) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    char *start = (char*)&START_RESP;
+    int start_len = START_RESP_LEN;
+    send_client_response(handle->conn, &start, &start_len, 1);
+
+    // Page through the matching sets, and estimate each page together
+    name_chunk chunk;
+    char *last = NULL;
+    while (1) {
+        chunk.num = 0;
+        setmgr_list_page(handle->mgr, args, last, LIST_CHUNK_SIZE, name_chunk_cb, &chunk);
+        if (chunk.num) send_sizes_chunk(handle, chunk.names, chunk.num);
+
+        // Continue after the last set
+        if (last) free(last);
+        last = (chunk.num) ? chunk.names[chunk.num-1] : NULL;
+        for (int i=0; i < chunk.num - 1; i++) free(chunk.names[i]);
+        if (chunk.num < LIST_CHUNK_SIZE) break;
+    }
+    if (last) free(last);
+
+    char *end = (char*)&END_RESP;
+    int end_len = END_RESP_LEN;
+    send_client_response(handle->conn, &end, &end_len, 1);
+}
+
+
+static void handle_intersect_size_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    // Split out the set names
+    char *names[HLL_MAX_INTERSECT];
+    int num = 0;
+    char *name = args;
+    while (name) {
+        buffer_after_terminator(args, args_len, ' ', &args, &args_len);
+        if (*name) {
+            if (num == HLL_MAX_INTERSECT) {
+                num++;
+                break;
+            }
+            names[num++] = name;
+        }
+        name = args;
+    }
+    if (num < 2 || num > HLL_MAX_INTERSECT) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    // Call into the set manager
+    uint64_t est;
+    int res = setmgr_intersect_size(handle->mgr, names, num, &est);
+    switch (res) {
+        case 0:
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)SET_NOT_EXIST, SET_NOT_EXIST_LEN);
+            return;
+        case -2:
+            handle_client_err(handle->conn, (char*)&PRECISION_MISMATCH, PRECISION_MISMATCH_LEN);
+            return;
+        default:
+            INTERNAL_ERROR();
+            return;
+    }
+
+    char *output;
+    int output_len = asprintf(&output, "%llu\n", (unsigned long long)est);
+    assert(output_len != -1);
+    handle_client_resp(handle->conn, output, output_len);
+    free(output);
+}
+
+
+static void handle_convert_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&SET_NEEDED, SET_NEEDED_LEN);
+        return;
+    }
+
+    // Expect exactly a layout after the set name
+    char *param, *extra = NULL;
+    int param_len, extra_len, layout;
+    int res = buffer_after_terminator(args, args_len, ' ', &param, &param_len);
+    if (!res) buffer_after_terminator(param, param_len, ' ', &extra, &extra_len);
+    if (res || extra || !parse_layout(param, &layout)) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    res = setmgr_convert_set(handle->mgr, args, layout);
+    if (res == -3) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+    handle_set_cmd_resp(handle, res);
+}
+
+
+static void handle_warm_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    handle_setop_cmd(handle, args, args_len, setmgr_warm_set);
+}
+
+static void handle_warm_prefix_cmd(hlld_conn_handler *handle, char *args, int args_len) {
+    // Check for any extra arguments after the prefix
+    char *extra = NULL;
+    int extra_len;
+    if (args) buffer_after_terminator(args, args_len, ' ', &extra, &extra_len);
+    if (extra) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // The faults are queued, so respond without waiting on them
+    setmgr_warm_prefix(handle->mgr, args);
+    handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+}
+
+
 /**
  * Sends a client response message back for a simple set command
  * Simple convenience wrapper around handle_client_resp.
@@ -591,6 +1012,64 @@ static void handle_client_err(hlld_conn_info *conn, char* err_msg, int msg_len)
 }
 
 
+// Invoked on an I/O thread once a set is faulted in
+static void fault_done_cb(void *data, int res) {
+    (void)res;
+    resume_client_connection(data);
+}
+
+/**
+ * Checks if a command adds to a set that is not in
+ * memory. If so, the set is faulted in on an I/O thread
+ * and the connection is parked until that is done, so
+ * the other clients of this worker do not wait on the disk.
+ * The command buffer is not modified.
+ * @return 1 if the connection was parked.
+ */
+static int park_for_fault(hlld_conn_handler *handle, char *buf, int buf_len) {
+    // Only set and bulk fault in sets
+    char *name = memchr(buf, ' ', buf_len);
+    if (!name) return 0;
+    int cmd_len = name - buf;
+    if (!((cmd_len == 1 && (*buf == 's' || *buf == 'b')) ||
+          (cmd_len == 3 && !memcmp(buf, "set", 3)) ||
+          (cmd_len == 4 && !memcmp(buf, "bulk", 4))))
+        return 0;
+
+    // Find the set name, commands without keys are rejected as usual.
+    // Names that are too long cannot exist, and are rejected later.
+    name++;
+    char *name_end = memchr(name, ' ', buf_len - (name - buf));
+    if (!name_end || name_end - name > MAX_SET_NAME_LEN) return 0;
+
+    // Copy the name on the stack, the lookup goes through the set cache
+    char set_name[MAX_SET_NAME_LEN + 1];
+    memcpy(set_name, name, name_end - name);
+    set_name[name_end - name] = '\0';
+    if (!setmgr_fault_async(handle->mgr, set_name, fault_done_cb, handle->conn))
+        return 0;
+
+    park_client_connection(handle->conn, buf, buf_len);
+    return 1;
+}
+
+/**
+ * Parses a register layout option
+ * @arg param The option, such as layout=bytes
+ * @arg layout Output. The hll_layout on success.
+ * @return 1 on success, 0 if the option is not a layout.
+ */
+static int parse_layout(char *param, int *layout) {
+    if (!strcmp(param, "layout=packed")) {
+        *layout = HLL_LAYOUT_PACKED;
+    } else if (!strcmp(param, "layout=bytes")) {
+        *layout = HLL_LAYOUT_BYTES;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
 /**
  * Determines the client command.
  * @arg cmd_buf A command buffer
@@ -628,6 +1107,8 @@ static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char *
                 type = CLOSE;
             } else if (CMD_MATCH("clear")) {
                 type = CLEAR;
+            } else if (CMD_MATCH("convert")) {
+                type = CONVERT;
             }
             break;
 
@@ -644,6 +1125,8 @@ static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char *
         case 'i':
             if (CMD_MATCH("info"))
                 type = INFO;
+            else if (CMD_MATCH("intersect_size"))
+                type = INTERSECT_SIZE;
 
         case 'l':
             if (CMD_MATCH("list"))
@@ -653,6 +1136,21 @@ static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char *
         case 's':
             if (CMD_MATCH("s") || CMD_MATCH("set"))
                 type = SET;
+            else if (CMD_MATCH("stats"))
+                type = STATS;
+            else if (CMD_MATCH("size"))
+                type = SIZE;
+            else if (CMD_MATCH("sizes"))
+                type = SIZES;
+            else if (CMD_MATCH("sizes_prefix"))
+                type = SIZES_PREFIX;
+            break;
+
+        case 'w':
+            if (CMD_MATCH("warm"))
+                type = WARM;
+            else if (CMD_MATCH("warm_prefix"))
+                type = WARM_PREFIX;
             break;
     }
     return type;
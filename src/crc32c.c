@@ -0,0 +1,94 @@
+#include <pthread.h>
+#include <string.h>
+#include "crc32c.h"
+
+/**
+ * Reversed Castagnoli polynomial
+ */
+#define CRC32C_POLY 0x82F63B78
+
+// Lookup table for the software version
+static uint32_t crc_table[256];
+
+// Selected implementation
+typedef uint32_t(*crc_func)(uint32_t crc, const unsigned char *buf, size_t len);
+static crc_func crc_impl;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Table driven CRC32C, processes a byte at a time
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len) {
+    while (len--) {
+        crc = crc_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/**
+ * Hardware CRC32C using the SSE4.2 crc32 instruction,
+ * processes 8 bytes at a time.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint64_t crc64 = crc;
+
+    // Align to 8 bytes
+    while (len && ((uintptr_t)buf & 7)) {
+        crc64 = __builtin_ia32_crc32qi(crc64, *buf++);
+        len--;
+    }
+
+    // Handle the bulk of the buffer
+    uint64_t word;
+    while (len >= 8) {
+        memcpy(&word, buf, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    // Handle any trailing bytes
+    while (len--) {
+        crc64 = __builtin_ia32_crc32qi(crc64, *buf++);
+    }
+    return crc64;
+}
+#endif
+
+/**
+ * Builds the lookup table and picks
+ * the fastest available implementation.
+ */
+static void crc32c_init(void) {
+    for (uint32_t i=0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j=0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+
+    crc_impl = crc32c_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc_impl = crc32c_hw;
+#endif
+}
+
+/**
+ * Computes the CRC32C (Castagnoli) of a buffer.
+ * Uses the SSE4.2 crc32 instruction when the CPU
+ * supports it, and a table driven version otherwise.
+ * Can be called incrementally by passing in the
+ * result of the previous call.
+ * @arg crc The CRC of the preceding data, 0 to start
+ * @arg buf The buffer to checksum
+ * @arg len The length of the buffer
+ * @return The updated CRC
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc_once, crc32c_init);
+    return ~crc_impl(~crc, buf, len);
+}
@@ -0,0 +1,19 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Computes the CRC32C (Castagnoli) of a buffer.
+ * Uses the SSE4.2 crc32 instruction when the CPU
+ * supports it, and a table driven version otherwise.
+ * Can be called incrementally by passing in the
+ * result of the previous call.
+ * @arg crc The CRC of the preceding data, 0 to start
+ * @arg buf The buffer to checksum
+ * @arg len The length of the buffer
+ * @return The updated CRC
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
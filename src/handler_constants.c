@@ -24,6 +24,12 @@ static const int SET_NEEDED_LEN = sizeof(SET_NEEDED) - 1;
 static const char BAD_SET_NAME[] = "Bad set name";
 static const int BAD_SET_NAME_LEN = sizeof(BAD_SET_NAME) - 1;
 
+static const char NOT_SLIDING[] = "Only sliding sets take a time";
+static const int NOT_SLIDING_LEN = sizeof(NOT_SLIDING) - 1;
+
+static const char PRECISION_MISMATCH[] = "Sets must have the same precision";
+static const int PRECISION_MISMATCH_LEN = sizeof(PRECISION_MISMATCH) - 1;
+
 static const char INTERNAL_ERR[] = "Internal Error\n";
 static const int INTERNAL_ERR_LEN = sizeof(INTERNAL_ERR) - 1;
 
@@ -62,6 +68,14 @@ typedef enum {
     CLOSE,          // Close a set
     CLEAR,          // Clears a set from the internals
     FLUSH,          // Force flush a set
+    STATS,          // Server statistics
+    SIZE,           // Estimate of a set, or its recent windows
+    SIZES,          // Estimates of many sets
+    SIZES_PREFIX,   // Estimates of sets matching a prefix
+    WARM,           // Fault a set in ahead of use
+    WARM_PREFIX,    // Fault in sets matching a prefix
+    INTERSECT_SIZE, // Estimate of the keys in every one of the sets
+    CONVERT,        // Convert the registers of a closed set
 } conn_cmd_type;
 
 /* Static regexes */
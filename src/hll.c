@@ -20,6 +20,7 @@ State of The Art Cardinality Estimation Algorithm"
 #define REG_WIDTH 6     // Bits per register
 #define INT_WIDTH 32    // Bits in an int
 #define REG_PER_WORD 5  // floor(INT_WIDTH / REG_WIDTH)
+#define REG_MASK ((1 << REG_WIDTH) - 1)
 
 #define NUM_REG(precision) ((1 << precision))
 #define INT_CEIL(num, denom) (((num) + (denom) - 1) / (denom))
@@ -27,6 +28,19 @@ State of The Art Cardinality Estimation Algorithm"
 // Link the external murmur hash in
 extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
 
+/**
+ * The hot paths of an HLL, specialized for each
+ * precision and layout. Each HLL points at the
+ * kernels matching its registers.
+ */
+struct hll_kernels {
+    int (*add_hash)(hll_t *h, uint64_t hash);
+    void (*merge)(hll_t *h, hll_t *other);  // Same layout only
+    void (*histogram)(hll_t *h, uint32_t *counts);
+};
+
+static const struct hll_kernels* kernels_for(unsigned char precision, hll_layout layout);
+
 
 /**
  * Initializes a new HLL
@@ -35,22 +49,29 @@ extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t
  * @return 0 on success
  */
 int hll_init(unsigned char precision, hll_t *h) {
+    return hll_init_layout(precision, HLL_LAYOUT_PACKED, h);
+}
+
+/**
+ * Initializes a new HLL with a given register layout
+ * @arg precision The digits of precision to use
+ * @arg layout The layout of the registers
+ * @arg h The HLL to initialize
+ * @return 0 on success
+ */
+int hll_init_layout(unsigned char precision, hll_layout layout, hll_t *h) {
     // Ensure the precision is somewhat sane
     if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
         return -1;
 
     // Store precision
     h->precision = precision;
-
-    // Determine how many registers are needed
-    int reg = NUM_REG(precision);
-
-    // Get the full words required
-    int words = INT_CEIL(reg, REG_PER_WORD);
+    h->layout = layout;
+    h->kernels = kernels_for(precision, layout);
 
     // Allocate and zero out the registers
     h->bm = NULL;
-    h->registers = calloc(words, sizeof(uint32_t));
+    h->registers = calloc(1, hll_bytes_for_layout(precision, layout));
     if (!h->registers) return -1;
     return 0;
 }
@@ -59,21 +80,24 @@ int hll_init(unsigned char precision, hll_t *h) {
 /**
  * Initializes a new HLL from a bitmap
  * @arg precision The digits of precision to use
+ * @arg layout The layout of the registers in the bitmap
  * @arg bm The bitmap to use
  * @arg h The HLL to initialize
  * @return 0 on success
  */
-int hll_init_from_bitmap(unsigned char precision, hlld_bitmap *bm, hll_t *h) {
+int hll_init_from_bitmap(unsigned char precision, hll_layout layout, hlld_bitmap *bm, hll_t *h) {
     // Ensure the precision is somewhat sane
     if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
         return -1;
 
     // Check the bitmap size
-    if (hll_bytes_for_precision(precision) != bm->size)
+    if (hll_bytes_for_layout(precision, layout) != bm->size)
         return -1;
 
     // Store precision
     h->precision = precision;
+    h->layout = layout;
+    h->kernels = kernels_for(precision, layout);
 
     // Use the bitmap
     h->registers = (uint32_t*)bm->mmap;
@@ -82,6 +106,30 @@ int hll_init_from_bitmap(unsigned char precision, hlld_bitmap *bm, hll_t *h) {
 }
 
 
+/**
+ * Initializes a new HLL over existing registers. The
+ * registers are not copied, and remain owned by the caller,
+ * so the HLL must not be destroyed.
+ * @arg precision The digits of precision to use
+ * @arg layout The layout of the registers
+ * @arg registers The registers to use
+ * @arg h The HLL to initialize
+ * @return 0 on success
+ */
+int hll_init_from_registers(unsigned char precision, hll_layout layout, uint32_t *registers, hll_t *h) {
+    // Ensure the precision is somewhat sane
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+        return -1;
+
+    h->precision = precision;
+    h->layout = layout;
+    h->kernels = kernels_for(precision, layout);
+    h->registers = registers;
+    h->bm = NULL;
+    return 0;
+}
+
+
 /**
  * Destroys an hll. Closes the bitmap, but does not free it.
  * @return 0 on success
@@ -103,12 +151,19 @@ int hll_destroy(hll_t *h) {
 }
 
 static int get_register(hll_t *h, int idx) {
+    if (h->layout == HLL_LAYOUT_BYTES) {
+        return ((unsigned char*)h->registers)[idx];
+    }
     uint32_t word = *(h->registers + (idx / REG_PER_WORD));
     word = word >> REG_WIDTH * (idx % REG_PER_WORD);
     return word & ((1 << REG_WIDTH) - 1);
 }
 
 static void set_register(hll_t *h, int idx, int val) {
+    if (h->layout == HLL_LAYOUT_BYTES) {
+        ((unsigned char*)h->registers)[idx] = val;
+        return;
+    }
     uint32_t *word = h->registers + (idx / REG_PER_WORD);
 
     // Shift the val into place
@@ -138,21 +193,126 @@ void hll_add(hll_t *h, char *key) {
  * Adds a new hash to the HLL
  * @arg h The hll to add to
  * @arg hash The hash to add
+ * @return 1 if a register was increased, 0 otherwise.
  */
-void hll_add_hash(hll_t *h, uint64_t hash) {
-    // Determine the index using the first p bits
-    int idx = hash >> (64 - h->precision);
+int hll_add_hash(hll_t *h, uint64_t hash) {
+    return h->kernels->add_hash(h, hash);
+}
 
-    // Shift out the index bits
-    hash = hash << h->precision | (1 << (h->precision -1));
+/**
+ * Copies the registers of an HLL into a new
+ * HLL of the same precision with another layout.
+ * @arg h The hll to copy
+ * @arg layout The layout of the new HLL
+ * @arg out Output. The HLL to initialize. Must be destroyed.
+ * @return 0 on success
+ */
+int hll_convert(hll_t *h, hll_layout layout, hll_t *out) {
+    if (hll_init_layout(h->precision, layout, out)) return -1;
+    hll_merge(out, h);
+    return 0;
+}
 
-    // Determine the count of leading zeros
-    int leading = __builtin_clzll(hash) + 1;
+/**
+ * Merges in the registers of another HLL with the
+ * same precision, keeping the larger of each register.
+ * The HLLs may have different layouts.
+ * @arg h The hll to merge into
+ * @arg other The hll to merge
+ */
+void hll_merge(hll_t *h, hll_t *other) {
+    int reg = NUM_REG(h->precision);
+
+    // Mixed layouts go a register at a time
+    if (h->layout != other->layout) {
+        for (int i=0; i < reg; i++) {
+            int val = get_register(other, i);
+            if (val > get_register(h, i)) set_register(h, i, val);
+        }
+        return;
+    }
 
-    // Update the register if the new value is larger
-    if (leading > get_register(h, idx)) {
-        set_register(h, idx, leading);
+    h->kernels->merge(h, other);
+}
+
+/**
+ * Encodes the registers of an HLL compactly, using a
+ * run length encoding. Low cardinality HLLs with mostly
+ * empty registers encode to a small fraction of their size.
+ *
+ * Each run of registers with the same value is stored as a
+ * single byte holding the value if the run has a length of one.
+ * Otherwise the byte has the high bit set, and is followed by
+ * the run length as a varint. This never takes more than a byte
+ * per register.
+ * @arg h The hll to encode
+ * @arg buf Output. Set to a malloc()'d buffer with the encoding
+ * @arg len Output. Set to the length of the encoding
+ * @return 0 on success
+ */
+int hll_encode(hll_t *h, unsigned char **buf, uint64_t *len) {
+    int reg = NUM_REG(h->precision);
+    unsigned char *out = malloc(reg);
+    if (!out) return -1;
+
+    uint64_t off = 0;
+    int idx = 0;
+    while (idx < reg) {
+        // Find the length of the run
+        int val = get_register(h, idx);
+        uint32_t run = 1;
+        while (idx + run < (uint32_t)reg && get_register(h, idx + run) == val)
+            run++;
+        idx += run;
+
+        if (run == 1) {
+            out[off++] = val;
+            continue;
+        }
+        out[off++] = 0x80 | val;
+        while (run >= 0x80) {
+            out[off++] = 0x80 | (run & 0x7F);
+            run >>= 7;
+        }
+        out[off++] = run;
+    }
+
+    *buf = out;
+    *len = off;
+    return 0;
+}
+
+/**
+ * Decodes registers produced by hll_encode into an
+ * HLL of the same precision, replacing its registers.
+ * @arg h The hll to decode into
+ * @arg buf The encoded registers
+ * @arg len The length of the encoding
+ * @return 0 on success, -1 if the encoding is invalid
+ */
+int hll_decode(hll_t *h, const unsigned char *buf, uint64_t len) {
+    int reg = NUM_REG(h->precision);
+    uint64_t off = 0;
+    int idx = 0;
+    while (off < len) {
+        int val = buf[off] & 0x3F;
+        uint32_t run = 1;
+        if (buf[off++] & 0x80) {
+            // Read the varint run length
+            run = 0;
+            int shift = 0;
+            do {
+                if (off >= len || shift > 28) return -1;
+                run |= (uint32_t)(buf[off] & 0x7F) << shift;
+                shift += 7;
+            } while (buf[off++] & 0x80);
+        }
+        if (run > (uint32_t)(reg - idx)) return -1;
+        for (uint32_t i=0; i < run; i++) {
+            set_register(h, idx++, val);
+        }
     }
+    return (idx == reg) ? 0 : -1;
 }
 
 /*
@@ -172,6 +332,14 @@ static double alpha(unsigned char precision) {
     }
 }
 
+/*
+ * Counts the registers with each value. This is
+ * the hot loop of the estimators for high precisions.
+ */
+static void register_histogram(hll_t *h, uint32_t *counts) {
+    h->kernels->histogram(h, counts);
+}
+
 /*
  * Computes the raw cardinality estimate
  */
@@ -180,13 +348,14 @@ static double raw_estimate(hll_t *h, int *num_zero) {
     int num_reg = NUM_REG(precision);
     double multi = alpha(precision) * num_reg * num_reg;
 
-    int reg_val;
+    uint32_t counts[1 << REG_WIDTH] = {0};
+    register_histogram(h, counts);
+
     double inv_sum = 0;
-    for (int i=0; i < num_reg; i++) {
-        reg_val = get_register(h, i);
-        inv_sum += pow(2.0, -1 * reg_val);
-        if (!reg_val) *num_zero += 1;
+    for (int val=0; val < (1 << REG_WIDTH); val++) {
+        if (counts[val]) inv_sum += ldexp(counts[val], -val);
     }
+    *num_zero += counts[0];
     return multi * (1.0 / inv_sum);
 }
 
@@ -255,11 +424,18 @@ static double bias_estimate(hll_t *h, double raw_est) {
 }
 
 /**
- * Estimates the cardinality of the HLL
+ * Estimates the cardinality of the HLL. Precisions
+ * above HLL_MAX_BIAS_PRECISION use hll_size_ertl, since
+ * there is no bias data for them.
  * @arg h The hll to query
  * @return An estimate of the cardinality
  */
 double hll_size(hll_t *h) {
+    // There is no bias data past this precision
+    if (h->precision > HLL_MAX_BIAS_PRECISION) {
+        return hll_size_ertl(h);
+    }
+
     int num_zero = 0;
     double raw_est = raw_estimate(h, &num_zero);
 
@@ -285,6 +461,325 @@ double hll_size(hll_t *h) {
     }
 }
 
+/*
+ * Series used by the improved estimator, from Ertl's paper
+ * "New cardinality estimation algorithms for HyperLogLog sketches".
+ * Sigma corrects for the registers that are still zero.
+ */
+static double ertl_sigma(double x) {
+    if (x == 1) return INFINITY;
+    double y = 1, z = x, z_prev;
+    do {
+        x *= x;
+        z_prev = z;
+        z += x * y;
+        y += y;
+    } while (z != z_prev);
+    return z;
+}
+
+/*
+ * Tau corrects for the registers that have saturated
+ */
+static double ertl_tau(double x) {
+    if (x == 0 || x == 1) return 0;
+    double y = 1, z = 1 - x, z_prev;
+    do {
+        x = sqrt(x);
+        z_prev = z;
+        y *= 0.5;
+        z -= (1 - x) * (1 - x) * y;
+    } while (z != z_prev);
+    return z / 3;
+}
+
+/**
+ * Estimates the cardinality of the HLL using Ertl's improved
+ * raw estimator. This only needs a histogram of the registers,
+ * so it has no bias tables or switch to linear counting.
+ * @arg h The hll to query
+ * @return An estimate of the cardinality
+ */
+double hll_size_ertl(hll_t *h) {
+    // Build the histogram of register values
+    int num_reg = NUM_REG(h->precision);
+    uint32_t counts[1 << REG_WIDTH] = {0};
+    register_histogram(h, counts);
+
+    // Registers can be at most the hash bits left after the index, plus one
+    int q = 64 - h->precision;
+    double m = num_reg;
+    double z = m * ertl_tau(1 - counts[q+1] / m);
+    for (int k=q; k >= 1; k--) {
+        z = 0.5 * (z + counts[k]);
+    }
+    z += m * ertl_sigma(counts[0] / m);
+    return m * m / (2 * log(2) * z);
+}
+
+/**
+ * Estimates the size of the intersection of several HLLs
+ * of the same precision. This uses the inclusion-exclusion
+ * principle, so the union of every subset is estimated.
+ *
+ * Subsets are visited in increasing order, and each union is
+ * built from the union of the subset without its lowest member,
+ * so each subset costs a single merge. That union is kept per
+ * number of members, and is never overwritten before it is used,
+ * since every subset visited in between has more members.
+ * @arg hlls The hlls to intersect
+ * @arg num The number of hlls, at most HLL_MAX_INTERSECT
+ * @arg size The estimator to use for the unions
+ * @return An estimate of the intersection, or -1 on error
+ */
+double hll_intersect_size(hll_t *hlls, int num, hll_size_fn size) {
+    if (num < 1 || num > HLL_MAX_INTERSECT) return -1;
+    for (int i=1; i < num; i++) {
+        if (hlls[i].precision != hlls[0].precision) return -1;
+    }
+
+    // The unions by number of members, in the layout of the inputs
+    hll_t unions[HLL_MAX_INTERSECT];
+    uint64_t bytes = hll_bytes_for_layout(hlls[0].precision, hlls[0].layout);
+    for (int i=0; i < num; i++) {
+        if (hll_init_layout(hlls[0].precision, hlls[0].layout, unions + i)) {
+            while (i--) hll_destroy(unions + i);
+            return -1;
+        }
+    }
+
+    // Add the unions of odd sized subsets, and subtract the even ones
+    double est = 0, smallest = -1;
+    for (int subset=1; subset < (1 << num); subset++) {
+        int members = __builtin_popcount(subset);
+        hll_t *u = unions + members - 1;
+        if (members == 1)
+            memset(u->registers, 0, bytes);
+        else
+            memcpy(u->registers, unions[members-2].registers, bytes);
+        hll_merge(u, hlls + __builtin_ctz(subset));
+
+        double union_est = size(u);
+        if (members == 1 && (smallest < 0 || union_est < smallest))
+            smallest = union_est;
+        est += (members & 1) ? union_est : -union_est;
+    }
+    for (int i=0; i < num; i++) hll_destroy(unions + i);
+
+    // The error of the unions can push the estimate out of range
+    if (est < 0) est = 0;
+    if (est > smallest) est = smallest;
+    return est;
+}
+
+
+/**
+ * Initializes a new sliding HLL
+ * @arg precision The digits of precision to use
+ * @arg window The longest window that can be queried, in seconds
+ * @arg h The sliding HLL to initialize
+ * @return 0 on success
+ */
+int shll_init(unsigned char precision, uint32_t window, shll_t *h) {
+    // Ensure the precision is somewhat sane
+    if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+        return -1;
+
+    h->precision = precision;
+    h->window = window;
+    h->registers = calloc(NUM_REG(precision), sizeof(shll_register));
+    if (!h->registers) return -1;
+    return 0;
+}
+
+/**
+ * Destroys a sliding HLL
+ * @return 0 on success
+ */
+int shll_destroy(shll_t *h) {
+    if (!h->registers) return 0;
+    int reg = NUM_REG(h->precision);
+    for (int i=0; i < reg; i++) {
+        if (h->registers[i].entries) free(h->registers[i].entries);
+    }
+    free(h->registers);
+    h->registers = NULL;
+    return 0;
+}
+
+/**
+ * Drops the entries of a register that are older
+ * than the longest window before a time.
+ */
+static void prune_register(shll_t *h, shll_register *r, uint32_t now) {
+    int expired = 0;
+    while (expired < r->num &&
+            (uint64_t)r->entries[expired].time + h->window <= now)
+        expired++;
+    if (!expired) return;
+    r->num -= expired;
+    memmove(r->entries, r->entries + expired, r->num * sizeof(shll_entry));
+}
+
+/**
+ * Adds a new hash to the sliding HLL, as seen at a time.
+ * Entries that have fallen out of the longest window
+ * are dropped from the register that is updated.
+ * @arg h The sliding hll to add to
+ * @arg hash The hash to add
+ * @arg time When the hash was seen, in seconds
+ * @return 1 if an entry was added to a register, 0 otherwise,
+ * -1 if the register could not be grown.
+ */
+int shll_add_hash(shll_t *h, uint64_t hash, uint32_t time) {
+    // Determine the index and rank the same way as hll_add_hash
+    int idx = hash >> (64 - h->precision);
+    hash = hash << h->precision | (1 << (h->precision -1));
+    unsigned char rank = __builtin_clzll(hash) + 1;
+    shll_register *r = h->registers + idx;
+
+    // Find where the entry goes, after any entries at the same time
+    int pos = r->num;
+    while (pos > 0 && r->entries[pos-1].time > time) pos--;
+
+    // Skip if an entry at the same time or later has a rank
+    // that is at least as large, since it will always win
+    if (pos < r->num && r->entries[pos].rank >= rank) return 0;
+    if (pos > 0 && r->entries[pos-1].time == time && r->entries[pos-1].rank >= rank) return 0;
+
+    // Older entries with a rank that is not larger can never win again
+    int keep = pos;
+    while (keep > 0 && r->entries[keep-1].rank <= rank) keep--;
+
+    // Grow the register if needed, and insert the entry
+    if (keep + 1 + r->num - pos > r->cap) {
+        int cap = (r->cap) ? r->cap * 2 : 2;
+        shll_entry *entries = realloc(r->entries, cap * sizeof(shll_entry));
+        if (!entries) return -1;
+        r->entries = entries;
+        r->cap = cap;
+    }
+    memmove(r->entries + keep + 1, r->entries + pos, (r->num - pos) * sizeof(shll_entry));
+    r->entries[keep].time = time;
+    r->entries[keep].rank = rank;
+    r->num = keep + 1 + r->num - pos;
+
+    // Drop the entries that are out of the window of the newest
+    prune_register(h, r, r->entries[r->num-1].time);
+    return 1;
+}
+
+/**
+ * Drops every entry that has fallen out of the longest window.
+ * @arg h The sliding hll to prune
+ * @arg now The current time, in seconds
+ */
+void shll_prune(shll_t *h, uint32_t now) {
+    int reg = NUM_REG(h->precision);
+    for (int i=0; i < reg; i++) {
+        prune_register(h, h->registers + i, now);
+    }
+}
+
+/**
+ * Builds the registers of a window into a new HLL,
+ * which can be used with hll_size.
+ * @arg h The sliding hll to query
+ * @arg now The end of the window, in seconds
+ * @arg window The length of the window, in seconds
+ * @arg out Output. The HLL to initialize. Must be destroyed.
+ * @return 0 on success
+ */
+int shll_window(shll_t *h, uint32_t now, uint32_t window, hll_t *out) {
+    if (hll_init(h->precision, out)) return -1;
+    int reg = NUM_REG(h->precision);
+    for (int i=0; i < reg; i++) {
+        // The ranks decrease over time, so the oldest
+        // entry in the window has the largest rank
+        shll_register *r = h->registers + i;
+        for (int j=0; j < r->num; j++) {
+            shll_entry *e = r->entries + j;
+            if ((uint64_t)e->time + window <= now) continue;
+            if (e->time <= now) set_register(out, i, e->rank);
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Encodes the registers of a sliding HLL. Each register is
+ * stored as a count, followed by the time and rank of each entry.
+ * @arg h The sliding hll to encode
+ * @arg buf Output. Set to a malloc()'d buffer with the encoding
+ * @arg len Output. Set to the length of the encoding
+ * @return 0 on success
+ */
+int shll_encode(shll_t *h, unsigned char **buf, uint64_t *len) {
+    int reg = NUM_REG(h->precision);
+    uint64_t size = reg;
+    for (int i=0; i < reg; i++) {
+        size += h->registers[i].num * (sizeof(uint32_t) + 1);
+    }
+    unsigned char *out = malloc(size);
+    if (!out) return -1;
+
+    uint64_t off = 0;
+    for (int i=0; i < reg; i++) {
+        shll_register *r = h->registers + i;
+        out[off++] = r->num;
+        for (int j=0; j < r->num; j++) {
+            memcpy(out+off, &r->entries[j].time, sizeof(uint32_t));
+            off += sizeof(uint32_t);
+            out[off++] = r->entries[j].rank;
+        }
+    }
+
+    *buf = out;
+    *len = off;
+    return 0;
+}
+
+/**
+ * Decodes registers produced by shll_encode into an
+ * empty sliding HLL of the same precision.
+ * @arg h The sliding hll to decode into
+ * @arg buf The encoded registers
+ * @arg len The length of the encoding
+ * @return 0 on success, -1 if the encoding is invalid,
+ * -2 if the registers could not be allocated.
+ */
+int shll_decode(shll_t *h, const unsigned char *buf, uint64_t len) {
+    int reg = NUM_REG(h->precision);
+    uint64_t off = 0;
+    for (int i=0; i < reg; i++) {
+        if (off >= len) return -1;
+        shll_register *r = h->registers + i;
+        int num = buf[off++];
+        if (off + num * (sizeof(uint32_t) + 1) > len) return -1;
+        if (num > r->cap) {
+            shll_entry *entries = realloc(r->entries, num * sizeof(shll_entry));
+            if (!entries) return -2;
+            r->entries = entries;
+            r->cap = num;
+        }
+        r->num = num;
+        for (int j=0; j < num; j++) {
+            memcpy(&r->entries[j].time, buf+off, sizeof(uint32_t));
+            off += sizeof(uint32_t);
+            r->entries[j].rank = buf[off++];
+
+            // Verify the ranks are valid, and the entries are in order
+            if (!r->entries[j].rank || r->entries[j].rank > 65 - h->precision)
+                return -1;
+            if (j && (r->entries[j].time < r->entries[j-1].time ||
+                        r->entries[j].rank >= r->entries[j-1].rank))
+                return -1;
+        }
+    }
+    return (off == len) ? 0 : -1;
+}
+
 
 /**
  * Computes the minimum number of registers
@@ -334,10 +829,26 @@ double hll_error_for_precision(int prec) {
  * @return The bytes required or 0 on error.
  */
 uint64_t hll_bytes_for_precision(int prec) {
+    return hll_bytes_for_layout(prec, HLL_LAYOUT_PACKED);
+}
+
+/**
+ * Computes the bytes required for a HLL of the
+ * given precision and register layout.
+ * @arg prec The precision to use
+ * @arg layout The layout of the registers
+ * @return The bytes required or 0 on error.
+ */
+uint64_t hll_bytes_for_layout(int prec, hll_layout layout) {
     // Check that the error bound is sane
     if (prec < HLL_MIN_PRECISION || prec > HLL_MAX_PRECISION)
         return 0;
 
+    // A byte per register
+    if (layout == HLL_LAYOUT_BYTES) {
+        return NUM_REG(prec);
+    }
+
     // Determine how many registers are needed
     int reg = NUM_REG(prec);
 
@@ -348,3 +859,139 @@ uint64_t hll_bytes_for_precision(int prec) {
     return words * sizeof(uint32_t);
 }
 
+
+/*
+ * Kernels are written once with the precision and layout as
+ * arguments, and always inlined into a wrapper for each pair.
+ * With both known at compile time, the register count, shifts
+ * and divisions fold into constants, and the loops can be
+ * unrolled and vectorized.
+ */
+#define KERNEL static inline __attribute__((always_inline))
+
+KERNEL int add_hash_kernel(hll_t *h, uint64_t hash, const int precision, const int layout) {
+    // Determine the index using the first p bits
+    int idx = hash >> (64 - precision);
+
+    // Shift out the index bits
+    hash = hash << precision | (1 << (precision -1));
+
+    // Determine the count of leading zeros
+    uint32_t leading = __builtin_clzll(hash) + 1;
+
+    // Byte registers are updated in place
+    if (layout == HLL_LAYOUT_BYTES) {
+        unsigned char *reg = (unsigned char*)h->registers + idx;
+        if (leading <= *reg) return 0;
+        *reg = leading;
+        return 1;
+    }
+
+    // Update the register if the new value is larger
+    uint32_t *word = h->registers + (idx / REG_PER_WORD);
+    unsigned shift = REG_WIDTH * (idx % REG_PER_WORD);
+    if (leading <= ((*word >> shift) & REG_MASK)) return 0;
+    *word = (*word & ~((uint32_t)REG_MASK << shift)) | (leading << shift);
+    return 1;
+}
+
+KERNEL void merge_kernel(hll_t *h, hll_t *other, const int precision, const int layout) {
+    const int reg = NUM_REG(precision);
+
+    // Byte registers are a plain max, which the compiler vectorizes
+    if (layout == HLL_LAYOUT_BYTES) {
+        unsigned char *ours = (unsigned char*)h->registers;
+        const unsigned char *theirs = (unsigned char*)other->registers;
+        for (int i=0; i < reg; i++) {
+            ours[i] = (theirs[i] > ours[i]) ? theirs[i] : ours[i];
+        }
+        return;
+    }
+
+    // Work a word at a time, the unused bits are always zero
+    const int words = INT_CEIL(reg, REG_PER_WORD);
+    for (int w=0; w < words; w++) {
+        uint32_t ours = h->registers[w];
+        uint32_t theirs = other->registers[w];
+        if (ours == theirs) continue;
+
+        uint32_t merged = ours;
+        for (int i=0; i < REG_PER_WORD; i++) {
+            uint32_t mask = (uint32_t)REG_MASK << (REG_WIDTH * i);
+            if ((theirs & mask) > (merged & mask)) {
+                merged = (merged & ~mask) | (theirs & mask);
+            }
+        }
+        h->registers[w] = merged;
+    }
+}
+
+KERNEL void histogram_kernel(hll_t *h, uint32_t *counts, const int precision, const int layout) {
+    const int num_reg = NUM_REG(precision);
+    if (layout == HLL_LAYOUT_BYTES) {
+        const unsigned char *regs = (unsigned char*)h->registers;
+        for (int i=0; i < num_reg; i++) {
+            counts[regs[i] & REG_MASK]++;
+        }
+        return;
+    }
+
+    // Full words first, then the registers of the last word
+    const int words = num_reg / REG_PER_WORD;
+    for (int w=0; w < words; w++) {
+        uint32_t word = h->registers[w];
+        for (int i=0; i < REG_PER_WORD; i++) {
+            counts[word & REG_MASK]++;
+            word >>= REG_WIDTH;
+        }
+    }
+    uint32_t word = (words < INT_CEIL(num_reg, REG_PER_WORD)) ? h->registers[words] : 0;
+    for (int i=words * REG_PER_WORD; i < num_reg; i++) {
+        counts[word & REG_MASK]++;
+        word >>= REG_WIDTH;
+    }
+}
+
+/*
+ * Defines the kernels for a precision, in both layouts
+ */
+#define DEFINE_KERNELS(p) \
+    static int add_hash_packed_##p(hll_t *h, uint64_t hash) { \
+        return add_hash_kernel(h, hash, p, HLL_LAYOUT_PACKED); } \
+    static int add_hash_bytes_##p(hll_t *h, uint64_t hash) { \
+        return add_hash_kernel(h, hash, p, HLL_LAYOUT_BYTES); } \
+    static void merge_packed_##p(hll_t *h, hll_t *other) { \
+        merge_kernel(h, other, p, HLL_LAYOUT_PACKED); } \
+    static void merge_bytes_##p(hll_t *h, hll_t *other) { \
+        merge_kernel(h, other, p, HLL_LAYOUT_BYTES); } \
+    static void histogram_packed_##p(hll_t *h, uint32_t *counts) { \
+        histogram_kernel(h, counts, p, HLL_LAYOUT_PACKED); } \
+    static void histogram_bytes_##p(hll_t *h, uint32_t *counts) { \
+        histogram_kernel(h, counts, p, HLL_LAYOUT_BYTES); }
+
+#define PACKED_KERNELS(p) \
+    [p] = {add_hash_packed_##p, merge_packed_##p, histogram_packed_##p},
+#define BYTES_KERNELS(p) \
+    [p] = {add_hash_bytes_##p, merge_bytes_##p, histogram_bytes_##p},
+
+// Must cover HLL_MIN_PRECISION to HLL_MAX_PRECISION
+#define FOR_EACH_PRECISION(X) \
+    X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) \
+    X(15) X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24)
+
+FOR_EACH_PRECISION(DEFINE_KERNELS)
+
+static const struct hll_kernels PACKED[HLL_MAX_PRECISION+1] = {
+    FOR_EACH_PRECISION(PACKED_KERNELS)
+};
+
+static const struct hll_kernels BYTES[HLL_MAX_PRECISION+1] = {
+    FOR_EACH_PRECISION(BYTES_KERNELS)
+};
+
+/*
+ * Returns the kernels for a sane precision and layout
+ */
+static const struct hll_kernels* kernels_for(unsigned char precision, hll_layout layout) {
+    return (layout == HLL_LAYOUT_BYTES) ? &BYTES[precision] : &PACKED[precision];
+}
@@ -6,14 +6,63 @@
 
 // Ensure precision in a sane bound
 #define HLL_MIN_PRECISION 4      // 16 registers
-#define HLL_MAX_PRECISION 18     // 262,144 registers
+#define HLL_MAX_PRECISION 24     // 16,777,216 registers
+
+// Highest precision with empirical bias data
+#define HLL_MAX_BIAS_PRECISION 18
+
+// Most HLLs that can be intersected, since every subset is unioned
+#define HLL_MAX_INTERSECT 8
+
+/**
+ * Layouts of the registers of an HLL
+ */
+typedef enum {
+    HLL_LAYOUT_PACKED = 0,  // 6 bit registers, 5 to a 32bit word
+    HLL_LAYOUT_BYTES        // A byte per register, for faster updates
+} hll_layout;
+
+// Routines specialized for a precision and layout
+struct hll_kernels;
 
 typedef struct {
     unsigned char precision;
+    unsigned char layout;       // The hll_layout of the registers
     uint32_t *registers;
     hlld_bitmap *bm;
+    const struct hll_kernels *kernels;
 } hll_t;
 
+/**
+ * A single entry of a sliding HLL register
+ */
+typedef struct {
+    uint32_t time;          // When the rank was seen, in seconds
+    unsigned char rank;     // Leading zeros of the hash, plus one
+} shll_entry;
+
+/**
+ * A register of a sliding HLL. This is the list of possible
+ * future maxima (LPFM), which are the entries that could still
+ * be the max of the register for a window that ends now or later.
+ * The entries are kept oldest first, with strictly decreasing ranks.
+ */
+typedef struct {
+    unsigned char num;      // Entries in use
+    unsigned char cap;      // Entries allocated
+    shll_entry *entries;
+} shll_register;
+
+/**
+ * A sliding HLL can estimate the cardinality of
+ * any window of time up to a maximum window.
+ */
+typedef struct {
+    unsigned char precision;
+    uint32_t window;            // Longest window that can be queried, in seconds
+    shll_register *registers;
+} shll_t;
+
 /**
  * Initializes a new HLL
  * @arg precision The digits of precision to use
@@ -22,14 +71,46 @@ typedef struct {
  */
 int hll_init(unsigned char precision, hll_t *h);
 
+/**
+ * Initializes a new HLL with a given register layout
+ * @arg precision The digits of precision to use
+ * @arg layout The layout of the registers
+ * @arg h The HLL to initialize
+ * @return 0 on success
+ */
+int hll_init_layout(unsigned char precision, hll_layout layout, hll_t *h);
+
 /**
  * Initializes a new HLL from a bitmap
  * @arg precision The digits of precision to use
+ * @arg layout The layout of the registers in the bitmap
  * @arg bm The bitmap to use
  * @arg h The HLL to initialize
  * @return 0 on success
  */
-int hll_init_from_bitmap(unsigned char precision, hlld_bitmap *bm, hll_t *h);
+int hll_init_from_bitmap(unsigned char precision, hll_layout layout, hlld_bitmap *bm, hll_t *h);
+
+/**
+ * Initializes a new HLL over existing registers. The
+ * registers are not copied, and remain owned by the caller,
+ * so the HLL must not be destroyed.
+ * @arg precision The digits of precision to use
+ * @arg layout The layout of the registers
+ * @arg registers The registers to use
+ * @arg h The HLL to initialize
+ * @return 0 on success
+ */
+int hll_init_from_registers(unsigned char precision, hll_layout layout, uint32_t *registers, hll_t *h);
+
+/**
+ * Copies the registers of an HLL into a new
+ * HLL of the same precision with another layout.
+ * @arg h The hll to copy
+ * @arg layout The layout of the new HLL
+ * @arg out Output. The HLL to initialize. Must be destroyed.
+ * @return 0 on success
+ */
+int hll_convert(hll_t *h, hll_layout layout, hll_t *out);
 
 /**
  * Destroys an hll. Closes the bitmap, but does not free it.
@@ -48,16 +129,140 @@ void hll_add(hll_t *h, char *key);
  * Adds a new hash to the HLL
  * @arg h The hll to add to
  * @arg hash The hash to add
+ * @return 1 if a register was increased, 0 otherwise.
+ */
+int hll_add_hash(hll_t *h, uint64_t hash);
+
+/**
+ * Merges in the registers of another HLL with the
+ * same precision, keeping the larger of each register.
+ * The HLLs may have different layouts.
+ * @arg h The hll to merge into
+ * @arg other The hll to merge
+ */
+void hll_merge(hll_t *h, hll_t *other);
+
+/**
+ * Encodes the registers of an HLL compactly, using a
+ * run length encoding. Low cardinality HLLs with mostly
+ * empty registers encode to a small fraction of their size.
+ * @arg h The hll to encode
+ * @arg buf Output. Set to a malloc()'d buffer with the encoding
+ * @arg len Output. Set to the length of the encoding
+ * @return 0 on success
+ */
+int hll_encode(hll_t *h, unsigned char **buf, uint64_t *len);
+
+/**
+ * Decodes registers produced by hll_encode into an
+ * HLL of the same precision, replacing its registers.
+ * @arg h The hll to decode into
+ * @arg buf The encoded registers
+ * @arg len The length of the encoding
+ * @return 0 on success, -1 if the encoding is invalid
  */
-void hll_add_hash(hll_t *h, uint64_t hash);
+int hll_decode(hll_t *h, const unsigned char *buf, uint64_t len);
 
 /**
- * Estimates the cardinality of the HLL
+ * Estimates the cardinality of the HLL. Precisions
+ * above HLL_MAX_BIAS_PRECISION use hll_size_ertl, since
+ * there is no bias data for them.
  * @arg h The hll to query
  * @return An estimate of the cardinality
  */
 double hll_size(hll_t *h);
 
+/**
+ * Estimates the cardinality of the HLL using Ertl's improved
+ * raw estimator. This only needs a histogram of the registers,
+ * so it has no bias tables or switch to linear counting.
+ * @arg h The hll to query
+ * @return An estimate of the cardinality
+ */
+double hll_size_ertl(hll_t *h);
+
+/**
+ * An estimator of the cardinality of an HLL
+ */
+typedef double (*hll_size_fn)(hll_t *h);
+
+/**
+ * Estimates the size of the intersection of several HLLs
+ * of the same precision. This uses the inclusion-exclusion
+ * principle, so the union of every subset is estimated.
+ * @arg hlls The hlls to intersect
+ * @arg num The number of hlls, at most HLL_MAX_INTERSECT
+ * @arg size The estimator to use for the unions
+ * @return An estimate of the intersection, or -1 on error
+ */
+double hll_intersect_size(hll_t *hlls, int num, hll_size_fn size);
+
+/**
+ * Initializes a new sliding HLL
+ * @arg precision The digits of precision to use
+ * @arg window The longest window that can be queried, in seconds
+ * @arg h The sliding HLL to initialize
+ * @return 0 on success
+ */
+int shll_init(unsigned char precision, uint32_t window, shll_t *h);
+
+/**
+ * Destroys a sliding HLL
+ * @return 0 on success
+ */
+int shll_destroy(shll_t *h);
+
+/**
+ * Adds a new hash to the sliding HLL, as seen at a time.
+ * Entries that have fallen out of the longest window
+ * are dropped from the register that is updated.
+ * @arg h The sliding hll to add to
+ * @arg hash The hash to add
+ * @arg time When the hash was seen, in seconds
+ * @return 1 if an entry was added to a register, 0 otherwise,
+ * -1 if the register could not be grown.
+ */
+int shll_add_hash(shll_t *h, uint64_t hash, uint32_t time);
+
+/**
+ * Drops every entry that has fallen out of the longest window.
+ * @arg h The sliding hll to prune
+ * @arg now The current time, in seconds
+ */
+void shll_prune(shll_t *h, uint32_t now);
+
+/**
+ * Builds the registers of a window into a new HLL,
+ * which can be used with hll_size.
+ * @arg h The sliding hll to query
+ * @arg now The end of the window, in seconds
+ * @arg window The length of the window, in seconds
+ * @arg out Output. The HLL to initialize. Must be destroyed.
+ * @return 0 on success
+ */
+int shll_window(shll_t *h, uint32_t now, uint32_t window, hll_t *out);
+
+/**
+ * Encodes the registers of a sliding HLL. Each register is
+ * stored as a count, followed by the time and rank of each entry.
+ * @arg h The sliding hll to encode
+ * @arg buf Output. Set to a malloc()'d buffer with the encoding
+ * @arg len Output. Set to the length of the encoding
+ * @return 0 on success
+ */
+int shll_encode(shll_t *h, unsigned char **buf, uint64_t *len);
+
+/**
+ * Decodes registers produced by shll_encode into an
+ * empty sliding HLL of the same precision.
+ * @arg h The sliding hll to decode into
+ * @arg buf The encoded registers
+ * @arg len The length of the encoding
+ * @return 0 on success, -1 if the encoding is invalid,
+ * -2 if the registers could not be allocated.
+ */
+int shll_decode(shll_t *h, const unsigned char *buf, uint64_t len);
+
 /**
  * Computes the minimum digits of precision
  * needed to hit a target error.
@@ -84,4 +289,13 @@ double hll_error_for_precision(int prec);
  */
 uint64_t hll_bytes_for_precision(int prec);
 
+/**
+ * Computes the bytes required for a HLL of the
+ * given precision and register layout.
+ * @arg prec The precision to use
+ * @arg layout The layout of the registers
+ * @return The bytes required or 0 on error.
+ */
+uint64_t hll_bytes_for_layout(int prec, hll_layout layout);
+
 #endif
@@ -189,6 +189,10 @@ int main(int argc, char **argv) {
     // Loop forever
     enter_main_loop(netconf, &SHOULD_RUN, threads);
 
+    // Resume any parked clients before the workers exit,
+    // since the fault callbacks notify the worker threads
+    setmgr_stop_faults(mgr);
+
     // Begin the shutdown/cleanup
     shutdown_networking(netconf, threads);
 
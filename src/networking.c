@@ -119,6 +119,9 @@ struct conn_info {
     ev_io write_client;
     circular_buffer output;
 
+    char *parked_cmd;       // Command waiting to be resumed, or NULL
+    int parked_len;
+
     struct conn_info *next;
 };
 
@@ -152,6 +155,7 @@ static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events
 static int read_client_data(conn_info *conn);
 static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_events);
 static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void notify_worker(worker_ev_userdata *data, char cmd, conn_info *conn);
 
 static void close_client_connection(conn_info *conn);
 static void deactivate_client_connection(conn_info *conn);
@@ -380,8 +384,22 @@ static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
     worker_ev_userdata *data = netconf->workers[next_thread];
 
     // Sent accept along with the connection
-    write(data->pipefd[1], "a", 1);
-    write(data->pipefd[1], &conn, sizeof(conn_info*));
+    notify_worker(data, 'a', conn);
+}
+
+
+/**
+ * Sends a command and a connection to a worker
+ * thread. This is done with a single write, so
+ * that notifications from many threads do not interleave.
+ */
+static void notify_worker(worker_ev_userdata *data, char cmd, conn_info *conn) {
+    char buf[1 + sizeof(conn_info*)];
+    buf[0] = cmd;
+    memcpy(buf+1, &conn, sizeof(conn_info*));
+    if (write(data->pipefd[1], buf, sizeof(buf)) != sizeof(buf)) {
+        syslog(LOG_ERR, "Failed to notify worker! %s.", strerror(errno));
+    }
 }
 
 
@@ -537,6 +555,30 @@ static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_ev
             ev_io_start(data->loop, &conn->client);
             break;
 
+        // Resume a parked connection
+        case 'r':
+            if (read(data->pipefd[0], &conn, sizeof(conn_info*)) < 0) {
+                perror("Failed to read from async pipe");
+                return;
+            }
+
+            // Close it now if it failed while parked
+            if (!conn->active) {
+                conn->next = data->inactive;
+                data->inactive = conn;
+                break;
+            }
+
+            // Start reading again, and run the parked command
+            ev_io_start(data->loop, &conn->client);
+            hlld_conn_handler handle;
+            handle.config = data->netconf->config;
+            handle.mgr = data->netconf->mgr;
+            handle.conn = conn;
+            if (handle_client_connect(&handle))
+                deactivate_client_connection(conn);
+            break;
+
         // Quit
         case 'q':
             data->should_run = 0;
@@ -731,6 +773,7 @@ static void close_client_connection(conn_info *conn) {
     // Clear everything out
     circbuf_free(&conn->input);
     circbuf_free(&conn->output);
+    if (conn->parked_cmd) free(conn->parked_cmd);
 
     // Close the fd
     syslog(LOG_DEBUG, "Closed connection. [%d]", conn->client.fd);
@@ -745,6 +788,10 @@ static void close_client_connection(conn_info *conn) {
 static void deactivate_client_connection(conn_info *conn) {
     if (!conn->active) return;
     conn->active = 0;
+
+    // A parked connection is closed once it is resumed,
+    // since the I/O thread still holds a reference
+    if (conn->parked_cmd) return;
     conn->next = conn->thread_ev->inactive;
     conn->thread_ev->inactive = conn;
 }
@@ -943,6 +990,75 @@ int extract_to_terminator(hlld_conn_info *conn, char terminator, char **buf, int
 }
 
 
+/**
+ * Parks a client connection while a command waits
+ * on a slow operation, such as faulting in a set. No
+ * more commands are read from the client until the
+ * connection is resumed, at which point the command
+ * can be retrieved with take_parked_command.
+ * @arg conn The client connection
+ * @arg cmd The command to park. This is copied.
+ * @arg cmd_len The length of the command
+ */
+void park_client_connection(conn_info *conn, char *cmd, int cmd_len) {
+    conn->parked_cmd = malloc(cmd_len);
+    memcpy(conn->parked_cmd, cmd, cmd_len);
+    conn->parked_len = cmd_len;
+    ev_io_stop(conn->thread_ev->loop, &conn->client);
+}
+
+/**
+ * Resumes a parked connection on its worker thread.
+ * @notes Thread safe.
+ * @arg conn The client connection
+ */
+void resume_client_connection(conn_info *conn) {
+    notify_worker(conn->thread_ev, 'r', conn);
+}
+
+/**
+ * Takes the parked command of a resumed connection.
+ * @arg conn The client connection
+ * @arg cmd Output parameter, the command. Must be freed by the caller.
+ * @arg cmd_len Output parameter, the length of the command.
+ * @return 1 if there was a parked command, 0 otherwise.
+ */
+int take_parked_command(conn_info *conn, char **cmd, int *cmd_len) {
+    if (!conn->parked_cmd) return 0;
+    *cmd = conn->parked_cmd;
+    *cmd_len = conn->parked_len;
+    conn->parked_cmd = NULL;
+    return 1;
+}
+
+/**
+ * Creates a connection that is not attached to a client
+ * socket, with input buffered as if it was read from the
+ * client. This allows the tests and benchmarks to drive the
+ * command parsing without the network stack.
+ * @arg input The bytes to buffer
+ * @arg input_len The number of bytes
+ * @return A new connection, destroyed with destroy_buffered_conn.
+ */
+hlld_conn_info* init_buffered_conn(char *input, uint64_t input_len) {
+    conn_info *conn = get_conn();
+    conn->thread_ev = NULL;
+    conn->next = NULL;
+    circbuf_write(&conn->input, input, input_len);
+    return conn;
+}
+
+/**
+ * Destroys a connection made by init_buffered_conn.
+ * @arg conn The connection to destroy
+ */
+void destroy_buffered_conn(hlld_conn_info *conn) {
+    circbuf_free(&conn->input);
+    circbuf_free(&conn->output);
+    if (conn->parked_cmd) free(conn->parked_cmd);
+    free(conn);
+}
+
 /**
  * Sets the client socket options.
  * @return 0 on success, 1 on error.
@@ -989,6 +1105,8 @@ static conn_info* get_conn() {
     // Setup variables
     conn->active = 1;
     conn->use_write_buf = 0;
+    conn->parked_cmd = NULL;
+    conn->parked_len = 0;
 
     // Prepare the buffers
     circbuf_init(&conn->input);
@@ -71,4 +71,49 @@ int send_client_response(hlld_conn_info *conn, char **response_buffers, int *buf
  */
 int extract_to_terminator(hlld_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free);
 
+/**
+ * Parks a client connection while a command waits
+ * on a slow operation, such as faulting in a set. No
+ * more commands are read from the client until the
+ * connection is resumed, at which point the command
+ * can be retrieved with take_parked_command.
+ * @arg conn The client connection
+ * @arg cmd The command to park. This is copied.
+ * @arg cmd_len The length of the command
+ */
+void park_client_connection(hlld_conn_info *conn, char *cmd, int cmd_len);
+
+/**
+ * Resumes a parked connection on its worker thread.
+ * @notes Thread safe.
+ * @arg conn The client connection
+ */
+void resume_client_connection(hlld_conn_info *conn);
+
+/**
+ * Takes the parked command of a resumed connection.
+ * @arg conn The client connection
+ * @arg cmd Output parameter, the command. Must be freed by the caller.
+ * @arg cmd_len Output parameter, the length of the command.
+ * @return 1 if there was a parked command, 0 otherwise.
+ */
+int take_parked_command(hlld_conn_info *conn, char **cmd, int *cmd_len);
+
+/**
+ * Creates a connection that is not attached to a client
+ * socket, with input buffered as if it was read from the
+ * client. This allows the tests and benchmarks to drive the
+ * command parsing without the network stack.
+ * @arg input The bytes to buffer
+ * @arg input_len The number of bytes
+ * @return A new connection, destroyed with destroy_buffered_conn.
+ */
+hlld_conn_info* init_buffered_conn(char *input, uint64_t input_len);
+
+/**
+ * Destroys a connection made by init_buffered_conn.
+ * @arg conn The connection to destroy
+ */
+void destroy_buffered_conn(hlld_conn_info *conn);
+
 #endif
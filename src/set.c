@@ -6,10 +6,13 @@
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <time.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <assert.h>
+#include <math.h>
 #include "set.h"
+#include "crc32c.h"
 #include "type_compat.h"
 
 /*
@@ -27,13 +30,122 @@ static const char* DATA_FILE_NAME = "registers.mmap";
  */
 static const char* CONFIG_FILENAME = "config.ini";
 
+/**
+ * Backup of the registers taken after the last
+ * flush. Used to repair torn writes.
+ */
+static const char* BACKUP_FILE_NAME = "registers.bak";
+
+/**
+ * Name a corrupt register file is moved to
+ */
+static const char* QUARANTINE_FILE_NAME = "registers.mmap.corrupt";
+
+/**
+ * Compressed registers of a closed set
+ */
+static const char* COMPRESSED_FILE_NAME = "registers.cmp";
+
+/**
+ * Header of the compressed registers. It is followed
+ * by the precision, the CRC32C of the raw registers
+ * and the output of hll_encode.
+ */
+static const char COMPRESSED_MAGIC[4] = {'H','L','L','Z'};
+#define COMPRESSED_HEADER_SIZE (sizeof(COMPRESSED_MAGIC) + sizeof(uint8_t) + sizeof(uint32_t))
+
+/**
+ * Registers of a sliding set. The file starts with a
+ * header holding the precision, followed by the output
+ * of shll_encode.
+ */
+static const char* SLIDING_FILE_NAME = "registers.sliding";
+static const char SLIDING_MAGIC[4] = {'H','L','L','S'};
+#define SLIDING_HEADER_SIZE (sizeof(SLIDING_MAGIC) + sizeof(uint8_t))
+
+/**
+ * Log of the hashes added since the last flush
+ */
+static const char* WAL_FILE_NAME = "registers.wal";
+
+/**
+ * Bytes of the hash log copied at a time when compacting
+ */
+#define WAL_COPY_SIZE 65536
+
+/**
+ * Folder of each window of a windowed set, named
+ * by the start of the window.
+ */
+static const char* WINDOW_FOLDER_NAME = "window.%llu";
+static const char WINDOW_FOLDER_PREFIX[] = "window.";
+#define WINDOW_FOLDER_PREFIX_LEN (sizeof(WINDOW_FOLDER_PREFIX) - 1)
+
+/**
+ * Number of keys that are hashed, added and
+ * logged together by hset_add_keys.
+ */
+#define ADD_BATCH_SIZE 64
+
+/**
+ * Time constant of the moving averages of the
+ * set and update rates, in seconds.
+ */
+#define RATE_WINDOW_SEC 60.0
+
 /*
  * Static delarations
  */
+static hlld_set* alloc_set(hlld_config *config, char *set_name);
+static int load_set(hlld_set *s);
+static int thread_safe_load(hlld_set *s);
 static int thread_safe_fault(hlld_set *f);
-static int timediff_msec(struct timeval *t1, struct timeval *t2);
-
+static int verify_registers(hlld_set *s, char *bitmap_path, bitmap_mode mode);
+static int matches_checksum(hlld_set_config *config, uint32_t checksum);
+static void write_backup(hlld_set *s, unsigned char *registers, uint32_t checksum);
+static int repair_registers(hlld_set *s);
+static int quarantine_registers(hlld_set *s, char *bitmap_path, bitmap_mode mode);
+static int open_wal(hlld_set *s);
+static int append_wal(hlld_set *s, uint64_t *hashes, int num);
+static int sync_wal(hlld_set *s, uint64_t offset);
+static int copy_wal(int from, uint64_t pos, uint64_t len, int to);
+static void truncate_wal(hlld_set *s, uint64_t offset);
+static int sync_dir(char *path);
+static void close_wal(hlld_set *s);
+static int write_file(char *path, unsigned char *buf, uint64_t len);
+static void compress_registers(hlld_set *s);
+static int inflate_registers(hlld_set *s, char *bitmap_path);
+static void fold_rates(set_counters *c, uint64_t now, double *set_rate, double *update_rate);
+static void update_rates(set_counters *c, uint64_t now);
+static void count_resident(hlld_set *s, int mapped);
+static int add_keys(hlld_set *set, char **keys, int num_keys, uint64_t at, uint64_t *updated);
+static int flush_registers(hlld_set *set);
+static int flush_checksummed(hlld_set *set, uint64_t wal_offset);
+static int write_config(hlld_set *s);
+static void refresh_disk_config(hlld_set *s);
+static hlld_set* alloc_window(hlld_set *s, uint64_t start);
+static uint64_t oldest_window(hlld_set *s);
+static int discover_windows(hlld_set *s);
+static hlld_set* take_current_window(hlld_set *s);
+static int take_windows(hlld_set *s, uint64_t since, hlld_set ***windows);
+static void release_window(hlld_set *s, hlld_set *w);
+static void release_windows(hlld_set *s, hlld_set **windows, int num);
+static int fault_window(hlld_set *s, hlld_set *w);
+static int add_window_keys(hlld_set *s, char **keys, int num_keys);
+static void merge_window_registers(hlld_set *s, uint64_t since, hll_t *h);
+static uint64_t merge_windows(hlld_set *s, uint64_t since);
+static uint64_t stored_windows_size(hlld_set *s);
+static int flush_windows(hlld_set *s);
+static void close_windows(hlld_set *s);
+static void expire_windows(hlld_set *s);
+static void delete_windows(hlld_set *s);
+static int load_sliding(hlld_set *s);
+static int flush_sliding(hlld_set *s);
+static uint64_t sliding_size(hlld_set *s, uint64_t last);
+
+static uint64_t estimate(hlld_set *s, hll_t *h);
 static int filter_out_special(CONST_DIRENT_T *d);
+static int filter_windows(CONST_DIRENT_T *d);
 
 // Link the external murmur hash in
 extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
@@ -48,54 +160,18 @@ extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t
  * @return 0 on success
  */
 int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set) {
-    // Allocate the buffers
-    hlld_set *s = *set = calloc(1, sizeof(hlld_set));
+    // Allocate and setup the set
+    hlld_set *s = *set = alloc_set(config, set_name);
 
-    // Initialize
-    s->is_dirty = 1;
-    s->is_proxied = 1;
-
-    // Store the things
-    s->config = config;
-    s->set_name = strdup(set_name);
-
-    // Copy set configs
-    s->set_config.default_eps = config->default_eps;
-    s->set_config.default_precision = config->default_precision;
-    s->set_config.in_memory = config->in_memory;
-
-    // Get the folder name
-    char *folder_name = NULL;
-    int res;
-    res = asprintf(&folder_name, SET_FOLDER_NAME, s->set_name);
-    assert(res != -1);
-
-    // Compute the full path
-    s->full_path = join_path(config->data_dir, folder_name);
-    free(folder_name);
-
-    // Initialize the locks
-    INIT_HLLD_SPIN(&s->hll_update);
-    pthread_mutex_init(&s->hll_lock, NULL);
-
-    // Try to create the folder path
-    res = mkdir(s->full_path, 0755);
-    if (res && errno != EEXIST) {
-        syslog(LOG_ERR, "Failed to create set directory '%s'. Err: %d [%d]", s->full_path, res, errno);
-        return res;
-    }
+    // Create the folder and read the set config
+    int res = load_set(s);
+    if (res) return res;
 
-    // Read in the set_config
-    char *config_name = join_path(s->full_path, (char*)CONFIG_FILENAME);
-    res = set_config_from_filename(config_name, &s->set_config);
-    free(config_name);
-    if (res && res != -ENOENT) {
-        syslog(LOG_ERR, "Failed to read set '%s' configuration. Err: %d [%d]", s->set_name, res, errno);
-        return res;
-    }
+    // Windows are discovered on first use, so only
+    // the config needs to be written out
+    if (s->set_config.window) return write_config(s);
 
     // Discover the existing set if we need to
-    res = 0;
     if (discover) {
         res = thread_safe_fault(s);
         if (res) {
@@ -112,6 +188,31 @@ int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set)
     return res;
 }
 
+/**
+ * Initializes a set wrapper for a set that is known to
+ * exist on disk, without touching the disk. The set folder
+ * and configuration are loaded lazily on first access,
+ * which makes this suitable for discovering many sets on start.
+ * @arg config The configuration to use
+ * @arg set_name The name of the set
+ * @arg set_config Optional, can be null. A known set config, which
+ * is used instead of reading the config from disk.
+ * @arg set Output parameter, the new set
+ * @return 0 on success
+ */
+int init_set_lazy(hlld_config *config, char *set_name, hlld_set_config *set_config, hlld_set **set) {
+    hlld_set *s = *set = alloc_set(config, set_name);
+
+    // Use the provided config, skips reading the config on access.
+    // The settings it does not track are read on the first fault.
+    if (set_config) {
+        memcpy(&s->set_config, set_config, sizeof(hlld_set_config));
+        s->is_loaded = 1;
+        s->needs_disk_config = 1;
+    }
+    return 0;
+}
+
 /**
  * Destroys a set
  * @arg set The set to destroy
@@ -138,6 +239,65 @@ set_counters* hset_counters(hlld_set *set) {
     return &set->counters;
 }
 
+/**
+ * Records a client access to the set
+ * @note Thread safe.
+ * @arg set The set
+ */
+void hset_touch(hlld_set *set) {
+    __atomic_store_n(&set->counters.last_access, (uint64_t)time(NULL), __ATOMIC_RELAXED);
+}
+
+/**
+ * Gets the moving averages of the sets and the
+ * register updates per second, as of now.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg set_rate Output. Sets per second.
+ * @arg update_rate Output. Updates per second.
+ */
+void hset_rates(hlld_set *set, double *set_rate, double *update_rate) {
+    LOCK_HLLD_SPIN(&set->hll_update);
+    fold_rates(&set->counters, time(NULL), set_rate, update_rate);
+    UNLOCK_HLLD_SPIN(&set->hll_update);
+}
+
+/**
+ * Gets the configuration of a set, loading it
+ * from disk if it has not been read yet.
+ * @notes Thread safe.
+ * @arg set The set
+ * @return A reference to the set configuration
+ */
+hlld_set_config* hset_config(hlld_set *set) {
+    thread_safe_load(set);
+    return &set->set_config;
+}
+
+/**
+ * Copies the configuration of a set, if it has already
+ * been read. Unlike hset_config, this never reads the
+ * config from disk, so it is cheap for unloaded sets.
+ * @notes Thread safe.
+ * @arg set The set
+ * @arg out Output. The set configuration
+ * @return 0 on success, -1 if the config has not been read.
+ */
+int hset_copy_config(hlld_set *set, hlld_set_config *out) {
+    // The config is loaded and refreshed under the fault lock,
+    // and flushes update it under the update lock
+    int res = -1;
+    pthread_mutex_lock(&set->hll_lock);
+    if (set->is_loaded) {
+        LOCK_HLLD_SPIN(&set->hll_update);
+        memcpy(out, &set->set_config, sizeof(hlld_set_config));
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+        res = 0;
+    }
+    pthread_mutex_unlock(&set->hll_lock);
+    return res;
+}
+
 /**
  * Checks if a set is currectly mapped into
  * memory or if it is proxied.
@@ -148,6 +308,77 @@ int hset_is_proxied(hlld_set *set) {
     return set->is_proxied;
 }
 
+/**
+ * Faults the set into memory if it is proxied. Windowed
+ * sets also fault in the window that adds go to.
+ * Adds do this implicitly, but this allows the
+ * disk access to be done ahead of time.
+ * @notes Thread safe.
+ * @arg set The set to fault in
+ * @return 0 on success.
+ */
+int hset_fault(hlld_set *set) {
+    if (set->is_proxied) {
+        int res = thread_safe_fault(set);
+        if (res) return res;
+    }
+    if (!set->set_config.window) return 0;
+
+    // Windowed sets add to their current window
+    hlld_set *w = take_current_window(set);
+    if (!w) return -1;
+    int res = fault_window(set, w);
+    release_window(set, w);
+    return res;
+}
+
+/**
+ * Checks if adding to a set would fault in registers.
+ * This is the case for proxied sets, and for windowed
+ * sets whose current window is not in memory.
+ * @notes Thread safe.
+ * @return 1 if a fault is needed, 0 otherwise.
+ */
+int hset_needs_fault(hlld_set *set) {
+    if (set->is_proxied) return 1;
+    if (!set->set_config.window) return 0;
+
+    uint64_t now = time(NULL);
+    uint64_t start = now - now % set->set_config.window;
+    pthread_mutex_lock(&set->window_lock);
+    int num = set->num_windows;
+    int needs = !num || set->windows[num-1].start < start ||
+                set->windows[num-1].set->is_proxied;
+    pthread_mutex_unlock(&set->window_lock);
+    return needs;
+}
+
+/**
+ * Faults the set into memory if it is proxied, and
+ * makes sure the registers are resident, so that
+ * the next access does not wait on the disk.
+ * @notes Thread safe.
+ * @arg set The set to warm
+ * @return 0 on success.
+ */
+int hset_warm(hlld_set *set) {
+    int res = hset_fault(set);
+    if (res) return res;
+    if (!set->set_config.window) {
+        bitmap_prefault(&set->bm);
+        return 0;
+    }
+
+    // Warm every window that is kept
+    hlld_set **windows;
+    int num = take_windows(set, 0, &windows);
+    for (int i=0; i < num; i++) {
+        if (!fault_window(set, windows[i])) bitmap_prefault(&windows[i]->bm);
+    }
+    release_windows(set, windows, num);
+    return 0;
+}
+
 /**
  * Flushes the set. Idempotent if the
  * set is proxied or not dirty.
@@ -159,39 +390,102 @@ int hset_flush(hlld_set *set) {
     if (set->is_proxied)
         return 0;
 
-    // Time how long this takes
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
-
-    // If we are not dirty, nothing to do
-    if (!set->is_dirty)
+    // If we are not dirty, nothing to do. Windowed
+    // sets check each of their windows.
+    if (!set->is_dirty && !set->set_config.window)
         return 0;
 
+    // Time how long this takes, on a clock that never steps
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int res;
+    if (set->set_config.window)
+        res = flush_windows(set);
+    else if (set->set_config.sliding)
+        res = flush_sliding(set);
+    else
+        res = flush_registers(set);
+
+    // Compute the elapsed time
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t usec = (end.tv_sec - start.tv_sec) * 1000000 +
+        (end.tv_nsec - start.tv_nsec) / 1000;
+    __atomic_store_n(&set->counters.last_flush, (uint64_t)time(NULL), __ATOMIC_RELAXED);
+    __atomic_store_n(&set->counters.flush_usec, usec, __ATOMIC_RELAXED);
+    syslog(LOG_DEBUG, "Flushed set '%s'. Total time: %d msec.",
+            set->set_name, (int)(usec / 1000));
+    return res;
+}
+
+/**
+ * Flushes the registers of a plain set, followed by its config.
+ */
+static int flush_registers(hlld_set *set) {
     // Store our properties for a future unmap
-    set->set_config.size = hset_size(set);
+    uint64_t size = hset_size(set);
+    LOCK_HLLD_SPIN(&set->hll_update);
+    set->set_config.size = size;
+    UNLOCK_HLLD_SPIN(&set->hll_update);
 
-    // Write out set_config
-    char *config_name = join_path(set->full_path, (char*)CONFIG_FILENAME);
-    int res = update_filename_from_set_config(config_name, &set->set_config);
-    free(config_name);
-    if (res) {
-        syslog(LOG_ERR, "Failed to write set '%s' configuration. Err: %d.",
-                set->set_name, res);
-    }
+    // Everything logged so far has been applied and is covered by this flush
+    pthread_mutex_lock(&set->wal_lock);
+    uint64_t wal_offset = set->wal_end;
+    pthread_mutex_unlock(&set->wal_lock);
 
     // Turn dirty off
     set->is_dirty = 0;
 
-    // Flush the set
-    res = 0;
+    // Checksummed registers are flushed from a copy, so the
+    // checksum of what is written is known before the write.
+    if (!set->set_config.in_memory && set->bm.mode == PERSISTENT)
+        return flush_checksummed(set, wal_offset);
+
+    int res = 0;
     if (!set->set_config.in_memory) {
         res = bitmap_flush(&set->bm);
     }
 
-    // Compute the elapsed time
-    gettimeofday(&end, NULL);
-    syslog(LOG_DEBUG, "Flushed set '%s'. Total time: %d msec.",
-            set->set_name, timediff_msec(&start, &end));
+    // Write out set_config
+    write_config(set);
+    return res;
+}
+
+/**
+ * Flushes PERSISTENT registers. The checksum of the new
+ * registers is recorded as pending before they are written,
+ * so a crash at any point leaves registers that match either
+ * the prior or the pending checksum, unless the write was
+ * torn. The hash log is only truncated, and the backup
+ * taken, once the registers are on disk.
+ */
+static int flush_checksummed(hlld_set *set, uint64_t wal_offset) {
+    unsigned char *copy = malloc(set->bm.size);
+    memcpy(copy, set->bm.mmap, set->bm.size);
+    uint32_t checksum = crc32c(0, copy, set->bm.size);
+
+    LOCK_HLLD_SPIN(&set->hll_update);
+    set->set_config.has_pending = 1;
+    set->set_config.pending_checksum = checksum;
+    UNLOCK_HLLD_SPIN(&set->hll_update);
+    int res = write_config(set);
+    if (!res) res = bitmap_flush_copy(&set->bm, copy, checksum);
+
+    // On failure, keep the prior checksum so the torn
+    // file is detected when it is next faulted in
+    if (res) {
+        set->is_dirty = 1;
+    } else {
+        LOCK_HLLD_SPIN(&set->hll_update);
+        set->set_config.has_checksum = 1;
+        set->set_config.checksum = checksum;
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+        truncate_wal(set, wal_offset);
+        if (set->config->corrupt_mode == CORRUPT_REPAIR) {
+            write_backup(set, copy, checksum);
+        }
+    }
+    free(copy);
     return res;
 }
 
@@ -205,9 +499,29 @@ int hset_close(hlld_set *set) {
     pthread_mutex_lock(&set->hll_lock);
 
     // Only act if we are non-proxied
-    if (!set->is_proxied) {
+    if (!set->is_proxied && set->set_config.window) {
+        // Windows account for their own registers
         hset_flush(set);
+        close_windows(set);
+        set->is_proxied = 1;
+        set->counters.page_outs += 1;
+
+    } else if (!set->is_proxied && set->set_config.sliding) {
+        count_resident(set, 0);
+        hset_flush(set);
+        shll_destroy(&set->shll);
+        set->is_proxied = 1;
+        set->counters.page_outs += 1;
+
+    } else if (!set->is_proxied) {
+        count_resident(set, 0);
+        hset_flush(set);
+        close_wal(set);
+        if (set->config->compress_cold && set->bm.mode == PERSISTENT) {
+            compress_registers(set);
+        }
         hll_destroy(&set->hll);
+        set->size_cached = 0;
         set->is_proxied = 1;
         set->counters.page_outs += 1;
     }
@@ -226,6 +540,11 @@ int hset_delete(hlld_set *set) {
     // Close first
     hset_close(set);
 
+    // Delete the windows, since they are folders of their own
+    if (hset_config(set)->window) {
+        delete_windows(set);
+    }
+
     // Delete the files
     struct dirent **namelist = NULL;
     int num;
@@ -265,70 +584,488 @@ int hset_delete(hlld_set *set) {
  * @return 0 on success.
  */
 int hset_add(hlld_set *set, char *key) {
+    return hset_add_keys(set, &key, 1);
+}
+
+/**
+ * Adds a batch of keys to the given set. If the hash
+ * log is in use, the hashes are logged before returning.
+ * @arg set The set to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @return 0 on success.
+ */
+int hset_add_keys(hlld_set *set, char **keys, int num_keys) {
+    return hset_add_keys_at(set, keys, num_keys, 0);
+}
+
+/**
+ * Adds a batch of keys to the given set, as seen at a
+ * given time. Only sliding sets take a time.
+ * @arg set The set to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg at When the keys were seen in seconds, 0 for now.
+ * Times are stored in 32 bits, so later times are rejected.
+ * @return 0 on success, -1 on error, -2 if a time is
+ * given and the set is not sliding.
+ */
+int hset_add_keys_at(hlld_set *set, char **keys, int num_keys, uint64_t at) {
+    if (at > UINT32_MAX) return -1;
+    if (at && !hset_config(set)->sliding) return -2;
+    uint64_t updated = 0;
+    return add_keys(set, keys, num_keys, at, &updated);
+}
+
+/**
+ * Adds a batch of keys to the given set, counting
+ * the keys that increased a register.
+ */
+static int add_keys(hlld_set *set, char **keys, int num_keys, uint64_t at, uint64_t *updated) {
     if (set->is_proxied) {
         if (thread_safe_fault(set) != 0) return -1;
     }
+    if (set->set_config.window) {
+        return add_window_keys(set, keys, num_keys);
+    }
 
-    // Compute the hash value of the key. We do this
-    // so that we can use the hll_add_hash instead of
-    // hll_add. This way, the expensive CPU bit can
-    // be done without holding a lock
+    uint64_t hashes[ADD_BATCH_SIZE];
     uint64_t out[2];
-    MurmurHash3_x64_128(key, strlen(key), 0, &out);
+    int res = 0;
+    uint64_t now = time(NULL);
+    uint64_t seen = (at) ? at : now;
+    for (int i=0; i < num_keys && !res; i += ADD_BATCH_SIZE) {
+        int num = num_keys - i;
+        if (num > ADD_BATCH_SIZE) num = ADD_BATCH_SIZE;
+
+        // Compute the hash value of the keys. We do this
+        // so that we can use the hll_add_hash instead of
+        // hll_add. This way, the expensive CPU bit can
+        // be done without holding a lock
+        for (int j=0; j < num; j++) {
+            MurmurHash3_x64_128(keys[i+j], strlen(keys[i+j]), 0, &out);
+            hashes[j] = out[1];
+        }
 
-    // Add the hashed value and update the
-    // counters
-    LOCK_HLLD_SPIN(&set->hll_update);
-    hll_add_hash(&set->hll, out[1]);
-    set->counters.sets += 1;
-    UNLOCK_HLLD_SPIN(&set->hll_update);
+        // Add the hashed values, counting the registers updated
+        uint64_t batch_updated = 0;
+        LOCK_HLLD_SPIN(&set->hll_update);
+        update_rates(&set->counters, now);
+        if (set->set_config.sliding) {
+            for (int j=0; j < num; j++) {
+                int added = shll_add_hash(&set->shll, hashes[j], seen);
+                if (added < 0) {
+                    res = -1;
+                    break;
+                }
+                batch_updated += added;
+            }
+        } else {
+            for (int j=0; j < num; j++) {
+                batch_updated += hll_add_hash(&set->hll, hashes[j]);
+            }
+        }
+        set->hll_version++;
+        UNLOCK_HLLD_SPIN(&set->hll_update);
 
-    // Mark as dirty
-    set->is_dirty = 1;
-    return 0;
+        // Update the counters without holding the lock
+        __atomic_add_fetch(&set->counters.sets, num, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&set->counters.updates, batch_updated, __ATOMIC_RELAXED);
+        *updated += batch_updated;
+
+        // Mark as dirty
+        set->is_dirty = 1;
+
+        // Log the hashes after they are applied, so that a
+        // flush never truncates hashes it did not include
+        if (set->wal_fd != -1 && append_wal(set, hashes, num)) {
+            res = -1;
+        }
+    }
+    return res;
 }
 
 /**
- * Gets the size of the set
+ * Gets the size of the set. The estimate is cached
+ * until the next update, since computing it requires
+ * a pass over every register.
  * @note Thread safe.
  * @arg set The set to check
  * @return The estimated size of the set
  */
 uint64_t hset_size(hlld_set *set) {
-    if (!set->is_proxied) {
-        return hll_size(&set->hll);
-    } else {
-        return set->set_config.size;
+    if (set->is_proxied) {
+        return hset_config(set)->size;
+    }
+
+    // Windowed sets merge every window that is kept. The estimate
+    // is not cached, since windows expire without any update.
+    if (set->set_config.window) {
+        return merge_windows(set, oldest_window(set));
+    }
+    if (set->set_config.sliding) {
+        return sliding_size(set, set->set_config.sliding);
+    }
+
+    // Check for a cached estimate
+    LOCK_HLLD_SPIN(&set->hll_update);
+    uint64_t version = set->hll_version;
+    if (set->size_cached && set->size_version == version) {
+        uint64_t est = set->cached_size;
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+        return est;
+    }
+    UNLOCK_HLLD_SPIN(&set->hll_update);
+
+    // Compute without the lock, and only cache the
+    // result if no updates raced with us
+    uint64_t est = estimate(set, &set->hll);
+    LOCK_HLLD_SPIN(&set->hll_update);
+    if (set->hll_version == version) {
+        set->cached_size = est;
+        set->size_version = version;
+        set->size_cached = 1;
     }
+    UNLOCK_HLLD_SPIN(&set->hll_update);
+    return est;
 }
 
 /**
- * Gets the byte size of the set
+ * Gets the size of the set without computing an estimate.
+ * This is the cached estimate if it is current, otherwise
+ * the size stored by the last flush.
  * @note Thread safe.
- * @arg set The set
- * @return The total byte size of the set
+ * @arg set The set to check
+ * @return The last known size of the set
  */
-uint64_t hset_byte_size(hlld_set *set) {
-    if (set->bm.size)
-        return set->bm.size;
-    return hll_bytes_for_precision(set->set_config.default_precision);
+uint64_t hset_cached_size(hlld_set *set) {
+    uint64_t est = hset_config(set)->size;
+    LOCK_HLLD_SPIN(&set->hll_update);
+    if (!set->is_proxied && set->size_cached && set->size_version == set->hll_version) {
+        est = set->cached_size;
+    }
+    UNLOCK_HLLD_SPIN(&set->hll_update);
+    return est;
 }
 
 /**
- * Provides a thread safe faulting of the set.
+ * Gets the size of the windows of a set that overlap
+ * the most recent period. The windows are merged, so
+ * keys seen in many windows are only counted once.
+ * Sets that are not windowed return their full size.
+ * @note Thread safe.
+ * @arg set The set to check
+ * @arg last The period to count, in seconds
+ * @return The estimated size of the period
  */
-static int thread_safe_fault(hlld_set *s) {
-    // Acquire lock
+uint64_t hset_size_last(hlld_set *set, uint64_t last) {
+    hlld_set_config *config = hset_config(set);
+    if (!config->window && !config->sliding) {
+        return hset_size(set);
+    }
+    if (set->is_proxied && thread_safe_fault(set)) {
+        return 0;
+    }
+    if (config->sliding) {
+        return sliding_size(set, (last < config->sliding) ? last : config->sliding);
+    }
+
+    // Never count windows that have expired
+    uint64_t now = time(NULL);
+    uint64_t since = (now > last) ? now - last : 0;
+    uint64_t oldest = oldest_window(set);
+    return merge_windows(set, (since > oldest) ? since : oldest);
+}
+
+/**
+ * Converts the registers of a closed set to another
+ * layout. Windowed and sliding sets cannot be converted.
+ * @note Thread safe.
+ * @arg set The set to convert
+ * @arg layout The new hll_layout of the registers
+ * @return 0 on success, -1 if the set cannot be converted,
+ * -2 if the set is not proxied, negative on other errors.
+ */
+int hset_convert(hlld_set *set, int layout) {
     int res = 0;
     char *bitmap_path = NULL;
-    pthread_mutex_lock(&s->hll_lock);
+    unsigned char *buf = NULL;
+    hll_t converted;
+    converted.registers = NULL;
+    converted.bm = NULL;
 
-    // Bail if we already faulted in
-    if (!s->is_proxied)
-        goto LEAVE;
+    // Hold the lock so the set is not faulted in while converting
+    pthread_mutex_lock(&set->hll_lock);
+    if (!set->is_proxied) {
+        res = -2;
+        goto LEAVE;
+    }
+    if (!set->is_loaded && (res = load_set(set)))
+        goto LEAVE;
+
+    hlld_set_config *config = &set->set_config;
+    if (config->window || config->sliding) {
+        res = -1;
+        goto LEAVE;
+    }
+    refresh_disk_config(set);
+    if (config->layout == layout) goto LEAVE;
+
+    // In-memory sets have no registers once closed
+    if (config->in_memory) {
+        config->layout = layout;
+        goto LEAVE;
+    }
+
+    // Read the registers in, if the set was ever flushed
+    bitmap_path = join_path(set->full_path, (char*)DATA_FILE_NAME);
+    if ((res = inflate_registers(set, bitmap_path)))
+        goto LEAVE;
+    uint64_t size = hll_bytes_for_layout(config->default_precision, config->layout);
+    FILE *f = fopen(bitmap_path, "r");
+    if (f) {
+        buf = malloc(size);
+        int read_ok = (fread(buf, size, 1, f) == 1 && fgetc(f) == EOF);
+        fclose(f);
+        if (!read_ok) {
+            syslog(LOG_ERR, "Unexpected register file size for set '%s'.", set->set_name);
+            res = -EINVAL;
+            goto LEAVE;
+        }
+
+        // Never convert torn registers, they can be repaired on fault
+        uint32_t checksum = crc32c(0, buf, size);
+        int checksummed = config->has_checksum || config->has_pending;
+        if (checksummed && !matches_checksum(config, checksum)) {
+            syslog(LOG_ERR, "Refusing to convert set '%s' with corrupt registers.", set->set_name);
+            res = -EIO;
+            goto LEAVE;
+        }
+
+        hll_t current;
+        hll_init_from_registers(config->default_precision, config->layout, (uint32_t*)buf, &current);
+        if (hll_convert(&current, layout, &converted)) {
+            res = -ENOMEM;
+            goto LEAVE;
+        }
+        size = hll_bytes_for_layout(config->default_precision, layout);
+        if ((res = write_file(bitmap_path, (unsigned char*)converted.registers, size))) {
+            syslog(LOG_ERR, "Failed to write converted registers for set '%s'. Err: %d",
+                    set->set_name, res);
+            goto LEAVE;
+        }
+        if (checksummed) {
+            config->has_checksum = 1;
+            config->checksum = crc32c(0, converted.registers, size);
+            config->has_pending = 0;
+        }
+
+        // The backup is of the old layout
+        char *backup_path = join_path(set->full_path, (char*)BACKUP_FILE_NAME);
+        unlink(backup_path);
+        free(backup_path);
+    }
+
+    config->layout = layout;
+    set->bm.size = 0;
+    res = write_config(set);
+
+LEAVE:
+    pthread_mutex_unlock(&set->hll_lock);
+    hll_destroy(&converted);
+    if (buf) free(buf);
+    if (bitmap_path) free(bitmap_path);
+    return res;
+}
+
+/**
+ * Merges the registers of the set into an HLL of the
+ * same precision, keeping the larger of each register.
+ * Windowed sets merge every window that is kept, and
+ * sliding sets merge their longest window.
+ * @note Thread safe.
+ * @arg set The set to merge
+ * @arg h The hll to merge into
+ * @return 0 on success, -1 if the precision differs
+ * or the set could not be faulted in.
+ */
+int hset_merge_into(hlld_set *set, hll_t *h) {
+    if (set->is_proxied && thread_safe_fault(set)) {
+        return -1;
+    }
+    hlld_set_config *config = hset_config(set);
+    if (config->default_precision != h->precision) {
+        return -1;
+    }
+
+    if (config->window) {
+        merge_window_registers(set, oldest_window(set), h);
+    } else if (config->sliding) {
+        hll_t w;
+        LOCK_HLLD_SPIN(&set->hll_update);
+        int res = shll_window(&set->shll, time(NULL), config->sliding, &w);
+        UNLOCK_HLLD_SPIN(&set->hll_update);
+        if (res) return -1;
+        hll_merge(h, &w);
+        hll_destroy(&w);
+    } else {
+        hll_merge(h, &set->hll);
+    }
+    return 0;
+}
+
+/**
+ * Gets the byte size of the set. For windowed
+ * sets, this is the size of the mapped windows.
+ * @note Thread safe.
+ * @arg set The set
+ * @return The total byte size of the set
+ */
+uint64_t hset_byte_size(hlld_set *set) {
+    if (hset_config(set)->window) {
+        uint64_t bytes = 0;
+        pthread_mutex_lock(&set->window_lock);
+        for (int i=0; i < set->num_windows; i++) {
+            hlld_set *w = set->windows[i].set;
+            if (!w->is_proxied) bytes += w->bm.size;
+        }
+        pthread_mutex_unlock(&set->window_lock);
+        return bytes;
+    }
+    if (set->bm.size)
+        return set->bm.size;
+    hlld_set_config *config = hset_config(set);
+    return hll_bytes_for_layout(config->default_precision, config->layout);
+}
+
+/**
+ * Allocates a new set and sets up the fields that
+ * do not require any disk access.
+ */
+static hlld_set* alloc_set(hlld_config *config, char *set_name) {
+    // Allocate the buffers
+    hlld_set *s = calloc(1, sizeof(hlld_set));
+
+    // Initialize
+    s->is_dirty = 1;
+    s->is_proxied = 1;
+
+    // Store the things
+    s->config = config;
+    s->set_name = strdup(set_name);
+
+    // Copy set configs
+    s->set_config.default_eps = config->default_eps;
+    s->set_config.default_precision = config->default_precision;
+    s->set_config.in_memory = config->in_memory;
+    s->set_config.window = config->window;
+    s->set_config.retain = config->retain;
+    s->set_config.sliding = config->sliding;
+    s->set_config.layout = config->layout;
+
+    // Get the folder name
+    char *folder_name = NULL;
+    int res;
+    res = asprintf(&folder_name, SET_FOLDER_NAME, s->set_name);
+    assert(res != -1);
+
+    // Compute the full path
+    s->full_path = join_path(config->data_dir, folder_name);
+    free(folder_name);
+
+    // Initialize the locks
+    INIT_HLLD_SPIN(&s->hll_update);
+    pthread_mutex_init(&s->hll_lock, NULL);
+    pthread_mutex_init(&s->wal_lock, NULL);
+    pthread_mutex_init(&s->wal_sync_lock, NULL);
+    pthread_mutex_init(&s->window_lock, NULL);
+    s->wal_fd = -1;
+    return s;
+}
+
+/**
+ * Creates the set folder if needed and reads in
+ * the set config. Not thread safe.
+ */
+static int load_set(hlld_set *s) {
+    // Try to create the folder path
+    int res = mkdir(s->full_path, 0755);
+    if (res && errno != EEXIST) {
+        syslog(LOG_ERR, "Failed to create set directory '%s'. Err: %d [%d]", s->full_path, res, errno);
+        return res;
+    }
+
+    // Read in the set_config. Configs written before
+    // layouts existed do not have one, and are packed.
+    int layout = s->set_config.layout;
+    s->set_config.layout = HLL_LAYOUT_PACKED;
+    char *config_name = join_path(s->full_path, (char*)CONFIG_FILENAME);
+    res = set_config_from_filename(config_name, &s->set_config);
+    free(config_name);
+    if (res == -ENOENT) s->set_config.layout = layout;
+    if (res && res != -ENOENT) {
+        syslog(LOG_ERR, "Failed to read set '%s' configuration. Err: %d [%d]", s->set_name, res, errno);
+        return res;
+    }
+
+    s->is_loaded = 1;
+    return 0;
+}
+
+/**
+ * Provides a thread safe loading of the set config.
+ */
+static int thread_safe_load(hlld_set *s) {
+    // Fast path, already loaded
+    if (s->is_loaded) return 0;
+
+    // Load under the lock
+    int res = 0;
+    pthread_mutex_lock(&s->hll_lock);
+    if (!s->is_loaded) res = load_set(s);
+    pthread_mutex_unlock(&s->hll_lock);
+    return res;
+}
+
+/**
+ * Provides a thread safe faulting of the set.
+ */
+static int thread_safe_fault(hlld_set *s) {
+    // Acquire lock
+    int res = 0;
+    char *bitmap_path = NULL;
+    pthread_mutex_lock(&s->hll_lock);
+
+    // Bail if we already faulted in
+    if (!s->is_proxied)
+        goto LEAVE;
+
+    // Read the set config if this set was lazily discovered
+    if (!s->is_loaded && (res = load_set(s)))
+        goto LEAVE;
+    refresh_disk_config(s);
+
+    // Windowed sets only need their windows discovered,
+    // the windows are faulted in as they are used
+    if (s->set_config.window) {
+        if ((res = discover_windows(s)))
+            goto LEAVE;
+        s->is_proxied = 0;
+        s->counters.page_ins += 1;
+        goto LEAVE;
+    }
+
+    // Sliding sets are read into memory
+    if (s->set_config.sliding) {
+        if ((res = load_sliding(s)))
+            goto LEAVE;
+        s->is_proxied = 0;
+        count_resident(s, 1);
+        goto LEAVE;
+    }
 
     // Determine the expected size
-    uint64_t size = hll_bytes_for_precision(s->set_config.default_precision);
+    uint64_t size = hll_bytes_for_layout(s->set_config.default_precision, s->set_config.layout);
 
     // Get the mode for our bitmap
     bitmap_mode mode;
@@ -349,6 +1086,10 @@ static int thread_safe_fault(hlld_set *s) {
     // Get the full path to the bitmap
     bitmap_path = join_path(s->full_path, (char*)DATA_FILE_NAME);
 
+    // Expand the register file if the set was compressed
+    if ((res = inflate_registers(s, bitmap_path)))
+        goto LEAVE;
+
     // Check if the register file exists
     struct stat buf;
     res = stat(bitmap_path, &buf);
@@ -362,6 +1103,10 @@ static int thread_safe_fault(hlld_set *s) {
             goto LEAVE;
         }
 
+        // Detect any torn writes
+        res = verify_registers(s, bitmap_path, mode);
+        if (res) goto LEAVE;
+
         // Increase our page ins
         s->counters.page_ins += 1;
 
@@ -383,13 +1128,29 @@ static int thread_safe_fault(hlld_set *s) {
 CREATE_HLL:
     // Create the HLL
     res = hll_init_from_bitmap(s->set_config.default_precision,
-                &s->bm, &s->hll);
+                s->set_config.layout, &s->bm, &s->hll);
 
-    // Disable proxied
-    if (!res)
-        s->is_proxied = 0;
-    else
+    if (res) {
         syslog(LOG_ERR, "Failed to create HLL! Res: %d", res);
+        goto LEAVE;
+    }
+
+    // Merge in the backup once the registers are usable
+    if (s->needs_repair) {
+        repair_registers(s);
+        s->needs_repair = 0;
+    }
+
+    // Replay any hashes logged since the last flush. The set is
+    // still usable without the log, the adds are just not logged.
+    if (mode == PERSISTENT && s->config->use_wal && open_wal(s)) {
+        syslog(LOG_WARNING, "Adds to set '%s' will not be logged until it is reopened.",
+                s->set_name);
+    }
+
+    // Disable proxied
+    s->is_proxied = 0;
+    count_resident(s, 1);
 
 LEAVE:
     // Release lock
@@ -400,6 +1161,1120 @@ LEAVE:
     return res;
 }
 
+/**
+ * Verifies the register file against the checksums recorded by
+ * the last flush. Only PERSISTENT bitmaps are checksummed, since
+ * the kernel writes SHARED pages back at any time. On a mismatch,
+ * the configured corrupt action is taken.
+ * @return 0 if the bitmap can be used, negative if the set should fail.
+ */
+static int verify_registers(hlld_set *s, char *bitmap_path, bitmap_mode mode) {
+    if (mode != PERSISTENT) return 0;
+
+    // Sets flushed without a checksum cannot be verified
+    hlld_set_config *config = &s->set_config;
+    if (!config->has_checksum && !config->has_pending) return 0;
+
+    // The registers are either from before or after the last flush
+    if (matches_checksum(config, s->bm.checksum)) {
+        config->has_checksum = 1;
+        config->checksum = s->bm.checksum;
+        config->has_pending = 0;
+        return 0;
+    }
+
+    syslog(LOG_ERR, "Checksum mismatch for set '%s' registers! Expected: %u Found: %u",
+            s->set_name, config->checksum, s->bm.checksum);
+    switch (s->config->corrupt_mode) {
+        case CORRUPT_REPAIR:
+            // Repaired once the HLL is created
+            s->needs_repair = 1;
+            return 0;
+
+        case CORRUPT_QUARANTINE:
+            return quarantine_registers(s, bitmap_path, mode);
+
+        case CORRUPT_FAIL:
+        default:
+            syslog(LOG_ERR, "Refusing to load set '%s' with corrupt registers.", s->set_name);
+            bitmap_close(&s->bm);
+            return -EIO;
+    }
+}
+
+/**
+ * Checks a checksum against the set config. A flush that
+ * did not finish may leave either the prior registers, or
+ * the registers it was writing.
+ * @return 1 if the checksum matches.
+ */
+static int matches_checksum(hlld_set_config *config, uint32_t checksum) {
+    return (config->has_checksum && config->checksum == checksum) ||
+           (config->has_pending && config->pending_checksum == checksum);
+}
+
+/**
+ * Writes a backup of flushed registers. The backup is the
+ * registers followed by their CRC32C. It is not synced, since
+ * the CRC32C is verified before the backup is used.
+ */
+static void write_backup(hlld_set *s, unsigned char *registers, uint32_t checksum) {
+    char *backup_path = join_path(s->full_path, (char*)BACKUP_FILE_NAME);
+    char *tmp_path = NULL;
+
+    // Write to a temporary file, then rename over
+    if (asprintf(&tmp_path, "%s.tmp", backup_path) == -1) {
+        tmp_path = NULL;
+        goto LEAVE;
+    }
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        syslog(LOG_WARNING, "Failed to open backup for set '%s'. %s", s->set_name, strerror(errno));
+        goto LEAVE;
+    }
+    int ok = fwrite(registers, s->bm.size, 1, f) == 1 &&
+             fwrite(&checksum, sizeof(checksum), 1, f) == 1;
+    if (fclose(f) || !ok || rename(tmp_path, backup_path)) {
+        syslog(LOG_WARNING, "Failed to write backup for set '%s'. %s", s->set_name, strerror(errno));
+        unlink(tmp_path);
+    }
+
+LEAVE:
+    if (tmp_path) free(tmp_path);
+    free(backup_path);
+}
+
+/**
+ * Repairs torn registers by merging in the backup. Since
+ * registers only ever increase, the max of the torn file and
+ * the last good backup does not lose any acknowledged data
+ * that made it to either.
+ * @return 0 on success, negative if there is no usable backup.
+ */
+static int repair_registers(hlld_set *s) {
+    char *backup_path = join_path(s->full_path, (char*)BACKUP_FILE_NAME);
+    uint64_t len = s->bm.size + sizeof(uint32_t);
+    unsigned char *buf = malloc(len);
+    int res = -1;
+
+    // Read and verify the backup
+    FILE *f = fopen(backup_path, "r");
+    if (f) {
+        uint32_t checksum;
+        if (fread(buf, len, 1, f) == 1 && fgetc(f) == EOF) {
+            memcpy(&checksum, buf + s->bm.size, sizeof(checksum));
+            if (crc32c(0, buf, s->bm.size) == checksum) res = 0;
+        }
+        fclose(f);
+    }
+
+    if (res) {
+        syslog(LOG_WARNING, "No valid backup for set '%s', using registers as is.", s->set_name);
+    } else {
+        hll_t backup;
+        hll_init_from_registers(s->hll.precision, s->hll.layout, (uint32_t*)buf, &backup);
+        hll_merge(&s->hll, &backup);
+        syslog(LOG_WARNING, "Repaired set '%s' registers from backup.", s->set_name);
+    }
+
+    // Force a flush to record a new checksum
+    s->is_dirty = 1;
+    free(buf);
+    free(backup_path);
+    return res;
+}
+
+/**
+ * Moves a corrupt register file aside, and replaces
+ * the bitmap with a new empty one.
+ * @return 0 on success, negative on error.
+ */
+static int quarantine_registers(hlld_set *s, char *bitmap_path, bitmap_mode mode) {
+    uint64_t size = s->bm.size;
+    char *quarantine_path = join_path(s->full_path, (char*)QUARANTINE_FILE_NAME);
+    int res = rename(bitmap_path, quarantine_path);
+    if (res) {
+        res = -errno;
+        syslog(LOG_ERR, "Failed to quarantine '%s'. %s", bitmap_path, strerror(errno));
+        bitmap_close(&s->bm);
+        free(quarantine_path);
+        return res;
+    }
+    syslog(LOG_ERR, "Quarantined corrupt registers of set '%s' to '%s'",
+            s->set_name, quarantine_path);
+    free(quarantine_path);
+
+    // Start over with an empty bitmap
+    bitmap_close(&s->bm);
+    res = bitmap_from_filename(bitmap_path, size, 1, mode, &s->bm);
+    if (res) {
+        syslog(LOG_ERR, "Failed to create bitmap: %s. %s", bitmap_path, strerror(errno));
+    }
+    s->is_dirty = 1;
+    return res;
+}
+
+/**
+ * Opens the hash log, replaying any hashes that were
+ * logged but not flushed. Replay is idempotent, since
+ * adding a hash twice does not change the registers.
+ * Must be called with the HLL created.
+ * @return 0 on success, negative on error.
+ */
+static int open_wal(hlld_set *s) {
+    char *wal_path = join_path(s->full_path, (char*)WAL_FILE_NAME);
+    int fh = open(wal_path, O_CREAT|O_RDWR|O_APPEND, 0644);
+    if (fh == -1) {
+        syslog(LOG_ERR, "Failed to open hash log '%s'. %s", wal_path, strerror(errno));
+        free(wal_path);
+        return -errno;
+    }
+    free(wal_path);
+
+    struct stat buf;
+    if (fstat(fh, &buf)) {
+        int res = -errno;
+        syslog(LOG_ERR, "Failed to stat hash log for set '%s'. %s", s->set_name, strerror(errno));
+        close(fh);
+        return res;
+    }
+
+    // Read in the existing log
+    uint64_t len = buf.st_size;
+    uint64_t *hashes = NULL;
+    uint64_t total = 0;
+    if (len) {
+        hashes = malloc(len);
+        ssize_t more;
+        while (total < len) {
+            more = pread(fh, ((char*)hashes)+total, len-total, total);
+            if (more == -1 && errno == EINTR) continue;
+            if (more <= 0) break;
+            total += more;
+        }
+    }
+
+    // Drop any partially written record
+    uint64_t num = total / sizeof(uint64_t);
+    if (num * sizeof(uint64_t) != len && ftruncate(fh, num * sizeof(uint64_t))) {
+        syslog(LOG_ERR, "Failed to truncate hash log for set '%s'. %s", s->set_name, strerror(errno));
+    }
+
+    // Replay, the set must be flushed to drop the log
+    if (num) {
+        for (uint64_t i=0; i < num; i++) {
+            hll_add_hash(&s->hll, hashes[i]);
+        }
+        s->is_dirty = 1;
+        syslog(LOG_INFO, "Replayed %llu hashes for set '%s'",
+                (unsigned long long)num, s->set_name);
+    }
+    if (hashes) free(hashes);
+
+    pthread_mutex_lock(&s->wal_sync_lock);
+    pthread_mutex_lock(&s->wal_lock);
+    s->wal_fd = fh;
+    s->wal_start = 0;
+    s->wal_end = s->wal_synced = num * sizeof(uint64_t);
+    pthread_mutex_unlock(&s->wal_lock);
+    pthread_mutex_unlock(&s->wal_sync_lock);
+    return 0;
+}
+
+/**
+ * Appends hashes to the hash log with a single write.
+ * If wal_sync is set, the log is synced before returning.
+ * @return 0 on success, -1 on error.
+ */
+static int append_wal(hlld_set *s, uint64_t *hashes, int num) {
+    uint64_t len = num * sizeof(uint64_t);
+    uint64_t written = 0;
+    ssize_t more;
+    int res = 0;
+
+    pthread_mutex_lock(&s->wal_lock);
+    while (s->wal_fd != -1 && written < len) {
+        more = write(s->wal_fd, ((char*)hashes)+written, len-written);
+        if (more == -1 && errno == EINTR) continue;
+        if (more == -1) {
+            syslog(LOG_ERR, "Failed to append to hash log for set '%s'. %s",
+                    s->set_name, strerror(errno));
+            res = -1;
+            break;
+        }
+        written += more;
+    }
+    s->wal_end += written;
+    uint64_t end = s->wal_end;
+    pthread_mutex_unlock(&s->wal_lock);
+
+    if (!res && s->config->wal_sync) {
+        res = sync_wal(s, end);
+    }
+    return res;
+}
+
+/**
+ * Syncs the hash log up to a logical offset. The sync is done
+ * without the append lock, and covers everything appended before
+ * it started, so concurrent appends share a single sync.
+ * @arg offset Logical offset that must be synced
+ * @return 0 on success, -1 on error.
+ */
+static int sync_wal(hlld_set *s, uint64_t offset) {
+    int res = 0;
+    pthread_mutex_lock(&s->wal_sync_lock);
+    if (s->wal_synced < offset) {
+        // The log cannot be swapped or closed while we hold the sync lock
+        pthread_mutex_lock(&s->wal_lock);
+        int fh = s->wal_fd;
+        uint64_t end = s->wal_end;
+        pthread_mutex_unlock(&s->wal_lock);
+
+        if (fh != -1 && FDATASYNC(fh)) {
+            syslog(LOG_ERR, "Failed to sync hash log for set '%s'. %s",
+                    s->set_name, strerror(errno));
+            res = -1;
+        } else {
+            s->wal_synced = end;
+        }
+    }
+    pthread_mutex_unlock(&s->wal_sync_lock);
+    return res;
+}
+
+/**
+ * Copies a range of one hash log to the end of another.
+ * @arg from The log to read
+ * @arg pos The position to copy from
+ * @arg len The number of bytes to copy
+ * @arg to The log to append to
+ * @return 0 on success, -1 on error.
+ */
+static int copy_wal(int from, uint64_t pos, uint64_t len, int to) {
+    char buf[WAL_COPY_SIZE];
+    while (len) {
+        ssize_t more = pread(from, buf, (len < sizeof(buf)) ? len : sizeof(buf), pos);
+        if (more == -1 && errno == EINTR) continue;
+        if (more <= 0) return -1;
+
+        ssize_t total = 0, out;
+        while (total < more) {
+            out = write(to, buf+total, more-total);
+            if (out == -1 && errno == EINTR) continue;
+            if (out <= 0) return -1;
+            total += out;
+        }
+        pos += more;
+        len -= more;
+    }
+    return 0;
+}
+
+/**
+ * Drops the hashes that are covered by a flush. Offsets are
+ * logical, so concurrent flushes can truncate in any order.
+ * Any hashes logged after the offset are kept.
+ *
+ * The kept hashes are copied to a new log without the append
+ * lock. Only the hashes appended during the copy are copied
+ * with the lock held, before the new log is swapped in.
+ * @arg offset Logical offset of the end of the flushed hashes
+ */
+static void truncate_wal(hlld_set *s, uint64_t offset) {
+    // Compactions are serialized with syncs, but not with appends
+    pthread_mutex_lock(&s->wal_sync_lock);
+    pthread_mutex_lock(&s->wal_lock);
+    if (s->wal_fd == -1 || offset <= s->wal_start) {
+        pthread_mutex_unlock(&s->wal_lock);
+        goto LEAVE;
+    }
+
+    // Fast path, nothing was logged since. This must
+    // not race with an append, so the lock is kept.
+    if (s->wal_end == offset) {
+        if (ftruncate(s->wal_fd, 0)) {
+            syslog(LOG_ERR, "Failed to truncate hash log for set '%s'. %s", s->set_name, strerror(errno));
+        } else {
+            s->wal_start = offset;
+        }
+        pthread_mutex_unlock(&s->wal_lock);
+        goto LEAVE;
+    }
+    int old_fh = s->wal_fd;
+    uint64_t start = s->wal_start;
+    uint64_t end = s->wal_end;
+    pthread_mutex_unlock(&s->wal_lock);
+
+    // Copy the tail to a new log, appends go to the old log meanwhile
+    char *wal_path = join_path(s->full_path, (char*)WAL_FILE_NAME);
+    char *tmp_path = NULL;
+    int fh = -1, swapped = 0;
+    if (asprintf(&tmp_path, "%s.tmp", wal_path) == -1) {
+        tmp_path = NULL;
+        goto CLEANUP;
+    }
+    fh = open(tmp_path, O_CREAT|O_TRUNC|O_RDWR|O_APPEND, 0644);
+    if (fh == -1) goto CLEANUP;
+    if (copy_wal(old_fh, offset - start, end - offset, fh) || FDATASYNC(fh))
+        goto CLEANUP;
+
+    // Copy any hashes appended during the copy and swap in the
+    // new log, with appends blocked so that none are left behind
+    pthread_mutex_lock(&s->wal_lock);
+    uint64_t synced = end;
+    uint64_t more = s->wal_end - end;
+    if (more && (copy_wal(old_fh, end - start, more, fh) ||
+                (s->config->wal_sync && FDATASYNC(fh)))) {
+        pthread_mutex_unlock(&s->wal_lock);
+        goto CLEANUP;
+    }
+    if (more && s->config->wal_sync) synced += more;
+    if (!rename(tmp_path, wal_path)) {
+        s->wal_fd = fh;
+        s->wal_start = offset;
+        swapped = 1;
+    }
+    pthread_mutex_unlock(&s->wal_lock);
+    if (!swapped) goto CLEANUP;
+    close(old_fh);
+
+    // Make the rename durable. Until then the old log is
+    // recovered, which is safe since replay is idempotent.
+    if (sync_dir(s->full_path)) {
+        syslog(LOG_ERR, "Failed to sync the folder of set '%s'. %s", s->set_name, strerror(errno));
+    } else if (s->wal_synced < synced) {
+        s->wal_synced = synced;
+    }
+
+CLEANUP:
+    if (!swapped) {
+        syslog(LOG_ERR, "Failed to compact hash log for set '%s'. %s", s->set_name, strerror(errno));
+        if (fh != -1) {
+            close(fh);
+            unlink(tmp_path);
+        }
+    }
+    if (tmp_path) free(tmp_path);
+    free(wal_path);
+
+LEAVE:
+    pthread_mutex_unlock(&s->wal_sync_lock);
+}
+
+/**
+ * Closes the hash log. The set should be flushed first.
+ */
+static void close_wal(hlld_set *s) {
+    pthread_mutex_lock(&s->wal_sync_lock);
+    pthread_mutex_lock(&s->wal_lock);
+    if (s->wal_fd != -1) {
+        close(s->wal_fd);
+        s->wal_fd = -1;
+    }
+    s->wal_start = s->wal_end = s->wal_synced = 0;
+    pthread_mutex_unlock(&s->wal_lock);
+    pthread_mutex_unlock(&s->wal_sync_lock);
+}
+
+/**
+ * Syncs a folder, so that renames into it are durable.
+ * @return 0 on success, -1 on error.
+ */
+static int sync_dir(char *path) {
+    int fh = open(path, O_RDONLY);
+    if (fh == -1) return -1;
+    int res = fsync(fh);
+    close(fh);
+    return res;
+}
+
+/**
+ * Writes a file durably, by writing to a temporary
+ * file that is synced and renamed into place.
+ * @return 0 on success, negative on error.
+ */
+static int write_file(char *path, unsigned char *buf, uint64_t len) {
+    char *tmp_path;
+    if (asprintf(&tmp_path, "%s.tmp", path) == -1) return -ENOMEM;
+
+    int res = 0;
+    int fh = open(tmp_path, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+    if (fh == -1) {
+        res = -errno;
+        goto LEAVE;
+    }
+
+    uint64_t written = 0;
+    ssize_t more;
+    while (written < len) {
+        more = write(fh, buf+written, len-written);
+        if (more == -1 && errno == EINTR) continue;
+        if (more == -1) {
+            res = -errno;
+            break;
+        }
+        written += more;
+    }
+    if (!res && fsync(fh)) res = -errno;
+    close(fh);
+    if (!res && rename(tmp_path, path)) res = -errno;
+    if (res) unlink(tmp_path);
+
+LEAVE:
+    free(tmp_path);
+    return res;
+}
+
+/**
+ * Replaces the register file of a set that is being closed
+ * with a compressed version, if that is smaller. Must be
+ * called after the set is flushed. The compressed file is
+ * renamed into place before the raw files are removed, so
+ * a crash leaves at least one of them intact.
+ */
+static void compress_registers(hlld_set *s) {
+    unsigned char *encoded;
+    uint64_t encoded_len;
+    if (hll_encode(&s->hll, &encoded, &encoded_len)) return;
+
+    // Only worth it if we save space
+    uint64_t len = COMPRESSED_HEADER_SIZE + encoded_len;
+    if (len >= s->bm.size) {
+        free(encoded);
+        return;
+    }
+
+    unsigned char *buf = malloc(len);
+    uint8_t precision = s->hll.precision;
+    uint32_t checksum = crc32c(0, s->bm.mmap, s->bm.size);
+    uint64_t off = 0;
+    memcpy(buf, COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC));
+    off += sizeof(COMPRESSED_MAGIC);
+    memcpy(buf+off, &precision, sizeof(precision));
+    off += sizeof(precision);
+    memcpy(buf+off, &checksum, sizeof(checksum));
+    off += sizeof(checksum);
+    memcpy(buf+off, encoded, encoded_len);
+    free(encoded);
+
+    char *cmp_path = join_path(s->full_path, (char*)COMPRESSED_FILE_NAME);
+    int res = write_file(cmp_path, buf, len);
+    free(buf);
+    free(cmp_path);
+    if (res) {
+        syslog(LOG_ERR, "Failed to compress set '%s'. Err: %d", s->set_name, res);
+        return;
+    }
+
+    // Remove the raw registers and the backup of them
+    char *bitmap_path = join_path(s->full_path, (char*)DATA_FILE_NAME);
+    char *backup_path = join_path(s->full_path, (char*)BACKUP_FILE_NAME);
+    unlink(bitmap_path);
+    unlink(backup_path);
+    free(bitmap_path);
+    free(backup_path);
+    syslog(LOG_DEBUG, "Compressed set '%s' from %llu to %llu bytes", s->set_name,
+            (unsigned long long)s->bm.size, (unsigned long long)len);
+}
+
+/**
+ * Expands the compressed registers of a set back into a
+ * register file. This is a no-op if the register file exists
+ * or the set is not compressed.
+ * @return 0 on success, negative on error.
+ */
+static int inflate_registers(hlld_set *s, char *bitmap_path) {
+    struct stat st;
+    if (!stat(bitmap_path, &st)) return 0;
+
+    char *cmp_path = join_path(s->full_path, (char*)COMPRESSED_FILE_NAME);
+    int fh = open(cmp_path, O_RDONLY);
+    if (fh == -1) {
+        free(cmp_path);
+        return 0;
+    }
+
+    // Read in the compressed file
+    int res = -EINVAL;
+    unsigned char *buf = NULL;
+    hll_t h;
+    h.registers = NULL;
+    h.bm = NULL;
+    if (fstat(fh, &st) || (uint64_t)st.st_size < COMPRESSED_HEADER_SIZE)
+        goto LEAVE;
+    uint64_t len = st.st_size;
+    buf = malloc(len);
+    if (!buf) goto LEAVE;
+    uint64_t total = 0;
+    ssize_t more;
+    while (total < len) {
+        more = pread(fh, buf+total, len-total, total);
+        if (more == -1 && errno == EINTR) continue;
+        if (more <= 0) break;
+        total += more;
+    }
+    if (total != len || memcmp(buf, COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC)))
+        goto LEAVE;
+
+    // Decode and verify the registers
+    uint8_t precision;
+    uint32_t checksum;
+    uint64_t off = sizeof(COMPRESSED_MAGIC);
+    memcpy(&precision, buf+off, sizeof(precision));
+    off += sizeof(precision);
+    memcpy(&checksum, buf+off, sizeof(checksum));
+    off += sizeof(checksum);
+    if (hll_init_layout(precision, s->set_config.layout, &h) || hll_decode(&h, buf+off, len-off))
+        goto LEAVE;
+    uint64_t size = hll_bytes_for_layout(precision, s->set_config.layout);
+    if (crc32c(0, h.registers, size) != checksum)
+        goto LEAVE;
+
+    // Write out the register file
+    res = write_file(bitmap_path, (unsigned char*)h.registers, size);
+    if (!res) unlink(cmp_path);
+
+LEAVE:
+    if (res) {
+        syslog(LOG_ERR, "Failed to expand compressed set '%s'. Err: %d", s->set_name, res);
+    }
+    close(fh);
+    hll_destroy(&h);
+    if (buf) free(buf);
+    free(cmp_path);
+    return res;
+}
+
+/**
+ * Writes out the set config. Logs on failure.
+ */
+static int write_config(hlld_set *s) {
+    char *config_name = join_path(s->full_path, (char*)CONFIG_FILENAME);
+    int res = update_filename_from_set_config(config_name, &s->set_config);
+    free(config_name);
+    if (!res && sync_dir(s->full_path)) res = -errno;
+    if (res) {
+        syslog(LOG_ERR, "Failed to write set '%s' configuration. Err: %d.",
+                s->set_name, res);
+    }
+    return res;
+}
+
+/**
+ * Reads the settings that the catalog does not track, or that
+ * may have changed since it was written, such as the checksum
+ * and the register layout. This is only done once, for sets
+ * whose config came from the catalog. Other sets keep their
+ * config current in memory.
+ */
+static void refresh_disk_config(hlld_set *s) {
+    if (!s->needs_disk_config) return;
+    s->needs_disk_config = 0;
+    if (s->set_config.in_memory) return;
+
+    hlld_set_config disk_config;
+    memset(&disk_config, 0, sizeof(hlld_set_config));
+    char *config_name = join_path(s->full_path, (char*)CONFIG_FILENAME);
+    int res = set_config_from_filename(config_name, &disk_config);
+    free(config_name);
+    if (res) return;
+
+    s->set_config.layout = disk_config.layout;
+    s->set_config.has_checksum = disk_config.has_checksum;
+    s->set_config.checksum = disk_config.checksum;
+    s->set_config.has_pending = disk_config.has_pending;
+    s->set_config.pending_checksum = disk_config.pending_checksum;
+}
+
+/**
+ * Allocates the set for a window of a windowed set. The
+ * window uses the settings of its parent, and lives in a
+ * folder inside the folder of the parent.
+ */
+static hlld_set* alloc_window(hlld_set *s, uint64_t start) {
+    char *name, *folder;
+    int res = asprintf(&name, "%s@%llu", s->set_name, (unsigned long long)start);
+    assert(res != -1);
+    hlld_set *w = alloc_set(s->config, name);
+    free(name);
+
+    res = asprintf(&folder, WINDOW_FOLDER_NAME, (unsigned long long)start);
+    assert(res != -1);
+    free(w->full_path);
+    w->full_path = join_path(s->full_path, folder);
+    free(folder);
+
+    memcpy(&w->set_config, &s->set_config, sizeof(hlld_set_config));
+    w->set_config.size = 0;
+    w->set_config.has_checksum = 0;
+    w->set_config.has_pending = 0;
+    w->set_config.window = 0;
+    w->set_config.retain = 0;
+    return w;
+}
+
+/**
+ * Returns the start of the oldest window that is kept.
+ */
+static uint64_t oldest_window(hlld_set *s) {
+    uint64_t window = s->set_config.window;
+    uint64_t now = time(NULL);
+    uint64_t current = now - now % window;
+    uint64_t span = window * (s->set_config.retain - 1);
+    return (current > span) ? current - span : 0;
+}
+
+/**
+ * Adds a window to the end of the windows. The window lock must be held.
+ */
+static void append_window(hlld_set *s, uint64_t start, hlld_set *w) {
+    s->windows = realloc(s->windows, (s->num_windows + 1) * sizeof(set_window));
+    s->windows[s->num_windows].start = start;
+    s->windows[s->num_windows].set = w;
+    s->num_windows++;
+}
+
+/**
+ * Orders windows by their start
+ */
+static int compare_windows(const void *a, const void *b) {
+    uint64_t a_start = ((set_window*)a)->start;
+    uint64_t b_start = ((set_window*)b)->start;
+    return (a_start > b_start) - (a_start < b_start);
+}
+
+/**
+ * Deletes the files of a window and frees it.
+ */
+static void delete_window(hlld_set *w) {
+    hset_delete(w);
+    destroy_set(w);
+}
+
+/**
+ * Scans the folder of a windowed set for its windows. The
+ * windows are not faulted in until they are used, and
+ * windows that have expired are deleted.
+ */
+static int discover_windows(hlld_set *s) {
+    struct dirent **namelist = NULL;
+    int num = scandir(s->full_path, &namelist, filter_windows, NULL);
+    if (num == -1) {
+        syslog(LOG_ERR, "Failed to scan windows of set '%s'. %s", s->set_name, strerror(errno));
+        return -1;
+    }
+
+    uint64_t oldest = oldest_window(s);
+    pthread_mutex_lock(&s->window_lock);
+    for (int i=0; i < num; i++) {
+        uint64_t start = strtoull(namelist[i]->d_name + WINDOW_FOLDER_PREFIX_LEN, NULL, 10);
+        hlld_set *w = alloc_window(s, start);
+        if (start < oldest) {
+            delete_window(w);
+        } else {
+            append_window(s, start, w);
+        }
+        free(namelist[i]);
+    }
+    if (namelist) free(namelist);
+    qsort(s->windows, s->num_windows, sizeof(set_window), compare_windows);
+    pthread_mutex_unlock(&s->window_lock);
+    return 0;
+}
+
+/**
+ * Takes a reference on the window that adds currently go to,
+ * rolling over to a new window if needed. The new window is
+ * created without the window lock, so adds are not held up.
+ * @return The window, or NULL if a new window could not be created.
+ */
+static hlld_set* take_current_window(hlld_set *s) {
+    uint64_t now = time(NULL);
+    uint64_t start = now - now % s->set_config.window;
+    hlld_set *w = NULL;
+    hlld_set *created = NULL;
+    while (!w) {
+        pthread_mutex_lock(&s->window_lock);
+
+        // Keep using the latest window if the clock went backwards
+        if (s->num_windows && s->windows[s->num_windows-1].start >= start) {
+            w = s->windows[s->num_windows-1].set;
+        } else if (created) {
+            append_window(s, start, created);
+            w = created;
+            created = NULL;
+            syslog(LOG_DEBUG, "Rolled over set '%s' to window %llu.", s->set_name,
+                    (unsigned long long)start);
+        }
+        if (w) w->window_refs++;
+        pthread_mutex_unlock(&s->window_lock);
+        if (w) break;
+
+        created = alloc_window(s, start);
+        if (load_set(created)) {
+            destroy_set(created);
+            return NULL;
+        }
+    }
+
+    // Another thread rolled over first
+    if (created) destroy_set(created);
+    return w;
+}
+
+/**
+ * Takes a reference on the windows that end after a time,
+ * so they can be used without holding the window lock.
+ * @arg since Windows that end at or before this are skipped
+ * @arg windows Output, a new array of the windows
+ * @return The number of windows.
+ */
+static int take_windows(hlld_set *s, uint64_t since, hlld_set ***windows) {
+    pthread_mutex_lock(&s->window_lock);
+    hlld_set **taken = malloc((s->num_windows + 1) * sizeof(hlld_set*));
+    int num = 0;
+    for (int i=0; i < s->num_windows; i++) {
+        set_window *w = s->windows + i;
+        if (w->start + s->set_config.window <= since) continue;
+        w->set->window_refs++;
+        taken[num++] = w->set;
+    }
+    pthread_mutex_unlock(&s->window_lock);
+    *windows = taken;
+    return num;
+}
+
+/**
+ * Releases a reference on a window. The window is
+ * deleted if it expired while it was in use.
+ */
+static void release_window(hlld_set *s, hlld_set *w) {
+    pthread_mutex_lock(&s->window_lock);
+    int expired = (--w->window_refs == 0 && w->window_expired);
+    pthread_mutex_unlock(&s->window_lock);
+    if (expired) delete_window(w);
+}
+
+/**
+ * Releases the windows taken with take_windows, and frees the array.
+ */
+static void release_windows(hlld_set *s, hlld_set **windows, int num) {
+    for (int i=0; i < num; i++) {
+        release_window(s, windows[i]);
+    }
+    free(windows);
+}
+
+/**
+ * Faults in a window, counting its registers towards
+ * the resident bytes of the parent.
+ */
+static int fault_window(hlld_set *s, hlld_set *w) {
+    w->resident = s->resident;
+    w->pinned = s->pinned;
+    return hset_fault(w);
+}
+
+/**
+ * Adds a batch of keys to the current window of a set. The
+ * window lock is only held to find the window, so the keys
+ * are hashed and added concurrently with other adds.
+ */
+static int add_window_keys(hlld_set *s, char **keys, int num_keys) {
+    // Take a reference, so the window cannot expire under us
+    hlld_set *w = take_current_window(s);
+    if (!w) return -1;
+    uint64_t updated = 0;
+    int res = fault_window(s, w);
+    if (!res) res = add_keys(w, keys, num_keys, 0, &updated);
+    release_window(s, w);
+    if (res) return res;
+
+    LOCK_HLLD_SPIN(&s->hll_update);
+    update_rates(&s->counters, time(NULL));
+    s->hll_version++;
+    UNLOCK_HLLD_SPIN(&s->hll_update);
+    __atomic_add_fetch(&s->counters.sets, num_keys, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->counters.updates, updated, __ATOMIC_RELAXED);
+    s->is_dirty = 1;
+    return 0;
+}
+
+/**
+ * Merges the registers of the windows that end after
+ * a time, by taking the max of each register.
+ */
+static void merge_window_registers(hlld_set *s, uint64_t since, hll_t *h) {
+    hlld_set **windows;
+    int num = take_windows(s, since, &windows);
+    for (int i=0; i < num; i++) {
+        hlld_set *w = windows[i];
+        if (fault_window(s, w)) continue;
+        if (w->hll.precision != h->precision) continue;
+        hll_merge(h, &w->hll);
+    }
+    release_windows(s, windows, num);
+}
+
+/**
+ * Estimates the union of the windows that end after a time.
+ */
+static uint64_t merge_windows(hlld_set *s, uint64_t since) {
+    hll_t h;
+    if (hll_init_layout(s->set_config.default_precision, s->set_config.layout, &h)) return 0;
+    merge_window_registers(s, since, &h);
+
+    uint64_t est = estimate(s, &h);
+    hll_destroy(&h);
+    return est;
+}
+
+/**
+ * Estimates the size of the windows without faulting any in.
+ * Resident windows are merged, and the sizes stored by the
+ * proxied windows are added on, so keys seen in more than
+ * one proxied window are counted more than once.
+ */
+static uint64_t stored_windows_size(hlld_set *s) {
+    hll_t h;
+    if (hll_init_layout(s->set_config.default_precision, s->set_config.layout, &h)) return 0;
+
+    uint64_t proxied = 0;
+    int merged = 0;
+    hlld_set **windows;
+    int num = take_windows(s, 0, &windows);
+    for (int i=0; i < num; i++) {
+        hlld_set *w = windows[i];
+        if (w->is_proxied) {
+            proxied += hset_config(w)->size;
+        } else if (w->hll.precision == h.precision) {
+            hll_merge(&h, &w->hll);
+            merged = 1;
+        }
+    }
+    release_windows(s, windows, num);
+
+    uint64_t est = (merged) ? estimate(s, &h) : 0;
+    hll_destroy(&h);
+    return est + proxied;
+}
+
+/**
+ * Flushes the windows of a set, after dropping the
+ * windows that have expired.
+ */
+static int flush_windows(hlld_set *s) {
+    expire_windows(s);
+
+    int res = 0;
+    hlld_set **windows;
+    int num = take_windows(s, 0, &windows);
+    for (int i=0; i < num; i++) {
+        int w_res = hset_flush(windows[i]);
+        if (w_res) res = w_res;
+    }
+    release_windows(s, windows, num);
+
+    // Store our properties for a future unmap. Only the
+    // resident windows can have changed, so none are faulted in.
+    if (s->is_dirty) {
+        s->is_dirty = 0;
+        uint64_t size = stored_windows_size(s);
+        LOCK_HLLD_SPIN(&s->hll_update);
+        s->set_config.size = size;
+        UNLOCK_HLLD_SPIN(&s->hll_update);
+        write_config(s);
+    }
+    return res;
+}
+
+/**
+ * Closes and frees all the windows of a set.
+ */
+static void close_windows(hlld_set *s) {
+    pthread_mutex_lock(&s->window_lock);
+    for (int i=0; i < s->num_windows; i++) {
+        destroy_set(s->windows[i].set);
+    }
+    free(s->windows);
+    s->windows = NULL;
+    s->num_windows = 0;
+    pthread_mutex_unlock(&s->window_lock);
+}
+
+/**
+ * Deletes the windows of a set that have expired.
+ */
+static void expire_windows(hlld_set *s) {
+    uint64_t oldest = oldest_window(s);
+
+    // Detach the expired windows, and delete them without the lock
+    pthread_mutex_lock(&s->window_lock);
+    int num = 0;
+    while (num < s->num_windows && s->windows[num].start < oldest) num++;
+    if (!num) {
+        pthread_mutex_unlock(&s->window_lock);
+        return;
+    }
+    set_window *expired = malloc(num * sizeof(set_window));
+    memcpy(expired, s->windows, num * sizeof(set_window));
+    s->num_windows -= num;
+    memmove(s->windows, s->windows + num, s->num_windows * sizeof(set_window));
+
+    // Windows that are in use are deleted on their last release
+    for (int i=0; i < num; i++) {
+        hlld_set *w = expired[i].set;
+        w->window_expired = 1;
+        if (w->window_refs) expired[i].set = NULL;
+    }
+    pthread_mutex_unlock(&s->window_lock);
+
+    for (int i=0; i < num; i++) {
+        syslog(LOG_INFO, "Dropping expired window %llu of set '%s'.",
+                (unsigned long long)expired[i].start, s->set_name);
+        if (expired[i].set) delete_window(expired[i].set);
+    }
+    free(expired);
+}
+
+/**
+ * Reads the registers of a sliding set, or starts
+ * with empty registers if there are none on disk.
+ */
+static int load_sliding(hlld_set *s) {
+    int res = shll_init(s->set_config.default_precision, s->set_config.sliding, &s->shll);
+    if (res) {
+        syslog(LOG_ERR, "Failed to create sliding HLL! Res: %d", res);
+        return res;
+    }
+    if (s->set_config.in_memory) return 0;
+
+    char *path = join_path(s->full_path, (char*)SLIDING_FILE_NAME);
+    int fh = open(path, O_RDONLY);
+    if (fh == -1) {
+        free(path);
+        return 0;
+    }
+
+    // Read in the whole file
+    res = -EINVAL;
+    unsigned char *buf = NULL;
+    struct stat st;
+    if (fstat(fh, &st) || (uint64_t)st.st_size < SLIDING_HEADER_SIZE)
+        goto LEAVE;
+    uint64_t len = st.st_size;
+    buf = malloc(len);
+    if (!buf) goto LEAVE;
+    uint64_t total = 0;
+    ssize_t more;
+    while (total < len) {
+        more = pread(fh, buf+total, len-total, total);
+        if (more == -1 && errno == EINTR) continue;
+        if (more <= 0) break;
+        total += more;
+    }
+    if (total != len || memcmp(buf, SLIDING_MAGIC, sizeof(SLIDING_MAGIC)) ||
+            buf[sizeof(SLIDING_MAGIC)] != s->set_config.default_precision)
+        goto LEAVE;
+    res = shll_decode(&s->shll, buf+SLIDING_HEADER_SIZE, len-SLIDING_HEADER_SIZE);
+    if (!res) s->counters.page_ins += 1;
+
+LEAVE:
+    if (res) {
+        syslog(LOG_ERR, "Failed to read sliding set '%s'. Err: %d", s->set_name, res);
+        shll_destroy(&s->shll);
+    }
+    close(fh);
+    if (buf) free(buf);
+    free(path);
+    return res;
+}
+
+/**
+ * Writes out the registers of a sliding set, after
+ * dropping the entries that are out of the window.
+ */
+static int flush_sliding(hlld_set *s) {
+    if (!s->is_dirty) return 0;
+    s->is_dirty = 0;
+    uint64_t size = hset_size(s);
+    LOCK_HLLD_SPIN(&s->hll_update);
+    s->set_config.size = size;
+    UNLOCK_HLLD_SPIN(&s->hll_update);
+
+    int res = 0;
+    if (!s->set_config.in_memory) {
+        unsigned char *enc;
+        uint64_t enc_len;
+        LOCK_HLLD_SPIN(&s->hll_update);
+        shll_prune(&s->shll, time(NULL));
+        res = shll_encode(&s->shll, &enc, &enc_len);
+        UNLOCK_HLLD_SPIN(&s->hll_update);
+        if (res) return res;
+
+        uint64_t len = SLIDING_HEADER_SIZE + enc_len;
+        unsigned char *buf = malloc(len);
+        memcpy(buf, SLIDING_MAGIC, sizeof(SLIDING_MAGIC));
+        buf[sizeof(SLIDING_MAGIC)] = s->set_config.default_precision;
+        memcpy(buf+SLIDING_HEADER_SIZE, enc, enc_len);
+        free(enc);
+
+        char *path = join_path(s->full_path, (char*)SLIDING_FILE_NAME);
+        res = write_file(path, buf, len);
+        if (res) {
+            syslog(LOG_ERR, "Failed to write sliding set '%s'. Err: %d", s->set_name, res);
+        }
+        free(path);
+        free(buf);
+    }
+
+    write_config(s);
+    return res;
+}
+
+/**
+ * Estimates the keys seen by a sliding set in the last seconds.
+ */
+static uint64_t sliding_size(hlld_set *s, uint64_t last) {
+    // Copy out the registers of the window, and estimate without the lock
+    hll_t h;
+    LOCK_HLLD_SPIN(&s->hll_update);
+    int res = shll_window(&s->shll, time(NULL), last, &h);
+    UNLOCK_HLLD_SPIN(&s->hll_update);
+    if (res) return 0;
+
+    uint64_t est = estimate(s, &h);
+    hll_destroy(&h);
+    return est;
+}
+
+/**
+ * Deletes all the windows of a closed set.
+ */
+static void delete_windows(hlld_set *s) {
+    discover_windows(s);
+    pthread_mutex_lock(&s->window_lock);
+    for (int i=0; i < s->num_windows; i++) {
+        delete_window(s->windows[i].set);
+    }
+    free(s->windows);
+    s->windows = NULL;
+    s->num_windows = 0;
+    pthread_mutex_unlock(&s->window_lock);
+}
+
+/**
+ * Estimates the size of registers with the configured estimator.
+ * The estimate is rounded, since small sets at high precisions
+ * are estimated a hair under their true size.
+ */
+static uint64_t estimate(hlld_set *s, hll_t *h) {
+    if (s->config->estimator_mode == ESTIMATE_ERTL)
+        return hll_size_ertl(h) + 0.5;
+    return hll_size(h) + 0.5;
+}
+
 /**
  * Works with scandir to filter out special files
  */
@@ -415,12 +2290,56 @@ static int filter_out_special(CONST_DIRENT_T *d) {
 }
 
 /**
- * Computes the difference in time in milliseconds
- * between two timeval structures.
+ * Filters the window folders of a windowed set
+ */
+static int filter_windows(CONST_DIRENT_T *d) {
+    return strncmp(d->d_name, WINDOW_FOLDER_PREFIX, WINDOW_FOLDER_PREFIX_LEN) == 0;
+}
+
+/**
+ * Computes the moving averages of the sets and updates per
+ * second as of a time, without storing them. The counts since
+ * the last fold are spread evenly over the seconds since then,
+ * so a set that goes idle decays towards zero.
+ * Must be called with the update lock held.
  */
-static int timediff_msec(struct timeval *t1, struct timeval *t2) {
-    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
-    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
-    return (micro2-micro1) / 1000;
+static void fold_rates(set_counters *c, uint64_t now, double *set_rate, double *update_rate) {
+    *set_rate = c->set_rate;
+    *update_rate = c->update_rate;
+    if (!c->rate_time || now <= c->rate_time) return;
+
+    double elapsed = now - c->rate_time;
+    double decay = exp(-elapsed / RATE_WINDOW_SEC);
+    uint64_t sets = __atomic_load_n(&c->sets, __ATOMIC_RELAXED);
+    uint64_t updates = __atomic_load_n(&c->updates, __ATOMIC_RELAXED);
+    *set_rate = *set_rate * decay + (sets - c->rate_sets) / elapsed * (1 - decay);
+    *update_rate = *update_rate * decay + (updates - c->rate_updates) / elapsed * (1 - decay);
 }
 
+/**
+ * Folds the counts since the last fold into the moving
+ * averages, at most once a second. Must be called with
+ * the update lock held.
+ */
+static void update_rates(set_counters *c, uint64_t now) {
+    if (now <= c->rate_time) return;
+    fold_rates(c, now, &c->set_rate, &c->update_rate);
+    c->rate_time = now;
+    c->rate_sets = __atomic_load_n(&c->sets, __ATOMIC_RELAXED);
+    c->rate_updates = __atomic_load_n(&c->updates, __ATOMIC_RELAXED);
+}
+
+/**
+ * Counts the registers of a set as it is mapped or
+ * unmapped. In-memory only sets can never be unmapped,
+ * so they are counted separately from the other sets.
+ * @arg mapped 1 if the set was mapped, 0 if unmapped
+ */
+static void count_resident(hlld_set *s, int mapped) {
+    uint64_t *counter = (s->set_config.in_memory) ? s->pinned : s->resident;
+    if (!counter) return;
+    if (mapped)
+        __atomic_add_fetch(counter, hset_byte_size(s), __ATOMIC_RELAXED);
+    else
+        __atomic_sub_fetch(counter, hset_byte_size(s), __ATOMIC_RELAXED);
+}
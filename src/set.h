@@ -11,13 +11,37 @@
 
 /**
  * These are the counters that are maintained for each set.
+ * The counters updated on the write path use relaxed atomics.
  */
 typedef struct {
     uint64_t sets;
     uint64_t page_ins;
     uint64_t page_outs;
+    uint64_t updates;           // Keys that increased a register
+    uint64_t last_access;       // Time of the last client access, in seconds
+    uint64_t last_flush;        // Time the last flush finished, in seconds
+    uint64_t flush_usec;        // Duration of the last flush
+
+    // Moving averages of sets and updates per second. These are
+    // folded in by the writers at most once a second.
+    uint64_t rate_time;         // Time of the last fold, in seconds
+    uint64_t rate_sets;         // Sets at the last fold
+    uint64_t rate_updates;      // Updates at the last fold
+    double set_rate;
+    double update_rate;
 } set_counters;
 
+struct hlld_set;
+
+/**
+ * A single window of a windowed set. Each window
+ * is a set of its own, in a folder of the parent set.
+ */
+typedef struct {
+    uint64_t start;                 // Start of the window, in seconds since the epoch
+    struct hlld_set *set;           // The registers of the window
+} set_window;
+
 /**
  * Representation of a hyperloglog set
  */
@@ -28,15 +52,39 @@ typedef struct hlld_set {
     char *set_name;                 // The name of the set
     char *full_path;                // Path to our data
 
+    char is_loaded;                 // Has the set config been read
+    char needs_disk_config;         // Config came from the catalog, see refresh_disk_config
     char is_proxied;                // Is the bitmap available
     pthread_mutex_t hll_lock;       // Protects faulting in the HLL
 
     char is_dirty;                  // Has a write happened
+    char needs_repair;              // Registers failed verification
     hlld_bitmap bm;                 // Bitmap for the HLL
     hll_t hll;                      // Underlying HLL
+    shll_t shll;                    // Registers of a sliding set
     hlld_spinlock hll_update;       // Protect the updates
 
+    uint64_t hll_version;           // Bumped on every register update
+    uint64_t size_version;          // hll_version the cached size is for
+    uint64_t cached_size;           // Cached estimate, valid if size_cached
+    char size_cached;               // Is the cached estimate usable
+
+    int wal_fd;                     // Hash log, -1 if not in use
+    uint64_t wal_start;             // Logical offset of the start of the log
+    uint64_t wal_end;               // Logical offset of the end of the log
+    uint64_t wal_synced;            // Logical offset the log is synced up to
+    pthread_mutex_t wal_lock;       // Serializes log appends and swaps of the log
+    pthread_mutex_t wal_sync_lock;  // Serializes syncs, compaction and closing of the log
+
+    set_window *windows;            // Windows of a windowed set, oldest first
+    int num_windows;                // Number of windows
+    pthread_mutex_t window_lock;    // Protects the windows, and the refs of each window
+    int window_refs;                // Users of this window outside the window lock
+    char window_expired;            // Expired while in use, deleted on the last release
+
     set_counters counters;         // Counters
+    uint64_t *resident;             // Optional count of resident register bytes
+    uint64_t *pinned;               // Optional count of those that can never be unmapped
 } hlld_set;
 
 /**
@@ -50,6 +98,20 @@ typedef struct hlld_set {
  */
 int init_set(hlld_config *config, char *set_name, int discover, hlld_set **set);
 
+/**
+ * Initializes a set wrapper for a set that is known to
+ * exist on disk, without touching the disk. The set folder
+ * and configuration are loaded lazily on first access,
+ * which makes this suitable for discovering many sets on start.
+ * @arg config The configuration to use
+ * @arg set_name The name of the set
+ * @arg set_config Optional, can be null. A known set config, which
+ * is used instead of reading the config from disk.
+ * @arg set Output parameter, the new set
+ * @return 0 on success
+ */
+int init_set_lazy(hlld_config *config, char *set_name, hlld_set_config *set_config, hlld_set **set);
+
 /**
  * Destroys a set
  * @arg set The set to destroy
@@ -65,6 +127,43 @@ int destroy_set(hlld_set *set);
  */
 set_counters* hset_counters(hlld_set *set);
 
+/**
+ * Records a client access to the set
+ * @note Thread safe.
+ * @arg set The set
+ */
+void hset_touch(hlld_set *set);
+
+/**
+ * Gets the moving averages of the sets and the
+ * register updates per second, as of now.
+ * @note Thread safe.
+ * @arg set The set
+ * @arg set_rate Output. Sets per second.
+ * @arg update_rate Output. Updates per second.
+ */
+void hset_rates(hlld_set *set, double *set_rate, double *update_rate);
+
+/**
+ * Gets the configuration of a set, loading it
+ * from disk if it has not been read yet.
+ * @notes Thread safe.
+ * @arg set The set
+ * @return A reference to the set configuration
+ */
+hlld_set_config* hset_config(hlld_set *set);
+
+/**
+ * Copies the configuration of a set, if it has already
+ * been read. Unlike hset_config, this never reads the
+ * config from disk, so it is cheap for unloaded sets.
+ * @notes Thread safe.
+ * @arg set The set
+ * @arg out Output. The set configuration
+ * @return 0 on success, -1 if the config has not been read.
+ */
+int hset_copy_config(hlld_set *set, hlld_set_config *out);
+
 /**
  * Checks if a set is currectly mapped into
  * memory or if it is proxied.
@@ -73,6 +172,36 @@ set_counters* hset_counters(hlld_set *set);
  */
 int hset_is_proxied(hlld_set *set);
 
+/**
+ * Faults the set into memory if it is proxied. Windowed
+ * sets also fault in the window that adds go to.
+ * Adds do this implicitly, but this allows the
+ * disk access to be done ahead of time.
+ * @notes Thread safe.
+ * @arg set The set to fault in
+ * @return 0 on success.
+ */
+int hset_fault(hlld_set *set);
+
+/**
+ * Checks if adding to a set would fault in registers.
+ * This is the case for proxied sets, and for windowed
+ * sets whose current window is not in memory.
+ * @notes Thread safe.
+ * @return 1 if a fault is needed, 0 otherwise.
+ */
+int hset_needs_fault(hlld_set *set);
+
+/**
+ * Faults the set into memory if it is proxied, and
+ * makes sure the registers are resident, so that
+ * the next access does not wait on the disk.
+ * @notes Thread safe.
+ * @arg set The set to warm
+ * @return 0 on success.
+ */
+int hset_warm(hlld_set *set);
+
 /**
  * Flushes the set. Idempotent if the
  * set is proxied or not dirty.
@@ -103,6 +232,29 @@ int hset_delete(hlld_set *set);
  */
 int hset_add(hlld_set *set, char *key);
 
+/**
+ * Adds a batch of keys to the given set. If the hash
+ * log is in use, the hashes are logged before returning.
+ * @arg set The set to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @return 0 on success.
+ */
+int hset_add_keys(hlld_set *set, char **keys, int num_keys);
+
+/**
+ * Adds a batch of keys to the given set, as seen at a
+ * given time. Only sliding sets take a time.
+ * @arg set The set to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg at When the keys were seen in seconds, 0 for now.
+ * Times are stored in 32 bits, so later times are rejected.
+ * @return 0 on success, -1 on error, -2 if a time is
+ * given and the set is not sliding.
+ */
+int hset_add_keys_at(hlld_set *set, char **keys, int num_keys, uint64_t at);
+
 /**
  * Gets the size of the set
  * @note Thread safe.
@@ -111,6 +263,52 @@ int hset_add(hlld_set *set, char *key);
  */
 uint64_t hset_size(hlld_set *set);
 
+/**
+ * Gets the size of the set without computing an estimate.
+ * This is the cached estimate if it is current, otherwise
+ * the size stored by the last flush.
+ * @note Thread safe.
+ * @arg set The set to check
+ * @return The last known size of the set
+ */
+uint64_t hset_cached_size(hlld_set *set);
+
+/**
+ * Gets the size of the windows of a set that overlap
+ * the most recent period. The windows are merged, so
+ * keys seen in many windows are only counted once.
+ * Sets that are not windowed return their full size.
+ * @note Thread safe.
+ * @arg set The set to check
+ * @arg last The period to count, in seconds
+ * @return The estimated size of the period
+ */
+uint64_t hset_size_last(hlld_set *set, uint64_t last);
+
+/**
+ * Converts the registers of a closed set to another
+ * layout. Windowed and sliding sets cannot be converted.
+ * @note Thread safe.
+ * @arg set The set to convert
+ * @arg layout The new hll_layout of the registers
+ * @return 0 on success, -1 if the set cannot be converted,
+ * -2 if the set is not proxied, negative on other errors.
+ */
+int hset_convert(hlld_set *set, int layout);
+
+/**
+ * Merges the registers of the set into an HLL of the
+ * same precision, keeping the larger of each register.
+ * Windowed sets merge every window that is kept, and
+ * sliding sets merge their longest window.
+ * @note Thread safe.
+ * @arg set The set to merge
+ * @arg h The hll to merge into
+ * @return 0 on success, -1 if the precision differs
+ * or the set could not be faulted in.
+ */
+int hset_merge_into(hlld_set *set, hll_t *h);
+
 /**
  * Gets the byte size of the set
  * @note Thread safe.
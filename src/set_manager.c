@@ -4,18 +4,69 @@
 #include <pthread.h>
 #include <dirent.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/stat.h>
 #include "spinlock.h"
 #include "set_manager.h"
 #include "art.h"
 #include "set.h"
+#include "catalog.h"
 #include "type_compat.h"
 
 /**
- * This defines how log we sleep between vacuum poll
- * iterations in microseconds
+ * This defines how long the vacuum thread waits for
+ * retired sets before checking if it should stop
  */
 #define VACUUM_POLL_USEC 500000
 
+/**
+ * Number of times the vacuum thread yields while waiting
+ * for readers to leave, before it starts to sleep.
+ */
+#define SYNC_SPIN_LIMIT 128
+#define SYNC_SLEEP_USEC 50
+
+/**
+ * Number of entries in the per-client set cache.
+ * Must be a power of 2.
+ */
+#define SET_CACHE_SIZE 64
+
+/**
+ * A bulk size request is only spread across the helper
+ * threads if the sets without a cached estimate have at
+ * least this many registers in total.
+ */
+#define SIZE_PARALLEL_REGISTERS (1 << 16)
+
+/**
+ * Upper bound on the number of size helper threads
+ */
+#define MAX_SIZE_HELPERS 4
+
+/**
+ * Each access to a set increments its hot count up
+ * to this value, and each pass of the eviction clock
+ * decrements it. Sets are evicted once it reaches 0,
+ * so frequently used sets survive more passes.
+ */
+#define HOT_MAX 3
+
+/**
+ * Number of sets the eviction clock inspects
+ * per visit to the set map.
+ */
+#define EVICT_SCAN_CHUNK 64
+
+/**
+ * Number of I/O threads used to fault in sets
+ * asynchronously.
+ */
+#define FAULT_THREADS 2
+
 /**
  * Wraps a hlld_set to ensure only a single
  * writer access it at a time. Tracks the outstanding
@@ -23,7 +74,7 @@
  */
 typedef struct {
     volatile int is_active;         // Set to 0 when we are trying to delete it
-    volatile int is_hot;            // Used to mark a set as hot
+    volatile int is_hot;            // Hot count, from 0 to HOT_MAX
     volatile int should_delete;     // Used to control deletion
 
     hlld_set *set;    // The actual set object
@@ -31,96 +82,158 @@ typedef struct {
     hlld_config *custom;   // Custom config to cleanup
 } hlld_set_wrapper;
 
+/**
+ * Entry in the per-client cache of set lookups.
+ * Only valid in the epoch it was filled in.
+ */
+typedef struct {
+    unsigned long long epoch;
+    uint32_t hash;
+    hlld_set_wrapper *set;
+} set_cache_entry;
+
 /**
  * We use a linked list of setmgr_client
  * structs to track any clients of the set manager.
- * Each client maintains a thread ID as well as the
- * last known version they used. The vacuum thread
- * uses this information to safely garbage collect
- * old versions.
+ * Each client publishes the epoch in which it entered
+ * the set manager, or 0 when it is not inside. Writers
+ * use this to wait until no client can still be using
+ * a tree or set that was unpublished.
  */
 typedef struct setmgr_client {
     pthread_t id;
-    unsigned long long vsn;
+    volatile unsigned long long epoch;  // Epoch on entry, 0 if outside
+    int depth;                          // Nesting depth, only used by the owner
+    uint64_t cache_hits;                // Set cache counters
+    uint64_t cache_misses;
+    set_cache_entry cache[SET_CACHE_SIZE];
     struct setmgr_client *next;
 } setmgr_client;
 
-// Enum of possible delta updates
-typedef enum {
-    CREATE,
-    DELETE,
-    BARRIER
-} delta_type;
+/**
+ * A bulk size request being worked on by the
+ * helper threads. Sets are claimed by index, so the
+ * requesting thread and the helpers share the work.
+ */
+typedef struct size_batch {
+    hlld_set_wrapper **sets;    // Sets to estimate, NULL if missing
+    uint64_t *ests;             // Output estimates
+    int num;
+    volatile int next;          // Next index to claim
+    int done;                   // Completed, protected by size_lock
+    int refs;                   // Helpers working on the batch
+    struct size_batch *next_batch;
+} size_batch;
+
+// Queued request to fault in a set
+typedef struct fault_job {
+    char *set_name;
+    fault_cb cb;
+    void *data;
+    struct fault_job *next;
+} fault_job;
 
 // Simple linked list of set wrappers
 typedef struct set_list {
-    unsigned long long vsn;
-    delta_type type;
+    char *set_name;     // Copy of the name, outlives the set
     hlld_set_wrapper *set;
     struct set_list *next;
 } set_list;
 
 /**
- * We use a a simple form of Multi-Version Concurrency Controll (MVCC)
+ * We use a simple form of epoch based reclamation (EBR)
  * to prevent locking on access to the map of set name -> hlld_set_wrapper.
  *
- * The way it works is we have 2 ART trees, the "primary" and an alternate.
- * All the clients of the set manager have reads go through the primary
- * without any locking. We also maintain a delta list of new and deleted sets,
- * which is a simple linked list.
+ * The way it works is we have a single ART tree, which is updated
+ * by copying the path to the changed key. Nodes reachable from the
+ * root are never modified, so all the clients of the set manager read
+ * the tree without any locking, after announcing the current epoch.
  *
- * We use a separate vacuum thread to merge changes from the delta lists
- * into the alternate tree, and then do a pointer swap to rotate the
- * primary tree for the alternate.
+ * A writer copies the path and publishes the new root with a pointer
+ * swap, so the change is visible immediately, and advances the epoch.
+ * Writers never wait for clients, since a client may be in the middle
+ * of a flush or a fault. Instead, the vacuum thread waits for the
+ * clients that entered in an older epoch to leave, after which nobody
+ * can be reading the replaced nodes and they are released.
  *
- * This mechanism ensures we have at most 2 ART trees, reads are lock-free,
- * and performance does not degrade with the number of sets.
+ * Dropped and cleared sets are unreachable once the writer returns,
+ * and are handed to the vacuum thread to be closed or deleted once
+ * the clients that could have reached them have left.
  *
+ * This mechanism ensures updates copy only O(key length) nodes,
+ * reads are lock-free, and performance does not degrade with the
+ * number of sets.
  */
 struct hlld_setmgr {
     hlld_config *config;
+    unsigned long long id;  // Unique id, used to cache client records
 
     int should_run;  // Used to stop the vacuum thread
     pthread_t vacuum_thread;
 
-    /*
-     * To support vacuuming of old versions, we require that
-     * workers 'periodically' checkpoint. This just updates an
-     * index to match the current version. The vacuum thread
-     * can scan for the minimum seen version and clean all older
-     * versions.
-     */
+    // Clients of the set manager, and the global epoch
     setmgr_client *clients;
     hlld_spinlock clients_lock;
+    volatile unsigned long long epoch;
+    uint64_t cache_hits;        // Set cache counters of departed clients
+    uint64_t cache_misses;
 
-    // This is the current version. Should be used
-    // under the write lock.
-    unsigned long long vsn;
     pthread_mutex_t write_lock; // Serializes destructive operations
 
     // Maps key names -> hlld_set_wrapper
-    unsigned long long primary_vsn; // This is the version that set_map represents
-    art_tree *set_map;
-    art_tree *alt_set_map;
+    art_tree set_map;
 
     /**
-     * List of pending deletes. This is necessary
-     * because the set_map may reflect that a delete has
-     * taken place, while the vacuum thread has not yet performed the
-     * delete. This allows create to return a "Delete in progress".
+     * List of sets that have been removed from the set map,
+     * but are not yet closed or deleted by the vacuum thread.
+     * This allows create to return a "Delete in progress".
      */
-    hlld_set_list *pending_deletes;
-    hlld_spinlock pending_lock;
+    set_list *retired;
+    hlld_spinlock retired_lock;
+    pthread_mutex_t vacuum_lock;
+    pthread_cond_t vacuum_cond;
+    int vacuum_pending;     // Set when there is something to reclaim
 
-    // Delta lists for non-merged operations
-    set_list *delta;
+    /**
+     * Helper threads for bulk size requests. Batches are
+     * only queued by a client inside the manager, which keeps
+     * the sets alive until the batch is complete.
+     */
+    int num_size_helpers;
+    pthread_t size_helpers[MAX_SIZE_HELPERS];
+    size_batch *size_batches;
+    int size_should_run;
+    pthread_mutex_t size_lock;
+    pthread_cond_t size_cond;       // Signaled on new batches
+    pthread_cond_t size_done_cond;  // Signaled on finished work
+
+    // Memory budget state
+    uint64_t resident_bytes;        // Register bytes of mapped sets that can be unmapped
+    uint64_t pinned_bytes;          // Register bytes of in-memory only sets
+    pthread_mutex_t evict_lock;     // Serializes eviction
+    char *clock_hand;               // Name of the last set inspected, NULL at the start
+
+    // I/O threads that fault in sets for the workers
+    int num_fault_threads;
+    pthread_t fault_threads[FAULT_THREADS];
+    fault_job *fault_head;
+    fault_job *fault_tail;
+    int fault_should_run;
+    pthread_mutex_t fault_lock;
+    pthread_cond_t fault_cond;
 };
 
 /**
- * We warn if there are this many outstanding versions
- * that cannot be vacuumed
+ * Source of unique set manager ids
  */
-#define WARN_THRESHOLD 32
+static unsigned long long next_mgr_id = 0;
+
+/**
+ * Each thread caches its client record for the
+ * last set manager it used, to avoid a list scan.
+ */
+static __thread unsigned long long local_mgr_id = 0;
+static __thread setmgr_client *local_client = NULL;
 
 /*
  * Static declarations
@@ -128,16 +241,48 @@ struct hlld_setmgr {
 static const char FOLDER_PREFIX[] = "hlld.";
 static const int FOLDER_PREFIX_LEN = sizeof(FOLDER_PREFIX) - 1;
 
+/**
+ * The catalog is kept in its own folder, so that
+ * replacing it does not modify the data directory.
+ */
+static const char CATALOG_FOLDER[] = "catalog";
+static const char CATALOG_FILE[] = "catalog/manifest";
+
+/**
+ * The catalog is only written if the data directory has
+ * not been modified for this many seconds. This guards
+ * against file systems with a coarse mtime resolution.
+ */
+#define CATALOG_RACY_SEC 1
+
+static setmgr_client* get_client(hlld_setmgr *mgr);
+static void enter_mgr(hlld_setmgr *mgr);
+static void leave_mgr(hlld_setmgr *mgr);
+static void wait_for_clients(hlld_setmgr *mgr, unsigned long long epoch);
+static void wake_vacuum(hlld_setmgr *mgr);
+static void publish_update(hlld_setmgr *mgr, int is_create, hlld_set_wrapper *set);
+static void retire_set(hlld_setmgr *mgr, hlld_set_wrapper *set);
+static void reclaim_retired(hlld_setmgr *mgr);
 static hlld_set_wrapper* find_set(hlld_setmgr *mgr, char *set_name);
 static hlld_set_wrapper* take_set(hlld_setmgr *mgr, char *set_name);
 static void delete_set(hlld_set_wrapper *set);
-static int add_set(hlld_setmgr *mgr, char *set_name, hlld_config *config, int is_hot, int delta);
+static int add_set(hlld_setmgr *mgr, char *set_name, hlld_config *config, int is_hot, int publish);
 static int set_map_list_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
 static int set_map_list_cold_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
 static int set_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int set_map_close_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int set_map_page_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static hlld_set_wrapper* load_cold_set(hlld_config *config, char *set_name, hlld_set_config *set_config);
+static int load_catalog(hlld_setmgr *mgr);
 static int load_existing_sets(hlld_setmgr *mgr);
-static unsigned long long create_delta_update(hlld_setmgr *mgr, delta_type type, hlld_set_wrapper *set);
 static void* setmgr_thread_main(void *in);
+static int work_size_batch(size_batch *b);
+static void unlink_size_batch(hlld_setmgr *mgr, size_batch *b);
+static void* size_helper_main(void *in);
+static void track_set(hlld_setmgr *mgr, hlld_set_wrapper *set);
+static void* fault_thread_main(void *in);
+static int queue_fault(hlld_setmgr *mgr, char *set_name, fault_cb cb, void *data);
+static int evict_scan_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
 
 /**
  * Initializer
@@ -153,34 +298,56 @@ int init_set_manager(hlld_config *config, int vacuum, hlld_setmgr **mgr) {
 
     // Copy the config
     m->config = config;
+    m->id = __atomic_add_fetch(&next_mgr_id, 1, __ATOMIC_RELAXED);
+    m->epoch = 1;
 
     // Initialize the locks
     pthread_mutex_init(&m->write_lock, NULL);
     INIT_HLLD_SPIN(&m->clients_lock);
-    INIT_HLLD_SPIN(&m->pending_lock);
-
-    // Allocate storage for the art trees
-    art_tree *trees = calloc(2, sizeof(art_tree));
-    m->set_map = trees;
-    m->alt_set_map = trees+1;
+    INIT_HLLD_SPIN(&m->retired_lock);
+    pthread_mutex_init(&m->vacuum_lock, NULL);
+    pthread_cond_init(&m->vacuum_cond, NULL);
+    pthread_mutex_init(&m->size_lock, NULL);
+    pthread_cond_init(&m->size_cond, NULL);
+    pthread_cond_init(&m->size_done_cond, NULL);
+    pthread_mutex_init(&m->evict_lock, NULL);
+    pthread_mutex_init(&m->fault_lock, NULL);
+    pthread_cond_init(&m->fault_cond, NULL);
 
     // Allocate the initial art tree
-    int res = init_art_tree(m->set_map);
+    int res = init_art_tree(&m->set_map);
     if (res) {
         syslog(LOG_ERR, "Failed to allocate set map!");
         free(m);
         return -1;
     }
 
-    // Discover existing sets
-    load_existing_sets(m);
+    // Discover existing sets, use the catalog if possible
+    if (load_catalog(m)) {
+        load_existing_sets(m);
+    }
 
-    // Initialize the alternate map
-    res = art_copy(m->alt_set_map, m->set_map);
-    if (res) {
-        syslog(LOG_ERR, "Failed to copy set map to alternate!");
-        destroy_set_manager(m);
-        return -1;
+    // Start the size helpers, leaving a core for the caller
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int helpers = (cpus > 1) ? cpus - 1 : 0;
+    if (helpers > MAX_SIZE_HELPERS) helpers = MAX_SIZE_HELPERS;
+    m->size_should_run = 1;
+    for (int i=0; i < helpers; i++) {
+        if (pthread_create(&m->size_helpers[i], NULL, size_helper_main, m)) {
+            syslog(LOG_WARNING, "Failed to start size helper thread!");
+            break;
+        }
+        m->num_size_helpers++;
+    }
+
+    // Start the I/O threads
+    m->fault_should_run = 1;
+    for (int i=0; i < FAULT_THREADS; i++) {
+        if (pthread_create(&m->fault_threads[i], NULL, fault_thread_main, m)) {
+            syslog(LOG_WARNING, "Failed to start fault thread!");
+            break;
+        }
+        m->num_fault_threads++;
     }
 
     // Start the vacuum thread
@@ -195,6 +362,26 @@ int init_set_manager(hlld_config *config, int vacuum, hlld_setmgr **mgr) {
     return 0;
 }
 
+/**
+ * Stops the I/O threads once the queued faults are done.
+ * Their callbacks are invoked before this returns, and
+ * later faults are done by the caller instead of being queued.
+ * This must be called before anything the callbacks
+ * use is torn down. Safe to call more than once.
+ * @arg mgr The manager
+ */
+void setmgr_stop_faults(hlld_setmgr *mgr) {
+    pthread_mutex_lock(&mgr->fault_lock);
+    int running = mgr->fault_should_run;
+    mgr->fault_should_run = 0;
+    pthread_cond_broadcast(&mgr->fault_cond);
+    pthread_mutex_unlock(&mgr->fault_lock);
+    if (!running) return;
+    for (int i=0; i < mgr->num_fault_threads; i++) {
+        pthread_join(mgr->fault_threads[i], NULL);
+    }
+}
+
 /**
  * Cleanup
  * @arg mgr The manager to destroy
@@ -202,24 +389,34 @@ int init_set_manager(hlld_config *config, int vacuum, hlld_setmgr **mgr) {
  */
 int destroy_set_manager(hlld_setmgr *mgr) {
     // Stop the vacuum thread
+    pthread_mutex_lock(&mgr->vacuum_lock);
     mgr->should_run = 0;
+    pthread_cond_signal(&mgr->vacuum_cond);
+    pthread_mutex_unlock(&mgr->vacuum_lock);
     if (mgr->vacuum_thread) pthread_join(mgr->vacuum_thread, NULL);
 
-    // Nuke all the keys in the current version.
-    art_iter(mgr->set_map, set_map_delete_cb, mgr);
+    // Stop the I/O threads, if not already stopped
+    setmgr_stop_faults(mgr);
 
-    // Handle any delta operations
-    set_list *next, *current = mgr->delta;
-    while (current) {
-        // Only delete pending creates, pending
-        // deletes are still in the primary tree
-        if (current->type == CREATE)
-            delete_set(current->set);
-        next = current->next;
-        free(current);
-        current = next;
+    // Stop the size helpers
+    pthread_mutex_lock(&mgr->size_lock);
+    mgr->size_should_run = 0;
+    pthread_cond_broadcast(&mgr->size_cond);
+    pthread_mutex_unlock(&mgr->size_lock);
+    for (int i=0; i < mgr->num_size_helpers; i++) {
+        pthread_join(mgr->size_helpers[i], NULL);
     }
 
+    // Close or delete any retired sets
+    reclaim_retired(mgr);
+
+    // Close the sets first, so the catalog has their final sizes
+    art_iter(&mgr->set_map, set_map_close_cb, mgr);
+    setmgr_write_catalog(mgr);
+
+    // Nuke all the keys in the current version.
+    art_iter(&mgr->set_map, set_map_delete_cb, mgr);
+
     // Free the clients
     setmgr_client *cl_next, *cl = mgr->clients;
     while (cl) {
@@ -229,11 +426,18 @@ int destroy_set_manager(hlld_setmgr *mgr) {
     }
 
     // Destroy the ART trees
-    destroy_art_tree(mgr->set_map);
-    destroy_art_tree(mgr->alt_set_map);
-    free((mgr->set_map < mgr->alt_set_map) ? mgr->set_map : mgr->alt_set_map);
+    destroy_art_tree(&mgr->set_map);
 
     // Free the manager
+    pthread_mutex_destroy(&mgr->vacuum_lock);
+    pthread_cond_destroy(&mgr->vacuum_cond);
+    pthread_mutex_destroy(&mgr->size_lock);
+    pthread_cond_destroy(&mgr->size_cond);
+    pthread_cond_destroy(&mgr->size_done_cond);
+    pthread_mutex_destroy(&mgr->evict_lock);
+    pthread_mutex_destroy(&mgr->fault_lock);
+    pthread_cond_destroy(&mgr->fault_cond);
+    if (mgr->clock_hand) free(mgr->clock_hand);
     free(mgr);
     return 0;
 }
@@ -247,33 +451,9 @@ int destroy_set_manager(hlld_setmgr *mgr) {
  * @arg mgr The manager
  */
 void setmgr_client_checkpoint(hlld_setmgr *mgr) {
-    // Get a reference to ourself
-    pthread_t id = pthread_self();
-
-    // Look for our ID, and update the version
-    // This is O(n), but N is small and its done infrequently
-    setmgr_client *cl = mgr->clients;
-    while (cl) {
-        if (cl->id == id) {
-            cl->vsn = mgr->vsn;
-            return;
-        }
-        cl = cl->next;
-    }
-
-    // If we make it here, we are not a client yet
-    // so we need to safely add ourself
-    cl = malloc(sizeof(setmgr_client));
-    cl->id = id;
-    cl->vsn = mgr->vsn;
-
-    // Critical section for the flip
-    LOCK_HLLD_SPIN(&mgr->clients_lock);
-
-    cl->next = mgr->clients;
-    mgr->clients = cl;
-
-    UNLOCK_HLLD_SPIN(&mgr->clients_lock);
+    // Clients only hold references inside of the set manager
+    // calls, so all that is needed is to be registered.
+    get_client(mgr);
 }
 
 /**
@@ -298,7 +478,15 @@ void setmgr_client_leave(hlld_setmgr *mgr) {
             // Set the last prev pointer to skip the current entry
             *last_next = cl->next;
 
+            // Keep the cache counters
+            mgr->cache_hits += cl->cache_hits;
+            mgr->cache_misses += cl->cache_misses;
+
             // Cleanup the memory associated
+            if (local_client == cl) {
+                local_client = NULL;
+                local_mgr_id = 0;
+            }
             free(cl);
             break;
         }
@@ -315,8 +503,12 @@ void setmgr_client_leave(hlld_setmgr *mgr) {
  */
 int setmgr_flush_set(hlld_setmgr *mgr, char *set_name) {
     // Get the set
+    enter_mgr(mgr);
     hlld_set_wrapper *set = take_set(mgr, set_name);
-    if (!set) return -1;
+    if (!set) {
+        leave_mgr(mgr);
+        return -1;
+    }
 
     // Acquire the READ lock. We use the read lock
     // since clients might inspect the hll, which
@@ -328,6 +520,7 @@ int setmgr_flush_set(hlld_setmgr *mgr, char *set_name) {
 
     // Release the lock
     pthread_rwlock_unlock(&set->rwlock);
+    leave_mgr(mgr);
     return 0;
 }
 
@@ -340,26 +533,43 @@ int setmgr_flush_set(hlld_setmgr *mgr, char *set_name) {
  * -2 on internal error.
  */
 int setmgr_set_keys(hlld_setmgr *mgr, char *set_name, char **keys, int num_keys) {
+    return setmgr_set_keys_at(mgr, set_name, keys, num_keys, 0);
+}
+
+/**
+ * Sets keys in a given set, as seen at a given time.
+ * Only sliding sets take a time.
+ * @arg set_name The name of the set
+ * @arg keys A list of points to character arrays to add
+ * @arg num_keys The number of keys to add
+ * @arg at When the keys were seen in seconds, 0 for now
+ * @return 0 on success, -1 if the set does not exist.
+ * -2 on internal error, -3 if a time is given and the set is not sliding.
+ */
+int setmgr_set_keys_at(hlld_setmgr *mgr, char *set_name, char **keys, int num_keys, uint64_t at) {
     // Get the set
+    enter_mgr(mgr);
     hlld_set_wrapper *set = take_set(mgr, set_name);
-    if (!set) return -1;
+    if (!set) {
+        leave_mgr(mgr);
+        return -1;
+    }
 
     // Acquire the READ lock. We use the read lock
     // since we can handle concurrent writes.
     pthread_rwlock_rdlock(&set->rwlock);
 
     // Set the keys, store the results
-    int res = 0;
-    for (int i=0; i<num_keys; i++) {
-        res = hset_add(set->set, keys[i]);
-        if (res) break;
-    }
+    int res = hset_add_keys_at(set->set, keys, num_keys, at);
 
     // Mark as hot
-    set->is_hot = 1;
+    if (set->is_hot < HOT_MAX) set->is_hot++;
+    hset_touch(set->set);
 
     // Release the lock
     pthread_rwlock_unlock(&set->rwlock);
+    leave_mgr(mgr);
+    if (res == -2) return -3;
     return (res == -1) ? -2 : 0;
 }
 
@@ -371,8 +581,12 @@ int setmgr_set_keys(hlld_setmgr *mgr, char *set_name, char **keys, int num_keys)
  */
 int setmgr_set_size(hlld_setmgr *mgr, char *set_name, uint64_t *est) {
     // Get the set
+    enter_mgr(mgr);
     hlld_set_wrapper *set = take_set(mgr, set_name);
-    if (!set) return -1;
+    if (!set) {
+        leave_mgr(mgr);
+        return -1;
+    }
 
     // Acquire the READ lock. We use the read lock
     // since we can handle concurrent read/writes.
@@ -380,12 +594,220 @@ int setmgr_set_size(hlld_setmgr *mgr, char *set_name, uint64_t *est) {
 
     // Get the size
     *est = hset_size(set->set);
+    hset_touch(set->set);
 
     // Release the lock
     pthread_rwlock_unlock(&set->rwlock);
+    leave_mgr(mgr);
+    return 0;
+}
+
+/**
+ * Estimates the size of the most recent windows of a set.
+ * Sets that are not windowed are estimated in full.
+ * @arg set_name The name of the set
+ * @arg last The period to estimate, in seconds
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if the set does not exist.
+ */
+int setmgr_set_size_last(hlld_setmgr *mgr, char *set_name, uint64_t last, uint64_t *est) {
+    enter_mgr(mgr);
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) {
+        leave_mgr(mgr);
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&set->rwlock);
+    *est = hset_size_last(set->set, last);
+    hset_touch(set->set);
+    pthread_rwlock_unlock(&set->rwlock);
+    leave_mgr(mgr);
     return 0;
 }
 
+/**
+ * Faults a set into memory on an I/O thread, so that
+ * the caller does not block on the disk. This is only
+ * done if the set exists and adding to it would fault in registers.
+ * The callback is invoked from the I/O thread.
+ * @arg mgr The manager
+ * @arg set_name The name of the set
+ * @arg cb The callback to invoke once the fault is done
+ * @arg data Opaque handle passed to the callback
+ * @return 1 if the fault was queued, 0 if there is nothing to fault
+ * or the I/O threads are stopped.
+ */
+int setmgr_fault_async(hlld_setmgr *mgr, char *set_name, fault_cb cb, void *data) {
+    if (!mgr->num_fault_threads) return 0;
+
+    // Check if the set needs to be faulted in
+    enter_mgr(mgr);
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    int needs_fault = set && hset_needs_fault(set->set);
+    leave_mgr(mgr);
+    if (!needs_fault) return 0;
+
+    return !queue_fault(mgr, set_name, cb, data);
+}
+
+/**
+ * Warms a set in the background. The set is faulted
+ * in and its pages touched on an I/O thread, so the next access
+ * does not wait on the disk.
+ * @arg mgr The manager
+ * @arg set_name The name of the set
+ * @return 0 on success, -1 if the set does not exist.
+ */
+int setmgr_warm_set(hlld_setmgr *mgr, char *set_name) {
+    enter_mgr(mgr);
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    leave_mgr(mgr);
+    if (!set) return -1;
+    if (mgr->num_fault_threads) queue_fault(mgr, set_name, NULL, NULL);
+    return 0;
+}
+
+// State of a prefix warm
+typedef struct {
+    hlld_setmgr *mgr;
+    int queued;
+} warm_state;
+
+// Callback invoked for each set matching a warm prefix
+static void warm_set_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set;
+    warm_state *state = data;
+    if (!queue_fault(state->mgr, set_name, NULL, NULL)) state->queued++;
+}
+
+/**
+ * Warms all the sets matching a prefix in the background.
+ * @arg mgr The manager
+ * @arg prefix The prefix to match on
+ * @return The number of sets that were queued.
+ */
+int setmgr_warm_prefix(hlld_setmgr *mgr, char *prefix) {
+    if (!mgr->num_fault_threads) return 0;
+    warm_state state = {mgr, 0};
+    setmgr_list_page(mgr, prefix, NULL, 0, warm_set_cb, &state);
+    return state.queued;
+}
+
+/**
+ * Estimates the size of many sets at once. Estimates
+ * that are not cached are computed in parallel by the
+ * size helpers when there are enough registers to scan.
+ * @arg mgr The manager
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg ests Output, the estimate of each set
+ * @arg found Output, set to 1 for each set that exists
+ * @return The number of sets that exist.
+ */
+int setmgr_set_sizes(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *ests, char *found) {
+    size_batch b = {calloc(num_sets, sizeof(hlld_set_wrapper*)), ests, num_sets, 0, 0, 0, NULL};
+    int num_found = 0;
+    uint64_t registers = 0;
+
+    // Resolve all the sets, and estimate the work
+    enter_mgr(mgr);
+    for (int i=0; i < num_sets; i++) {
+        hlld_set_wrapper *set = take_set(mgr, set_names[i]);
+        found[i] = (set != NULL);
+        ests[i] = 0;
+        if (!set) continue;
+        b.sets[i] = set;
+        num_found++;
+
+        hlld_set *s = set->set;
+        if (!s->is_proxied && !(s->size_cached && s->size_version == s->hll_version))
+            registers += 1ULL << s->set_config.default_precision;
+    }
+
+    // Small requests are not worth the handoff
+    if (!mgr->num_size_helpers || num_found < 2 || registers < SIZE_PARALLEL_REGISTERS) {
+        work_size_batch(&b);
+
+    } else {
+        // Queue the batch for the helpers
+        pthread_mutex_lock(&mgr->size_lock);
+        size_batch **tail = &mgr->size_batches;
+        while (*tail) tail = &(*tail)->next_batch;
+        *tail = &b;
+        pthread_cond_broadcast(&mgr->size_cond);
+        pthread_mutex_unlock(&mgr->size_lock);
+
+        // Work on it ourself, then wait for the helpers
+        int done = work_size_batch(&b);
+        pthread_mutex_lock(&mgr->size_lock);
+        b.done += done;
+        while (b.done < b.num || b.refs) {
+            pthread_cond_wait(&mgr->size_done_cond, &mgr->size_lock);
+        }
+        unlink_size_batch(mgr, &b);
+        pthread_mutex_unlock(&mgr->size_lock);
+    }
+    leave_mgr(mgr);
+
+    free(b.sets);
+    return num_found;
+}
+
+/**
+ * Estimates the number of keys that were added to every
+ * one of the given sets. The registers of each set are
+ * copied out, so no set is locked for the estimate.
+ * @arg set_names The names of the sets to intersect
+ * @arg num_sets The number of sets, at most HLL_MAX_INTERSECT
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if a set does not exist,
+ * -2 if the sets have a different precision, -3 on internal error.
+ */
+int setmgr_intersect_size(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *est) {
+    if (num_sets < 1 || num_sets > HLL_MAX_INTERSECT) return -3;
+    hll_t hlls[HLL_MAX_INTERSECT];
+    int num_init = 0;
+    int res = 0;
+
+    enter_mgr(mgr);
+    for (int i=0; i < num_sets && !res; i++) {
+        hlld_set_wrapper *set = take_set(mgr, set_names[i]);
+        if (!set) {
+            res = -1;
+            break;
+        }
+
+        // Copy out the registers under the read lock
+        pthread_rwlock_rdlock(&set->rwlock);
+        unsigned char precision = hset_config(set->set)->default_precision;
+        if (i && precision != hlls[0].precision) {
+            res = -2;
+        } else if (hll_init(precision, hlls+i)) {
+            res = -3;
+        } else {
+            num_init++;
+            if (hset_merge_into(set->set, hlls+i)) res = -3;
+            hset_touch(set->set);
+        }
+        pthread_rwlock_unlock(&set->rwlock);
+    }
+    leave_mgr(mgr);
+
+    if (!res) {
+        hll_size_fn size = (mgr->config->estimator_mode == ESTIMATE_ERTL) ? hll_size_ertl : hll_size;
+        double intersect = hll_intersect_size(hlls, num_sets, size);
+        if (intersect < 0)
+            res = -3;
+        else
+            *est = intersect + 0.5;
+    }
+    for (int i=0; i < num_init; i++) {
+        hll_destroy(hlls+i);
+    }
+    return res;
+}
+
 /**
  * Creates a new set of the given name and parameters.
  * @arg set_name The name of the set
@@ -408,20 +830,18 @@ int setmgr_create_set(hlld_setmgr *mgr, char *set_name, hlld_config *custom_conf
         goto LEAVE;
     }
 
-    // Scan the pending delete queue
-    LOCK_HLLD_SPIN(&mgr->pending_lock);
-    if (mgr->pending_deletes) {
-        hlld_set_list *node = mgr->pending_deletes;
-        while (node) {
-            if (!strcmp(node->set_name, set_name)) {
-                res = -3; // Pending delete
-                UNLOCK_HLLD_SPIN(&mgr->pending_lock);
-                goto LEAVE;
-            }
-            node = node->next;
+    // Scan the retired sets that are not yet deleted
+    LOCK_HLLD_SPIN(&mgr->retired_lock);
+    set_list *node = mgr->retired;
+    while (node) {
+        if (!strcmp(node->set_name, set_name)) {
+            res = -3; // Pending delete
+            UNLOCK_HLLD_SPIN(&mgr->retired_lock);
+            goto LEAVE;
         }
+        node = node->next;
     }
-    UNLOCK_HLLD_SPIN(&mgr->pending_lock);
+    UNLOCK_HLLD_SPIN(&mgr->retired_lock);
 
     // Use a custom config if provided, else the default
     hlld_config *config = (custom_config) ? custom_config : mgr->config;
@@ -457,7 +877,8 @@ int setmgr_drop_set(hlld_setmgr *mgr, char *set_name) {
     // Set the set to be non-active and mark for deletion
     set->is_active = 0;
     set->should_delete = 1;
-    create_delta_update(mgr, DELETE, set);
+    publish_update(mgr, 0, set);
+    retire_set(mgr, set);
 
 LEAVE:
     pthread_mutex_unlock(&mgr->write_lock);
@@ -493,7 +914,8 @@ int setmgr_clear_set(hlld_setmgr *mgr, char *set_name) {
     // being deleted. Instead, it is merely closed.
     set->is_active = 0;
     set->should_delete = 0;
-    create_delta_update(mgr, DELETE, set);
+    publish_update(mgr, 0, set);
+    retire_set(mgr, set);
 
 LEAVE:
     pthread_mutex_unlock(&mgr->write_lock);
@@ -512,11 +934,15 @@ LEAVE:
  */
 int setmgr_unmap_set(hlld_setmgr *mgr, char *set_name) {
     // Get the set
+    enter_mgr(mgr);
     hlld_set_wrapper *set = take_set(mgr, set_name);
-    if (!set) return -1;
+    if (!set) {
+        leave_mgr(mgr);
+        return -1;
+    }
 
     // Bail if we are in memory only
-    if (set->set->set_config.in_memory)
+    if (hset_config(set->set)->in_memory)
         goto LEAVE;
 
     // Acquire the write lock
@@ -529,9 +955,43 @@ int setmgr_unmap_set(hlld_setmgr *mgr, char *set_name) {
     pthread_rwlock_unlock(&set->rwlock);
 
 LEAVE:
+    leave_mgr(mgr);
     return 0;
 }
 
+/**
+ * Converts the registers of a closed set to another layout.
+ * @arg set_name The name of the set to convert
+ * @arg layout The new hll_layout of the registers
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 if the set is not proxied, -3 if the set cannot be
+ * converted, -4 on internal error.
+ */
+int setmgr_convert_set(hlld_setmgr *mgr, char *set_name, int layout) {
+    enter_mgr(mgr);
+    hlld_set_wrapper *set = take_set(mgr, set_name);
+    if (!set) {
+        leave_mgr(mgr);
+        return -1;
+    }
+
+    // Block any updates, which would fault the set in
+    pthread_rwlock_wrlock(&set->rwlock);
+    int res = hset_convert(set->set, layout);
+    pthread_rwlock_unlock(&set->rwlock);
+    leave_mgr(mgr);
+
+    switch (res) {
+        case 0:
+        case -2:
+            return res;
+        case -1:
+            return -3;
+        default:
+            return -4;
+    }
+}
+
 
 /**
  * Allocates space for and returns a linked
@@ -546,34 +1006,12 @@ int setmgr_list_sets(hlld_setmgr *mgr, char *prefix, hlld_set_list_head **head)
     hlld_set_list_head *h = *head = calloc(1, sizeof(hlld_set_list_head));
 
     // Check if we should use the prefix
-    int prefix_len = 0;
-    if (prefix) {
-        prefix_len = strlen(prefix);
-        art_iter_prefix(mgr->set_map, (unsigned char*)prefix, prefix_len, set_map_list_cb, h);
-    } else
-        art_iter(mgr->set_map, set_map_list_cb, h);
-
-    // Joy... we have to potentially handle the delta updates
-    if (mgr->primary_vsn == mgr->vsn) return 0;
-
-    set_list *current = mgr->delta;
-    hlld_set_wrapper *s;
-    while (current) {
-        // Check if this is a match (potential prefix)
-        if (current->type == CREATE) {
-            s = current->set;
-            if (!prefix_len || !strncmp(s->set->set_name, prefix, prefix_len)) {
-                s = current->set;
-                set_map_list_cb(h, (unsigned char*)s->set->set_name, 0, s);
-            }
-        }
-
-        // Don't seek past what the primary set map incorporates
-        if (current->vsn == mgr->primary_vsn + 1)
-            break;
-        current = current->next;
-    }
-
+    enter_mgr(mgr);
+    if (prefix)
+        art_iter_prefix(&mgr->set_map, (unsigned char*)prefix, strlen(prefix), set_map_list_cb, h);
+    else
+        art_iter(&mgr->set_map, set_map_list_cb, h);
+    leave_mgr(mgr);
     return 0;
 }
 
@@ -590,9 +1028,10 @@ int setmgr_list_cold_sets(hlld_setmgr *mgr, hlld_set_list_head **head) {
     // Allocate the head of a new hashmap
     hlld_set_list_head *h = *head = calloc(1, sizeof(hlld_set_list_head));
 
-    // Scan for the cold sets. Ignore deltas, since they are either
-    // new (e.g. hot), or being deleted anyways.
-    art_iter(mgr->set_map, set_map_list_cold_cb, h);
+    // Scan for the cold sets
+    enter_mgr(mgr);
+    art_iter(&mgr->set_map, set_map_list_cold_cb, h);
+    leave_mgr(mgr);
     return 0;
 }
 
@@ -607,15 +1046,62 @@ int setmgr_list_cold_sets(hlld_setmgr *mgr, hlld_set_list_head **head) {
  */
 int setmgr_set_cb(hlld_setmgr *mgr, char *set_name, set_cb cb, void* data) {
     // Get the set
+    enter_mgr(mgr);
     hlld_set_wrapper *set = take_set(mgr, set_name);
-    if (!set) return -1;
+    if (!set) {
+        leave_mgr(mgr);
+        return -1;
+    }
 
     // Callback
     cb(data, set_name, set->set);
+    leave_mgr(mgr);
     return 0;
 }
 
 
+/**
+ * State of a paged listing
+ */
+typedef struct {
+    char *prefix;
+    int prefix_len;
+    int limit;
+    int count;
+    set_cb cb;
+    void *data;
+} set_page;
+
+/**
+ * Invokes a callback with each set in name order, starting
+ * after a given name. This walks the set map in place, without
+ * building a list, so a large listing can be done in pages.
+ * Like setmgr_set_cb, the callback must only read metrics from the set.
+ * @arg mgr The manager to list from
+ * @arg prefix The prefix to match on or NULL
+ * @arg after Only list sets after this name, or NULL
+ * @arg limit The maximum number of sets, 0 for no limit
+ * @arg cb The callback to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return The number of sets visited.
+ */
+int setmgr_list_page(hlld_setmgr *mgr, char *prefix, char *after, int limit, set_cb cb, void *data) {
+    set_page page = {prefix, (prefix) ? strlen(prefix) : 0, limit, 0, cb, data};
+
+    // Seek past the name if it is within the prefix range,
+    // otherwise start at the prefix
+    enter_mgr(mgr);
+    if (after && (!prefix || strncmp(after, prefix, page.prefix_len) >= 0))
+        art_iter_after(&mgr->set_map, (unsigned char*)after, strlen(after)+1, set_map_page_cb, &page);
+    else if (prefix)
+        art_iter_prefix(&mgr->set_map, (unsigned char*)prefix, page.prefix_len, set_map_page_cb, &page);
+    else
+        art_iter(&mgr->set_map, set_map_page_cb, &page);
+    leave_mgr(mgr);
+    return page.count;
+}
+
+
 /**
  * Convenience method to cleanup a set list.
  */
@@ -632,43 +1118,52 @@ void setmgr_cleanup_list(hlld_set_list_head *head) {
 
 
 /**
- * Searches the primary tree and the delta list for a set
+ * Searches the primary tree for a set. Must be
+ * invoked by a client that has entered the manager,
+ * or with the write lock.
  */
 static hlld_set_wrapper* find_set(hlld_setmgr *mgr, char *set_name) {
-    // Search the tree first
-    hlld_set_wrapper *set = art_search(mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1);
-
-    // If we found the set, check if it is active
-    if (set) return set;
-
-    // Check if the primary has all delta changes
-    if (mgr->primary_vsn == mgr->vsn) return NULL;
-
-    // Search the delta list
-    set_list *current = mgr->delta;
-    while (current) {
-        // Check if this is a match
-        if (current->type != BARRIER &&
-            strcmp(current->set->set->set_name, set_name) == 0) {
-            return current->set;
-        }
-
-        // Don't seek past what the primary set map incorporates
-        if (current->vsn == mgr->primary_vsn + 1)
-            break;
-        current = current->next;
-    }
-
-    // Not found
-    return NULL;
+    return art_search(&mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1);
 }
 
 
 /**
- * Gets the hlld set in a thread safe way.
+ * Gets the hlld set in a thread safe way. Inside of a
+ * critical section, the lookup goes through the client's
+ * set cache. Any create or delete advances the epoch,
+ * which invalidates all the cached entries.
  */
 static hlld_set_wrapper* take_set(hlld_setmgr *mgr, char *set_name) {
-    hlld_set_wrapper *set = find_set(mgr, set_name);
+    setmgr_client *cl = get_client(mgr);
+    if (!cl->depth) {
+        hlld_set_wrapper *set = find_set(mgr, set_name);
+        return (set && set->is_active) ? set : NULL;
+    }
+
+    // FNV-1a hash of the name, and the length
+    uint32_t hash = 2166136261U;
+    int len = 0;
+    for (unsigned char *c = (unsigned char*)set_name; *c; c++, len++) {
+        hash = (hash ^ *c) * 16777619U;
+    }
+
+    // Check the cache
+    set_cache_entry *e = cl->cache + (hash & (SET_CACHE_SIZE - 1));
+    hlld_set_wrapper *set;
+    if (e->epoch == cl->epoch && e->hash == hash &&
+            !strcmp(e->set->set->set_name, set_name)) {
+        set = e->set;
+        __atomic_store_n(&cl->cache_hits, cl->cache_hits + 1, __ATOMIC_RELAXED);
+
+    } else {
+        set = art_search(&mgr->set_map, (unsigned char*)set_name, len+1);
+        __atomic_store_n(&cl->cache_misses, cl->cache_misses + 1, __ATOMIC_RELAXED);
+        if (set) {
+            e->epoch = cl->epoch;
+            e->hash = hash;
+            e->set = set;
+        }
+    }
     return (set && set->is_active) ? set : NULL;
 }
 
@@ -702,12 +1197,12 @@ static void delete_set(hlld_set_wrapper *set) {
  * @arg set_name The name of the set
  * @arg config The configuration for the set
  * @arg is_hot Is the set hot. False for existing.
- * @arg delta Should a delta entry be added, or the primary tree updated.
- * This is usually 0, except during initialization when it is safe to update
- * the primary tree.
+ * @arg publish Should the set be published to both trees, or only the
+ * primary tree updated. This is usually 1, except during initialization
+ * when it is safe to update the primary tree.
  * @return 0 on success, -1 on error
  */
-static int add_set(hlld_setmgr *mgr, char *set_name, hlld_config *config, int is_hot, int delta) {
+static int add_set(hlld_setmgr *mgr, char *set_name, hlld_config *config, int is_hot, int publish) {
     // Create the set
     hlld_set_wrapper *set = calloc(1, sizeof(hlld_set_wrapper));
     set->is_active = 1;
@@ -727,11 +1222,13 @@ static int add_set(hlld_setmgr *mgr, char *set_name, hlld_config *config, int is
         return -1;
     }
 
-    // Check if we are adding a delta value or directly updating ART tree
-    if (delta)
-        create_delta_update(mgr, CREATE, set);
+    track_set(mgr, set);
+
+    // Check if we are publishing or directly updating ART tree
+    if (publish)
+        publish_update(mgr, 1, set);
     else
-        art_insert(mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1, set);
+        art_insert(&mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1, set);
 
     return 0;
 }
@@ -806,6 +1303,24 @@ static int set_map_list_cold_cb(void *data, const unsigned char *key, uint32_t k
     return 0;
 }
 
+/**
+ * Called as part of the hashmap callback
+ * to list a page of sets. Stops at the limit,
+ * or once past the prefix.
+ */
+static int set_map_page_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    set_page *page = data;
+    hlld_set_wrapper *set = value;
+    if (page->prefix && strncmp((char*)key, page->prefix, page->prefix_len))
+        return 1;
+    if (!set->is_active) return 0;
+
+    page->cb(page->data, (char*)key, set->set);
+    page->count++;
+    return (page->limit && page->count >= page->limit);
+}
+
 /**
  * Called as part of the hashmap callback
  * to cleanup the sets.
@@ -819,6 +1334,20 @@ static int set_map_delete_cb(void *data, const unsigned char *key, uint32_t key_
     return 0;
 }
 
+/**
+ * Called as part of the hashmap callback
+ * to close the sets before shutdown. The
+ * sets are deleted later by set_map_delete_cb.
+ */
+static int set_map_close_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)data;
+    (void)key;
+    (void)key_len;
+    hlld_set_wrapper *set = value;
+    if (!set->should_delete) hset_close(set->set);
+    return 0;
+}
+
 /**
  * Works with scandir to set out non-hlld folders.
  */
@@ -841,6 +1370,72 @@ static int set_hlld_folders(CONST_DIRENT_T *d) {
     return 0;
 }
 
+/**
+ * Creates the wrapper for an existing set without
+ * touching the disk. Existing sets start cold.
+ * @arg config The configuration
+ * @arg set_name The name of the set
+ * @arg set_config Optional, the known set config
+ * @return The new wrapper or NULL on error.
+ */
+static hlld_set_wrapper* load_cold_set(hlld_config *config, char *set_name, hlld_set_config *set_config) {
+    hlld_set_wrapper *set = calloc(1, sizeof(hlld_set_wrapper));
+    set->is_active = 1;
+    set->is_hot = 0;
+    set->should_delete = 0;
+    pthread_rwlock_init(&set->rwlock, NULL);
+
+    if (init_set_lazy(config, set_name, set_config, &set->set)) {
+        syslog(LOG_ERR, "Failed to load set '%s'!", set_name);
+        free(set);
+        return NULL;
+    }
+    return set;
+}
+
+/**
+ * Loads the existing sets from the catalog. The catalog
+ * is only used if the data directory has not been modified
+ * since it was written. This is not thread safe and assumes
+ * that we are being initialized.
+ * @return 0 if the catalog was used, -1 if we must scan.
+ */
+static int load_catalog(hlld_setmgr *mgr) {
+    hlld_catalog catalog;
+    char *path = join_path(mgr->config->data_dir, (char*)CATALOG_FILE);
+    int res = catalog_read(path, &catalog);
+    free(path);
+    if (res == -ENOENT) {
+        return -1;
+    } else if (res) {
+        syslog(LOG_WARNING, "Ignoring unreadable set catalog. Err: %d", res);
+        return -1;
+    }
+
+    // Check the catalog is not stale
+    struct stat buf;
+    if (stat(mgr->config->data_dir, &buf) ||
+            buf.st_mtime != catalog.mtime_sec ||
+            STAT_MTIME_NSEC(buf) != catalog.mtime_nsec) {
+        syslog(LOG_INFO, "Set catalog is stale, scanning for sets");
+        catalog_free(&catalog);
+        return -1;
+    }
+
+    // Add all the sets to the primary tree
+    for (uint32_t i=0; i < catalog.num_entries; i++) {
+        hlld_catalog_entry *e = catalog.entries+i;
+        hlld_set_wrapper *set = load_cold_set(mgr->config, e->set_name, &e->config);
+        if (!set) continue;
+        track_set(mgr, set);
+        art_insert(&mgr->set_map, (unsigned char*)e->set_name, strlen(e->set_name)+1, set);
+    }
+    syslog(LOG_INFO, "Loaded %d existing sets from the catalog", catalog.num_entries);
+
+    catalog_free(&catalog);
+    return 0;
+}
+
 /**
  * Loads the existing sets. This is not thread
  * safe and assumes that we are being initialized.
@@ -856,13 +1451,16 @@ static int load_existing_sets(hlld_setmgr *mgr) {
     }
     syslog(LOG_INFO, "Found %d existing sets", num);
 
-    // Add all the sets
-    for (int i=0; i< num; i++) {
+    // Add all the sets to the primary tree. The sets start cold and
+    // their configs are only read on first use, so the only disk
+    // access here is the scan.
+    for (int i=0; i < num; i++) {
         char *folder_name = namelist[i]->d_name;
         char *set_name = folder_name + FOLDER_PREFIX_LEN;
-        if (add_set(mgr, set_name, mgr->config, 0, 0)) {
-            syslog(LOG_ERR, "Failed to load set '%s'!", set_name);
-        }
+        hlld_set_wrapper *set = load_cold_set(mgr->config, set_name, NULL);
+        if (!set) continue;
+        track_set(mgr, set);
+        art_insert(&mgr->set_map, (unsigned char*)set_name, strlen(set_name)+1, set);
     }
 
     for (int i=0; i < num; i++) free(namelist[i]);
@@ -872,285 +1470,681 @@ static int load_existing_sets(hlld_setmgr *mgr) {
 
 
 /**
- * Creates a new delta update and adds to the head of the list.
- * This must be invoked with the write lock as it is unsafe.
+ * Returns the client record of the calling thread,
+ * registering the thread if it is not yet a client.
  * @arg mgr The manager
- * @arg type The type of delta
+ * @return The client record
+ */
+static setmgr_client* get_client(hlld_setmgr *mgr) {
+    // Fast path, use the cached record
+    if (local_mgr_id == mgr->id && local_client) return local_client;
+
+    // Look for our ID. This is O(n), but only on the first use
+    pthread_t id = pthread_self();
+    LOCK_HLLD_SPIN(&mgr->clients_lock);
+    setmgr_client *cl = mgr->clients;
+    while (cl && !pthread_equal(cl->id, id)) cl = cl->next;
+    UNLOCK_HLLD_SPIN(&mgr->clients_lock);
+
+    // If we make it here, we are not a client yet
+    // so we need to safely add ourself
+    if (!cl) {
+        cl = calloc(1, sizeof(setmgr_client));
+        cl->id = id;
+        LOCK_HLLD_SPIN(&mgr->clients_lock);
+        cl->next = mgr->clients;
+        mgr->clients = cl;
+        UNLOCK_HLLD_SPIN(&mgr->clients_lock);
+    }
+
+    local_mgr_id = mgr->id;
+    local_client = cl;
+    return cl;
+}
+
+/**
+ * Enters a read-side critical section. Until the matching
+ * leave_mgr(), any set or tree that is reached is not freed.
+ * Calls may be nested.
+ * @arg mgr The manager
+ */
+static void enter_mgr(hlld_setmgr *mgr) {
+    setmgr_client *cl = get_client(mgr);
+    if (cl->depth++) return;
+
+    // Publish our epoch before reading the set map
+    __atomic_store_n(&cl->epoch, __atomic_load_n(&mgr->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * Leaves a read-side critical section.
+ * @arg mgr The manager
+ */
+static void leave_mgr(hlld_setmgr *mgr) {
+    setmgr_client *cl = get_client(mgr);
+    if (--cl->depth) return;
+    __atomic_store_n(&cl->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Waits until every client that entered before an epoch
+ * has left. After this returns, nothing that was unpublished
+ * before the epoch was reached is referenced.
+ * Must not be called from inside a critical section.
+ * @arg mgr The manager
+ * @arg epoch The epoch
+ */
+static void wait_for_clients(hlld_setmgr *mgr, unsigned long long epoch) {
+    setmgr_client *self = (local_mgr_id == mgr->id) ? local_client : NULL;
+
+    int waits = 0;
+    int busy;
+    do {
+        // Look for a client that is in an older epoch
+        busy = 0;
+        LOCK_HLLD_SPIN(&mgr->clients_lock);
+        for (setmgr_client *cl = mgr->clients; cl; cl = cl->next) {
+            if (cl == self) continue;
+            unsigned long long cl_epoch = __atomic_load_n(&cl->epoch, __ATOMIC_ACQUIRE);
+            if (cl_epoch && cl_epoch < epoch) {
+                busy = 1;
+                break;
+            }
+        }
+        UNLOCK_HLLD_SPIN(&mgr->clients_lock);
+
+        // Back off while waiting
+        if (!busy) break;
+        if (waits++ < SYNC_SPIN_LIMIT)
+            sched_yield();
+        else
+            usleep(SYNC_SLEEP_USEC);
+    } while (busy);
+}
+
+/**
+ * Publishes the creation or removal of a set. The path to the
+ * set is copied and the new root is published. The old path is
+ * released by the vacuum thread once no client can be reading it,
+ * so this never waits on the clients. This must be invoked with
+ * the write lock.
+ * @arg mgr The manager
+ * @arg is_create Should the set be added, otherwise removed.
  * @arg set The set that is affected
- * @return The new version we created
  */
-static unsigned long long create_delta_update(hlld_setmgr *mgr, delta_type type, hlld_set_wrapper *set) {
-    set_list *delta = malloc(sizeof(set_list));
-    delta->vsn = ++mgr->vsn;
-    delta->type = type;
-    delta->set = set;
-    delta->next = mgr->delta;
-    mgr->delta = delta;
-    return delta->vsn;
+static void publish_update(hlld_setmgr *mgr, int is_create, hlld_set_wrapper *set) {
+    unsigned char *key = (unsigned char*)set->set->set_name;
+    int key_len = strlen(set->set->set_name)+1;
+
+    // Publish a new root
+    if (is_create)
+        art_insert_cow(&mgr->set_map, key, key_len, set);
+    else
+        art_delete_cow(&mgr->set_map, key, key_len);
+
+    // Clients that enter from now on can not reach the old path
+    __atomic_add_fetch(&mgr->epoch, 1, __ATOMIC_SEQ_CST);
+    wake_vacuum(mgr);
 }
 
 /**
- * Merges changes into the alternate tree from the delta lists
- * Safety: Safe ONLY if no other thread is using alt_set_map
+ * Wakes up the vacuum thread to reclaim what was unpublished.
+ * @arg mgr The manager
  */
-static void merge_old_versions(hlld_setmgr *mgr, set_list *delta, unsigned long long min_vsn) {
-    // Handle older delta first (bottom up)
-    if (delta->next) merge_old_versions(mgr, delta->next, min_vsn);
+static void wake_vacuum(hlld_setmgr *mgr) {
+    pthread_mutex_lock(&mgr->vacuum_lock);
+    mgr->vacuum_pending = 1;
+    pthread_cond_signal(&mgr->vacuum_cond);
+    pthread_mutex_unlock(&mgr->vacuum_lock);
+}
 
-    // Check if we should skip this update
-    if (delta->vsn > min_vsn) return;
+/**
+ * Hands a set that was removed from the set map to the
+ * vacuum thread, to be closed or deleted once no client
+ * can be using it. This must be invoked with the write lock.
+ * @arg mgr The manager
+ * @arg set The set to retire
+ */
+static void retire_set(hlld_setmgr *mgr, hlld_set_wrapper *set) {
+    set_list *node = malloc(sizeof(set_list));
+    node->set_name = strdup(set->set->set_name);
+    node->set = set;
+
+    LOCK_HLLD_SPIN(&mgr->retired_lock);
+    node->next = mgr->retired;
+    mgr->retired = node;
+    UNLOCK_HLLD_SPIN(&mgr->retired_lock);
+    wake_vacuum(mgr);
+}
 
-    // Handle current update
-    hlld_set_wrapper *s = delta->set;
-    switch (delta->type) {
-        case CREATE:
-            art_insert(mgr->alt_set_map, (unsigned char*)s->set->set_name, strlen(s->set->set_name)+1, s);
-            break;
-        case DELETE:
-            art_delete(mgr->alt_set_map, (unsigned char*)s->set->set_name, strlen(s->set->set_name)+1);
-            break;
-        case BARRIER:
-            // Ignore the barrier...
-            break;
+/**
+ * Releases the replaced nodes of the set map, and closes or
+ * deletes the retired sets, once the clients that could be
+ * using them have left. Writers are only blocked while taking
+ * a snapshot and while releasing the nodes, not while waiting.
+ * The sets are only removed from the retired list once they are
+ * deleted, so that create can report a pending delete.
+ * @arg mgr The manager
+ */
+static void reclaim_retired(hlld_setmgr *mgr) {
+    // Snapshot what was unpublished so far. Writers unpublish and
+    // advance the epoch under the write lock, so the epoch covers it all.
+    pthread_mutex_lock(&mgr->write_lock);
+    uint32_t garbage = mgr->set_map.num_garbage;
+    unsigned long long epoch = __atomic_load_n(&mgr->epoch, __ATOMIC_ACQUIRE);
+    LOCK_HLLD_SPIN(&mgr->retired_lock);
+    set_list *old = mgr->retired;
+    UNLOCK_HLLD_SPIN(&mgr->retired_lock);
+    pthread_mutex_unlock(&mgr->write_lock);
+    if (!garbage && !old) return;
+
+    // Wait for the clients that may be using them
+    wait_for_clients(mgr, epoch);
+
+    // Release the old nodes, any replaced since are kept
+    if (garbage) {
+        pthread_mutex_lock(&mgr->write_lock);
+        art_release_garbage_upto(&mgr->set_map, garbage);
+        pthread_mutex_unlock(&mgr->write_lock);
+    }
+    if (!old) return;
+
+    // Handle the deletes
+    for (set_list *node = old; node; node = node->next) {
+        delete_set(node->set);
+    }
+
+    // Unlink the handled sets. New sets are only
+    // added at the head, so we just cut the list.
+    LOCK_HLLD_SPIN(&mgr->retired_lock);
+    set_list **ref = &mgr->retired;
+    while (*ref != old) ref = &(*ref)->next;
+    *ref = NULL;
+    UNLOCK_HLLD_SPIN(&mgr->retired_lock);
+
+    set_list *next;
+    while (old) {
+        next = old->next;
+        free(old->set_name);
+        free(old);
+        old = next;
     }
 }
 
 /**
- * Updates the pending deletes list with a list of pending deletes
+ * This thread is started after initialization to maintain
+ * the state of the set manager. It's current use is to release
+ * the unpublished parts of the set map, and close or delete the
+ * sets that were dropped or cleared, once no client uses them.
  */
-static void mark_pending_deletes(hlld_setmgr *mgr, unsigned long long min_vsn) {
-    hlld_set_list *tmp, *pending = NULL;
-
-    // Add each delete
-    set_list *delta = mgr->delta;
-    while (delta) {
-        if (delta->vsn <= min_vsn && delta->type == DELETE) {
-            tmp = malloc(sizeof(hlld_set_list));
-            tmp->set_name = strdup(delta->set->set->set_name);
-            tmp->next = pending;
-            pending = tmp;
+static void* setmgr_thread_main(void *in) {
+    // Extract our arguments
+    hlld_setmgr *mgr = in;
+    struct timespec ts;
+    while (mgr->should_run) {
+        // Wait for something to reclaim, or a timeout
+        pthread_mutex_lock(&mgr->vacuum_lock);
+        if (mgr->should_run && !mgr->vacuum_pending) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += VACUUM_POLL_USEC * 1000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&mgr->vacuum_cond, &mgr->vacuum_lock, &ts);
         }
-        delta = delta->next;
+        mgr->vacuum_pending = 0;
+        pthread_mutex_unlock(&mgr->vacuum_lock);
+
+        reclaim_retired(mgr);
     }
+    return NULL;
+}
+
 
-    LOCK_HLLD_SPIN(&mgr->pending_lock);
-    mgr->pending_deletes = pending;
-    UNLOCK_HLLD_SPIN(&mgr->pending_lock);
+/**
+ * Counts the registers of a new set towards the resident
+ * memory, and keeps them counted as it is mapped and unmapped.
+ * Must be called before the set is published.
+ */
+static void track_set(hlld_setmgr *mgr, hlld_set_wrapper *set) {
+    set->set->resident = &mgr->resident_bytes;
+    set->set->pinned = &mgr->pinned_bytes;
+    if (!hset_is_proxied(set->set)) {
+        uint64_t *counter = (hset_config(set->set)->in_memory) ?
+            &mgr->pinned_bytes : &mgr->resident_bytes;
+        __atomic_add_fetch(counter, hset_byte_size(set->set), __ATOMIC_RELAXED);
+    }
 }
 
 /**
- * Clears the pending deletes
+ * Returns the number of register bytes of all the
+ * sets that are currently mapped and can be unmapped.
+ * In-memory only sets are not included.
+ * @arg mgr The manager
+ * @return The resident bytes
  */
-static void clear_pending_deletes(hlld_setmgr *mgr) {
-    // Get a reference to the head
-    hlld_set_list *pending = mgr->pending_deletes;
-    if (!pending) return;
+uint64_t setmgr_resident_bytes(hlld_setmgr *mgr) {
+    return __atomic_load_n(&mgr->resident_bytes, __ATOMIC_RELAXED);
+}
 
-    // Set the pending list to NULL safely
-    LOCK_HLLD_SPIN(&mgr->pending_lock);
-    mgr->pending_deletes = NULL;
-    UNLOCK_HLLD_SPIN(&mgr->pending_lock);
+/**
+ * Returns the number of register bytes of the
+ * in-memory only sets, which are never unmapped.
+ * @arg mgr The manager
+ * @return The pinned bytes
+ */
+uint64_t setmgr_pinned_bytes(hlld_setmgr *mgr) {
+    return __atomic_load_n(&mgr->pinned_bytes, __ATOMIC_RELAXED);
+}
 
-    // Free the nodes
-    hlld_set_list *next;
-    while (pending) {
-        free(pending->set_name);
-        next = pending->next;
-        free(pending);
-        pending = next;
+// State of a single visit of the eviction clock
+typedef struct {
+    uint64_t need;      // Bytes left to free
+    int scanned;
+    int cooled;         // Hot sets that were cooled
+    int num;
+    char *names[EVICT_SCAN_CHUNK];
+    const unsigned char *last;
+} evict_scan;
+
+/**
+ * Called as part of the hashmap callback to
+ * advance the eviction clock. Sets that are hot
+ * are cooled, and cold sets are picked for eviction.
+ */
+static int evict_scan_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    evict_scan *scan = data;
+    hlld_set_wrapper *set = value;
+    scan->last = key;
+    scan->scanned++;
+
+    // Only mapped sets that can be unmapped use memory we can reclaim
+    if (set->is_active && !hset_is_proxied(set->set) &&
+            !hset_config(set->set)->in_memory) {
+        if (set->is_hot) {
+            set->is_hot--;
+            scan->cooled++;
+        } else {
+            scan->names[scan->num++] = strdup((char*)key);
+            uint64_t bytes = hset_byte_size(set->set);
+            scan->need = (bytes < scan->need) ? scan->need - bytes : 0;
+        }
     }
+    return scan->scanned == EVICT_SCAN_CHUNK || !scan->need;
 }
 
 /**
- * Swap the alternate / primary maps, sets the primary_vsn
- * This is always safe, since its just a pointer swap.
+ * Unmaps the coldest sets until the resident memory is
+ * within a target. This uses a CLOCK sweep over the
+ * sets in name order, which resumes where the last sweep
+ * stopped. Sets used since the last pass of the clock are
+ * skipped, so the least frequently used sets go first.
+ * The sweep gives up once a full pass over the sets
+ * neither cools nor unmaps any of them.
+ * @arg mgr The manager
+ * @arg target The target resident bytes
+ * @return The number of sets unmapped.
  */
-static void swap_set_maps(hlld_setmgr *mgr, unsigned long long primary_vsn) {
-    art_tree *tmp = mgr->set_map;
-    mgr->set_map = mgr->alt_set_map;
-    mgr->alt_set_map = tmp;
-    mgr->primary_vsn = primary_vsn;
+int setmgr_evict(hlld_setmgr *mgr, uint64_t target) {
+    pthread_mutex_lock(&mgr->evict_lock);
+    int evicted = 0;
+    int wraps = 0;
+    int progress = 0;
+    uint64_t resident;
+
+    // Stop once every set has been cooled all the way
+    while ((resident = setmgr_resident_bytes(mgr)) > target && wraps <= HOT_MAX) {
+        evict_scan scan;
+        scan.need = resident - target;
+        scan.scanned = 0;
+        scan.cooled = 0;
+        scan.num = 0;
+        scan.last = NULL;
+
+        // Visit the next chunk of sets
+        enter_mgr(mgr);
+        int stopped;
+        if (mgr->clock_hand)
+            stopped = art_iter_after(&mgr->set_map, (unsigned char*)mgr->clock_hand,
+                    strlen(mgr->clock_hand)+1, evict_scan_cb, &scan);
+        else
+            stopped = art_iter(&mgr->set_map, evict_scan_cb, &scan);
+
+        // Advance the hand, wrapping at the end of the map
+        if (mgr->clock_hand) free(mgr->clock_hand);
+        mgr->clock_hand = (stopped && scan.last) ? strdup((char*)scan.last) : NULL;
+        leave_mgr(mgr);
+
+        // Unmap the victims
+        progress += scan.cooled;
+        for (int i=0; i < scan.num; i++) {
+            syslog(LOG_DEBUG, "Unmapping set '%s' to stay within the memory budget.", scan.names[i]);
+            if (!setmgr_unmap_set(mgr, scan.names[i])) {
+                evicted++;
+                progress++;
+            }
+            free(scan.names[i]);
+        }
+
+        // Give up if a whole pass could not free anything. The
+        // first pass may have started part way through the map.
+        if (!stopped) {
+            if (wraps++ && !progress) break;
+            progress = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&mgr->evict_lock);
+    return evicted;
 }
 
-/*
- * Scans a set_list* until it finds an entry with a version
- * less than min_vsn. It NULLs the pointer to that version
- * and returns a pointer to that node.
- *
- * Safety: This is ONLY safe if the minimum client version
- * and the primary_vsn is strictly greater than the min_vsn argument.
- * This ensures access to older delta entries will not happen.
+/**
+ * Queues a set to be faulted in by the I/O threads.
+ * @arg cb Optional, invoked once the fault is done
+ * @return 0 if queued, -1 if the I/O threads are stopped.
  */
-static set_list* remove_delta_versions(set_list *init, set_list **ref, unsigned long long min_vsn) {
-    set_list *current = init;
-    set_list **prev = ref;
-    while (current && current->vsn > min_vsn) {
-        prev = &current->next;
-        current = current->next;
+static int queue_fault(hlld_setmgr *mgr, char *set_name, fault_cb cb, void *data) {
+    pthread_mutex_lock(&mgr->fault_lock);
+    if (!mgr->fault_should_run) {
+        pthread_mutex_unlock(&mgr->fault_lock);
+        return -1;
     }
 
-    // NULL out the reference pointer to current node if any
-    if (current) *prev = NULL;
-    return current;
+    fault_job *job = malloc(sizeof(fault_job));
+    job->set_name = strdup(set_name);
+    job->cb = cb;
+    job->data = data;
+    job->next = NULL;
+    if (mgr->fault_tail)
+        mgr->fault_tail->next = job;
+    else
+        mgr->fault_head = job;
+    mgr->fault_tail = job;
+    pthread_cond_signal(&mgr->fault_cond);
+    pthread_mutex_unlock(&mgr->fault_lock);
+    return 0;
 }
 
 /**
- * Deletes old versions from the delta lists, and calls
- * delete_set on the sets in the destroyed list.
- *
- * Safety: Same as remove_delta_versions
+ * Entry point for the I/O threads. Each thread
+ * faults in and warms the queued sets in order,
+ * and invokes the callback of each request.
  */
-static void delete_old_versions(hlld_setmgr *mgr, unsigned long long min_vsn) {
-    // Get the merged in pending ops, lock to avoid a race
-    pthread_mutex_lock(&mgr->write_lock);
-    set_list *old = remove_delta_versions(mgr->delta, &mgr->delta, min_vsn);
-    pthread_mutex_unlock(&mgr->write_lock);
+static void* fault_thread_main(void *in) {
+    hlld_setmgr *mgr = in;
+    pthread_mutex_lock(&mgr->fault_lock);
+    while (1) {
+        while (!mgr->fault_head && mgr->fault_should_run) {
+            pthread_cond_wait(&mgr->fault_cond, &mgr->fault_lock);
+        }
+        fault_job *job = mgr->fault_head;
+        if (!job) break;
+        mgr->fault_head = job->next;
+        if (!mgr->fault_head) mgr->fault_tail = NULL;
+        pthread_mutex_unlock(&mgr->fault_lock);
+
+        // Fault in the set. It may have been dropped since it was queued.
+        int res = -1;
+        enter_mgr(mgr);
+        hlld_set_wrapper *set = take_set(mgr, job->set_name);
+        if (set) {
+            // Faults for a parked client only need what adds use
+            pthread_rwlock_rdlock(&set->rwlock);
+            res = (job->cb) ? hset_fault(set->set) : hset_warm(set->set);
+            pthread_rwlock_unlock(&set->rwlock);
+        }
+        leave_mgr(mgr);
 
-    // Delete the sets now that we have merged into both trees
-    set_list *next, *current = old;
-    while (current) {
-        if (current->type == DELETE) delete_set(current->set);
-        next = current->next;
-        free(current);
-        current = next;
+        if (job->cb) job->cb(job->data, res);
+        free(job->set_name);
+        free(job);
+        pthread_mutex_lock(&mgr->fault_lock);
     }
+    pthread_mutex_unlock(&mgr->fault_lock);
+    return NULL;
 }
 
 /**
- * Determines the minimum visible version from the client list
- * Safety: Always safe
+ * Claims and estimates sets from a batch until
+ * there are none left.
+ * @return The number of sets claimed.
  */
-static unsigned long long client_min_vsn(hlld_setmgr *mgr) {
-    // Determine the minimum version
-    unsigned long long thread_vsn, min_vsn = mgr->vsn;
-    for (setmgr_client *cl=mgr->clients; cl != NULL; cl=cl->next) {
-        thread_vsn = cl->vsn;
-        if (thread_vsn < min_vsn) min_vsn = thread_vsn;
+static int work_size_batch(size_batch *b) {
+    int claimed = 0;
+    int i;
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->num) {
+        claimed++;
+        hlld_set_wrapper *set = b->sets[i];
+        if (!set) continue;
+        pthread_rwlock_rdlock(&set->rwlock);
+        b->ests[i] = hset_size(set->set);
+        hset_touch(set->set);
+        pthread_rwlock_unlock(&set->rwlock);
     }
-    return min_vsn;
+    return claimed;
 }
 
 /**
- * Creates a barrier that is implicit by adding a
- * new version, and waiting for all clients to reach
- * that version. This can be used as a non-locking
- * syncronization mechanism.
+ * Removes a batch from the queue if it is present.
+ * Must be called with the size lock.
  */
-static void version_barrier(hlld_setmgr *mgr) {
-    // Create a new delta
-    pthread_mutex_lock(&mgr->write_lock);
-    unsigned long long vsn = create_delta_update(mgr, BARRIER, NULL);
-    pthread_mutex_unlock(&mgr->write_lock);
-
-    // Wait until we converge on the version
-    while (mgr->should_run && client_min_vsn(mgr) < vsn)
-        usleep(VACUUM_POLL_USEC);
+static void unlink_size_batch(hlld_setmgr *mgr, size_batch *b) {
+    size_batch **prev = &mgr->size_batches;
+    while (*prev && *prev != b) prev = &(*prev)->next_batch;
+    if (*prev) *prev = b->next_batch;
 }
 
 /**
- * This thread is started after initialization to maintain
- * the state of the set manager. It's current use is to
- * cleanup the garbage created by our MVCC model. We do this
- * by making use of periodic 'checkpoints'. Our worker threads
- * report the version they are currently using, and we are always
- * able to delete versions that are strictly less than the minimum.
+ * Entry point for the size helper threads. Each helper
+ * works on the oldest queued batch, and unlinks it once
+ * every set has been claimed.
  */
-static void* setmgr_thread_main(void *in) {
-    // Extract our arguments
+static void* size_helper_main(void *in) {
     hlld_setmgr *mgr = in;
-    unsigned long long min_vsn, mgr_vsn;
-    while (mgr->should_run) {
-        // Do nothing if there is no changes
-        if (mgr->vsn == mgr->primary_vsn) {
-            usleep(VACUUM_POLL_USEC);
-            continue;
+    pthread_mutex_lock(&mgr->size_lock);
+    while (1) {
+        while (!mgr->size_batches && mgr->size_should_run) {
+            pthread_cond_wait(&mgr->size_cond, &mgr->size_lock);
         }
+        if (!mgr->size_should_run) break;
 
-        /*
-         * Because we use a version barrier, we always
-         * end up creating a new version when we try to
-         * apply delta updates. We need to handle the special case
-         * where we are 1 version behind and the only delta is
-         * a barrier. Do this by just updating primary_vsn.
-         */
-        mgr_vsn = mgr->vsn;
-        if ((mgr_vsn - mgr->primary_vsn) == 1) {
-            pthread_mutex_lock(&mgr->write_lock);
-
-            // Ensure no version created in the mean time
-            int should_continue = 0;
-            if (mgr_vsn == mgr->vsn && mgr->delta->type == BARRIER) {
-                mgr->primary_vsn = mgr_vsn;
-                should_continue = 1;
-            }
+        size_batch *b = mgr->size_batches;
+        b->refs++;
+        pthread_mutex_unlock(&mgr->size_lock);
 
-            // Release the lock and see if we should loop back
-            pthread_mutex_unlock(&mgr->write_lock);
-            if (should_continue) {
-                syslog(LOG_INFO, "All updates applied. (vsn: %llu)", mgr_vsn);
-                continue;
-            }
-        }
+        int done = work_size_batch(b);
 
-        // Determine the minimum version
-        min_vsn = client_min_vsn(mgr);
+        pthread_mutex_lock(&mgr->size_lock);
+        unlink_size_batch(mgr, b);
+        b->done += done;
+        b->refs--;
+        pthread_cond_broadcast(&mgr->size_done_cond);
+    }
+    pthread_mutex_unlock(&mgr->size_lock);
+    return NULL;
+}
 
-        // Warn if there are a lot of outstanding deltas
-        if (mgr->vsn - min_vsn > WARN_THRESHOLD) {
-            syslog(LOG_WARNING, "Many delta versions detected! min: %llu (vsn: %llu)",
-                    min_vsn, mgr->vsn);
-        } else {
-            syslog(LOG_DEBUG, "Applying delta update up to: %llu (vsn: %llu)",
-                    min_vsn, mgr->vsn);
-        }
+// State of a walk over the set map to build the catalog
+typedef struct {
+    hlld_catalog_entry *entries;
+    char *unread;           // Set for entries whose config is not in memory
+    uint32_t num;
+    uint32_t cap;
+} catalog_scan;
 
-        // Merge the old versions into the alternate three
-        merge_old_versions(mgr, mgr->delta, min_vsn);
+/**
+ * Adds an entry to the catalog being built.
+ * @return The new entry
+ */
+static hlld_catalog_entry* catalog_add(catalog_scan *scan, char *set_name) {
+    if (scan->num == scan->cap) {
+        scan->cap = (scan->cap) ? scan->cap * 2 : 64;
+        scan->entries = realloc(scan->entries, scan->cap * sizeof(hlld_catalog_entry));
+        scan->unread = realloc(scan->unread, scan->cap);
+    }
+    hlld_catalog_entry *e = scan->entries + scan->num;
+    e->set_name = strdup(set_name);
+    scan->unread[scan->num++] = 0;
+    return e;
+}
 
-        /*
-         * Mark any pending deletes so that create does not allow
-         * a set to be created before we manage to call delete_old_versions.
-         * There is an unforunate race that can happen if a client
-         * does a create/drop/create cycle, where the create/drop are
-         * reflected in the set_map, and thus the second create is allowed
-         * BEFORE we have had a chance to actually handle the delete.
-         */
-        mark_pending_deletes(mgr, min_vsn);
+/**
+ * Called as part of the hashmap callback to
+ * add each active set to the catalog. The config
+ * of sets that have not been read yet is left to
+ * be read from disk, without loading the set.
+ */
+static int catalog_scan_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    catalog_scan *scan = data;
+    hlld_set_wrapper *set = value;
+    if (!set->is_active) return 0;
 
-        // Swap the maps
-        swap_set_maps(mgr, min_vsn);
+    hlld_catalog_entry *e = catalog_add(scan, (char*)key);
+    if (hset_copy_config(set->set, &e->config)) {
+        scan->unread[scan->num - 1] = 1;
+    }
+    return 0;
+}
 
-        // Wait on a barrier until nobody is using the old tree
-        version_barrier(mgr);
+/**
+ * Reads the config of a set from its folder.
+ * @return 0 on success
+ */
+static int read_catalog_config(hlld_setmgr *mgr, char *set_name, hlld_set_config *config) {
+    memset(config, 0, sizeof(hlld_set_config));
+    config->default_eps = mgr->config->default_eps;
+    config->default_precision = mgr->config->default_precision;
+    config->in_memory = mgr->config->in_memory;
+
+    int len = FOLDER_PREFIX_LEN + strlen(set_name) + 1;
+    char *folder_name = malloc(len);
+    snprintf(folder_name, len, "%s%s", FOLDER_PREFIX, set_name);
+    char *set_folder = join_path(mgr->config->data_dir, folder_name);
+    char *config_path = join_path(set_folder, "config.ini");
+    int res = set_config_from_filename(config_path, config);
+    free(config_path);
+    free(set_folder);
+    free(folder_name);
+    return res;
+}
 
-        // Merge the changes into the other tree now that its safe
-        merge_old_versions(mgr, mgr->delta, min_vsn);
+/**
+ * Compares a set name with a catalog entry, for bsearch.
+ */
+static int catalog_entry_cmp(const void *name, const void *entry) {
+    return strcmp((const char*)name, ((const hlld_catalog_entry*)entry)->set_name);
+}
 
-        // Both trees have the changes incorporated, safe to delete
-        delete_old_versions(mgr, min_vsn);
+/**
+ * Writes out a catalog of all the sets in the data directory.
+ * The catalog is used on start to avoid scanning every set folder.
+ * The catalog is built from the sets in memory. Only the sets that
+ * are not in the set map, or whose config has not been read yet,
+ * have their config read from disk. The catalog is not written if
+ * the data directory was modified too recently to reliably detect
+ * future changes.
+ * @arg mgr The manager
+ * @return 0 on success, 1 if skipped, negative on error.
+ */
+int setmgr_write_catalog(hlld_setmgr *mgr) {
+    char *data_dir = mgr->config->data_dir;
+    char *folder = join_path(data_dir, (char*)CATALOG_FOLDER);
+    int res = mkdir(folder, 0755);
+    free(folder);
+    if (res && errno != EEXIST) {
+        syslog(LOG_ERR, "Failed to create catalog folder! %s", strerror(errno));
+        return -errno;
+    }
 
-        // Clear the pending delete list, since delete_old_versions() will
-        // block untill all deletes are completed.
-        clear_pending_deletes(mgr);
+    // Stat before scanning, so that any later change makes it stale
+    struct stat buf;
+    if (stat(data_dir, &buf)) return -errno;
+    if (time(NULL) - buf.st_mtime <= CATALOG_RACY_SEC) return 1;
+
+    // Get the config of each active set in name order
+    catalog_scan scan = {NULL, NULL, 0, 0};
+    enter_mgr(mgr);
+    art_iter(&mgr->set_map, catalog_scan_cb, &scan);
+    leave_mgr(mgr);
+    uint32_t num_active = scan.num;
+
+    // Read the configs that were not in memory
+    uint32_t kept = 0;
+    for (uint32_t i=0; i < num_active; i++) {
+        hlld_catalog_entry *e = scan.entries + i;
+        if (scan.unread[i] && read_catalog_config(mgr, e->set_name, &e->config)) {
+            free(e->set_name);
+            continue;
+        }
+        scan.entries[kept++] = *e;
+    }
+    num_active = scan.num = kept;
 
-        // Log that we finished
-        syslog(LOG_INFO, "Finished delta updates up to: %llu (vsn: %llu)",
-                min_vsn, mgr->vsn);
+    // Sets that are not in the map (e.g. they were cleared) are read from disk
+    struct dirent **namelist;
+    int num = scandir(data_dir, &namelist, set_hlld_folders, NULL);
+    if (num == -1) {
+        syslog(LOG_ERR, "Failed to scan files for the set catalog!");
+        res = -1;
+        goto LEAVE;
     }
-    return NULL;
+    for (int i=0; i < num; i++) {
+        char *set_name = namelist[i]->d_name + FOLDER_PREFIX_LEN;
+        if (!bsearch(set_name, scan.entries, num_active,
+                    sizeof(hlld_catalog_entry), catalog_entry_cmp)) {
+            hlld_catalog_entry *e = catalog_add(&scan, set_name);
+            if (read_catalog_config(mgr, set_name, &e->config)) {
+                free(e->set_name);
+                scan.num--;
+            }
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    hlld_catalog catalog;
+    catalog.mtime_sec = buf.st_mtime;
+    catalog.mtime_nsec = STAT_MTIME_NSEC(buf);
+    catalog.num_entries = scan.num;
+    catalog.entries = scan.entries;
+
+    char *path = join_path(data_dir, (char*)CATALOG_FILE);
+    res = catalog_write(path, &catalog);
+    free(path);
+
+LEAVE:
+    for (uint32_t i=0; i < scan.num; i++) free(scan.entries[i].set_name);
+    free(scan.entries);
+    free(scan.unread);
+    return res;
 }
 
+/**
+ * Gets the hit and miss counts of the per-client
+ * set caches, including clients that have left.
+ * @arg mgr The manager
+ * @arg hits Output, the number of cache hits
+ * @arg misses Output, the number of cache misses
+ */
+void setmgr_cache_stats(hlld_setmgr *mgr, uint64_t *hits, uint64_t *misses) {
+    LOCK_HLLD_SPIN(&mgr->clients_lock);
+    *hits = mgr->cache_hits;
+    *misses = mgr->cache_misses;
+    for (setmgr_client *cl = mgr->clients; cl; cl = cl->next) {
+        *hits += __atomic_load_n(&cl->cache_hits, __ATOMIC_RELAXED);
+        *misses += __atomic_load_n(&cl->cache_misses, __ATOMIC_RELAXED);
+    }
+    UNLOCK_HLLD_SPIN(&mgr->clients_lock);
+}
 
 /**
- * This method is used to force a vacuum up to the current
- * version. It is generally unsafe to use in hlld,
+ * This method is used to force the retired sets to be
+ * closed or deleted. It is generally unsafe to use in hlld,
  * but can be used in an embeded or test environment.
  */
 void setmgr_vacuum(hlld_setmgr *mgr) {
-    unsigned long long vsn = mgr->vsn;
-    merge_old_versions(mgr, mgr->delta, vsn);
-    swap_set_maps(mgr, vsn);
-    merge_old_versions(mgr, mgr->delta, vsn);
-    delete_old_versions(mgr, vsn);
+    reclaim_retired(mgr);
 }
 
@@ -40,6 +40,16 @@ int init_set_manager(hlld_config *config, int vacuum, hlld_setmgr **mgr);
  */
 int destroy_set_manager(hlld_setmgr *mgr);
 
+/**
+ * Stops the I/O threads once the queued faults are done.
+ * Their callbacks are invoked before this returns, and
+ * later faults are done by the caller instead of being queued.
+ * This must be called before anything the callbacks
+ * use is torn down. Safe to call more than once.
+ * @arg mgr The manager
+ */
+void setmgr_stop_faults(hlld_setmgr *mgr);
+
 /**
  * Should be invoked periodically by client threads to allow
  * the vacuum thread to cleanup garbage state. It should also
@@ -75,6 +85,18 @@ int setmgr_flush_set(hlld_setmgr *mgr, char *set_name);
  */
 int setmgr_set_keys(hlld_setmgr *mgr, char *set_name, char **keys, int num_keys);
 
+/**
+ * Sets keys in a given set, as seen at a given time.
+ * Only sliding sets take a time.
+ * @arg set_name The name of the set
+ * @arg keys A list of points to character arrays to add
+ * @arg num_keys The number of keys to add
+ * @arg at When the keys were seen in seconds, 0 for now
+ * @return 0 on success, -1 if the set does not exist.
+ * -2 on internal error, -3 if a time is given and the set is not sliding.
+ */
+int setmgr_set_keys_at(hlld_setmgr *mgr, char *set_name, char **keys, int num_keys, uint64_t at);
+
 /**
  * Estimates the size of a set
  * @arg set_name The name of the set
@@ -83,6 +105,80 @@ int setmgr_set_keys(hlld_setmgr *mgr, char *set_name, char **keys, int num_keys)
  */
 int setmgr_set_size(hlld_setmgr *mgr, char *set_name, uint64_t *est);
 
+/**
+ * Estimates the size of the most recent windows of a set.
+ * Sets that are not windowed are estimated in full.
+ * @arg set_name The name of the set
+ * @arg last The period to estimate, in seconds
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if the set does not exist.
+ */
+int setmgr_set_size_last(hlld_setmgr *mgr, char *set_name, uint64_t last, uint64_t *est);
+
+/**
+ * Callback invoked when an asynchronous fault completes
+ * @arg data Opaque handle given to setmgr_fault_async
+ * @arg res 0 if the set was faulted in, negative otherwise.
+ */
+typedef void(*fault_cb)(void *data, int res);
+
+/**
+ * Faults a set into memory on an I/O thread, so that
+ * the caller does not block on the disk. This is only
+ * done if the set exists and adding to it would fault in registers.
+ * The callback is invoked from the I/O thread.
+ * @arg mgr The manager
+ * @arg set_name The name of the set
+ * @arg cb The callback to invoke once the fault is done
+ * @arg data Opaque handle passed to the callback
+ * @return 1 if the fault was queued, 0 if there is nothing to fault
+ * or the I/O threads are stopped.
+ */
+int setmgr_fault_async(hlld_setmgr *mgr, char *set_name, fault_cb cb, void *data);
+
+/**
+ * Warms a set in the background. The set is faulted
+ * in and its pages touched on an I/O thread, so the next access
+ * does not wait on the disk.
+ * @arg mgr The manager
+ * @arg set_name The name of the set
+ * @return 0 on success, -1 if the set does not exist.
+ */
+int setmgr_warm_set(hlld_setmgr *mgr, char *set_name);
+
+/**
+ * Warms all the sets matching a prefix in the background.
+ * @arg mgr The manager
+ * @arg prefix The prefix to match on
+ * @return The number of sets that were queued.
+ */
+int setmgr_warm_prefix(hlld_setmgr *mgr, char *prefix);
+
+/**
+ * Estimates the size of many sets at once. Estimates
+ * that are not cached are computed in parallel by the
+ * size helpers when there are enough registers to scan.
+ * @arg mgr The manager
+ * @arg set_names The names of the sets
+ * @arg num_sets The number of sets
+ * @arg ests Output, the estimate of each set
+ * @arg found Output, set to 1 for each set that exists
+ * @return The number of sets that exist.
+ */
+int setmgr_set_sizes(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *ests, char *found);
+
+/**
+ * Estimates the number of keys that were added to every
+ * one of the given sets. The registers of each set are
+ * copied out, so no set is locked for the estimate.
+ * @arg set_names The names of the sets to intersect
+ * @arg num_sets The number of sets, at most HLL_MAX_INTERSECT
+ * @arg est Output pointer, the estimate on success.
+ * @return 0 on success, -1 if a set does not exist,
+ * -2 if the sets have a different precision, -3 on internal error.
+ */
+int setmgr_intersect_size(hlld_setmgr *mgr, char **set_names, int num_sets, uint64_t *est);
+
 /**
  * Creates a new set of the given name and parameters.
  * @arg set_name The name of the set
@@ -100,6 +196,16 @@ int setmgr_create_set(hlld_setmgr *mgr, char *set_name, hlld_config *custom_conf
  */
 int setmgr_drop_set(hlld_setmgr *mgr, char *set_name);
 
+/**
+ * Converts the registers of a closed set to another layout.
+ * @arg set_name The name of the set to convert
+ * @arg layout The new hll_layout of the registers
+ * @return 0 on success, -1 if the set does not exist,
+ * -2 if the set is not proxied, -3 if the set cannot be
+ * converted, -4 on internal error.
+ */
+int setmgr_convert_set(hlld_setmgr *mgr, char *set_name, int layout);
+
 /**
  * Unmaps the set from memory, but leaves it
  * registered in the set manager. This is rarely invoked
@@ -159,8 +265,76 @@ typedef void(*set_cb)(void* in, char *set_name, hlld_set *set);
 int setmgr_set_cb(hlld_setmgr *mgr, char *set_name, set_cb cb, void* data);
 
 /**
- * This method is used to force a vacuum up to the current
- * version. It is generally unsafe to use in hlld,
+ * Invokes a callback with each set in name order, starting
+ * after a given name. This walks the set map in place, without
+ * building a list, so a large listing can be done in pages.
+ * Like setmgr_set_cb, the callback must only read metrics from the set.
+ * @arg mgr The manager to list from
+ * @arg prefix The prefix to match on or NULL
+ * @arg after Only list sets after this name, or NULL
+ * @arg limit The maximum number of sets, 0 for no limit
+ * @arg cb The callback to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return The number of sets visited.
+ */
+int setmgr_list_page(hlld_setmgr *mgr, char *prefix, char *after, int limit, set_cb cb, void *data);
+
+/**
+ * Returns the number of register bytes of all the
+ * sets that are currently mapped and can be unmapped.
+ * In-memory only sets are not included.
+ * @arg mgr The manager
+ * @return The resident bytes
+ */
+uint64_t setmgr_resident_bytes(hlld_setmgr *mgr);
+
+/**
+ * Returns the number of register bytes of the
+ * in-memory only sets, which are never unmapped.
+ * @arg mgr The manager
+ * @return The pinned bytes
+ */
+uint64_t setmgr_pinned_bytes(hlld_setmgr *mgr);
+
+/**
+ * Unmaps the coldest sets until the resident memory is
+ * within a target. This uses a CLOCK sweep over the
+ * sets in name order, which resumes where the last sweep
+ * stopped. Sets used since the last pass of the clock are
+ * skipped, so the least frequently used sets go first.
+ * The sweep gives up once a full pass over the sets
+ * neither cools nor unmaps any of them.
+ * @arg mgr The manager
+ * @arg target The target resident bytes
+ * @return The number of sets unmapped.
+ */
+int setmgr_evict(hlld_setmgr *mgr, uint64_t target);
+
+/**
+ * Writes out a catalog of all the sets in the data directory.
+ * The catalog is used on start to avoid scanning every set folder.
+ * The catalog is built from the sets in memory. Only the sets that
+ * are not in the set map, or whose config has not been read yet,
+ * have their config read from disk. The catalog is not written if
+ * the data directory was modified too recently to reliably detect
+ * future changes.
+ * @arg mgr The manager
+ * @return 0 on success, 1 if skipped, negative on error.
+ */
+int setmgr_write_catalog(hlld_setmgr *mgr);
+
+/**
+ * Gets the hit and miss counts of the per-client
+ * set caches, including clients that have left.
+ * @arg mgr The manager
+ * @arg hits Output, the number of cache hits
+ * @arg misses Output, the number of cache misses
+ */
+void setmgr_cache_stats(hlld_setmgr *mgr, uint64_t *hits, uint64_t *misses);
+
+/**
+ * This method is used to force the retired sets to be
+ * closed or deleted. It is generally unsafe to use in hlld,
  * but can be used in an embeded or test environment.
  */
 void setmgr_vacuum(hlld_setmgr *mgr);
@@ -12,3 +12,22 @@
 #define CONST_DIRENT_T const struct dirent
 #endif
 
+
+/*
+ * Nanosecond portion of a file modification time
+ */
+#ifdef __MACH__
+#define STAT_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define STAT_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+
+/*
+ * Syncs the data of a file, OS X has no fdatasync
+ */
+#ifdef __MACH__
+#define FDATASYNC(fh) fsync(fh)
+#else
+#define FDATASYNC(fh) fdatasync(fh)
+#endif
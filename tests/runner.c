@@ -7,6 +7,8 @@
 #include "test_set.c"
 #include "test_setmgr.c"
 #include "test_art.c"
+#include "test_catalog.c"
+#include "test_crc32c.c"
 
 int main(void)
 {
@@ -19,6 +21,8 @@ int main(void)
     TCase *tc5 = tcase_create("set");
     TCase *tc6 = tcase_create("manager");
     TCase *tc7 = tcase_create("art");
+    TCase *tc8 = tcase_create("catalog");
+    TCase *tc9 = tcase_create("crc32c");
     SRunner *sr = srunner_create(s1);
     int nf;
 
@@ -40,7 +44,13 @@ int main(void)
     tcase_add_test(tc1, test_sane_cold_interval);
     tcase_add_test(tc1, test_sane_in_memory);
     tcase_add_test(tc1, test_sane_use_mmap);
+    tcase_add_test(tc1, test_sane_use_wal);
+    tcase_add_test(tc1, test_sane_wal_sync);
+    tcase_add_test(tc1, test_sane_compress_cold);
+    tcase_add_test(tc1, test_sane_window);
     tcase_add_test(tc1, test_sane_worker_threads);
+    tcase_add_test(tc1, test_sane_corrupt_action);
+    tcase_add_test(tc1, test_sane_estimator);
     tcase_add_test(tc1, test_set_config_bad_file);
     tcase_add_test(tc1, test_set_config_empty_file);
     tcase_add_test(tc1, test_set_config_basic_config);
@@ -67,10 +77,17 @@ int main(void)
     tcase_add_test(tc4, test_hll_add_size);
     tcase_add_test(tc4, test_hll_add_size_bitmap);
     tcase_add_test(tc4, test_hll_size);
+    tcase_add_test(tc4, test_hll_layout_bytes);
+    tcase_add_test(tc4, test_hll_every_precision);
+    tcase_add_test(tc4, test_hll_size_ertl);
+    tcase_add_test(tc4, test_hll_high_precision);
     tcase_add_test(tc4, test_hll_error_bound);
     tcase_add_test(tc4, test_hll_precision_for_error);
     tcase_add_test(tc4, test_hll_error_for_precision);
     tcase_add_test(tc4, test_hll_bytes_for_precision);
+    tcase_add_test(tc4, test_hll_encode_decode);
+    tcase_add_test(tc4, test_hll_intersect);
+    tcase_add_test(tc4, test_shll_window);
 
     // Add the set tests
     suite_add_tcase(s1, tc5);
@@ -81,9 +98,20 @@ int main(void)
     tcase_add_test(tc5, test_set_init_proxied);
     tcase_add_test(tc5, test_set_add);
     tcase_add_test(tc5, test_set_restore);
+    tcase_add_test(tc5, test_set_restore_lazy);
     tcase_add_test(tc5, test_set_flush);
     tcase_add_test(tc5, test_set_add_in_mem);
     tcase_add_test(tc5, test_set_page_out);
+    tcase_add_test(tc5, test_set_corrupt_repair);
+    tcase_add_test(tc5, test_set_corrupt_quarantine);
+    tcase_add_test(tc5, test_set_corrupt_fail);
+    tcase_add_test(tc5, test_set_interrupted_flush);
+    tcase_add_test(tc5, test_set_wal_replay);
+    tcase_add_test(tc5, test_set_compress_cold);
+    tcase_add_test(tc5, test_set_windows);
+    tcase_add_test(tc5, test_set_windows_concurrent);
+    tcase_add_test(tc5, test_set_sliding);
+    tcase_add_test(tc5, test_set_convert);
 
     // Add the filter tests
     suite_add_tcase(s1, tc6);
@@ -111,6 +139,17 @@ int main(void)
     tcase_add_test(tc6, test_mgr_create_custom_config);
     tcase_add_test(tc6, test_mgr_restore);
     tcase_add_test(tc6, test_mgr_callback);
+    tcase_add_test(tc6, test_mgr_restore_catalog);
+    tcase_add_test(tc6, test_mgr_catalog_lazy);
+    tcase_add_test(tc6, test_mgr_concurrent_drop);
+    tcase_add_test(tc6, test_mgr_slow_reader);
+    tcase_add_test(tc6, test_mgr_set_cache);
+    tcase_add_test(tc6, test_mgr_list_page);
+    tcase_add_test(tc6, test_mgr_set_sizes);
+    tcase_add_test(tc6, test_mgr_intersect_size);
+    tcase_add_test(tc6, test_mgr_evict);
+    tcase_add_test(tc6, test_mgr_fault_async);
+    tcase_add_test(tc6, test_mgr_warm);
 
     // Add the art tests
     suite_add_tcase(s1, tc7);
@@ -122,6 +161,19 @@ int main(void)
     tcase_add_test(tc7, test_art_insert_iter);
     tcase_add_test(tc7, test_art_iter_prefix);
     tcase_add_test(tc7, test_art_insert_copy_delete);
+    tcase_add_test(tc7, test_art_insert_delete_cow);
+    tcase_add_test(tc7, test_art_iter_after);
+
+    // Add the catalog tests
+    suite_add_tcase(s1, tc8);
+    tcase_add_test(tc8, test_catalog_missing);
+    tcase_add_test(tc8, test_catalog_write_read);
+    tcase_add_test(tc8, test_catalog_corrupt);
+
+    // Add the crc32c tests
+    suite_add_tcase(s1, tc9);
+    tcase_add_test(tc9, test_crc32c_check_value);
+    tcase_add_test(tc9, test_crc32c_incremental);
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
@@ -384,3 +384,98 @@ START_TEST(test_art_insert_copy_delete)
 }
 END_TEST
 
+
+START_TEST(test_art_insert_delete_cow)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    int len;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+
+    uintptr_t line = 1, nlines;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL ==
+            art_insert_cow(&t, (unsigned char*)buf, len, (void*)line));
+        if (line % 1000 == 0) art_release_garbage(&t);
+        line++;
+    }
+    art_release_garbage(&t);
+
+    nlines = line - 1;
+    fail_unless(art_size(&t) == nlines);
+
+    // Keep the current root, it must not change
+    art_tree old = t;
+
+    // Seek back to the start
+    fseek(f, 0, SEEK_SET);
+
+    // Delete each line
+    line = 1;
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+
+        // Delete, should get lineno back
+        uintptr_t val = (uintptr_t)art_delete_cow(&t, (unsigned char*)buf, len);
+        fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line,
+            val, buf);
+        fail_unless(!art_search(&t, (unsigned char*)buf, len));
+
+        // Still visible from the old root
+        val = (uintptr_t)art_search(&old, (unsigned char*)buf, len);
+        fail_unless(line == val, "Line: %d Val: %" PRIuPTR " Str: %s\n", line,
+            val, buf);
+
+        fail_unless(art_size(&t) == nlines - line);
+        line++;
+    }
+    fail_unless(!art_minimum(&t));
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static int after_cb(void *data, const unsigned char* key, uint32_t key_len, void *val) {
+    (void)key_len;
+    (void)val;
+    char **prev = data;
+    fail_unless(strcmp((char*)key, *prev) > 0);
+    *prev = (char*)key;
+    return 0;
+}
+
+START_TEST(test_art_iter_after)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    char *s[] = {"abc", "abcd", "abd", "b", "bbbbbbbbbbbbbbbbbbbb1",
+        "bbbbbbbbbbbbbbbbbbbb2", "c", NULL};
+    for (int i=0; s[i]; i++) {
+        art_insert(&t, (unsigned char*)s[i], strlen(s[i])+1, (void*)(uintptr_t)(i+1));
+    }
+
+    // Count the keys after each key, and a few missing ones
+    char *start[] = {"", "a", "abc", "abcc", "abce", "bbbbbbbbbbbbbbbbbbbb1", "bz", "c", "d", NULL};
+    int expect[] = {7, 7, 6, 6, 5, 2, 1, 0, 0};
+    for (int i=0; start[i]; i++) {
+        char *prev = "";
+        uint64_t out[] = {0, 0};
+        res = art_iter_after(&t, (unsigned char*)start[i], strlen(start[i])+1, iter_cb, &out);
+        fail_unless(res == 0);
+        fail_unless(out[0] == (uint64_t)expect[i], "After: %s Count: %llu", start[i], out[0]);
+        art_iter_after(&t, (unsigned char*)start[i], strlen(start[i])+1, after_cb, &prev);
+    }
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
@@ -0,0 +1,82 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "catalog.h"
+
+START_TEST(test_catalog_missing)
+{
+    hlld_catalog catalog;
+    int res = catalog_read("/tmp/does_not_exist_catalog", &catalog);
+    fail_unless(res == -ENOENT);
+    fail_unless(catalog.num_entries == 0);
+}
+END_TEST
+
+START_TEST(test_catalog_write_read)
+{
+    hlld_catalog_entry entries[2];
+    memset(entries, 0, sizeof(entries));
+    entries[0].set_name = "foo";
+    entries[0].config.default_eps = 0.01625;
+    entries[0].config.default_precision = 12;
+    entries[0].config.size = 1000;
+    entries[1].set_name = "bar.baz";
+    entries[1].config.default_eps = 0.0325;
+    entries[1].config.default_precision = 10;
+    entries[1].config.in_memory = 1;
+
+    hlld_catalog catalog = {12345, 6789, 2, entries};
+    int res = catalog_write("/tmp/test_catalog_write_read", &catalog);
+    fail_unless(res == 0);
+
+    hlld_catalog out;
+    res = catalog_read("/tmp/test_catalog_write_read", &out);
+    fail_unless(res == 0);
+    fail_unless(out.mtime_sec == 12345);
+    fail_unless(out.mtime_nsec == 6789);
+    fail_unless(out.num_entries == 2);
+
+    fail_unless(strcmp(out.entries[0].set_name, "foo") == 0);
+    fail_unless(out.entries[0].config.default_eps == 0.01625);
+    fail_unless(out.entries[0].config.default_precision == 12);
+    fail_unless(out.entries[0].config.in_memory == 0);
+    fail_unless(out.entries[0].config.size == 1000);
+
+    fail_unless(strcmp(out.entries[1].set_name, "bar.baz") == 0);
+    fail_unless(out.entries[1].config.default_eps == 0.0325);
+    fail_unless(out.entries[1].config.default_precision == 10);
+    fail_unless(out.entries[1].config.in_memory == 1);
+    fail_unless(out.entries[1].config.size == 0);
+
+    catalog_free(&out);
+    unlink("/tmp/test_catalog_write_read");
+}
+END_TEST
+
+START_TEST(test_catalog_corrupt)
+{
+    hlld_catalog_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.set_name = "foo";
+
+    hlld_catalog catalog = {1, 2, 1, &entry};
+    int res = catalog_write("/tmp/test_catalog_corrupt", &catalog);
+    fail_unless(res == 0);
+
+    // Chop off the end of the last record
+    res = truncate("/tmp/test_catalog_corrupt", 40);
+    fail_unless(res == 0);
+
+    hlld_catalog out;
+    res = catalog_read("/tmp/test_catalog_corrupt", &out);
+    fail_unless(res == -EINVAL);
+    fail_unless(out.num_entries == 0);
+    fail_unless(out.entries == NULL);
+
+    unlink("/tmp/test_catalog_corrupt");
+}
+END_TEST
@@ -25,6 +25,9 @@ START_TEST(test_config_get_default)
     fail_unless(config.in_memory == 0);
     fail_unless(config.worker_threads == 1);
     fail_unless(config.use_mmap == 0);
+    fail_unless(config.max_memory == 0);
+    fail_unless(strcmp(config.estimator, "bias") == 0);
+    fail_unless(config.estimator_mode == ESTIMATE_BIAS);
 }
 END_TEST
 
@@ -91,6 +94,7 @@ default_eps = 0.05\n\
 data_dir = /tmp/test\n\
 workers = 2\n\
 use_mmap = 1\n\
+max_memory = 8GB\n\
 log_level = INFO\n";
     write(fh, buf, strlen(buf));
     fchmod(fh, 777);
@@ -112,6 +116,7 @@ log_level = INFO\n";
     fail_unless(config.in_memory == 1);
     fail_unless(config.worker_threads == 2);
     fail_unless(config.use_mmap == 1);
+    fail_unless(config.max_memory == 8ULL << 30);
 
     unlink("/tmp/basic_config");
 }
@@ -227,16 +232,18 @@ START_TEST(test_sane_default_eps)
     fail_unless(sane_default_eps(0.25) == 0);
     fail_unless(sane_default_eps(0.005) == 0);
     fail_unless(sane_default_eps(0.3) == 1);
-    fail_unless(sane_default_eps(0.002) == 1);
+    fail_unless(sane_default_eps(0.002) == 0);
+    fail_unless(sane_default_eps(0.0002) == 1);
 }
 END_TEST
 
 START_TEST(test_sane_default_precision)
 {
     fail_unless(sane_default_precision(0) == 1);
-    fail_unless(sane_default_precision(20) == 1);
+    fail_unless(sane_default_precision(25) == 1);
     fail_unless(sane_default_precision(4) == 0);
     fail_unless(sane_default_precision(18) == 0);
+    fail_unless(sane_default_precision(24) == 0);
     fail_unless(sane_default_precision(12) == 0);
 }
 END_TEST
@@ -280,6 +287,49 @@ START_TEST(test_sane_use_mmap)
 }
 END_TEST
 
+START_TEST(test_sane_use_wal)
+{
+    fail_unless(sane_use_wal(-1) == 1);
+    fail_unless(sane_use_wal(0) == 0);
+    fail_unless(sane_use_wal(1) == 0);
+    fail_unless(sane_use_wal(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_wal_sync)
+{
+    fail_unless(sane_wal_sync(-1) == 1);
+    fail_unless(sane_wal_sync(0) == 0);
+    fail_unless(sane_wal_sync(1) == 0);
+    fail_unless(sane_wal_sync(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_compress_cold)
+{
+    fail_unless(sane_compress_cold(-1) == 1);
+    fail_unless(sane_compress_cold(0) == 0);
+    fail_unless(sane_compress_cold(1) == 0);
+    fail_unless(sane_compress_cold(2) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_window)
+{
+    fail_unless(sane_window(0, 0) == 0);
+    fail_unless(sane_window(3600, 0) == 1);
+    fail_unless(sane_window(3600, 48) == 0);
+    fail_unless(sane_window(3600, MAX_RETAIN+1) == 1);
+
+    uint64_t secs;
+    fail_unless(value_to_seconds("90", &secs) == 1 && secs == 90);
+    fail_unless(value_to_seconds("1h", &secs) == 1 && secs == 3600);
+    fail_unless(value_to_seconds("2d", &secs) == 1 && secs == 172800);
+    fail_unless(value_to_seconds("1w", &secs) == 0);
+    fail_unless(value_to_seconds("h", &secs) == 0);
+}
+END_TEST
+
 START_TEST(test_sane_worker_threads)
 {
     fail_unless(sane_worker_threads(-1) == 1);
@@ -290,6 +340,30 @@ START_TEST(test_sane_worker_threads)
 }
 END_TEST
 
+START_TEST(test_sane_corrupt_action)
+{
+    corrupt_action_t mode;
+    fail_unless(sane_corrupt_action("repair", &mode) == 0);
+    fail_unless(mode == CORRUPT_REPAIR);
+    fail_unless(sane_corrupt_action("QUARANTINE", &mode) == 0);
+    fail_unless(mode == CORRUPT_QUARANTINE);
+    fail_unless(sane_corrupt_action("fail", &mode) == 0);
+    fail_unless(mode == CORRUPT_FAIL);
+    fail_unless(sane_corrupt_action("foo", &mode) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_estimator)
+{
+    estimator_t mode;
+    fail_unless(sane_estimator("bias", &mode) == 0);
+    fail_unless(mode == ESTIMATE_BIAS);
+    fail_unless(sane_estimator("ERTL", &mode) == 0);
+    fail_unless(mode == ESTIMATE_ERTL);
+    fail_unless(sane_estimator("mle", &mode) == 1);
+}
+END_TEST
+
 START_TEST(test_set_config_bad_file)
 {
     hlld_set_config config;
@@ -354,10 +428,17 @@ END_TEST
 START_TEST(test_update_filename_from_set_config)
 {
     hlld_set_config config;
+    memset(&config, '\0', sizeof(config));
     config.default_eps = 0.01625;
     config.default_precision = 12;
     config.in_memory = 1;
     config.size = 4096;
+    config.has_checksum = 1;
+    config.checksum = 0xDEADBEEF;
+    config.has_pending = 1;
+    config.pending_checksum = 0xCAFEF00D;
+    config.window = 3600;
+    config.retain = 48;
 
     int res = update_filename_from_set_config("/tmp/update_filter", &config);
     chmod("/tmp/update_filter", 777);
@@ -373,7 +454,15 @@ START_TEST(test_update_filename_from_set_config)
     fail_unless(config2.default_precision == 12);
     fail_unless(config2.in_memory == 1);
     fail_unless(config2.size == 4096);
-
+    fail_unless(config2.has_checksum == 1);
+    fail_unless(config2.checksum == 0xDEADBEEF);
+    fail_unless(config2.has_pending == 1);
+    fail_unless(config2.pending_checksum == 0xCAFEF00D);
+    fail_unless(config2.window == 3600);
+    fail_unless(config2.retain == 48);
+
+    // The config is renamed into place
+    fail_unless(access("/tmp/update_filter.tmp", F_OK) == -1);
     unlink("/tmp/update_filter");
 }
 END_TEST
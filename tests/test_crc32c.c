@@ -0,0 +1,22 @@
+#include <check.h>
+#include <string.h>
+#include "crc32c.h"
+
+START_TEST(test_crc32c_check_value)
+{
+    fail_unless(crc32c(0, "123456789", 9) == 0xE3069283);
+    fail_unless(crc32c(0, "", 0) == 0);
+}
+END_TEST
+
+START_TEST(test_crc32c_incremental)
+{
+    unsigned char buf[1000];
+    for (int i=0; i < 1000; i++) buf[i] = i * 7;
+
+    // Use an unaligned start to hit the slow path
+    uint32_t crc = crc32c(0, buf+1, 999);
+    uint32_t crc2 = crc32c(crc32c(0, buf+1, 333), buf+334, 666);
+    fail_unless(crc == crc2);
+}
+END_TEST
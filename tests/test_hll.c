@@ -84,7 +84,7 @@ START_TEST(test_hll_add_size_bitmap)
     fail_unless(bitmap_from_file(-1, bytes, ANONYMOUS, &bm) == 0);
 
     hll_t h;
-    fail_unless(hll_init_from_bitmap(10, &bm, &h) == 0);
+    fail_unless(hll_init_from_bitmap(10, HLL_LAYOUT_PACKED, &bm, &h) == 0);
 
     char buf[100];
     for (int i=0; i < 100; i++) {
@@ -111,6 +111,121 @@ START_TEST(test_hll_size)
 }
 END_TEST
 
+START_TEST(test_hll_layout_bytes)
+{
+    hll_t packed, bytes, converted;
+    fail_unless(hll_init(12, &packed) == 0);
+    fail_unless(hll_init_layout(12, HLL_LAYOUT_BYTES, &bytes) == 0);
+    fail_unless(hll_bytes_for_layout(12, HLL_LAYOUT_BYTES) == 4096);
+
+    char buf[100];
+    for (int i=0; i < 10000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&packed, (char*)&buf);
+        hll_add(&bytes, (char*)&buf);
+    }
+    fail_unless(hll_size(&packed) == hll_size(&bytes));
+
+    // Converting keeps every register
+    fail_unless(hll_convert(&bytes, HLL_LAYOUT_PACKED, &converted) == 0);
+    fail_unless(memcmp(converted.registers, packed.registers,
+                hll_bytes_for_precision(12)) == 0);
+    fail_unless(hll_destroy(&converted) == 0);
+
+    // The encoding does not depend on the layout
+    unsigned char *enc_packed, *enc_bytes;
+    uint64_t len_packed, len_bytes;
+    fail_unless(hll_encode(&packed, &enc_packed, &len_packed) == 0);
+    fail_unless(hll_encode(&bytes, &enc_bytes, &len_bytes) == 0);
+    fail_unless(len_packed == len_bytes);
+    fail_unless(memcmp(enc_packed, enc_bytes, len_packed) == 0);
+    free(enc_packed);
+    free(enc_bytes);
+
+    // Merging across layouts
+    fail_unless(hll_init_layout(12, HLL_LAYOUT_BYTES, &converted) == 0);
+    hll_merge(&converted, &packed);
+    fail_unless(memcmp(converted.registers, bytes.registers, 4096) == 0);
+
+    fail_unless(hll_destroy(&converted) == 0);
+    fail_unless(hll_destroy(&packed) == 0);
+    fail_unless(hll_destroy(&bytes) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_every_precision)
+{
+    char buf[100];
+    for (int p=HLL_MIN_PRECISION; p <= HLL_MAX_PRECISION; p++) {
+        hll_t packed, bytes, half, converted;
+        fail_unless(hll_init(p, &packed) == 0);
+        fail_unless(hll_init_layout(p, HLL_LAYOUT_BYTES, &bytes) == 0);
+        fail_unless(hll_init(p, &half) == 0);
+
+        for (int i=0; i < 1000; i++) {
+            fail_unless(sprintf((char*)&buf, "test%d", i));
+            hll_add(&bytes, (char*)&buf);
+            hll_add((i % 2) ? &packed : &half, (char*)&buf);
+        }
+
+        // Merging the halves matches adding everything
+        hll_merge(&packed, &half);
+        fail_unless(hll_size(&packed) == hll_size(&bytes));
+        fail_unless(hll_convert(&bytes, HLL_LAYOUT_PACKED, &converted) == 0);
+        fail_unless(memcmp(converted.registers, packed.registers,
+                    hll_bytes_for_precision(p)) == 0);
+
+        fail_unless(hll_destroy(&converted) == 0);
+        fail_unless(hll_destroy(&half) == 0);
+        fail_unless(hll_destroy(&packed) == 0);
+        fail_unless(hll_destroy(&bytes) == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_hll_size_ertl)
+{
+    hll_t h;
+    fail_unless(hll_init(14, &h) == 0);
+    fail_unless(hll_size_ertl(&h) == 0);
+
+    // Check across the range linear counting would be used for
+    char buf[100];
+    for (int i=0; i < 50000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&h, (char*)&buf);
+        if (i == 99) {
+            double s = hll_size_ertl(&h);
+            fail_unless(s > 98 && s < 102, "Size %f", s);
+        } else if (i == 9999 || i == 49999) {
+            double s = hll_size_ertl(&h);
+            fail_unless(s > (i+1) * 0.98 && s < (i+1) * 1.02, "Size %f", s);
+        }
+    }
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
+START_TEST(test_hll_high_precision)
+{
+    // Precisions without bias data use the improved estimator
+    hll_t h;
+    fail_unless(hll_init(HLL_MAX_PRECISION, &h) == 0);
+    fail_unless(hll_size(&h) == 0);
+
+    char buf[100];
+    for (int i=0; i < 200000; i++) {
+        fail_unless(sprintf((char*)&buf, "test%d", i));
+        hll_add(&h, (char*)&buf);
+    }
+    double s = hll_size(&h);
+    fail_unless(s > 199000 && s < 201000, "Size %f", s);
+
+    fail_unless(hll_destroy(&h) == 0);
+}
+END_TEST
+
 START_TEST(test_hll_error_bound)
 {
     // Precision 14 -> variance of 1%
@@ -145,7 +260,7 @@ END_TEST
 START_TEST(test_hll_error_for_precision)
 {
     fail_unless(hll_error_for_precision(3) == 0);
-    fail_unless(hll_error_for_precision(20) == 0);
+    fail_unless(hll_error_for_precision(25) == 0);
     fail_unless(hll_error_for_precision(12) == .01625);
     fail_unless(hll_error_for_precision(10) == .0325);
     fail_unless(hll_error_for_precision(16) == .0040625);
@@ -155,10 +270,153 @@ END_TEST
 START_TEST(test_hll_bytes_for_precision)
 {
     fail_unless(hll_bytes_for_precision(3) == 0);
-    fail_unless(hll_bytes_for_precision(20) == 0);
+    fail_unless(hll_bytes_for_precision(25) == 0);
     fail_unless(hll_bytes_for_precision(12) == 3280);
     fail_unless(hll_bytes_for_precision(10) == 820);
     fail_unless(hll_bytes_for_precision(16) == 52432);
+    fail_unless(hll_bytes_for_precision(24) == 13421776);
+}
+END_TEST
+
+
+START_TEST(test_hll_encode_decode)
+{
+    hll_t h, h2;
+    fail_unless(hll_init(14, &h) == 0);
+    fail_unless(hll_init(14, &h2) == 0);
+
+    // Empty HLL should encode to a few bytes
+    unsigned char *buf;
+    uint64_t len;
+    fail_unless(hll_encode(&h, &buf, &len) == 0);
+    fail_unless(len <= 4);
+    fail_unless(hll_decode(&h2, buf, len) == 0);
+    fail_unless(hll_size(&h2) == 0);
+    free(buf);
+
+    char key[100];
+    for (int i=0; i < 1000; i++) {
+        fail_unless(sprintf((char*)&key, "test%d", i));
+        hll_add(&h, (char*)&key);
+    }
+
+    // Sparse HLL should be much smaller than the registers
+    fail_unless(hll_encode(&h, &buf, &len) == 0);
+    fail_unless(len < hll_bytes_for_precision(14) / 4);
+    fail_unless(hll_decode(&h2, buf, len) == 0);
+    fail_unless(hll_size(&h2) == hll_size(&h));
+
+    // Truncated encodings are invalid
+    fail_unless(hll_decode(&h2, buf, len - 1) == -1);
+    free(buf);
+
+    fail_unless(hll_destroy(&h) == 0);
+    fail_unless(hll_destroy(&h2) == 0);
 }
 END_TEST
 
+START_TEST(test_hll_intersect)
+{
+    // Overlapping HLLs, in both layouts
+    hll_t h[4];
+    char key[100];
+    for (int k=0; k < 4; k++) {
+        fail_unless(hll_init_layout(14, (k % 2) ? HLL_LAYOUT_BYTES : HLL_LAYOUT_PACKED, h+k) == 0);
+        for (int i=k*5000; i < k*5000 + 20000; i++) {
+            fail_unless(sprintf((char*)&key, "test%d", i));
+            hll_add(h+k, (char*)&key);
+        }
+    }
+
+    // Compare with building every union from scratch
+    hll_t u;
+    for (int num=1; num <= 4; num++) {
+        double expected = 0, smallest = -1;
+        for (int subset=1; subset < (1 << num); subset++) {
+            fail_unless(hll_init(14, &u) == 0);
+            int members = 0;
+            for (int i=0; i < num; i++) {
+                if (!(subset & (1 << i))) continue;
+                hll_merge(&u, h+i);
+                members++;
+            }
+            double union_est = hll_size(&u);
+            if (members == 1 && (smallest < 0 || union_est < smallest))
+                smallest = union_est;
+            expected += (members & 1) ? union_est : -union_est;
+            fail_unless(hll_destroy(&u) == 0);
+        }
+        if (expected < 0) expected = 0;
+        if (expected > smallest) expected = smallest;
+
+        double est = hll_intersect_size(h, num, hll_size);
+        fail_unless(est > expected - 1e-6 && est < expected + 1e-6);
+    }
+
+    // Precisions must match
+    fail_unless(hll_init(12, &u) == 0);
+    hll_t mixed[] = {h[0], u};
+    fail_unless(hll_intersect_size(mixed, 2, hll_size) == -1);
+    fail_unless(hll_destroy(&u) == 0);
+
+    for (int k=0; k < 4; k++) fail_unless(hll_destroy(h+k) == 0);
+}
+END_TEST
+
+
+// Link the external murmur hash in
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+START_TEST(test_shll_window)
+{
+    shll_t s, s2;
+    fail_unless(shll_init(12, 300, &s) == 0);
+    fail_unless(shll_init(12, 300, &s2) == 0);
+
+    // Add distinct keys at two times, 200 seconds apart
+    uint64_t out[2];
+    char key[100];
+    for (int i=0; i < 2000; i++) {
+        fail_unless(sprintf((char*)&key, "test%d", i));
+        MurmurHash3_x64_128(key, strlen(key), 0, &out);
+        shll_add_hash(&s, out[1], (i < 1000) ? 1000 : 1200);
+    }
+
+    hll_t h;
+    fail_unless(shll_window(&s, 1200, 100, &h) == 0);
+    double size = hll_size(&h);
+    fail_unless(size > 950 && size < 1050);
+    hll_destroy(&h);
+
+    fail_unless(shll_window(&s, 1200, 300, &h) == 0);
+    size = hll_size(&h);
+    fail_unless(size > 1900 && size < 2100);
+    hll_destroy(&h);
+
+    // Nothing is seen before the first keys
+    fail_unless(shll_window(&s, 999, 300, &h) == 0);
+    fail_unless(hll_size(&h) == 0);
+    hll_destroy(&h);
+
+    // The first keys fall out of the window
+    shll_prune(&s, 1350);
+    fail_unless(shll_window(&s, 1350, 300, &h) == 0);
+    size = hll_size(&h);
+    fail_unless(size > 950 && size < 1050);
+    hll_destroy(&h);
+
+    // Encodings round trip
+    unsigned char *buf;
+    uint64_t len;
+    fail_unless(shll_encode(&s, &buf, &len) == 0);
+    fail_unless(shll_decode(&s2, buf, len) == 0);
+    fail_unless(shll_window(&s2, 1350, 300, &h) == 0);
+    fail_unless(hll_size(&h) == size);
+    hll_destroy(&h);
+    fail_unless(shll_decode(&s2, buf, len - 1) == -1);
+    free(buf);
+
+    fail_unless(shll_destroy(&s) == 0);
+    fail_unless(shll_destroy(&s2) == 0);
+}
+END_TEST
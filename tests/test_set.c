@@ -77,7 +77,8 @@ START_TEST(test_set_init_discover_destroy)
 
     res = destroy_set(set);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/hlld/hlld.test_set") == 2);
+    // Config, registers and the backup taken on flush
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set") == 3);
 }
 END_TEST
 
@@ -149,10 +150,34 @@ START_TEST(test_set_add)
     fail_unless(hset_size(set) > 9800 && hset_size(set) < 10200);
     fail_unless(hset_byte_size(set) == 3280);
     fail_unless(counters->sets == 10000);
+    fail_unless(counters->updates > 0 && counters->updates < 10000);
+
+    // Adding the keys again updates no registers
+    uint64_t updates = counters->updates;
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hset_add(set, (char*)&buf) == 0);
+    }
+    fail_unless(counters->sets == 20000);
+    fail_unless(counters->updates == updates);
+
+    // Pretend the last 600 sets were spread over 10 seconds
+    double set_rate, update_rate;
+    counters->rate_time = time(NULL) - 10;
+    counters->rate_sets = counters->sets - 600;
+    counters->rate_updates = counters->updates;
+    counters->set_rate = counters->update_rate = 0;
+    hset_rates(set, &set_rate, &update_rate);
+    fail_unless(set_rate > 5 && set_rate < 15);
+    fail_unless(update_rate == 0);
+
+    fail_unless(counters->last_flush == 0);
+    fail_unless(hset_flush(set) == 0);
+    fail_unless(counters->last_flush > 0);
 
     res = destroy_set(set);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/hlld/hlld.test_set4") == 2);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set4") == 3);
 }
 END_TEST
 
@@ -191,7 +216,55 @@ START_TEST(test_set_restore)
 
     res = destroy_set(set);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/hlld/hlld.test_set5") == 2);
+    // Config, registers and the backup taken on flush
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set5") == 3);
+}
+END_TEST
+
+START_TEST(test_set_restore_lazy)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set11", 0, &set);
+    fail_unless(res == 0);
+
+    // Check all the keys get added
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+
+    // Get the size
+    uint64_t size = hset_size(set);
+
+    // Destroy the set
+    res = destroy_set(set);
+    fail_unless(res == 0);
+
+    // Remake the set lazily, should not touch the disk
+    res = init_set_lazy(&config, "test_set11", NULL, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_is_proxied(set) == 1);
+
+    // Config should be loaded on first access
+    fail_unless(hset_size(set) == size);
+    fail_unless(hset_config(set)->default_precision == 12);
+
+    // Fault in with an add
+    res = hset_add(set, (char*)&buf);
+    fail_unless(res == 0);
+    fail_unless(hset_is_proxied(set) == 0);
+    fail_unless(hset_size(set) == size);
+
+    res = destroy_set(set);
+    fail_unless(res == 0);
+    // Config, registers and the backup taken on flush
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set11") == 3);
 }
 END_TEST
 
@@ -213,10 +286,19 @@ START_TEST(test_set_flush)
         fail_unless(res == 0);
     }
 
+    // Nothing is cached until an estimate is made or the set is flushed
+    fail_unless(hset_cached_size(set) == 0);
+
     // Flush
     fail_unless(hset_flush(set) == 0);
+    fail_unless(hset_cached_size(set) == hset_size(set));
+
+    // New keys are not counted until the next estimate
+    fail_unless(hset_add(set, "another") == 0);
+    fail_unless(hset_cached_size(set) == hset_config(set)->size);
 
     // Remake the set
+    fail_unless(hset_flush(set) == 0);
     hlld_set *set2 = NULL;
     res = init_set(&config, "test_set6", 1, &set2);
     fail_unless(res == 0);
@@ -231,7 +313,8 @@ START_TEST(test_set_flush)
 
     res = destroy_set(set2);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/hlld/hlld.test_set6") == 2);
+    // Config, registers and the backup taken on flush
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set6") == 3);
 }
 END_TEST
 
@@ -260,6 +343,11 @@ START_TEST(test_set_add_in_mem)
     fail_unless(hset_byte_size(set) == 3280);
     fail_unless(counters->sets == 10000);
 
+    // Only sliding sets take a time
+    char *keys[] = {"foobar0"};
+    fail_unless(hset_add_keys_at(set, keys, 1, time(NULL)) == -2);
+    fail_unless(counters->sets == 10000);
+
     res = destroy_set(set);
     fail_unless(res == 0);
     fail_unless(delete_dir("/tmp/hlld/hlld.test_set7") == 1);
@@ -304,7 +392,474 @@ START_TEST(test_set_page_out)
 
     res = destroy_set(set);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/hlld/hlld.test_set10") == 2);
+    // Config, registers and the backup taken on flush
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set10") == 3);
+}
+END_TEST
+
+
+/**
+ * Simulates a torn write by zeroing the start of a register file
+ */
+static void tear_registers(char *path) {
+    int fh = open(path, O_RDWR);
+    fail_unless(fh >= 0);
+    char zeros[512] = {0};
+    fail_unless(pwrite(fh, zeros, sizeof(zeros), 0) == sizeof(zeros));
+    close(fh);
+}
+
+START_TEST(test_set_corrupt_repair)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set12", 0, &set);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    uint64_t size = hset_size(set);
+    fail_unless(destroy_set(set) == 0);
+
+    // Should repair from the backup taken on flush
+    tear_registers("/tmp/hlld/hlld.test_set12/registers.mmap");
+    res = init_set(&config, "test_set12", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_size(set) == size);
+
+    fail_unless(destroy_set(set) == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set12") == 3);
+}
+END_TEST
+
+START_TEST(test_set_corrupt_quarantine)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.corrupt_mode = CORRUPT_QUARANTINE;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set13", 0, &set);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    fail_unless(destroy_set(set) == 0);
+
+    // Should move the registers aside and start empty
+    tear_registers("/tmp/hlld/hlld.test_set13/registers.mmap");
+    res = init_set(&config, "test_set13", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_size(set) == 0);
+
+    struct stat st;
+    fail_unless(stat("/tmp/hlld/hlld.test_set13/registers.mmap.corrupt", &st) == 0);
+
+    fail_unless(destroy_set(set) == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set13") == 3);
+}
+END_TEST
+
+START_TEST(test_set_corrupt_fail)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.corrupt_mode = CORRUPT_FAIL;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set14", 0, &set);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    fail_unless(destroy_set(set) == 0);
+
+    // Should refuse to fault in
+    tear_registers("/tmp/hlld/hlld.test_set14/registers.mmap");
+    res = init_set(&config, "test_set14", 1, &set);
+    fail_unless(res == -EIO);
+    fail_unless(hset_is_proxied(set) == 1);
+    fail_unless(hset_add(set, "foo") == -1);
+
+    fail_unless(destroy_set(set) == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set14") == 2);
+}
+END_TEST
+
+/**
+ * Reads a whole file into a new buffer
+ */
+static unsigned char* read_registers(char *path, long *len) {
+    FILE *f = fopen(path, "r");
+    fail_unless(f != NULL);
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    rewind(f);
+    unsigned char *buf = malloc(*len);
+    fail_unless(fread(buf, *len, 1, f) == 1);
+    fclose(f);
+    return buf;
+}
+
+START_TEST(test_set_interrupted_flush)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.corrupt_mode = CORRUPT_FAIL;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set20", 0, &set);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hset_add(set, (char*)&buf) == 0);
+    }
+    fail_unless(hset_flush(set) == 0);
+    uint64_t size = hset_size(set);
+    long len;
+    unsigned char *prior = read_registers("/tmp/hlld/hlld.test_set20/registers.mmap", &len);
+
+    for (int i=1000;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(hset_add(set, (char*)&buf) == 0);
+    }
+    fail_unless(destroy_set(set) == 0);
+
+    // A crash before the registers were written leaves the prior ones
+    FILE *f = fopen("/tmp/hlld/hlld.test_set20/registers.mmap", "r+");
+    fail_unless(fwrite(prior, len, 1, f) == 1);
+    fclose(f);
+    free(prior);
+    res = init_set(&config, "test_set20", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_size(set) == size);
+    fail_unless(destroy_set(set) == 0);
+
+    // Torn registers match neither
+    tear_registers("/tmp/hlld/hlld.test_set20/registers.mmap");
+    res = init_set(&config, "test_set20", 1, &set);
+    fail_unless(res == -EIO);
+    fail_unless(destroy_set(set) == 0);
+
+    // Backups are only taken to repair
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set20") == 2);
+}
+END_TEST
+
+START_TEST(test_set_wal_replay)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.use_wal = 1;
+    config.wal_sync = 1;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set15", 0, &set);
+    fail_unless(res == 0);
+
+    char buf[100];
+    char *keys[100];
+    for (int i=0;i<100;i++) {
+        keys[i] = malloc(100);
+        snprintf(keys[i], 100, "foobar%d", i);
+    }
+    res = hset_add_keys(set, keys, 100);
+    fail_unless(res == 0);
+    fail_unless(set->wal_synced == 100 * sizeof(uint64_t));
+
+    // The log should be truncated by a flush
+    struct stat st;
+    fail_unless(stat("/tmp/hlld/hlld.test_set15/registers.wal", &st) == 0);
+    fail_unless(st.st_size == 100 * sizeof(uint64_t));
+    fail_unless(hset_flush(set) == 0);
+    fail_unless(stat("/tmp/hlld/hlld.test_set15/registers.wal", &st) == 0);
+    fail_unless(st.st_size == 0);
+
+    // Add more without flushing
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "zipzab%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    uint64_t size = hset_size(set);
+
+    // Load the set from disk as if we crashed, should replay the log
+    hlld_set *set2 = NULL;
+    res = init_set(&config, "test_set15", 1, &set2);
+    fail_unless(res == 0);
+    fail_unless(hset_size(set2) == size);
+
+    fail_unless(destroy_set(set2) == 0);
+    fail_unless(destroy_set(set) == 0);
+    for (int i=0;i<100;i++) free(keys[i]);
+
+    // Config, registers, backup and the log
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set15") == 4);
+}
+END_TEST
+
+START_TEST(test_set_compress_cold)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.compress_cold = 1;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set16", 0, &set);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<100;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    uint64_t size = hset_size(set);
+
+    // Closing should replace the registers with a compressed copy
+    struct stat st;
+    fail_unless(hset_close(set) == 0);
+    fail_unless(stat("/tmp/hlld/hlld.test_set16/registers.mmap", &st) == -1);
+    fail_unless(stat("/tmp/hlld/hlld.test_set16/registers.cmp", &st) == 0);
+    fail_unless(st.st_size < 3280);
+
+    // Fault in should expand them again
+    res = hset_add(set, (char*)&buf);
+    fail_unless(res == 0);
+    fail_unless(hset_size(set) == size);
+    fail_unless(stat("/tmp/hlld/hlld.test_set16/registers.mmap", &st) == 0);
+    fail_unless(stat("/tmp/hlld/hlld.test_set16/registers.cmp", &st) == -1);
+
+    fail_unless(destroy_set(set) == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set16") == 2);
+}
+END_TEST
+
+/**
+ * Waits for the start of the next second, so that
+ * each step of a test uses a known one second window.
+ */
+static time_t next_second(void) {
+    time_t now = time(NULL);
+    while (time(NULL) == now) usleep(1000);
+    return now + 1;
+}
+
+START_TEST(test_set_windows)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.window = 1;
+    config.retain = 2;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set17", 0, &set);
+    fail_unless(res == 0);
+
+    char *first[] = {"a", "b", "c"};
+    char *second[] = {"c", "d"};
+    time_t start = next_second();
+    fail_unless(hset_add_keys(set, first, 3) == 0);
+    fail_unless(hset_size(set) == 3);
+
+    // Windows are merged, so "c" is only counted once
+    fail_unless(next_second() == start + 1);
+    fail_unless(hset_add_keys(set, second, 2) == 0);
+    fail_unless(hset_size(set) == 4);
+    fail_unless(set->num_windows == 2);
+
+    // Windows are discovered again after a close
+    fail_unless(hset_close(set) == 0);
+    fail_unless(hset_needs_fault(set) == 1);
+    fail_unless(hset_size(set) == 4);
+    fail_unless(hset_size_last(set, 1) == 4);
+    fail_unless(set->num_windows == 2);
+
+    // The first window expires, and adds need a new window
+    fail_unless(next_second() == start + 2);
+    fail_unless(hset_needs_fault(set) == 1);
+    fail_unless(hset_fault(set) == 0);
+    fail_unless(hset_needs_fault(set) == 0);
+    fail_unless(hset_size(set) == 2);
+    fail_unless(hset_size_last(set, 1) == 2);
+    fail_unless(hset_add_keys(set, first, 3) == 0);
+    fail_unless(hset_flush(set) == 0);
+    fail_unless(set->num_windows == 2);
+
+    // Flushing does not fault in the older window, its stored size is used
+    fail_unless(hset_close(set) == 0);
+    fail_unless(hset_add_keys(set, first, 3) == 0);
+    fail_unless(hset_flush(set) == 0);
+    fail_unless(set->windows[0].set->is_proxied);
+    fail_unless(hset_config(set)->size == 5);
+
+    struct stat st;
+    char path[100];
+    snprintf(path, sizeof(path), "/tmp/hlld/hlld.test_set17/window.%llu", (unsigned long long)start);
+    fail_unless(stat(path, &st) == -1);
+
+    fail_unless(hset_delete(set) == 0);
+    fail_unless(stat("/tmp/hlld/hlld.test_set17", &st) == -1);
+    fail_unless(destroy_set(set) == 0);
+}
+END_TEST
+
+typedef struct {
+    hlld_set *set;
+    int id;
+    volatile int *stop;
+} window_worker;
+
+static void* window_adder_main(void *in) {
+    window_worker *args = in;
+    char buf[100];
+    char *keys[] = {buf};
+    for (int i=0; !*args->stop; i++) {
+        snprintf(buf, sizeof(buf), "key%d-%d", args->id, i);
+        fail_unless(hset_add_keys(args->set, keys, 1) == 0);
+    }
+    return NULL;
+}
+
+static void* window_flusher_main(void *in) {
+    window_worker *args = in;
+    while (!*args->stop) {
+        fail_unless(hset_flush(args->set) == 0);
+        hset_size(args->set);
+        usleep(1000);
+    }
+    return NULL;
+}
+
+START_TEST(test_set_windows_concurrent)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.window = 1;
+    config.retain = 1;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set21", 0, &set);
+    fail_unless(res == 0);
+
+    // Add across roll overs, while flushes expire the old windows
+    volatile int stop = 0;
+    pthread_t threads[4];
+    window_worker args[4];
+    for (int i=0; i < 4; i++) {
+        args[i].set = set;
+        args[i].id = i;
+        args[i].stop = &stop;
+        pthread_create(&threads[i], NULL, (i) ? window_adder_main : window_flusher_main, &args[i]);
+    }
+    time_t end = time(NULL) + 2;
+    while (time(NULL) < end) usleep(10000);
+    stop = 1;
+    for (int i=0; i < 4; i++) pthread_join(threads[i], NULL);
+
+    fail_unless(hset_size(set) > 0);
+    fail_unless(hset_delete(set) == 0);
+    fail_unless(destroy_set(set) == 0);
+}
+END_TEST
+
+START_TEST(test_set_sliding)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.sliding = 300;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set18", 1, &set);
+    fail_unless(res == 0);
+
+    char *older[] = {"a", "b", "c"};
+    char *newer[] = {"c", "d"};
+    uint64_t now = time(NULL);
+    fail_unless(hset_add_keys_at(set, older, 3, now - 200) == 0);
+    fail_unless(hset_add_keys_at(set, newer, 2, 0) == 0);
+    fail_unless(hset_size(set) == 4);
+    fail_unless(hset_size_last(set, 100) == 2);
+
+    // Keys older than the window are not counted
+    fail_unless(hset_add_keys_at(set, older, 3, now - 400) == 0);
+    fail_unless(hset_size(set) == 4);
+
+    // Times past 32 bits are rejected, rather than wrapping
+    fail_unless(hset_add_keys_at(set, older, 3, (uint64_t)UINT32_MAX + 1) == -1);
+    fail_unless(hset_size(set) == 4);
+
+    // The registers survive a close
+    struct stat st;
+    fail_unless(hset_close(set) == 0);
+    fail_unless(stat("/tmp/hlld/hlld.test_set18/registers.sliding", &st) == 0);
+    fail_unless(hset_size_last(set, 100) == 2);
+    fail_unless(hset_size_last(set, 1000) == 4);
+
+    fail_unless(destroy_set(set) == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set18") == 2);
 }
 END_TEST
 
+START_TEST(test_set_convert)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.layout = HLL_LAYOUT_BYTES;
+
+    hlld_set *set = NULL;
+    res = init_set(&config, "test_set19", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_byte_size(set) == 4096);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = hset_add(set, (char*)&buf);
+        fail_unless(res == 0);
+    }
+    uint64_t size = hset_size(set);
+
+    // Only closed sets are converted
+    fail_unless(hset_convert(set, HLL_LAYOUT_PACKED) == -2);
+    fail_unless(hset_close(set) == 0);
+    fail_unless(hset_convert(set, HLL_LAYOUT_PACKED) == 0);
+    fail_unless(hset_byte_size(set) == 3280);
+    fail_unless(destroy_set(set) == 0);
+
+    // The new layout is read back from disk
+    res = init_set(&config, "test_set19", 1, &set);
+    fail_unless(res == 0);
+    fail_unless(hset_byte_size(set) == 3280);
+    fail_unless(hset_size(set) == size);
+
+    fail_unless(destroy_set(set) == 0);
+    fail_unless(delete_dir("/tmp/hlld/hlld.test_set19") == 3);
+}
+END_TEST
@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
 #include "config.h"
 #include "set.h"
 #include "set_manager.h"
@@ -690,3 +691,605 @@ START_TEST(test_mgr_callback)
 }
 END_TEST
 
+
+static void stored_size_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
+    *(uint64_t*)data = hset_config(set)->size;
+}
+
+START_TEST(test_mgr_restore_catalog)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = setmgr_create_set(mgr, "zab9", NULL);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    res = setmgr_set_keys(mgr, "zab9", (char**)&keys, 3);
+    fail_unless(res == 0);
+
+    res = setmgr_flush_set(mgr, "zab9");
+    fail_unless(res == 0);
+
+    // The data directory was just modified, so
+    // the catalog cannot be trusted yet
+    res = setmgr_write_catalog(mgr);
+    fail_unless(res == 1);
+
+    sleep(2);
+    res = setmgr_write_catalog(mgr);
+    fail_unless(res == 0);
+
+    // Not flushed, the catalog written on shutdown must include these
+    char *more[] = {"more","keys"};
+    res = setmgr_set_keys(mgr, "zab9", (char**)&more, 2);
+    fail_unless(res == 0);
+
+    // Shutdown
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // Restore from the catalog
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // The cold set has the size from the shutdown
+    uint64_t size = 0;
+    res = setmgr_set_cb(mgr, "zab9", stored_size_cb, &size);
+    fail_unless(res == 0);
+    fail_unless(size == 5);
+
+    res = setmgr_set_size(mgr, "zab9", &size);
+    fail_unless(res == 0);
+    fail_unless(size == 5);
+
+    res = setmgr_drop_set(mgr, "zab9");
+    fail_unless(res == 0);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void loaded_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
+    *(int*)data = set->is_loaded;
+}
+
+START_TEST(test_mgr_catalog_lazy)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = setmgr_create_set(mgr, "zab10", NULL);
+    fail_unless(res == 0);
+    res = setmgr_create_set(mgr, "zab11", NULL);
+    fail_unless(res == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // Without a catalog, the sets are discovered lazily
+    unlink("/tmp/hlld/catalog/manifest");
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    int loaded = 1;
+    res = setmgr_set_cb(mgr, "zab10", loaded_cb, &loaded);
+    fail_unless(res == 0);
+    fail_unless(loaded == 0);
+
+    // Cleared sets are only on disk
+    res = setmgr_clear_set(mgr, "zab11");
+    fail_unless(res == 0);
+    setmgr_vacuum(mgr);
+
+    // Writing the catalog does not load the sets
+    sleep(2);
+    res = setmgr_write_catalog(mgr);
+    fail_unless(res == 0);
+    res = setmgr_set_cb(mgr, "zab10", loaded_cb, &loaded);
+    fail_unless(res == 0);
+    fail_unless(loaded == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+
+    // Both sets are restored from the catalog
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = setmgr_set_cb(mgr, "zab10", loaded_cb, &loaded);
+    fail_unless(res == 0);
+    fail_unless(loaded == 1);
+    res = setmgr_set_cb(mgr, "zab11", loaded_cb, &loaded);
+    fail_unless(res == 0);
+    fail_unless(loaded == 1);
+
+    res = setmgr_drop_set(mgr, "zab10");
+    fail_unless(res == 0);
+    res = setmgr_drop_set(mgr, "zab11");
+    fail_unless(res == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void* drop_reader_main(void *in) {
+    hlld_setmgr *mgr = in;
+    char *keys[] = {"hey","there","person"};
+    uint64_t size;
+    setmgr_client_checkpoint(mgr);
+    for (int i=0; i < 2000; i++) {
+        setmgr_set_keys(mgr, "zip1", (char**)&keys, 3);
+        setmgr_set_size(mgr, "zip1", &size);
+    }
+    setmgr_client_leave(mgr);
+    return NULL;
+}
+
+static volatile int slow_done;
+
+static void slow_cb(void *data, char *set_name, hlld_set *set) {
+    (void)data;
+    (void)set_name;
+    (void)set;
+    sleep(1);
+    slow_done = 1;
+}
+
+static void* slow_reader_main(void *in) {
+    hlld_setmgr *mgr = in;
+    setmgr_set_cb(mgr, "slow1", slow_cb, NULL);
+    setmgr_client_leave(mgr);
+    return NULL;
+}
+
+START_TEST(test_mgr_slow_reader)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = setmgr_create_set(mgr, "slow1", NULL);
+    fail_unless(res == 0);
+
+    slow_done = 0;
+    pthread_t t;
+    fail_unless(pthread_create(&t, NULL, slow_reader_main, mgr) == 0);
+    usleep(100000);
+
+    // Writers do not wait for a reader inside the manager
+    fail_unless(setmgr_create_set(mgr, "slow2", NULL) == 0);
+    fail_unless(setmgr_drop_set(mgr, "slow2") == 0);
+    fail_unless(setmgr_drop_set(mgr, "slow1") == 0);
+    fail_unless(!slow_done);
+
+    // The dropped sets are reclaimed once the reader leaves
+    setmgr_vacuum(mgr);
+    fail_unless(slow_done);
+    pthread_join(t, NULL);
+    fail_unless(setmgr_create_set(mgr, "slow1", NULL) == 0);
+    fail_unless(setmgr_drop_set(mgr, "slow1") == 0);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_concurrent_drop)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 1, &mgr);
+    fail_unless(res == 0);
+
+    pthread_t t;
+    fail_unless(pthread_create(&t, NULL, drop_reader_main, mgr) == 0);
+
+    // Creates are visible immediately, and drops are
+    // not deleted while the reader is using the set
+    for (int i=0; i < 50; i++) {
+        do {
+            res = setmgr_create_set(mgr, "zip1", NULL);
+        } while (res == -3);
+        fail_unless(res == 0);
+
+        uint64_t size;
+        res = setmgr_set_size(mgr, "zip1", &size);
+        fail_unless(res == 0);
+
+        res = setmgr_drop_set(mgr, "zip1");
+        fail_unless(res == 0);
+
+        res = setmgr_set_size(mgr, "zip1", &size);
+        fail_unless(res == -1);
+    }
+    pthread_join(t, NULL);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_set_cache)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = setmgr_create_set(mgr, "cache1", NULL);
+    fail_unless(res == 0);
+
+    // The first lookup misses, and the second hits
+    char *keys[] = {"hey","there","person"};
+    uint64_t hits, misses;
+    res = setmgr_set_keys(mgr, "cache1", (char**)&keys, 3);
+    fail_unless(res == 0);
+    res = setmgr_set_keys(mgr, "cache1", (char**)&keys, 3);
+    fail_unless(res == 0);
+    setmgr_cache_stats(mgr, &hits, &misses);
+    fail_unless(hits == 1);
+    fail_unless(misses == 1);
+
+    // Dropping the set invalidates the cache
+    res = setmgr_drop_set(mgr, "cache1");
+    fail_unless(res == 0);
+    res = setmgr_set_keys(mgr, "cache1", (char**)&keys, 3);
+    fail_unless(res == -1);
+    setmgr_cache_stats(mgr, &hits, &misses);
+    fail_unless(hits == 1);
+    fail_unless(misses == 2);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void page_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set;
+    char *names = data;
+    strcat(names, set_name);
+    strcat(names, " ");
+}
+
+START_TEST(test_mgr_list_page)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    char *sets[] = {"pg1", "pg2", "pg3", "ph1", "pg21", NULL};
+    for (int i=0; sets[i]; i++) {
+        res = setmgr_create_set(mgr, sets[i], NULL);
+        fail_unless(res == 0);
+    }
+
+    char names[128] = "";
+    fail_unless(setmgr_list_page(mgr, NULL, NULL, 0, page_cb, names) == 5);
+    fail_unless(!strcmp(names, "pg1 pg2 pg21 pg3 ph1 "));
+
+    names[0] = 0;
+    fail_unless(setmgr_list_page(mgr, "pg", "pg2", 0, page_cb, names) == 2);
+    fail_unless(!strcmp(names, "pg21 pg3 "));
+
+    names[0] = 0;
+    fail_unless(setmgr_list_page(mgr, "pg", NULL, 2, page_cb, names) == 2);
+    fail_unless(!strcmp(names, "pg1 pg2 "));
+
+    names[0] = 0;
+    fail_unless(setmgr_list_page(mgr, "ph", "pg3", 0, page_cb, names) == 1);
+    fail_unless(!strcmp(names, "ph1 "));
+
+    for (int i=0; sets[i]; i++) {
+        res = setmgr_drop_set(mgr, sets[i]);
+        fail_unless(res == 0);
+    }
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_set_sizes)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.default_precision = 14;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Enough registers to use the size helpers
+    char *sets[] = {"sz0", "sz1", "sz2", "missing", "sz3", "sz4", "sz5"};
+    char key[32];
+    char *keys[] = {key};
+    for (int i=0; i < 7; i++) {
+        if (i == 3) continue;
+        res = setmgr_create_set(mgr, sets[i], NULL);
+        fail_unless(res == 0);
+        for (int j=0; j < 10*(i+1); j++) {
+            snprintf(key, sizeof(key), "key%d", j);
+            res = setmgr_set_keys(mgr, sets[i], (char**)&keys, 1);
+            fail_unless(res == 0);
+        }
+    }
+
+    // Check twice, the second time is cached
+    uint64_t ests[7];
+    char found[7];
+    for (int pass=0; pass < 2; pass++) {
+        fail_unless(setmgr_set_sizes(mgr, sets, 7, ests, found) == 6);
+        for (int i=0; i < 7; i++) {
+            fail_unless(found[i] == (i != 3));
+            if (i == 3) continue;
+            fail_unless(ests[i] + 2 >= (uint64_t)10*(i+1) && ests[i] <= (uint64_t)10*(i+1) + 2);
+        }
+    }
+
+    // Adding keys invalidates the cached estimate
+    for (int j=0; j < 100; j++) {
+        snprintf(key, sizeof(key), "more%d", j);
+        res = setmgr_set_keys(mgr, "sz0", (char**)&keys, 1);
+        fail_unless(res == 0);
+    }
+    fail_unless(setmgr_set_sizes(mgr, sets, 7, ests, found) == 6);
+    fail_unless(ests[0] >= 105 && ests[0] <= 115);
+
+    for (int i=0; i < 7; i++) {
+        if (i != 3) setmgr_drop_set(mgr, sets[i]);
+    }
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_intersect_size)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+    config.default_precision = 14;
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Sets a and b share 5000 of their keys
+    char key[32];
+    char *keys[] = {key};
+    fail_unless(setmgr_create_set(mgr, "int_a", NULL) == 0);
+    fail_unless(setmgr_create_set(mgr, "int_b", NULL) == 0);
+    for (int i=0; i < 15000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        if (i < 10000) fail_unless(setmgr_set_keys(mgr, "int_a", (char**)&keys, 1) == 0);
+        if (i >= 5000) fail_unless(setmgr_set_keys(mgr, "int_b", (char**)&keys, 1) == 0);
+    }
+
+    uint64_t est;
+    char *both[] = {"int_a", "int_b"};
+    fail_unless(setmgr_intersect_size(mgr, both, 2, &est) == 0);
+    fail_unless(est > 4500 && est < 5500);
+
+    char *missing[] = {"int_a", "missing"};
+    fail_unless(setmgr_intersect_size(mgr, missing, 2, &est) == -1);
+
+    // Sets of another precision can not be intersected
+    hlld_config *custom = malloc(sizeof(hlld_config));
+    memcpy(custom, &config, sizeof(hlld_config));
+    custom->default_precision = 12;
+    fail_unless(setmgr_create_set(mgr, "int_c", custom) == 0);
+    char *mixed[] = {"int_a", "int_c"};
+    fail_unless(setmgr_intersect_size(mgr, mixed, 2, &est) == -2);
+
+    setmgr_drop_set(mgr, "int_a");
+    setmgr_drop_set(mgr, "int_b");
+    setmgr_drop_set(mgr, "int_c");
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void proxied_cb(void *data, char *set_name, hlld_set *set) {
+    (void)set_name;
+    *(int*)data = hset_is_proxied(set);
+}
+
+START_TEST(test_mgr_evict)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    uint64_t base = setmgr_resident_bytes(mgr);
+
+    // The last set is used the most
+    char *sets[] = {"evict0", "evict1", "evict2", "evict3"};
+    char *keys[] = {"hey","there","person"};
+    for (int i=0; i < 4; i++) {
+        res = setmgr_create_set(mgr, sets[i], NULL);
+        fail_unless(res == 0);
+        for (int j=0; j < ((i == 3) ? 5 : 1); j++) {
+            res = setmgr_set_keys(mgr, sets[i], (char**)&keys, 3);
+            fail_unless(res == 0);
+        }
+    }
+    uint64_t per_set = (setmgr_resident_bytes(mgr) - base) / 4;
+    fail_unless(per_set == hll_bytes_for_precision(config.default_precision));
+
+    // Evict down to two sets, the oldest go first
+    fail_unless(setmgr_evict(mgr, base + 2 * per_set) == 2);
+    fail_unless(setmgr_resident_bytes(mgr) == base + 2 * per_set);
+    int proxied;
+    for (int i=0; i < 4; i++) {
+        setmgr_set_cb(mgr, sets[i], proxied_cb, &proxied);
+        fail_unless(proxied == (i < 2));
+    }
+
+    // Faulting back in is counted
+    res = setmgr_set_keys(mgr, "evict0", (char**)&keys, 3);
+    fail_unless(res == 0);
+    fail_unless(setmgr_resident_bytes(mgr) == base + 3 * per_set);
+
+    // In-memory only sets are pinned, and are left out of the budget
+    hlld_config *custom = malloc(sizeof(hlld_config));
+    memcpy(custom, &config, sizeof(hlld_config));
+    custom->in_memory = 1;
+    res = setmgr_create_set(mgr, "evict4", custom);
+    fail_unless(res == 0);
+    fail_unless(setmgr_resident_bytes(mgr) == base + 3 * per_set);
+    fail_unless(setmgr_pinned_bytes(mgr) == per_set);
+
+    // Everything else can be unmapped
+    fail_unless(setmgr_evict(mgr, base) == 3);
+    fail_unless(setmgr_resident_bytes(mgr) == base);
+    fail_unless(setmgr_pinned_bytes(mgr) == per_set);
+
+    for (int i=0; i < 4; i++) {
+        res = setmgr_drop_set(mgr, sets[i]);
+        fail_unless(res == 0);
+    }
+    res = setmgr_drop_set(mgr, "evict4");
+    fail_unless(res == 0);
+    setmgr_vacuum(mgr);
+    fail_unless(setmgr_resident_bytes(mgr) == base);
+    fail_unless(setmgr_pinned_bytes(mgr) == 0);
+
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static void fault_cb_test(void *data, int res) {
+    __atomic_store_n((int*)data, res + 1, __ATOMIC_RELEASE);
+}
+
+START_TEST(test_mgr_fault_async)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Nothing to do for missing or mapped sets
+    volatile int done = 0;
+    fail_unless(setmgr_fault_async(mgr, "fault1", fault_cb_test, (void*)&done) == 0);
+    res = setmgr_create_set(mgr, "fault1", NULL);
+    fail_unless(res == 0);
+    fail_unless(setmgr_fault_async(mgr, "fault1", fault_cb_test, (void*)&done) == 0);
+
+    // Fault in an unmapped set
+    res = setmgr_unmap_set(mgr, "fault1");
+    fail_unless(res == 0);
+    fail_unless(setmgr_fault_async(mgr, "fault1", fault_cb_test, (void*)&done) == 1);
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) usleep(1000);
+    fail_unless(done == 1);
+
+    int proxied;
+    setmgr_set_cb(mgr, "fault1", proxied_cb, &proxied);
+    fail_unless(proxied == 0);
+
+    // Stopping runs the queued callbacks first
+    done = 0;
+    res = setmgr_unmap_set(mgr, "fault1");
+    fail_unless(res == 0);
+    fail_unless(setmgr_fault_async(mgr, "fault1", fault_cb_test, (void*)&done) == 1);
+    setmgr_stop_faults(mgr);
+    fail_unless(done == 1);
+
+    // Later faults are left to the caller
+    res = setmgr_unmap_set(mgr, "fault1");
+    fail_unless(res == 0);
+    fail_unless(setmgr_fault_async(mgr, "fault1", fault_cb_test, (void*)&done) == 0);
+    fail_unless(setmgr_warm_prefix(mgr, "fault") == 0);
+
+    res = setmgr_drop_set(mgr, "fault1");
+    fail_unless(res == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_warm)
+{
+    hlld_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    hlld_setmgr *mgr;
+    res = init_set_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    fail_unless(setmgr_warm_set(mgr, "warm1") == -1);
+    res = setmgr_create_set(mgr, "warm1", NULL);
+    fail_unless(res == 0);
+    res = setmgr_create_set(mgr, "warm2", NULL);
+    fail_unless(res == 0);
+
+    // Warm a single unmapped set
+    int proxied = 0;
+    res = setmgr_unmap_set(mgr, "warm1");
+    fail_unless(res == 0);
+    fail_unless(setmgr_warm_set(mgr, "warm1") == 0);
+    do {
+        usleep(1000);
+        setmgr_set_cb(mgr, "warm1", proxied_cb, &proxied);
+    } while (proxied);
+
+    // Warm by prefix
+    res = setmgr_unmap_set(mgr, "warm1");
+    fail_unless(res == 0);
+    res = setmgr_unmap_set(mgr, "warm2");
+    fail_unless(res == 0);
+    fail_unless(setmgr_warm_prefix(mgr, "warm") == 2);
+    fail_unless(setmgr_warm_prefix(mgr, "nope") == 0);
+    for (int i=0; i < 2; i++) {
+        char *name = (i) ? "warm2" : "warm1";
+        do {
+            usleep(1000);
+            setmgr_set_cb(mgr, name, proxied_cb, &proxied);
+        } while (proxied);
+    }
+
+    res = setmgr_drop_set(mgr, "warm1");
+    fail_unless(res == 0);
+    res = setmgr_drop_set(mgr, "warm2");
+    fail_unless(res == 0);
+    res = destroy_set_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST